@@ -0,0 +1,608 @@
+/*
+ * bluealsa-autoconfig - agent-bridge.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include "agent-bridge.h"
+#include "bluez-alsa/shared/defs.h"
+#include "bluez-alsa/shared/log.h"
+#include "bluez-alsa/shared/rt.h"
+
+/* Maximum time a bridge thread waits for I/O before checking for stop */
+#define BRIDGE_POLL_TIMEOUT 100
+
+/* The PCMs of one transport */
+enum {
+	/* BlueALSA source PCM, audio from the Bluetooth device */
+	BRIDGE_SOURCE,
+	/* BlueALSA sink PCM, audio to the Bluetooth device */
+	BRIDGE_SINK,
+	BRIDGE_COUNT,
+};
+
+static const struct {
+	const char *name;
+	unsigned int latency;
+} bridge_codecs[BLUEALSA_AGENT_BRIDGE_CODEC_COUNT] = {
+	[BLUEALSA_AGENT_BRIDGE_CVSD] = { "CVSD", 40 },
+	[BLUEALSA_AGENT_BRIDGE_MSBC] = { "mSBC", 40 },
+	[BLUEALSA_AGENT_BRIDGE_LC3_SWB] = { "LC3-SWB", 40 },
+	[BLUEALSA_AGENT_BRIDGE_A2DP] = { "A2DP", 100 },
+};
+
+/* Single producer, single consumer ring of audio frames. */
+struct bridge_ring {
+	uint8_t *data;
+	/* capacity in frames, a power of 2 */
+	size_t frames;
+	size_t frame_size;
+	/* only written by the producer */
+	atomic_size_t head;
+	/* only written by the consumer */
+	atomic_size_t tail;
+};
+
+struct bridge_stream {
+	/* true if the audio flows from the Bluetooth device to the ALSA device */
+	bool from_bluetooth;
+	char path[128];
+	int fd_pcm;
+	int fd_ctrl;
+	snd_pcm_t *alsa;
+	snd_pcm_format_t format;
+	unsigned int channels;
+	unsigned int rate;
+	/* frames per transfer */
+	size_t period;
+	/* ring fill in frames at which the consumer starts */
+	size_t target;
+	struct bridge_ring ring;
+	/* partial frame received from the Bluetooth PCM */
+	uint8_t partial[32];
+	size_t partial_len;
+	pthread_t producer;
+	pthread_t consumer;
+	atomic_bool stopping;
+	atomic_ulong overruns;
+	atomic_ulong underruns;
+};
+
+struct bridge {
+	unsigned int owner;
+	const struct bluealsa_agent_bridge_config *config;
+	struct bluealsa_pcm_data pcms[BRIDGE_COUNT];
+	bool present[BRIDGE_COUNT];
+	/* a start has failed, do not retry until the transport is restarted */
+	bool failed[BRIDGE_COUNT];
+	struct bridge_stream *streams[BRIDGE_COUNT];
+};
+
+static bluealsa_client_t bridge_client = NULL;
+
+static struct {
+	struct bridge *data;
+	size_t capacity;
+	size_t count;
+} bridges = { 0 };
+
+static int bridge_ring_init(struct bridge_ring *ring, size_t frames, size_t frame_size) {
+	size_t capacity = 1;
+	while (capacity < frames)
+		capacity <<= 1;
+	if ((ring->data = malloc(capacity * frame_size)) == NULL)
+		return -ENOMEM;
+	ring->frames = capacity;
+	ring->frame_size = frame_size;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	return 0;
+}
+
+static size_t bridge_ring_fill(struct bridge_ring *ring) {
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+		atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/**
+ * Copy frames into the ring. Called only by the producer.
+ * @return the number of frames copied, which is less than requested if the
+ * ring is full.
+ */
+static size_t bridge_ring_write(struct bridge_ring *ring, const uint8_t *buffer, size_t frames) {
+	const size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	const size_t offset = head & (ring->frames - 1);
+
+	frames = MIN(frames, ring->frames - (head - tail));
+	const size_t first = MIN(frames, ring->frames - offset);
+	memcpy(ring->data + offset * ring->frame_size, buffer, first * ring->frame_size);
+	memcpy(ring->data, buffer + first * ring->frame_size, (frames - first) * ring->frame_size);
+
+	atomic_store_explicit(&ring->head, head + frames, memory_order_release);
+	return frames;
+}
+
+/**
+ * Copy frames out of the ring, or discard them if buffer is NULL. Called
+ * only by the consumer.
+ * @return the number of frames copied, which is less than requested if the
+ * ring is empty.
+ */
+static size_t bridge_ring_read(struct bridge_ring *ring, uint8_t *buffer, size_t frames) {
+	const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	const size_t offset = tail & (ring->frames - 1);
+
+	frames = MIN(frames, head - tail);
+	if (buffer != NULL) {
+		const size_t first = MIN(frames, ring->frames - offset);
+		memcpy(buffer, ring->data + offset * ring->frame_size, first * ring->frame_size);
+		memcpy(buffer + first * ring->frame_size, ring->data, (frames - first) * ring->frame_size);
+	}
+
+	atomic_store_explicit(&ring->tail, tail + frames, memory_order_release);
+	return frames;
+}
+
+/**
+ * Read frames from the Bluetooth PCM.
+ * @return the number of frames read, or -1 if the PCM has been closed.
+ */
+static ssize_t bridge_bluetooth_read(struct bridge_stream *stream, uint8_t *buffer, size_t frames) {
+	const size_t frame_size = stream->ring.frame_size;
+	struct pollfd pfd = { stream->fd_pcm, POLLIN, 0 };
+	ssize_t len;
+
+	if (poll(&pfd, 1, BRIDGE_POLL_TIMEOUT) <= 0)
+		return 0;
+
+	memcpy(buffer, stream->partial, stream->partial_len);
+	if ((len = read(stream->fd_pcm, buffer + stream->partial_len, frames * frame_size - stream->partial_len)) <= 0) {
+		if (len == -1 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		return -1;
+	}
+
+	len += stream->partial_len;
+	stream->partial_len = len % frame_size;
+	memcpy(stream->partial, buffer + len - stream->partial_len, stream->partial_len);
+	return len / frame_size;
+}
+
+/**
+ * Write all frames to the Bluetooth PCM, then wait until they are due
+ * according to the stream sample rate.
+ * @return the number of frames written, or -1 if the PCM has been closed.
+ */
+static ssize_t bridge_bluetooth_write(struct bridge_stream *stream, struct asrsync *asrs, const uint8_t *buffer, size_t frames) {
+	size_t len = frames * stream->ring.frame_size;
+
+	while (len > 0) {
+		struct pollfd pfd = { stream->fd_pcm, POLLOUT, 0 };
+		ssize_t ret;
+
+		if (atomic_load(&stream->stopping))
+			return 0;
+		if (poll(&pfd, 1, BRIDGE_POLL_TIMEOUT) <= 0)
+			continue;
+		if ((ret = write(stream->fd_pcm, buffer, len)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			/* SIGPIPE is blocked, so a PCM released by BlueALSA is reported
+			 * here, for example when the device disconnects */
+			if (errno == EPIPE)
+				debug("Bridge PCM closed by BlueALSA: %s", stream->path);
+			return -1;
+		}
+		buffer += ret;
+		len -= ret;
+	}
+
+	/* the BlueALSA PCM FIFO accepts data faster than real time, so pace the
+	 * writes to avoid accumulating latency in the FIFO */
+	asrsync_sync(asrs, frames);
+	return frames;
+}
+
+static ssize_t bridge_alsa_read(struct bridge_stream *stream, uint8_t *buffer, size_t frames) {
+	snd_pcm_sframes_t ret;
+	int err;
+
+	if ((ret = snd_pcm_wait(stream->alsa, BRIDGE_POLL_TIMEOUT)) == 0)
+		return 0;
+	if (ret > 0 && (ret = snd_pcm_readi(stream->alsa, buffer, frames)) >= 0)
+		return ret;
+	if (ret == -EAGAIN)
+		return 0;
+	/* a recovered capture PCM is only prepared, so it must be started again */
+	if ((err = snd_pcm_recover(stream->alsa, ret, 1)) < 0 ||
+			(err = snd_pcm_start(stream->alsa)) < 0) {
+		error("Bridge capture failed (%s)", snd_strerror(err));
+		return -1;
+	}
+	atomic_fetch_add(&stream->overruns, 1);
+	return 0;
+}
+
+static ssize_t bridge_alsa_write(struct bridge_stream *stream, const uint8_t *buffer, size_t frames) {
+	size_t done = 0;
+
+	while (done < frames && !atomic_load(&stream->stopping)) {
+		snd_pcm_sframes_t ret;
+
+		if (snd_pcm_wait(stream->alsa, BRIDGE_POLL_TIMEOUT) == 0)
+			continue;
+		if ((ret = snd_pcm_writei(stream->alsa, buffer + done * stream->ring.frame_size, frames - done)) >= 0) {
+			done += ret;
+			continue;
+		}
+		if (ret == -EAGAIN)
+			continue;
+		if (snd_pcm_recover(stream->alsa, ret, 1) < 0) {
+			error("Bridge playback failed (%s)", snd_strerror(ret));
+			return -1;
+		}
+		atomic_fetch_add(&stream->underruns, 1);
+	}
+
+	return done;
+}
+
+/**
+ * Move audio from the source into the ring. If the ring is full, new frames
+ * are dropped.
+ */
+static void *bridge_producer(struct bridge_stream *stream) {
+	uint8_t *buffer = malloc(stream->period * stream->ring.frame_size);
+
+	while (buffer != NULL && !atomic_load(&stream->stopping)) {
+		ssize_t frames = stream->from_bluetooth ?
+			bridge_bluetooth_read(stream, buffer, stream->period) :
+			bridge_alsa_read(stream, buffer, stream->period);
+		if (frames < 0)
+			break;
+		if (bridge_ring_write(&stream->ring, buffer, frames) < (size_t)frames)
+			atomic_fetch_add(&stream->overruns, 1);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/**
+ * Move audio from the ring to the destination, one period at a time. The ring
+ * is first filled to the target latency. Missing frames are replaced by
+ * silence so that the destination keeps running, and frames in excess of
+ * twice the target are discarded so that the latency does not grow.
+ */
+static void *bridge_consumer(struct bridge_stream *stream) {
+	const size_t frame_size = stream->ring.frame_size;
+	uint8_t *buffer = malloc(stream->period * frame_size);
+	struct asrsync asrs;
+
+	asrsync_init(&asrs, stream->rate);
+	while (buffer != NULL && !atomic_load(&stream->stopping) &&
+			bridge_ring_fill(&stream->ring) < stream->target)
+		asrsync_sync(&asrs, stream->period);
+
+	asrsync_init(&asrs, stream->rate);
+	while (buffer != NULL && !atomic_load(&stream->stopping)) {
+		size_t fill, frames;
+		ssize_t ret;
+
+		if ((fill = bridge_ring_fill(&stream->ring)) > 2 * stream->target)
+			bridge_ring_read(&stream->ring, NULL, fill - stream->target);
+
+		if ((frames = bridge_ring_read(&stream->ring, buffer, stream->period)) < stream->period) {
+			snd_pcm_format_set_silence(stream->format, buffer + frames * frame_size,
+					(stream->period - frames) * stream->channels);
+			atomic_fetch_add(&stream->underruns, 1);
+		}
+
+		ret = stream->from_bluetooth ?
+			bridge_alsa_write(stream, buffer, stream->period) :
+			bridge_bluetooth_write(stream, &asrs, buffer, stream->period);
+		if (ret < 0)
+			break;
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static enum bluealsa_agent_bridge_codec bridge_codec(const char *codec) {
+	for (size_t n = 0; n < BLUEALSA_AGENT_BRIDGE_A2DP; n++)
+		if (strcasecmp(codec, bridge_codecs[n].name) == 0)
+			return n;
+	return BLUEALSA_AGENT_BRIDGE_A2DP;
+}
+
+static void bridge_stream_stop(struct bridge_stream *stream) {
+	atomic_store(&stream->stopping, true);
+	pthread_join(stream->producer, NULL);
+	pthread_join(stream->consumer, NULL);
+
+	debug("Bridge for %s stopped: overruns %lu, underruns %lu", stream->path,
+			atomic_load(&stream->overruns), atomic_load(&stream->underruns));
+
+	snd_pcm_close(stream->alsa);
+	close(stream->fd_pcm);
+	close(stream->fd_ctrl);
+	free(stream->ring.data);
+	free(stream);
+}
+
+static struct bridge_stream *bridge_stream_start(const struct bridge *bridge, int dir) {
+	const struct bluealsa_pcm_data *pcm = &bridge->pcms[dir];
+	const char *device = dir == BRIDGE_SOURCE ? bridge->config->playback : bridge->config->capture;
+	const unsigned int latency = bridge->config->latency[bridge_codec(pcm->codec)];
+	struct bridge_stream *stream;
+	int err;
+
+	if ((stream = calloc(1, sizeof(*stream))) == NULL)
+		return NULL;
+	stream->from_bluetooth = dir == BRIDGE_SOURCE;
+	strcpy(stream->path, pcm->path);
+	stream->fd_pcm = stream->fd_ctrl = -1;
+	stream->format = snd_pcm_format_value(pcm->format);
+	stream->channels = atoi(pcm->channels);
+	stream->rate = atoi(pcm->rate);
+
+	const ssize_t frame_size = snd_pcm_format_physical_width(stream->format) / 8 * stream->channels;
+	if (stream->format == SND_PCM_FORMAT_UNKNOWN || frame_size <= 0 ||
+			(size_t)frame_size > sizeof(stream->partial) || stream->rate == 0) {
+		error("Unsupported PCM format for bridge: %s %s %s", pcm->format, pcm->channels, pcm->rate);
+		goto fail;
+	}
+
+	/* half of the latency is in the ring, the other half in the ALSA buffer */
+	stream->period = MAX(stream->rate * latency / 4000, 1);
+	stream->target = stream->rate * latency / 2000;
+	if (bridge_ring_init(&stream->ring, 4 * MAX(stream->target, stream->period), frame_size) < 0)
+		goto fail;
+
+	if (bluealsa_client_open_pcm(bridge_client, pcm->service, pcm->path, &stream->fd_pcm, &stream->fd_ctrl) < 0)
+		goto fail;
+	fcntl(stream->fd_pcm, F_SETFL, fcntl(stream->fd_pcm, F_GETFL) | O_NONBLOCK);
+
+	if ((err = snd_pcm_open(&stream->alsa, device,
+					stream->from_bluetooth ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE,
+					SND_PCM_NONBLOCK)) < 0) {
+		error("Couldn't open ALSA device %s (%s)", device, snd_strerror(err));
+		goto fail;
+	}
+	if ((err = snd_pcm_set_params(stream->alsa, stream->format, SND_PCM_ACCESS_RW_INTERLEAVED,
+					stream->channels, stream->rate, 1, latency * 500)) < 0) {
+		error("Couldn't configure ALSA device %s (%s)", device, snd_strerror(err));
+		goto fail;
+	}
+	/* the start threshold is the whole buffer, which a read of one period
+	 * never reaches, so capture is started here */
+	if (!stream->from_bluetooth && (err = snd_pcm_start(stream->alsa)) < 0) {
+		error("Couldn't start ALSA device %s (%s)", device, snd_strerror(err));
+		goto fail;
+	}
+
+	if ((err = pthread_create(&stream->producer, NULL, PTHREAD_FUNC(bridge_producer), stream)) != 0) {
+		error("Couldn't create bridge thread (%s)", strerror(err));
+		goto fail;
+	}
+	if ((err = pthread_create(&stream->consumer, NULL, PTHREAD_FUNC(bridge_consumer), stream)) != 0) {
+		error("Couldn't create bridge thread (%s)", strerror(err));
+		atomic_store(&stream->stopping, true);
+		pthread_join(stream->producer, NULL);
+		goto fail;
+	}
+
+	info("Bridging %s %s %s (%u ms)", pcm->path, stream->from_bluetooth ? "to" : "from", device, latency);
+	return stream;
+
+fail:
+	if (stream->alsa != NULL)
+		snd_pcm_close(stream->alsa);
+	if (stream->fd_pcm != -1)
+		close(stream->fd_pcm);
+	if (stream->fd_ctrl != -1)
+		close(stream->fd_ctrl);
+	free(stream->ring.data);
+	free(stream);
+	return NULL;
+}
+
+/**
+ * Start or stop the streams of a bridge to match the state of its PCMs.
+ * The bridge is active while the source PCM is running. An A2DP or ASHA
+ * transport without a source PCM cannot become running until it is opened,
+ * so its sink PCM is bridged for as long as it is present. A SCO transport
+ * always has both PCMs.
+ */
+static void bridge_refresh(struct bridge *bridge) {
+	const struct bluealsa_pcm_data *pcm = &bridge->pcms[bridge->present[BRIDGE_SOURCE] ? BRIDGE_SOURCE : BRIDGE_SINK];
+	const bool sco = strcmp(pcm->transport_type, "SCO") == 0;
+	const bool active = bridge->present[BRIDGE_SOURCE] ?
+		bridge->pcms[BRIDGE_SOURCE].running : bridge->present[BRIDGE_SINK] && !sco;
+
+	for (int dir = 0; dir < BRIDGE_COUNT; dir++) {
+		const char *device = dir == BRIDGE_SOURCE ? bridge->config->playback : bridge->config->capture;
+		const bool wanted = active && bridge->present[dir] && device != NULL;
+
+		if (!active)
+			bridge->failed[dir] = false;
+
+		if (wanted && bridge->streams[dir] == NULL && !bridge->failed[dir]) {
+			if ((bridge->streams[dir] = bridge_stream_start(bridge, dir)) == NULL)
+				bridge->failed[dir] = true;
+		}
+		else if (!wanted && bridge->streams[dir] != NULL) {
+			bridge_stream_stop(bridge->streams[dir]);
+			bridge->streams[dir] = NULL;
+		}
+	}
+}
+
+static int bridge_dir(const struct bluealsa_pcm_data *pcm) {
+	return strcmp(pcm->mode, "source") == 0 ? BRIDGE_SOURCE : BRIDGE_SINK;
+}
+
+static struct bridge *bridge_find(unsigned int owner, const struct bluealsa_pcm_data *pcm) {
+	for (size_t n = 0; n < bridges.count; n++) {
+		struct bridge *bridge = &bridges.data[n];
+		if (bridge->owner != owner)
+			continue;
+		for (int dir = 0; dir < BRIDGE_COUNT; dir++)
+			if (bridge->present[dir] &&
+					strcmp(bridge->pcms[dir].device_path, pcm->device_path) == 0 &&
+					strcmp(bridge->pcms[dir].transport_type, pcm->transport_type) == 0 &&
+					strcmp(bridge->pcms[dir].service, pcm->service) == 0)
+				return bridge;
+	}
+	return NULL;
+}
+
+void bluealsa_agent_bridge_config_init(struct bluealsa_agent_bridge_config *config) {
+	config->playback = NULL;
+	config->capture = NULL;
+	for (size_t n = 0; n < ARRAYSIZE(bridge_codecs); n++)
+		config->latency[n] = bridge_codecs[n].latency;
+}
+
+/**
+ * Parse a list of target latencies.
+ * @param arg comma separated list of CODEC:MILLISECONDS, where CODEC is one
+ *            of CVSD, mSBC, LC3-SWB or A2DP.
+ * @return false if the list is invalid.
+ */
+bool bluealsa_agent_bridge_parse_latency(struct bluealsa_agent_bridge_config *config, const char *arg) {
+	char *list = strdup(arg);
+	char *saveptr, *item;
+	bool ret = true;
+
+	for (item = strtok_r(list, ",", &saveptr); item != NULL && ret;
+			item = strtok_r(NULL, ",", &saveptr)) {
+		char *value, *end;
+		size_t n;
+
+		if ((value = strrchr(item, ':')) == NULL) {
+			ret = false;
+			break;
+		}
+		*value++ = '\0';
+
+		for (n = 0; n < ARRAYSIZE(bridge_codecs); n++)
+			if (strcasecmp(item, bridge_codecs[n].name) == 0)
+				break;
+		unsigned long latency = strtoul(value, &end, 10);
+		if (n == ARRAYSIZE(bridge_codecs) || end == value || *end != '\0' ||
+				latency < 4 || latency > 1000)
+			ret = false;
+		else
+			config->latency[n] = latency;
+	}
+
+	free(list);
+	return ret;
+}
+
+void bluealsa_agent_bridge_init(bluealsa_client_t client) {
+	bridge_client = client;
+}
+
+/**
+ * Add a PCM to the bridge of its transport, creating the bridge if necessary.
+ * @param owner identifies the rule that selected the PCM.
+ * @param config the bridge configuration of the rule, which must remain
+ *               valid while the bridge exists.
+ */
+void bluealsa_agent_bridge_add(unsigned int owner, const struct bluealsa_agent_bridge_config *config, const struct bluealsa_pcm_data *pcm) {
+	struct bridge *bridge;
+
+	if ((bridge = bridge_find(owner, pcm)) == NULL) {
+		if (bridges.count == bridges.capacity) {
+			const size_t new_size = bridges.capacity + 4;
+			if ((bridge = realloc(bridges.data, new_size * sizeof(*bridges.data))) == NULL) {
+				error("Out of memory");
+				return;
+			}
+			bridges.data = bridge;
+			bridges.capacity = new_size;
+		}
+		bridge = &bridges.data[bridges.count++];
+		memset(bridge, 0, sizeof(*bridge));
+		bridge->owner = owner;
+		bridge->config = config;
+	}
+
+	const int dir = bridge_dir(pcm);
+	bridge->pcms[dir] = *pcm;
+	bridge->present[dir] = true;
+	bridge_refresh(bridge);
+}
+
+/**
+ * Update the PCM data of a bridge. The bridge is restarted if the audio
+ * parameters have changed while it is active.
+ * @param changes mask of BLUEALSA_AGENT_CHANGE_ bits.
+ */
+void bluealsa_agent_bridge_update(unsigned int owner, const struct bluealsa_pcm_data *pcm, unsigned int changes) {
+	const unsigned int restart = BLUEALSA_AGENT_CHANGE_CODEC | BLUEALSA_AGENT_CHANGE_FORMAT |
+		BLUEALSA_AGENT_CHANGE_CHANNELS | BLUEALSA_AGENT_CHANGE_RATE;
+	struct bridge *bridge;
+
+	if ((bridge = bridge_find(owner, pcm)) == NULL)
+		return;
+
+	const int dir = bridge_dir(pcm);
+	bridge->pcms[dir] = *pcm;
+	if ((changes & restart) && bridge->streams[dir] != NULL) {
+		bridge_stream_stop(bridge->streams[dir]);
+		bridge->streams[dir] = NULL;
+	}
+	bridge_refresh(bridge);
+}
+
+void bluealsa_agent_bridge_remove(unsigned int owner, const struct bluealsa_pcm_data *pcm) {
+	struct bridge *bridge;
+
+	if ((bridge = bridge_find(owner, pcm)) == NULL)
+		return;
+
+	bridge->present[bridge_dir(pcm)] = false;
+	bridge_refresh(bridge);
+
+	if (!bridge->present[BRIDGE_SOURCE] && !bridge->present[BRIDGE_SINK]) {
+		const size_t n = bridge - bridges.data;
+		if (--bridges.count > n)
+			memcpy(bridge, &bridges.data[bridges.count], sizeof(*bridge));
+	}
+}
+
+void bluealsa_agent_bridge_stop_all(void) {
+	for (size_t n = 0; n < bridges.count; n++)
+		for (int dir = 0; dir < BRIDGE_COUNT; dir++)
+			if (bridges.data[n].streams[dir] != NULL)
+				bridge_stream_stop(bridges.data[n].streams[dir]);
+	free(bridges.data);
+	bridges.data = NULL;
+	bridges.count = bridges.capacity = 0;
+}
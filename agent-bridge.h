@@ -0,0 +1,44 @@
+/*
+ * bluealsa-autoconfig - agent-bridge.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_BRIDGE_H
+#define BLUEALSA_AGENT_BRIDGE_H
+
+#include <stdbool.h>
+
+#include "bluealsa-agent-plugin.h"
+#include "bluealsa-client.h"
+
+/* Codecs for which the bridge latency can be set */
+enum bluealsa_agent_bridge_codec {
+	BLUEALSA_AGENT_BRIDGE_CVSD,
+	BLUEALSA_AGENT_BRIDGE_MSBC,
+	BLUEALSA_AGENT_BRIDGE_LC3_SWB,
+	/* all other codecs */
+	BLUEALSA_AGENT_BRIDGE_A2DP,
+	BLUEALSA_AGENT_BRIDGE_CODEC_COUNT,
+};
+
+struct bluealsa_agent_bridge_config {
+	/* ALSA device to play audio received from Bluetooth, or NULL */
+	char *playback;
+	/* ALSA device to capture audio sent to Bluetooth, or NULL */
+	char *capture;
+	/* target latency in milliseconds */
+	unsigned int latency[BLUEALSA_AGENT_BRIDGE_CODEC_COUNT];
+};
+
+void bluealsa_agent_bridge_config_init(struct bluealsa_agent_bridge_config *config);
+bool bluealsa_agent_bridge_parse_latency(struct bluealsa_agent_bridge_config *config, const char *arg);
+
+void bluealsa_agent_bridge_init(bluealsa_client_t client);
+void bluealsa_agent_bridge_add(unsigned int owner, const struct bluealsa_agent_bridge_config *config, const struct bluealsa_pcm_data *pcm);
+void bluealsa_agent_bridge_update(unsigned int owner, const struct bluealsa_pcm_data *pcm, unsigned int changes);
+void bluealsa_agent_bridge_remove(unsigned int owner, const struct bluealsa_pcm_data *pcm);
+void bluealsa_agent_bridge_stop_all(void);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * bluealsa-autoconfig - agent-calibration.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "agent-calibration.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * The calibration file is a text file with one line for each device and
+ * codec, of the form:
+ *
+ *   ADDRESS CODEC DELAY
+ *
+ * where DELAY is the ClientDelay value in units of 1/10 millisecond. Blank
+ * lines and lines beginning with '#' are ignored.
+ */
+
+struct calibration_entry {
+	char address[18];
+	char codec[16];
+	int16_t delay;
+};
+
+struct bluealsa_agent_calibration {
+	char *path;
+	struct calibration_entry *data;
+	size_t capacity;
+	size_t count;
+};
+
+static struct calibration_entry *calibration_find(const struct bluealsa_agent_calibration *calibration, const char *address, const char *codec) {
+	for (size_t n = 0; n < calibration->count; n++)
+		if (strcasecmp(calibration->data[n].address, address) == 0 &&
+				strcasecmp(calibration->data[n].codec, codec) == 0)
+			return &calibration->data[n];
+	return NULL;
+}
+
+static struct calibration_entry *calibration_add(struct bluealsa_agent_calibration *calibration, const char *address, const char *codec) {
+	struct calibration_entry *entry;
+
+	if (strlen(address) >= sizeof(entry->address) || strlen(codec) >= sizeof(entry->codec))
+		return NULL;
+
+	if (calibration->count == calibration->capacity) {
+		const size_t new_size = calibration->capacity > 0 ? 2 * calibration->capacity : 8;
+		if ((entry = realloc(calibration->data, new_size * sizeof(*entry))) == NULL)
+			return NULL;
+		calibration->data = entry;
+		calibration->capacity = new_size;
+	}
+
+	entry = &calibration->data[calibration->count++];
+	strcpy(entry->address, address);
+	strcpy(entry->codec, codec);
+	entry->delay = 0;
+	return entry;
+}
+
+/**
+ * Write the calibration file. A temporary file is written and then renamed,
+ * so that the file is never left incomplete.
+ * @return 0 on success, negative error code otherwise.
+ */
+static int calibration_save(const struct bluealsa_agent_calibration *calibration) {
+	char tmp[PATH_MAX];
+	FILE *file;
+	int err = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", calibration->path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	if ((file = fopen(tmp, "w")) == NULL)
+		return -errno;
+
+	fprintf(file, "# bluealsa-agent client delay calibration\n");
+	fprintf(file, "# ADDRESS CODEC DELAY(1/10 ms)\n");
+	for (size_t n = 0; n < calibration->count; n++)
+		fprintf(file, "%s %s %d\n", calibration->data[n].address,
+				calibration->data[n].codec, calibration->data[n].delay);
+
+	if (fflush(file) != 0 || fsync(fileno(file)) == -1)
+		err = -errno;
+	if (fclose(file) != 0 && err == 0)
+		err = -errno;
+	if (err == 0 && rename(tmp, calibration->path) == -1)
+		err = -errno;
+	if (err != 0)
+		unlink(tmp);
+	return err;
+}
+
+/**
+ * Load a calibration file. A file that does not yet exist is treated as
+ * empty, so that it can be created by storing values.
+ * @return the calibration table, or NULL on error.
+ */
+struct bluealsa_agent_calibration *bluealsa_agent_calibration_open(const char *path) {
+	struct bluealsa_agent_calibration *calibration;
+	unsigned int lineno = 0;
+	char line[256];
+	FILE *file;
+
+	if ((calibration = calloc(1, sizeof(*calibration))) == NULL ||
+			(calibration->path = strdup(path)) == NULL) {
+		free(calibration);
+		return NULL;
+	}
+
+	if ((file = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return calibration;
+		error("Cannot open calibration file '%s' (%s)", path, strerror(errno));
+		bluealsa_agent_calibration_close(calibration);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		char address[18], codec[16], extra;
+		int delay;
+
+		lineno++;
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[strspn(line, " \t")] == '#')
+			continue;
+
+		if (sscanf(line, "%17s %15s %d %c", address, codec, &delay, &extra) != 3 ||
+				delay < INT16_MIN || delay > INT16_MAX) {
+			warn("%s:%u: Invalid calibration entry", path, lineno);
+			continue;
+		}
+
+		struct calibration_entry *entry;
+		if ((entry = calibration_find(calibration, address, codec)) == NULL &&
+				(entry = calibration_add(calibration, address, codec)) == NULL) {
+			error("Out of memory");
+			break;
+		}
+		entry->delay = delay;
+	}
+
+	fclose(file);
+	return calibration;
+}
+
+void bluealsa_agent_calibration_close(struct bluealsa_agent_calibration *calibration) {
+	if (calibration == NULL)
+		return;
+	free(calibration->path);
+	free(calibration->data);
+	free(calibration);
+}
+
+/**
+ * Find the calibrated client delay of a device when using a codec.
+ * @param delay returns the delay in units of 1/10 millisecond.
+ * @return true if the device and codec are calibrated.
+ */
+bool bluealsa_agent_calibration_lookup(const struct bluealsa_agent_calibration *calibration, const char *address, const char *codec, int16_t *delay) {
+	const struct calibration_entry *entry;
+	if ((entry = calibration_find(calibration, address, codec)) == NULL)
+		return false;
+	*delay = entry->delay;
+	return true;
+}
+
+/**
+ * Record the client delay of a device when using a codec, and save the
+ * calibration file if the value has changed.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_agent_calibration_store(struct bluealsa_agent_calibration *calibration, const char *address, const char *codec, int16_t delay) {
+	struct calibration_entry *entry;
+	int ret;
+
+	if ((entry = calibration_find(calibration, address, codec)) != NULL) {
+		if (entry->delay == delay)
+			return 0;
+	}
+	else if ((entry = calibration_add(calibration, address, codec)) == NULL)
+		return -ENOMEM;
+
+	entry->delay = delay;
+	if ((ret = calibration_save(calibration)) < 0)
+		error("Couldn't save calibration file '%s' (%s)", calibration->path, strerror(-ret));
+	return ret;
+}
@@ -0,0 +1,21 @@
+/*
+ * bluealsa-autoconfig - agent-calibration.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_CALIBRATION_H
+#define BLUEALSA_AGENT_CALIBRATION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct bluealsa_agent_calibration;
+
+struct bluealsa_agent_calibration *bluealsa_agent_calibration_open(const char *path);
+void bluealsa_agent_calibration_close(struct bluealsa_agent_calibration *calibration);
+bool bluealsa_agent_calibration_lookup(const struct bluealsa_agent_calibration *calibration, const char *address, const char *codec, int16_t *delay);
+int bluealsa_agent_calibration_store(struct bluealsa_agent_calibration *calibration, const char *address, const char *codec, int16_t delay);
+
+#endif
@@ -0,0 +1,403 @@
+/*
+ * bluealsa-autoconfig - agent-plugin-mpd.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "agent-plugin.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Built-in plugin to control MPD, doing the work of the example script
+ * 52-mpd.bash over a single persistent connection to the MPD socket:
+ *
+ * - when an A2DP sink PCM is added, playback is switched to the Bluetooth
+ *   output, and back to the card output when the PCM is removed.
+ * - when an A2DP source PCM starts running, its stream is inserted into the
+ *   queue and played; when it stops, the stream is removed and the previous
+ *   playback state is restored.
+ *
+ * Arguments are a comma separated list of:
+ *   socket=PATH    the MPD socket
+ *   card=N         the MPD output number of the sound card, default 1
+ *   bluetooth=N    the MPD output number for Bluetooth, default 2
+ * Output numbers are as shown by "mpc outputs".
+ */
+
+/* Time allowed for MPD to respond, in milliseconds */
+#define MPD_TIMEOUT 1000
+
+#define MPD_STREAM_TITLE "Bluetooth Input Stream"
+
+struct mpd {
+	char socket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	unsigned int card_output;
+	unsigned int bluetooth_output;
+	int fd;
+	char buffer[4096];
+	size_t len;
+	char line[4096];
+	/* the stream inserted for a running source PCM */
+	struct {
+		bool active;
+		char path[128];
+		unsigned int id;
+		char state[8];
+		int song;
+		char elapsed[16];
+	} stream;
+};
+
+static void mpd_disconnect(struct mpd *mpd) {
+	if (mpd->fd != -1)
+		close(mpd->fd);
+	mpd->fd = -1;
+	mpd->len = 0;
+}
+
+/**
+ * Read one line of the MPD response, without the newline.
+ * @return the line, which is valid until the next call, or NULL if the
+ * connection has failed.
+ */
+static char *mpd_read_line(struct mpd *mpd) {
+	char *end;
+
+	while ((end = memchr(mpd->buffer, '\n', mpd->len)) == NULL) {
+		ssize_t ret;
+		if (mpd->len == sizeof(mpd->buffer))
+			return NULL;
+		if ((ret = recv(mpd->fd, mpd->buffer + mpd->len, sizeof(mpd->buffer) - mpd->len, 0)) <= 0)
+			return NULL;
+		mpd->len += ret;
+	}
+
+	const size_t len = end - mpd->buffer;
+	memcpy(mpd->line, mpd->buffer, len);
+	mpd->line[len] = '\0';
+	mpd->len -= len + 1;
+	memmove(mpd->buffer, end + 1, mpd->len);
+	return mpd->line;
+}
+
+static int mpd_connect(struct mpd *mpd) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const struct timeval timeout = {
+		.tv_sec = MPD_TIMEOUT / 1000,
+		.tv_usec = (MPD_TIMEOUT % 1000) * 1000,
+	};
+	const char *greeting;
+
+	if (mpd->fd != -1) {
+		/* MPD sends nothing unsolicited, so a readable idle connection
+		 * has been closed by the server */
+		struct pollfd pfd = { .fd = mpd->fd, .events = POLLIN };
+		if (poll(&pfd, 1, 0) == 0)
+			return 0;
+		mpd_disconnect(mpd);
+	}
+
+	strcpy(addr.sun_path, mpd->socket);
+	if ((mpd->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -errno;
+	/* without the timeouts a hung MPD would stall the plugin thread */
+	if (setsockopt(mpd->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+			setsockopt(mpd->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1 ||
+			connect(mpd->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		const int err = errno;
+		mpd_disconnect(mpd);
+		return -err;
+	}
+
+	if ((greeting = mpd_read_line(mpd)) == NULL || strncmp(greeting, "OK MPD ", 7) != 0) {
+		mpd_disconnect(mpd);
+		return -EPROTO;
+	}
+
+	debug("Connected to %s", greeting + 3);
+	return 0;
+}
+
+/**
+ * Send commands to MPD, reconnecting if the connection has been closed since
+ * the last request, for example by the MPD idle timeout.
+ * @param commands one or more newline terminated commands. Multiple commands
+ *                 should be enclosed in a command list so that they are
+ *                 executed atomically.
+ * @param reply buffer for the response lines, without the final "OK", or
+ *              NULL if the response is not required.
+ * @return 0 on success, -EPROTO if MPD rejected a command, or other negative
+ * error code if MPD could not be reached.
+ */
+static int mpd_command(struct mpd *mpd, const char *commands, char *reply, size_t size) {
+	const size_t len = strlen(commands);
+	int ret = 0;
+
+	for (int attempt = 0; attempt < 2; attempt++) {
+		char *line;
+		size_t used = 0;
+
+		if ((ret = mpd_connect(mpd)) < 0)
+			continue;
+
+		if (send(mpd->fd, commands, len, MSG_NOSIGNAL) != (ssize_t)len) {
+			mpd_disconnect(mpd);
+			ret = -EIO;
+			continue;
+		}
+
+		if (reply != NULL && size > 0)
+			reply[0] = '\0';
+		while ((line = mpd_read_line(mpd)) != NULL) {
+			if (strcmp(line, "OK") == 0)
+				return 0;
+			if (strncmp(line, "ACK ", 4) == 0) {
+				warn("MPD: %s", line + 4);
+				return -EPROTO;
+			}
+			if (reply != NULL && used + strlen(line) + 1 < size)
+				used += sprintf(reply + used, "%s\n", line);
+		}
+
+		/* the connection failed part way through the response, so there is
+		 * no way to know whether the commands were executed */
+		warn("MPD: Connection lost");
+		mpd_disconnect(mpd);
+		return -EIO;
+	}
+
+	error("Couldn't connect to MPD at %s (%s)", mpd->socket, strerror(-ret));
+	return ret;
+}
+
+/**
+ * Find a value in an MPD response.
+ * @return the value, copied into buffer, or NULL if the key is not present.
+ */
+static const char *mpd_value(const char *reply, const char *key, char *buffer, size_t size) {
+	const size_t len = strlen(key);
+
+	for (const char *line = reply; *line != '\0'; line = strchr(line, '\n') + 1) {
+		if (strncmp(line, key, len) == 0 && strncmp(line + len, ": ", 2) == 0) {
+			const char *value = line + len + 2;
+			snprintf(buffer, size, "%.*s", (int)strcspn(value, "\n"), value);
+			return buffer;
+		}
+	}
+	return NULL;
+}
+
+static bool mpd_is_a2dp(const struct bluealsa_pcm_data *pcm) {
+	return strcmp(pcm->profile, "A2DP") == 0;
+}
+
+/**
+ * Switch playback between the card and Bluetooth outputs, resuming playback
+ * if it was playing before the switch.
+ */
+static void mpd_switch_output(struct mpd *mpd, unsigned int enable, unsigned int disable) {
+	char reply[1024], state[8], commands[256];
+
+	if (mpd_command(mpd, "status\n", reply, sizeof(reply)) < 0)
+		return;
+	const bool playing = mpd_value(reply, "state", state, sizeof(state)) != NULL &&
+		strcmp(state, "play") == 0;
+
+	snprintf(commands, sizeof(commands),
+			"command_list_begin\n"
+			"pause 1\n"
+			"enableoutput %u\n"
+			"disableoutput %u\n"
+			"%s"
+			"command_list_end\n",
+			enable, disable, playing ? "play\n" : "");
+	mpd_command(mpd, commands, NULL, 0);
+}
+
+static void mpd_stream_start(struct mpd *mpd, const struct bluealsa_pcm_data *pcm) {
+	char reply[1024], value[16], commands[512];
+	int position = 0;
+
+	if (mpd->stream.active)
+		return;
+
+	if (mpd_command(mpd, "status\n", reply, sizeof(reply)) < 0)
+		return;
+
+	if (mpd_value(reply, "state", mpd->stream.state, sizeof(mpd->stream.state)) == NULL)
+		strcpy(mpd->stream.state, "stop");
+	mpd->stream.song = mpd_value(reply, "song", value, sizeof(value)) != NULL ? atoi(value) : -1;
+	if (mpd_value(reply, "elapsed", mpd->stream.elapsed, sizeof(mpd->stream.elapsed)) == NULL)
+		strcpy(mpd->stream.elapsed, "0");
+	/* insert after the current song, if any */
+	if (mpd->stream.song >= 0)
+		position = mpd->stream.song + 1;
+
+	snprintf(commands, sizeof(commands), "addid \"alsa://%s?format=%s:16:%s\" %d\n",
+			pcm->alsa_id, pcm->rate, pcm->channels, position);
+	if (mpd_command(mpd, commands, reply, sizeof(reply)) < 0 ||
+			mpd_value(reply, "Id", value, sizeof(value)) == NULL)
+		return;
+
+	mpd->stream.id = atoi(value);
+	mpd->stream.active = true;
+	strcpy(mpd->stream.path, pcm->path);
+
+	snprintf(commands, sizeof(commands),
+			"command_list_begin\n"
+			"addtagid %u title \"" MPD_STREAM_TITLE "\"\n"
+			"playid %u\n"
+			"command_list_end\n",
+			mpd->stream.id, mpd->stream.id);
+	mpd_command(mpd, commands, NULL, 0);
+}
+
+static void mpd_stream_stop(struct mpd *mpd, const struct bluealsa_pcm_data *pcm) {
+	char commands[256];
+	int len;
+
+	if (!mpd->stream.active || strcmp(mpd->stream.path, pcm->path) != 0)
+		return;
+	mpd->stream.active = false;
+
+	len = snprintf(commands, sizeof(commands),
+			"command_list_begin\n"
+			"stop\n"
+			"deleteid %u\n",
+			mpd->stream.id);
+
+	/* the stream was inserted after the previous song, so its position
+	 * is unchanged */
+	if (mpd->stream.song >= 0 && strcmp(mpd->stream.state, "stop") != 0) {
+		len += snprintf(commands + len, sizeof(commands) - len, "seek %d %s\n",
+				mpd->stream.song, mpd->stream.elapsed);
+		if (strcmp(mpd->stream.state, "pause") == 0)
+			len += snprintf(commands + len, sizeof(commands) - len, "pause 1\n");
+	}
+
+	snprintf(commands + len, sizeof(commands) - len, "command_list_end\n");
+	mpd_command(mpd, commands, NULL, 0);
+}
+
+static int mpd_init(const char *args, void **data) {
+	struct mpd *mpd;
+	char *list = NULL, *item, *saveptr;
+	const char *session;
+	int ret = 0;
+
+	if ((mpd = calloc(1, sizeof(*mpd))) == NULL)
+		return -ENOMEM;
+	mpd->fd = -1;
+	mpd->card_output = 1;
+	mpd->bluetooth_output = 2;
+
+	/* the same default as the example script 52-mpd.bash */
+	if ((session = getenv("BLUEALSA_AGENT_SYSTEMD")) != NULL && strcmp(session, "USER") == 0)
+		snprintf(mpd->socket, sizeof(mpd->socket), "/run/user/%u/mpd/socket", getuid());
+	else
+		strcpy(mpd->socket, "/run/mpd/socket");
+
+	if (args != NULL && (list = strdup(args)) == NULL)
+		ret = -ENOMEM;
+	for (item = list ? strtok_r(list, ",", &saveptr) : NULL; item != NULL && ret == 0;
+			item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+		if (value == NULL) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = '\0';
+		if (strcmp(item, "socket") == 0) {
+			if (strlen(value) >= sizeof(mpd->socket))
+				ret = -ENAMETOOLONG;
+			else
+				strcpy(mpd->socket, value);
+		}
+		else if (strcmp(item, "card") == 0 && atoi(value) > 0)
+			mpd->card_output = atoi(value);
+		else if (strcmp(item, "bluetooth") == 0 && atoi(value) > 0)
+			mpd->bluetooth_output = atoi(value);
+		else
+			ret = -EINVAL;
+	}
+	free(list);
+
+	if (ret < 0) {
+		free(mpd);
+		return ret;
+	}
+
+	*data = mpd;
+	return 0;
+}
+
+static void mpd_add(const struct bluealsa_pcm_data *pcm, void *data) {
+	struct mpd *mpd = data;
+
+	if (!mpd_is_a2dp(pcm))
+		return;
+
+	/* MPD output ids start from 0 */
+	if (strcmp(pcm->mode, "sink") == 0)
+		mpd_switch_output(mpd, mpd->bluetooth_output - 1, mpd->card_output - 1);
+	else if (pcm->running)
+		mpd_stream_start(mpd, pcm);
+}
+
+static void mpd_remove(const struct bluealsa_pcm_data *pcm, void *data) {
+	struct mpd *mpd = data;
+
+	if (!mpd_is_a2dp(pcm))
+		return;
+
+	if (strcmp(pcm->mode, "sink") == 0)
+		mpd_switch_output(mpd, mpd->card_output - 1, mpd->bluetooth_output - 1);
+	else
+		mpd_stream_stop(mpd, pcm);
+}
+
+static void mpd_update(const struct bluealsa_pcm_data *pcm, unsigned int changes, void *data) {
+	struct mpd *mpd = data;
+
+	if (!mpd_is_a2dp(pcm) || strcmp(pcm->mode, "source") != 0 ||
+			!(changes & BLUEALSA_AGENT_CHANGE_RUNNING))
+		return;
+
+	if (pcm->running)
+		mpd_stream_start(mpd, pcm);
+	else
+		mpd_stream_stop(mpd, pcm);
+}
+
+static void mpd_free(void *data) {
+	struct mpd *mpd = data;
+	mpd_disconnect(mpd);
+	free(mpd);
+}
+
+const struct bluealsa_agent_plugin bluealsa_agent_plugin_mpd = {
+	.abi_version = BLUEALSA_AGENT_PLUGIN_ABI_VERSION,
+	.name = "mpd",
+	/* allow for one reconnection attempt */
+	.budget = 3 * MPD_TIMEOUT,
+	.init_func = mpd_init,
+	.add_func = mpd_add,
+	.remove_func = mpd_remove,
+	.update_func = mpd_update,
+	.free_func = mpd_free,
+};
@@ -0,0 +1,370 @@
+/*
+ * bluealsa-autoconfig - agent-plugin-performance.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "agent-plugin.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Built-in plugin to apply a CPU performance profile while any selected PCM
+ * is running, and to revert it when the last one stops. This avoids audio
+ * underruns at the start of a stream while a power saving cpufreq governor
+ * ramps up.
+ *
+ * Arguments are a comma separated list of:
+ *   governor=NAME      cpufreq scaling governor
+ *   min-freq=KHZ|max   cpufreq minimum scaling frequency
+ *   cpus=MASK          hexadecimal mask of the CPUs to which the governor and
+ *                      minimum frequency apply, default all
+ *   dma-latency=USEC   PM QoS CPU DMA latency, held while the profile applies
+ *   irq=N:MASK         hexadecimal CPU affinity mask of interrupt N, may be
+ *                      given more than once; the 32 bit words of a longer
+ *                      mask are separated by ':', not ','
+ *   root=DIR           prefix for the /sys, /proc and /dev paths
+ */
+
+#define PERFORMANCE_MAX_CPUS 64
+#define PERFORMANCE_MAX_IRQS 16
+
+/* A setting changed by the profile, and its value before the change */
+struct saved_value {
+	char path[PATH_MAX];
+	char value[64];
+};
+
+struct performance {
+	char root[PATH_MAX / 2];
+	char governor[32];
+	char min_freq[16];
+	uint64_t cpus;
+	int dma_latency;
+	struct {
+		unsigned int irq;
+		char mask[64];
+	} irqs[PERFORMANCE_MAX_IRQS];
+	size_t irqs_count;
+	/* the paths of the running PCMs */
+	struct {
+		char (*data)[128];
+		size_t capacity;
+		size_t count;
+	} running;
+	/* the settings to be restored when the profile is reverted */
+	struct {
+		struct saved_value *data;
+		size_t capacity;
+		size_t count;
+	} saved;
+	int dma_latency_fd;
+};
+
+static int performance_read(const char *path, char *buffer, size_t size) {
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -errno;
+	len = read(fd, buffer, size - 1);
+	close(fd);
+	if (len == -1)
+		return -errno;
+
+	buffer[len] = '\0';
+	buffer[strcspn(buffer, "\n")] = '\0';
+	return 0;
+}
+
+static int performance_write(const char *path, const char *value) {
+	const size_t len = strlen(value);
+	int fd, ret = 0;
+
+	/* truncation has no effect on sysfs, but allows testing with a tree of
+	 * regular files */
+	if ((fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC)) == -1)
+		return -errno;
+	if (write(fd, value, len) != (ssize_t)len)
+		ret = -errno;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Change a setting, remembering its current value so that it can be restored.
+ */
+static void performance_set(struct performance *perf, const char *path, const char *value) {
+	struct saved_value *saved;
+	int ret;
+
+	if (perf->saved.count == perf->saved.capacity) {
+		const size_t new_size = perf->saved.capacity > 0 ? 2 * perf->saved.capacity : 8;
+		if ((saved = realloc(perf->saved.data, new_size * sizeof(*saved))) == NULL) {
+			error("Out of memory");
+			return;
+		}
+		perf->saved.data = saved;
+		perf->saved.capacity = new_size;
+	}
+
+	saved = &perf->saved.data[perf->saved.count];
+	snprintf(saved->path, sizeof(saved->path), "%s", path);
+	if ((ret = performance_read(path, saved->value, sizeof(saved->value))) < 0) {
+		warn("Couldn't read %s (%s)", path, strerror(-ret));
+		return;
+	}
+	if (strcmp(saved->value, value) == 0)
+		return;
+
+	if ((ret = performance_write(path, value)) < 0) {
+		warn("Couldn't write %s to %s (%s)", value, path, strerror(-ret));
+		return;
+	}
+	perf->saved.count++;
+}
+
+static void performance_apply(struct performance *perf) {
+	char path[PATH_MAX], value[64];
+
+	for (unsigned int cpu = 0; cpu < PERFORMANCE_MAX_CPUS; cpu++) {
+		if (perf->governor[0] == '\0' && perf->min_freq[0] == '\0')
+			break;
+
+		snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/cpufreq", perf->root, cpu);
+		if (access(path, F_OK) == -1) {
+			/* CPUs are numbered consecutively, but may lack cpufreq */
+			snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u", perf->root, cpu);
+			if (access(path, F_OK) == -1)
+				break;
+			continue;
+		}
+		if (perf->cpus != 0 && !(perf->cpus & (UINT64_C(1) << cpu)))
+			continue;
+
+		if (perf->governor[0] != '\0') {
+			snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/cpufreq/scaling_governor", perf->root, cpu);
+			performance_set(perf, path, perf->governor);
+		}
+
+		if (perf->min_freq[0] != '\0') {
+			const char *freq = perf->min_freq;
+			if (strcmp(freq, "max") == 0) {
+				snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/cpufreq/cpuinfo_max_freq", perf->root, cpu);
+				if (performance_read(path, value, sizeof(value)) < 0)
+					continue;
+				freq = value;
+			}
+			snprintf(path, sizeof(path), "%s/sys/devices/system/cpu/cpu%u/cpufreq/scaling_min_freq", perf->root, cpu);
+			performance_set(perf, path, freq);
+		}
+	}
+
+	for (size_t n = 0; n < perf->irqs_count; n++) {
+		snprintf(path, sizeof(path), "%s/proc/irq/%u/smp_affinity", perf->root, perf->irqs[n].irq);
+		performance_set(perf, path, perf->irqs[n].mask);
+	}
+
+	/* the QoS request remains in force for as long as the file is open */
+	if (perf->dma_latency >= 0) {
+		const int32_t latency = perf->dma_latency;
+		snprintf(path, sizeof(path), "%s/dev/cpu_dma_latency", perf->root);
+		if ((perf->dma_latency_fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+			warn("Couldn't open %s (%s)", path, strerror(errno));
+		else if (write(perf->dma_latency_fd, &latency, sizeof(latency)) != sizeof(latency)) {
+			warn("Couldn't set CPU DMA latency (%s)", strerror(errno));
+			close(perf->dma_latency_fd);
+			perf->dma_latency_fd = -1;
+		}
+	}
+
+	debug("Performance profile applied");
+}
+
+static void performance_revert(struct performance *perf) {
+	int ret;
+
+	if (perf->dma_latency_fd != -1) {
+		close(perf->dma_latency_fd);
+		perf->dma_latency_fd = -1;
+	}
+
+	/* in reverse order, in case any setting depends on an earlier one */
+	while (perf->saved.count > 0) {
+		const struct saved_value *saved = &perf->saved.data[--perf->saved.count];
+		if ((ret = performance_write(saved->path, saved->value)) < 0)
+			warn("Couldn't restore %s to %s (%s)", saved->path, saved->value, strerror(-ret));
+	}
+
+	debug("Performance profile reverted");
+}
+
+static void performance_start(struct performance *perf, const struct bluealsa_pcm_data *pcm) {
+	for (size_t n = 0; n < perf->running.count; n++)
+		if (strcmp(perf->running.data[n], pcm->path) == 0)
+			return;
+
+	if (perf->running.count == perf->running.capacity) {
+		const size_t new_size = perf->running.capacity > 0 ? 2 * perf->running.capacity : 4;
+		char (*data)[128];
+		if ((data = realloc(perf->running.data, new_size * sizeof(*data))) == NULL) {
+			error("Out of memory");
+			return;
+		}
+		perf->running.data = data;
+		perf->running.capacity = new_size;
+	}
+	memcpy(perf->running.data[perf->running.count++], pcm->path, sizeof(pcm->path));
+
+	if (perf->running.count == 1)
+		performance_apply(perf);
+}
+
+static void performance_stop(struct performance *perf, const struct bluealsa_pcm_data *pcm) {
+	for (size_t n = 0; n < perf->running.count; n++) {
+		if (strcmp(perf->running.data[n], pcm->path) != 0)
+			continue;
+		if (--perf->running.count > n)
+			memcpy(perf->running.data[n], perf->running.data[perf->running.count], sizeof(*perf->running.data));
+		if (perf->running.count == 0)
+			performance_revert(perf);
+		return;
+	}
+}
+
+static int performance_parse(struct performance *perf, char *item) {
+	char *value, *end;
+
+	if ((value = strchr(item, '=')) == NULL)
+		return -EINVAL;
+	*value++ = '\0';
+
+	if (strcmp(item, "governor") == 0) {
+		if (value[0] == '\0' || strlen(value) >= sizeof(perf->governor))
+			return -EINVAL;
+		strcpy(perf->governor, value);
+	}
+	else if (strcmp(item, "min-freq") == 0) {
+		if (strcmp(value, "max") != 0 && (strtoul(value, &end, 10) == 0 || *end != '\0'))
+			return -EINVAL;
+		if (strlen(value) >= sizeof(perf->min_freq))
+			return -EINVAL;
+		strcpy(perf->min_freq, value);
+	}
+	else if (strcmp(item, "cpus") == 0) {
+		errno = 0;
+		perf->cpus = strtoull(value, &end, 16);
+		if (errno != 0 || end == value || *end != '\0' || perf->cpus == 0)
+			return -EINVAL;
+	}
+	else if (strcmp(item, "dma-latency") == 0) {
+		const long latency = strtol(value, &end, 10);
+		if (end == value || *end != '\0' || latency < 0 || latency > INT32_MAX)
+			return -EINVAL;
+		perf->dma_latency = latency;
+	}
+	else if (strcmp(item, "irq") == 0) {
+		const unsigned long irq = strtoul(value, &end, 10);
+		if (end == value || *end != ':' || perf->irqs_count == PERFORMANCE_MAX_IRQS)
+			return -EINVAL;
+		value = end + 1;
+		if (value[0] == '\0' || strlen(value) >= sizeof(perf->irqs[0].mask) ||
+				value[strspn(value, "0123456789abcdefABCDEF:")] != '\0')
+			return -EINVAL;
+		/* smp_affinity separates the words with ',' */
+		for (end = value; (end = strchr(end, ':')) != NULL; end++)
+			*end = ',';
+		perf->irqs[perf->irqs_count].irq = irq;
+		strcpy(perf->irqs[perf->irqs_count++].mask, value);
+	}
+	else if (strcmp(item, "root") == 0) {
+		if (strlen(value) >= sizeof(perf->root))
+			return -ENAMETOOLONG;
+		strcpy(perf->root, value);
+	}
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static int performance_init(const char *args, void **data) {
+	struct performance *perf;
+	char *list = NULL, *item, *saveptr;
+	int ret = 0;
+
+	if ((perf = calloc(1, sizeof(*perf))) == NULL)
+		return -ENOMEM;
+	perf->dma_latency = -1;
+	perf->dma_latency_fd = -1;
+
+	if (args != NULL && (list = strdup(args)) == NULL)
+		ret = -ENOMEM;
+	for (item = list ? strtok_r(list, ",", &saveptr) : NULL; item != NULL && ret == 0;
+			item = strtok_r(NULL, ",", &saveptr))
+		ret = performance_parse(perf, item);
+	free(list);
+
+	if (ret == 0 && perf->governor[0] == '\0' && perf->min_freq[0] == '\0' &&
+			perf->dma_latency < 0 && perf->irqs_count == 0)
+		ret = -EINVAL;
+
+	if (ret < 0) {
+		free(perf);
+		return ret;
+	}
+
+	*data = perf;
+	return 0;
+}
+
+static void performance_add(const struct bluealsa_pcm_data *pcm, void *data) {
+	if (pcm->running)
+		performance_start(data, pcm);
+}
+
+static void performance_remove(const struct bluealsa_pcm_data *pcm, void *data) {
+	performance_stop(data, pcm);
+}
+
+static void performance_update(const struct bluealsa_pcm_data *pcm, unsigned int changes, void *data) {
+	if (!(changes & BLUEALSA_AGENT_CHANGE_RUNNING))
+		return;
+	if (pcm->running)
+		performance_start(data, pcm);
+	else
+		performance_stop(data, pcm);
+}
+
+static void performance_free(void *data) {
+	struct performance *perf = data;
+	if (perf->running.count > 0)
+		performance_revert(perf);
+	free(perf->running.data);
+	free(perf->saved.data);
+	free(perf);
+}
+
+const struct bluealsa_agent_plugin bluealsa_agent_plugin_performance = {
+	.abi_version = BLUEALSA_AGENT_PLUGIN_ABI_VERSION,
+	.name = "performance",
+	.budget = 0,
+	.init_func = performance_init,
+	.add_func = performance_add,
+	.remove_func = performance_remove,
+	.update_func = performance_update,
+	.free_func = performance_free,
+};
@@ -0,0 +1,387 @@
+/*
+ * bluealsa-autoconfig - agent-plugin.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "agent-plugin.h"
+#include "bluez-alsa/shared/log.h"
+
+#ifndef BLUEALSA_AGENT_PLUGIN_DIR
+# define BLUEALSA_AGENT_PLUGIN_DIR "/usr/lib/bluealsa-agent"
+#endif
+
+/* Maximum number of events waiting for a plugin worker thread */
+#define PLUGIN_QUEUE_SIZE 64
+
+/* Plugins compiled into the agent, selected by name */
+static const struct {
+	const char *name;
+	const struct bluealsa_agent_plugin *plugin;
+} builtin_plugins[] = {
+	{ "mpd", &bluealsa_agent_plugin_mpd },
+	{ "performance", &bluealsa_agent_plugin_performance },
+	{ NULL, NULL },
+};
+
+enum plugin_event_type {
+	PLUGIN_EVENT_ADD,
+	PLUGIN_EVENT_REMOVE,
+	PLUGIN_EVENT_UPDATE,
+};
+
+struct plugin_event {
+	enum plugin_event_type type;
+	unsigned int changes;
+	struct bluealsa_pcm_data pcm;
+};
+
+struct bluealsa_agent_plugin_instance {
+	const struct bluealsa_agent_plugin *plugin;
+	char name[64];
+	void *dl_handle;
+	void *data;
+	unsigned int budget;
+	pthread_t thread;
+	/* signalled when an event is queued or the state changes */
+	pthread_cond_t cond;
+	struct plugin_event queue[PLUGIN_QUEUE_SIZE];
+	size_t head;
+	size_t count;
+	unsigned int dropped;
+	/* a callback is in progress, and must return before deadline */
+	bool busy;
+	struct timespec deadline;
+	bool disabled;
+	bool stopping;
+	bool finished;
+	struct bluealsa_agent_plugin_instance *next;
+};
+
+/* Protects all plugin instance state, and the instance list */
+static pthread_mutex_t plugin_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watchdog_cond;
+static pthread_t watchdog_thread;
+static bool watchdog_started = false;
+static struct bluealsa_agent_plugin_instance *plugins = NULL;
+
+static int timespec_cmp(const struct timespec *a, const struct timespec *b) {
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec ? -1 : 1;
+	if (a->tv_nsec != b->tv_nsec)
+		return a->tv_nsec < b->tv_nsec ? -1 : 1;
+	return 0;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms) {
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static int plugin_cond_init(pthread_cond_t *cond) {
+	pthread_condattr_t attr;
+	int ret;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+	return ret;
+}
+
+/**
+ * Disable plugins whose current callback has exceeded its time budget.
+ * A stalled callback cannot safely be interrupted, so its worker thread is
+ * abandoned and no further events are passed to that plugin.
+ */
+static void *plugin_watchdog(void *arg) {
+	(void) arg;
+
+	pthread_mutex_lock(&plugin_mutex);
+	for (;;) {
+		struct bluealsa_agent_plugin_instance *instance;
+		struct timespec now, next;
+		bool have_next = false;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (instance = plugins; instance != NULL; instance = instance->next) {
+			if (!instance->busy || instance->disabled)
+				continue;
+			if (timespec_cmp(&now, &instance->deadline) >= 0) {
+				error("Plugin '%s' exceeded its time budget of %u ms: disabled",
+						instance->name, instance->budget);
+				instance->disabled = true;
+				pthread_cond_broadcast(&instance->cond);
+				continue;
+			}
+			if (!have_next || timespec_cmp(&instance->deadline, &next) < 0) {
+				next = instance->deadline;
+				have_next = true;
+			}
+		}
+
+		if (have_next)
+			pthread_cond_timedwait(&watchdog_cond, &plugin_mutex, &next);
+		else
+			pthread_cond_wait(&watchdog_cond, &plugin_mutex);
+	}
+
+	return NULL;
+}
+
+static void plugin_dispatch(struct bluealsa_agent_plugin_instance *instance, const struct plugin_event *event) {
+	const struct bluealsa_agent_plugin *plugin = instance->plugin;
+	switch (event->type) {
+	case PLUGIN_EVENT_ADD:
+		if (plugin->add_func != NULL)
+			plugin->add_func(&event->pcm, instance->data);
+		break;
+	case PLUGIN_EVENT_REMOVE:
+		if (plugin->remove_func != NULL)
+			plugin->remove_func(&event->pcm, instance->data);
+		break;
+	case PLUGIN_EVENT_UPDATE:
+		if (plugin->update_func != NULL)
+			plugin->update_func(&event->pcm, event->changes, instance->data);
+		break;
+	}
+}
+
+static void *plugin_worker(void *arg) {
+	struct bluealsa_agent_plugin_instance *instance = arg;
+	struct plugin_event event;
+
+	pthread_mutex_lock(&plugin_mutex);
+	for (;;) {
+		while (instance->count == 0 && !instance->stopping)
+			pthread_cond_wait(&instance->cond, &plugin_mutex);
+		if (instance->count == 0)
+			break;
+
+		event = instance->queue[instance->head];
+		instance->head = (instance->head + 1) % PLUGIN_QUEUE_SIZE;
+		instance->count--;
+
+		instance->busy = true;
+		clock_gettime(CLOCK_MONOTONIC, &instance->deadline);
+		timespec_add_ms(&instance->deadline, instance->budget);
+		pthread_cond_signal(&watchdog_cond);
+		pthread_mutex_unlock(&plugin_mutex);
+
+		plugin_dispatch(instance, &event);
+
+		pthread_mutex_lock(&plugin_mutex);
+		instance->busy = false;
+		if (instance->disabled)
+			break;
+	}
+	instance->finished = true;
+	pthread_cond_broadcast(&instance->cond);
+	pthread_mutex_unlock(&plugin_mutex);
+
+	return NULL;
+}
+
+static void plugin_queue_event(struct bluealsa_agent_plugin_instance *instance, enum plugin_event_type type, const struct bluealsa_pcm_data *pcm, unsigned int changes) {
+	pthread_mutex_lock(&plugin_mutex);
+
+	if (instance->disabled)
+		goto final;
+
+	if (instance->count == PLUGIN_QUEUE_SIZE) {
+		if (instance->dropped++ == 0)
+			warn("Plugin '%s' event queue full: dropping events", instance->name);
+		goto final;
+	}
+	instance->dropped = 0;
+
+	struct plugin_event *event = &instance->queue[(instance->head + instance->count) % PLUGIN_QUEUE_SIZE];
+	event->type = type;
+	event->changes = changes;
+	event->pcm = *pcm;
+	instance->count++;
+	pthread_cond_broadcast(&instance->cond);
+
+final:
+	pthread_mutex_unlock(&plugin_mutex);
+}
+
+static const struct bluealsa_agent_plugin *plugin_open(const char *name, void **handle) {
+	const struct bluealsa_agent_plugin *plugin;
+	char path[PATH_MAX];
+	int ret;
+
+	*handle = NULL;
+	for (size_t n = 0; builtin_plugins[n].name != NULL; n++)
+		if (strcmp(name, builtin_plugins[n].name) == 0)
+			return builtin_plugins[n].plugin;
+
+	if (strchr(name, '/') != NULL)
+		ret = snprintf(path, sizeof(path), "%s", name);
+	else
+		ret = snprintf(path, sizeof(path), BLUEALSA_AGENT_PLUGIN_DIR "/%s.so", name);
+	if (ret >= (int)sizeof(path)) {
+		error("Plugin path too long: %s", name);
+		return NULL;
+	}
+
+	if ((*handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		error("Cannot load plugin '%s' (%s)", path, dlerror());
+		return NULL;
+	}
+
+	if ((plugin = dlsym(*handle, BLUEALSA_AGENT_PLUGIN_SYMBOL)) == NULL) {
+		error("Invalid plugin '%s' (%s)", path, dlerror());
+		dlclose(*handle);
+		*handle = NULL;
+		return NULL;
+	}
+
+	return plugin;
+}
+
+/**
+ * Load a plugin and start its worker thread.
+ * @param spec the plugin name or path, optionally followed by a colon and
+ *             an argument string to be passed to the plugin.
+ * @return the plugin instance, or NULL on error.
+ */
+struct bluealsa_agent_plugin_instance *bluealsa_agent_plugin_load(const char *spec) {
+	struct bluealsa_agent_plugin_instance *instance;
+	const struct bluealsa_agent_plugin *plugin;
+	const char *args;
+	char name[PATH_MAX];
+	void *handle;
+	int ret;
+
+	if ((args = strchr(spec, ':')) != NULL) {
+		snprintf(name, sizeof(name), "%.*s", (int)(args - spec), spec);
+		args++;
+	}
+	else
+		snprintf(name, sizeof(name), "%s", spec);
+
+	if ((plugin = plugin_open(name, &handle)) == NULL)
+		return NULL;
+
+	if (plugin->abi_version != BLUEALSA_AGENT_PLUGIN_ABI_VERSION) {
+		error("Plugin '%s' has incompatible ABI version %u (expected %u)",
+				name, plugin->abi_version, BLUEALSA_AGENT_PLUGIN_ABI_VERSION);
+		goto fail;
+	}
+
+	if ((instance = calloc(1, sizeof(*instance))) == NULL) {
+		error("Out of memory");
+		goto fail;
+	}
+
+	instance->plugin = plugin;
+	instance->dl_handle = handle;
+	instance->budget = plugin->budget > 0 ? plugin->budget : BLUEALSA_AGENT_PLUGIN_DEFAULT_BUDGET;
+	strncpy(instance->name, plugin->name != NULL ? plugin->name : name, sizeof(instance->name) - 1);
+
+	if (plugin->init_func != NULL && (ret = plugin->init_func(args, &instance->data)) < 0) {
+		error("Plugin '%s' initialization failed (%s)", instance->name, strerror(-ret));
+		free(instance);
+		goto fail;
+	}
+
+	plugin_cond_init(&instance->cond);
+
+	pthread_mutex_lock(&plugin_mutex);
+	if (!watchdog_started) {
+		plugin_cond_init(&watchdog_cond);
+		if ((ret = pthread_create(&watchdog_thread, NULL, plugin_watchdog, NULL)) != 0) {
+			pthread_mutex_unlock(&plugin_mutex);
+			error("Cannot create plugin watchdog thread (%s)", strerror(ret));
+			goto fail_thread;
+		}
+		pthread_detach(watchdog_thread);
+		watchdog_started = true;
+	}
+	if ((ret = pthread_create(&instance->thread, NULL, plugin_worker, instance)) != 0) {
+		pthread_mutex_unlock(&plugin_mutex);
+		error("Cannot create thread for plugin '%s' (%s)", instance->name, strerror(ret));
+		goto fail_thread;
+	}
+	instance->next = plugins;
+	plugins = instance;
+	pthread_mutex_unlock(&plugin_mutex);
+
+	debug("Loaded plugin '%s'", instance->name);
+	return instance;
+
+fail_thread:
+	if (plugin->free_func != NULL)
+		plugin->free_func(instance->data);
+	pthread_cond_destroy(&instance->cond);
+	free(instance);
+fail:
+	if (handle != NULL)
+		dlclose(handle);
+	return NULL;
+}
+
+/**
+ * Deliver all queued events, then stop the worker thread and release the
+ * plugin. A plugin whose callback is stalled is abandoned.
+ */
+void bluealsa_agent_plugin_unload(struct bluealsa_agent_plugin_instance *instance) {
+	struct bluealsa_agent_plugin_instance **ptr;
+
+	pthread_mutex_lock(&plugin_mutex);
+	instance->stopping = true;
+	pthread_cond_broadcast(&instance->cond);
+	while (!instance->finished && !instance->disabled)
+		pthread_cond_wait(&instance->cond, &plugin_mutex);
+
+	if (!instance->finished) {
+		pthread_mutex_unlock(&plugin_mutex);
+		pthread_detach(instance->thread);
+		return;
+	}
+
+	for (ptr = &plugins; *ptr != NULL; ptr = &(*ptr)->next)
+		if (*ptr == instance) {
+			*ptr = instance->next;
+			break;
+		}
+	pthread_mutex_unlock(&plugin_mutex);
+
+	pthread_join(instance->thread, NULL);
+	if (instance->plugin->free_func != NULL)
+		instance->plugin->free_func(instance->data);
+	if (instance->dl_handle != NULL)
+		dlclose(instance->dl_handle);
+	pthread_cond_destroy(&instance->cond);
+	free(instance);
+}
+
+void bluealsa_agent_plugin_add(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm) {
+	plugin_queue_event(instance, PLUGIN_EVENT_ADD, pcm, 0);
+}
+
+void bluealsa_agent_plugin_remove(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm) {
+	plugin_queue_event(instance, PLUGIN_EVENT_REMOVE, pcm, 0);
+}
+
+void bluealsa_agent_plugin_update(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm, unsigned int changes) {
+	plugin_queue_event(instance, PLUGIN_EVENT_UPDATE, pcm, changes);
+}
@@ -0,0 +1,26 @@
+/*
+ * bluealsa-autoconfig - agent-plugin.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_PLUGIN_LOADER_H
+#define BLUEALSA_AGENT_PLUGIN_LOADER_H
+
+#include "bluealsa-agent-plugin.h"
+
+struct bluealsa_agent_plugin_instance;
+
+/* Built-in plugins */
+extern const struct bluealsa_agent_plugin bluealsa_agent_plugin_mpd;
+extern const struct bluealsa_agent_plugin bluealsa_agent_plugin_performance;
+
+struct bluealsa_agent_plugin_instance *bluealsa_agent_plugin_load(const char *spec);
+void bluealsa_agent_plugin_unload(struct bluealsa_agent_plugin_instance *instance);
+
+void bluealsa_agent_plugin_add(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm);
+void bluealsa_agent_plugin_remove(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm);
+void bluealsa_agent_plugin_update(struct bluealsa_agent_plugin_instance *instance, const struct bluealsa_pcm_data *pcm, unsigned int changes);
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * bluealsa-autoconfig - agent-prewarm.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agent-prewarm.h"
+#include "bluez-alsa/shared/log.h"
+#include "metrics.h"
+
+/*
+ * A warm process is a child of the agent, forked when a device connects,
+ * which waits for the arguments and environment of its handler event. These
+ * are sent as a single message of nul-terminated strings: the event, the
+ * D-Bus path, the name of the environment variable for each file descriptor
+ * passed with the message, then the environment variables. The process then
+ * executes the handler. If it reads end of file instead, it exits.
+ */
+
+/* Largest event message, which is bounded by the agent environment table */
+#define PREWARM_MESSAGE_MAX 16384
+/* Most file descriptors passed with an event */
+#define PREWARM_MAX_FDS 8
+
+struct warm {
+	unsigned int owner;
+	char address[18];
+	char *prog;
+	pid_t pid;
+	/* the agent end of the socket pair */
+	int fd;
+	/* time at which the process is discarded, in milliseconds */
+	uint64_t deadline;
+};
+
+static struct {
+	struct warm *data;
+	size_t capacity;
+	size_t count;
+} warms = { 0 };
+
+static uint64_t prewarm_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct warm *warm_find(unsigned int owner, const char *address, const char *prog) {
+	for (size_t n = 0; n < warms.count; n++)
+		if (warms.data[n].owner == owner && strcasecmp(warms.data[n].address, address) == 0 &&
+				strcmp(warms.data[n].prog, prog) == 0)
+			return &warms.data[n];
+	return NULL;
+}
+
+/**
+ * Forget a warm process. If it has not been given an event, then it sees end
+ * of file and exits; it is reaped by the main loop.
+ */
+static void warm_remove(size_t n) {
+	struct warm *warm = &warms.data[n];
+	close(warm->fd);
+	free(warm->prog);
+	if (--warms.count > n)
+		memcpy(warm, &warms.data[warms.count], sizeof(*warm));
+}
+
+/**
+ * Wait for an event and execute the handler for it. Returns only if the
+ * handler could not be executed.
+ */
+static void warm_child(int fd, const char *prog, const struct bluealsa_agent_sched *sched) {
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(PREWARM_MAX_FDS * sizeof(int))];
+	} control;
+	char buffer[PREWARM_MESSAGE_MAX];
+	struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = &control,
+		.msg_controllen = sizeof(control),
+	};
+	char fd_env[PREWARM_MAX_FDS][64];
+	int fds[PREWARM_MAX_FDS];
+	size_t fds_count = 0;
+	sigset_t mask;
+	ssize_t len;
+
+	/* Keep only stdio and the event socket. The agent descriptors, such as
+	 * its D-Bus connection, event clients, bridge PCMs and the agent ends of
+	 * the other warm processes, must not be held open by this copy. */
+	if (fd > 3)
+		close_range(3, fd - 1, 0);
+	close_range(fd + 1, ~0U, 0);
+
+	bluealsa_agent_sched_apply(sched);
+
+	sigfillset(&mask);
+	sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+	while ((len = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+		continue;
+	if (len <= 0)
+		_exit(EXIT_SUCCESS);
+	close(fd);
+
+	struct cmsghdr *cmsg;
+	if ((cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+			cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		fds_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), fds_count * sizeof(int));
+	}
+
+	buffer[len] = '\0';
+	char *event = buffer;
+	char *path = event + strlen(event) + 1;
+	if (path >= buffer + len)
+		_exit(EXIT_FAILURE);
+	char *string = path + strlen(path) + 1;
+	for (size_t n = 0; n < fds_count && string < buffer + len; n++, string += strlen(string) + 1) {
+		snprintf(fd_env[n], sizeof(fd_env[n]), "%s=%d", string, fds[n]);
+		putenv(fd_env[n]);
+	}
+	for (; string < buffer + len; string += strlen(string) + 1)
+		putenv(string);
+
+	char *argv[] = { (char *)prog, event, path, NULL };
+	execv(prog, argv);
+	error("Failed to execute %s (%s)", prog, strerror(errno));
+}
+
+/**
+ * Fork a process to run a handler for a device that is expected to add a
+ * PCM. If a warm process already exists for the handler, then its timeout
+ * is restarted.
+ * @param owner identifies the rule of the handler.
+ * @param address the Bluetooth address of the device.
+ * @param prog the handler executable.
+ * @param sched the scheduling of the handler, or NULL.
+ * @param timeout milliseconds after which the process is discarded if no
+ *                event has been given to it.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_agent_prewarm_spawn(unsigned int owner, const char *address, const char *prog, const struct bluealsa_agent_sched *sched, unsigned int timeout) {
+	const uint64_t deadline = prewarm_now() + timeout;
+	struct warm *warm;
+	int fds[2], ret;
+	pid_t pid;
+
+	if ((warm = warm_find(owner, address, prog)) != NULL) {
+		warm->deadline = deadline;
+		return 0;
+	}
+
+	if (strlen(address) >= sizeof(warm->address))
+		return -EINVAL;
+
+	if (warms.count == warms.capacity) {
+		const size_t new_size = warms.capacity + 4;
+		if ((warm = realloc(warms.data, new_size * sizeof(*warms.data))) == NULL)
+			return -ENOMEM;
+		warms.data = warm;
+		warms.capacity = new_size;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+		return -errno;
+
+	switch (pid = fork()) {
+	case 0:
+		close(fds[0]);
+		warm_child(fds[1], prog, sched);
+		_exit(EXIT_FAILURE);
+	case -1:
+		ret = -errno;
+		error("Failed to fork process for %s (%s)", prog, strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return ret;
+	default:
+		close(fds[1]);
+		break;
+	}
+
+	warm = &warms.data[warms.count];
+	if ((warm->prog = strdup(prog)) == NULL) {
+		close(fds[0]);
+		return -ENOMEM;
+	}
+	warm->owner = owner;
+	strcpy(warm->address, address);
+	warm->pid = pid;
+	warm->fd = fds[0];
+	warm->deadline = deadline;
+	warms.count++;
+
+	debug("Pre-spawned %s [%d] for %s", prog, pid, address);
+	return 0;
+}
+
+/**
+ * @return true if a warm process is waiting to run the handler.
+ */
+bool bluealsa_agent_prewarm_ready(unsigned int owner, const char *address, const char *prog) {
+	return warm_find(owner, address, prog) != NULL;
+}
+
+/**
+ * Give an event to a warm process, which then executes the handler.
+ * @param fd_names the names of the environment variables which give the
+ *                 handler the numbers of the file descriptors.
+ * @param fds file descriptors to be inherited by the handler. They are not
+ *            closed by this function.
+ * @return the process id of the handler, or -1 if there is no warm process
+ * for it or the event could not be given to it.
+ */
+pid_t bluealsa_agent_prewarm_run(unsigned int owner, const char *address, const char *prog, const char *event, const char *path, char *const *envp, size_t envc, const char *const *fd_names, const int *fds, size_t fds_count) {
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(PREWARM_MAX_FDS * sizeof(int))];
+	} control;
+	char buffer[PREWARM_MESSAGE_MAX];
+	size_t len = 0;
+	struct warm *warm;
+	pid_t pid;
+
+	if ((warm = warm_find(owner, address, prog)) == NULL)
+		return -1;
+	pid = warm->pid;
+
+	const char *strings[2] = { event, path };
+	for (size_t n = 0; n < 2 + fds_count + envc && len < sizeof(buffer); n++) {
+		const char *string = n < 2 ? strings[n] :
+			n < 2 + fds_count ? fd_names[n - 2] : envp[n - 2 - fds_count];
+		len += snprintf(buffer + len, sizeof(buffer) - len, "%s", string) + 1;
+	}
+
+	struct iovec iov = { .iov_base = buffer, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	if (fds_count > 0 && fds_count <= PREWARM_MAX_FDS) {
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = &control;
+		msg.msg_controllen = CMSG_SPACE(fds_count * sizeof(int));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds_count * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, fds_count * sizeof(int));
+	}
+
+	/* the warm process reserves one byte for a terminating nul */
+	if (len >= sizeof(buffer) || fds_count > PREWARM_MAX_FDS)
+		pid = -1;
+	else if (sendmsg(warm->fd, &msg, MSG_NOSIGNAL) == -1) {
+		debug("Couldn't use warm process [%d] (%s)", pid, strerror(errno));
+		pid = -1;
+	}
+
+	warm_remove(warm - warms.data);
+	return pid;
+}
+
+/**
+ * Discard the warm processes of a device.
+ */
+void bluealsa_agent_prewarm_discard(const char *address) {
+	size_t n = warms.count;
+	while (n-- > 0)
+		if (strcasecmp(warms.data[n].address, address) == 0)
+			warm_remove(n);
+}
+
+void bluealsa_agent_prewarm_discard_all(void) {
+	while (warms.count > 0)
+		warm_remove(warms.count - 1);
+	free(warms.data);
+	warms.data = NULL;
+	warms.capacity = 0;
+}
+
+/**
+ * Forget a warm process which has terminated before being given an event.
+ */
+void bluealsa_agent_prewarm_reaped(pid_t pid) {
+	for (size_t n = 0; n < warms.count; n++)
+		if (warms.data[n].pid == pid) {
+			warm_remove(n);
+			return;
+		}
+}
+
+/**
+ * @return milliseconds until a warm process is to be discarded, or -1 if
+ * there are none.
+ */
+int bluealsa_agent_prewarm_timeout(void) {
+	const uint64_t now = prewarm_now();
+	int timeout = -1;
+
+	for (size_t n = 0; n < warms.count; n++) {
+		const int remaining = warms.data[n].deadline > now ? warms.data[n].deadline - now : 0;
+		if (timeout == -1 || remaining < timeout)
+			timeout = remaining;
+	}
+
+	return timeout;
+}
+
+/**
+ * Discard the warm processes whose timeout has expired.
+ */
+void bluealsa_agent_prewarm_run_timers(void) {
+	const uint64_t now = prewarm_now();
+	size_t n = warms.count;
+
+	while (n-- > 0)
+		if (warms.data[n].deadline <= now) {
+			debug("Discarding unused %s [%d] for %s", warms.data[n].prog, warms.data[n].pid, warms.data[n].address);
+			bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_TIMED_OUT, 1);
+			warm_remove(n);
+		}
+}
@@ -0,0 +1,26 @@
+/*
+ * bluealsa-autoconfig - agent-prewarm.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_PREWARM_H
+#define BLUEALSA_AGENT_PREWARM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "agent-sched.h"
+
+int bluealsa_agent_prewarm_spawn(unsigned int owner, const char *address, const char *prog, const struct bluealsa_agent_sched *sched, unsigned int timeout);
+bool bluealsa_agent_prewarm_ready(unsigned int owner, const char *address, const char *prog);
+pid_t bluealsa_agent_prewarm_run(unsigned int owner, const char *address, const char *prog, const char *event, const char *path, char *const *envp, size_t envc, const char *const *fd_names, const int *fds, size_t fds_count);
+void bluealsa_agent_prewarm_discard(const char *address);
+void bluealsa_agent_prewarm_discard_all(void);
+void bluealsa_agent_prewarm_reaped(pid_t pid);
+int bluealsa_agent_prewarm_timeout(void);
+void bluealsa_agent_prewarm_run_timers(void);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * bluealsa-autoconfig - agent-sched.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "agent-sched.h"
+#include "bluez-alsa/shared/log.h"
+
+/* Mount point of the cgroup v2 hierarchy, for relative cgroup paths */
+#define SCHED_CGROUP_ROOT "/sys/fs/cgroup"
+
+/* From linux/ioprio.h, which is not installed by all distributions */
+#define SCHED_IOPRIO_CLASS_SHIFT 13
+#define SCHED_IOPRIO_WHO_PROCESS 1
+
+static const struct {
+	const char *name;
+	int class;
+} sched_ioprio_classes[] = {
+	{ "realtime", 1 },
+	{ "best-effort", 2 },
+	{ "idle", 3 },
+};
+
+/* Scheduling of the handler processes of a rule */
+struct bluealsa_agent_sched {
+	cpu_set_t cpus;
+	bool has_cpus;
+	int nice;
+	bool has_nice;
+	/* SCHED_OTHER, SCHED_BATCH or SCHED_IDLE, or -1 to inherit */
+	int policy;
+	/* I/O priority as for ioprio_set(2), or -1 to inherit */
+	int ioprio;
+	/* cgroup v2 directory, or NULL */
+	char *cgroup;
+	char *cpu_weight;
+	char *memory_max;
+};
+
+/**
+ * Parse a list of CPUs, such as "0-1,3".
+ */
+static bool sched_parse_cpus(cpu_set_t *cpus, const char *arg) {
+	const char *item = arg;
+
+	CPU_ZERO(cpus);
+	do {
+		unsigned long first, last;
+		char *end;
+
+		first = last = strtoul(item, &end, 10);
+		if (end == item)
+			return false;
+		if (*end == '-') {
+			item = end + 1;
+			last = strtoul(item, &end, 10);
+			if (end == item)
+				return false;
+		}
+		if (first > last || last >= CPU_SETSIZE || (*end != ',' && *end != '\0'))
+			return false;
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpus);
+		item = end + 1;
+	} while (item[-1] == ',');
+
+	return true;
+}
+
+static bool sched_parse_ioprio(int *ioprio, const char *arg) {
+	const char *level = strchr(arg, ':');
+	const size_t len = level ? (size_t)(level - arg) : strlen(arg);
+	unsigned long data = 4;
+
+	for (size_t n = 0; n < sizeof(sched_ioprio_classes) / sizeof(*sched_ioprio_classes); n++) {
+		if (strncasecmp(arg, sched_ioprio_classes[n].name, len) != 0 ||
+				sched_ioprio_classes[n].name[len] != '\0')
+			continue;
+		if (level != NULL) {
+			char *end;
+			/* the idle class has no levels */
+			data = strtoul(level + 1, &end, 10);
+			if (sched_ioprio_classes[n].class == 3 || end == level + 1 || *end != '\0' || data > 7)
+				return false;
+		}
+		*ioprio = sched_ioprio_classes[n].class << SCHED_IOPRIO_CLASS_SHIFT | data;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Parse one handler scheduling setting.
+ * @param sched_ptr the settings of a rule, which are allocated by the first
+ *              setting parsed.
+ * @return false if the argument is invalid.
+ */
+bool bluealsa_agent_sched_parse(struct bluealsa_agent_sched **sched_ptr, enum bluealsa_agent_sched_setting setting, const char *arg) {
+	struct bluealsa_agent_sched *sched;
+	char *end;
+
+	if ((sched = *sched_ptr) == NULL) {
+		if ((sched = calloc(1, sizeof(*sched))) == NULL)
+			return false;
+		sched->policy = -1;
+		sched->ioprio = -1;
+		*sched_ptr = sched;
+	}
+
+	switch (setting) {
+	case BLUEALSA_AGENT_SCHED_CPUS:
+		return sched->has_cpus = sched_parse_cpus(&sched->cpus, arg);
+
+	case BLUEALSA_AGENT_SCHED_NICE: {
+		const long nice = strtol(arg, &end, 10);
+		if (end == arg || *end != '\0' || nice < -20 || nice > 19)
+			return false;
+		sched->nice = nice;
+		return sched->has_nice = true;
+	}
+
+	case BLUEALSA_AGENT_SCHED_POLICY:
+		if (strcasecmp(arg, "other") == 0)
+			sched->policy = SCHED_OTHER;
+		else if (strcasecmp(arg, "batch") == 0)
+			sched->policy = SCHED_BATCH;
+		else if (strcasecmp(arg, "idle") == 0)
+			sched->policy = SCHED_IDLE;
+		else
+			return false;
+		return true;
+
+	case BLUEALSA_AGENT_SCHED_IOPRIO:
+		return sched_parse_ioprio(&sched->ioprio, arg);
+
+	case BLUEALSA_AGENT_SCHED_CGROUP: {
+		char path[PATH_MAX];
+		if (arg[0] == '\0' || strstr(arg, "..") != NULL)
+			return false;
+		if (snprintf(path, sizeof(path), "%s%s", arg[0] == '/' ? "" : SCHED_CGROUP_ROOT "/", arg) >= (int)sizeof(path))
+			return false;
+		free(sched->cgroup);
+		return (sched->cgroup = strdup(path)) != NULL;
+	}
+
+	case BLUEALSA_AGENT_SCHED_CPU_WEIGHT: {
+		const unsigned long weight = strtoul(arg, &end, 10);
+		if (end == arg || *end != '\0' || weight < 1 || weight > 10000)
+			return false;
+		free(sched->cpu_weight);
+		return (sched->cpu_weight = strdup(arg)) != NULL;
+	}
+
+	case BLUEALSA_AGENT_SCHED_MEMORY_MAX:
+		if (strcmp(arg, "max") != 0) {
+			strtoull(arg, &end, 10);
+			if (end == arg || (*end != '\0' && (strchr("KMG", *end) == NULL || end[1] != '\0')))
+				return false;
+		}
+		free(sched->memory_max);
+		return (sched->memory_max = strdup(arg)) != NULL;
+	}
+
+	return false;
+}
+
+void bluealsa_agent_sched_free(struct bluealsa_agent_sched *sched) {
+	if (sched == NULL)
+		return;
+	free(sched->cgroup);
+	free(sched->cpu_weight);
+	free(sched->memory_max);
+	free(sched);
+}
+
+static int sched_cgroup_write(const char *cgroup, const char *file, const char *value) {
+	char path[PATH_MAX];
+	const size_t len = strlen(value);
+	int fd, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+	if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+		return -errno;
+	const ssize_t written = write(fd, value, len);
+	if (written == -1)
+		ret = -errno;
+	else if (written != (ssize_t)len)
+		ret = -EIO;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Enable a controller for the children of a cgroup.
+ * @param controller the controller name, prefixed by "+".
+ * @return 0 if the controller is enabled, negative error code otherwise.
+ */
+static int sched_cgroup_enable(const char *cgroup, const char *controller) {
+	char path[PATH_MAX];
+	char enabled[256];
+	FILE *file;
+	int ret;
+
+	if ((ret = sched_cgroup_write(cgroup, "cgroup.subtree_control", controller)) == 0)
+		return 0;
+
+	/* an administrator may have enabled it already on our behalf */
+	if (snprintf(path, sizeof(path), "%s/cgroup.subtree_control", cgroup) >= (int)sizeof(path))
+		return ret;
+	if ((file = fopen(path, "re")) != NULL) {
+		if (fgets(enabled, sizeof(enabled), file) != NULL) {
+			char *saveptr;
+			for (char *name = strtok_r(enabled, " \n", &saveptr); name != NULL;
+					name = strtok_r(NULL, " \n", &saveptr))
+				if (strcmp(name, controller + 1) == 0)
+					ret = 0;
+		}
+		fclose(file);
+	}
+
+	return ret;
+}
+
+/**
+ * Create the cgroup for the handler processes, if one is given, and set its
+ * resource limits. Called once by the agent, before any handler is run.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_agent_sched_setup(const struct bluealsa_agent_sched *sched) {
+	static const struct {
+		const char *controller;
+		const char *file;
+	} limits[] = {
+		{ "+cpu", "cpu.weight" },
+		{ "+memory", "memory.max" },
+	};
+	int ret;
+
+	if (sched == NULL)
+		return 0;
+	if (sched->cgroup == NULL) {
+		if (sched->cpu_weight != NULL || sched->memory_max != NULL)
+			warn("Handler cgroup limits ignored: no cgroup given");
+		return 0;
+	}
+
+	if (mkdir(sched->cgroup, 0755) == -1 && errno != EEXIST) {
+		ret = -errno;
+		error("Couldn't create cgroup %s (%s)", sched->cgroup, strerror(-ret));
+		return ret;
+	}
+
+	const char *values[] = { sched->cpu_weight, sched->memory_max };
+	for (size_t n = 0; n < sizeof(limits) / sizeof(*limits); n++) {
+		char parent[PATH_MAX];
+		if (values[n] == NULL)
+			continue;
+
+		/* the controller must be enabled for the children of the parent
+		 * cgroup, which cgroup v2 refuses with EBUSY while the parent itself
+		 * holds processes */
+		snprintf(parent, sizeof(parent), "%s", sched->cgroup);
+		*strrchr(parent, '/') = '\0';
+		if ((ret = sched_cgroup_enable(parent, limits[n].controller)) < 0) {
+			error("Couldn't enable the %s controller in cgroup %s (%s)%s", limits[n].controller + 1,
+					parent, strerror(-ret), ret == -EBUSY ? ": It must not contain any process" : "");
+			return ret;
+		}
+
+		if ((ret = sched_cgroup_write(sched->cgroup, limits[n].file, values[n])) < 0) {
+			error("Couldn't set %s of cgroup %s (%s)", limits[n].file, sched->cgroup, strerror(-ret));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Apply the settings to the calling process. Called by a handler process
+ * between fork() and exec(). Failures are reported, but the handler is run
+ * regardless.
+ */
+void bluealsa_agent_sched_apply(const struct bluealsa_agent_sched *sched) {
+	int ret;
+
+	if (sched == NULL)
+		return;
+
+	if (sched->cgroup != NULL && (ret = sched_cgroup_write(sched->cgroup, "cgroup.procs", "0")) < 0)
+		warn("Couldn't move handler to cgroup %s (%s)", sched->cgroup, strerror(-ret));
+
+	if (sched->has_cpus && sched_setaffinity(0, sizeof(sched->cpus), &sched->cpus) == -1)
+		warn("Couldn't set handler CPU affinity (%s)", strerror(errno));
+
+	if (sched->policy != -1) {
+		const struct sched_param param = { .sched_priority = 0 };
+		if (sched_setscheduler(0, sched->policy, &param) == -1)
+			warn("Couldn't set handler scheduling policy (%s)", strerror(errno));
+	}
+
+	if (sched->has_nice && setpriority(PRIO_PROCESS, 0, sched->nice) == -1)
+		warn("Couldn't set handler nice value (%s)", strerror(errno));
+
+	if (sched->ioprio != -1 &&
+			syscall(SYS_ioprio_set, SCHED_IOPRIO_WHO_PROCESS, 0, sched->ioprio) == -1)
+		warn("Couldn't set handler I/O priority (%s)", strerror(errno));
+}
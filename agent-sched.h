@@ -0,0 +1,31 @@
+/*
+ * bluealsa-autoconfig - agent-sched.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_SCHED_H
+#define BLUEALSA_AGENT_SCHED_H
+
+#include <stdbool.h>
+
+/* Settings which can be given for handler processes */
+enum bluealsa_agent_sched_setting {
+	BLUEALSA_AGENT_SCHED_CPUS,
+	BLUEALSA_AGENT_SCHED_NICE,
+	BLUEALSA_AGENT_SCHED_POLICY,
+	BLUEALSA_AGENT_SCHED_IOPRIO,
+	BLUEALSA_AGENT_SCHED_CGROUP,
+	BLUEALSA_AGENT_SCHED_CPU_WEIGHT,
+	BLUEALSA_AGENT_SCHED_MEMORY_MAX,
+};
+
+struct bluealsa_agent_sched;
+
+bool bluealsa_agent_sched_parse(struct bluealsa_agent_sched **sched, enum bluealsa_agent_sched_setting setting, const char *arg);
+void bluealsa_agent_sched_free(struct bluealsa_agent_sched *sched);
+int bluealsa_agent_sched_setup(const struct bluealsa_agent_sched *sched);
+void bluealsa_agent_sched_apply(const struct bluealsa_agent_sched *sched);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * bluealsa-autoconfig - agent-server.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "agent-server.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Event records are sent to clients as text: a line giving the event and the
+ * PCM path, one line for each property in the same form as the handler
+ * environment variables, then an empty line. A client first sends the line
+ *
+ *   subscribe [NAME=VALUE]...
+ *
+ * and receives an "add" record for each current PCM that matches the filter,
+ * then a "ready" record, then the records of subsequent events. Records are
+ * queued for each client, and are never allowed to delay the agent. If a
+ * client does not read its records quickly enough then its queue is
+ * discarded and it is sent a "resync" record followed by a new snapshot.
+ */
+
+/* Bytes of records queued for one client */
+#define SERVER_QUEUE_SIZE 65536
+/* Largest single record */
+#define SERVER_RECORD_MAX 10240
+#define SERVER_MAX_FILTERS 8
+
+struct bluealsa_agent_server_client {
+	int fd;
+	bool subscribed;
+	/* the client is to be disconnected */
+	bool failed;
+	char input[512];
+	size_t input_len;
+	/* each as a complete variable assignment, BLUEALSA_PCM_PROPERTY_NAME=VALUE */
+	char filters[SERVER_MAX_FILTERS][160];
+	size_t filters_count;
+	/* records, the first of which starts at offset 0 */
+	char *queue;
+	size_t len;
+	size_t sent;
+};
+
+static struct {
+	char *path;
+	int fd;
+	bluealsa_agent_server_snapshot_t snapshot_func;
+	struct bluealsa_agent_server_client clients[BLUEALSA_AGENT_SERVER_MAX_CLIENTS];
+	size_t clients_count;
+} server = { .fd = -1 };
+
+/**
+ * @return the offset of the end of the record that starts at offset pos.
+ */
+static size_t client_record_end(const struct bluealsa_agent_server_client *client, size_t pos) {
+	const char *end = memmem(client->queue + pos, client->len - pos, "\n\n", 2);
+	return end != NULL ? (size_t)(end - client->queue) + 2 : client->len;
+}
+
+/**
+ * Discard records which have been completely sent, keeping any record which
+ * has been partly sent.
+ */
+static void client_compact(struct bluealsa_agent_server_client *client) {
+	size_t start = 0, end;
+
+	while (start < client->sent && (end = client_record_end(client, start)) <= client->sent)
+		start = end;
+
+	memmove(client->queue, client->queue + start, client->len - start);
+	client->len -= start;
+	client->sent -= start;
+}
+
+static bool client_queue(struct bluealsa_agent_server_client *client, const char *record, size_t len) {
+	if (client->len + len > SERVER_QUEUE_SIZE)
+		client_compact(client);
+	if (client->len + len > SERVER_QUEUE_SIZE)
+		return false;
+	memcpy(client->queue + client->len, record, len);
+	client->len += len;
+	return true;
+}
+
+static void client_flush(struct bluealsa_agent_server_client *client) {
+	while (client->sent < client->len) {
+		const ssize_t ret = send(client->fd, client->queue + client->sent,
+				client->len - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				client->failed = true;
+			return;
+		}
+		client->sent += ret;
+	}
+	client->len = client->sent = 0;
+}
+
+static bool client_match(const struct bluealsa_agent_server_client *client, char *const *strings, size_t count) {
+	bool matched[SERVER_MAX_FILTERS] = { false };
+
+	for (size_t f = 0; f < client->filters_count; f++)
+		for (size_t n = 0; n < count && !matched[f]; n++)
+			matched[f] = strcasecmp(client->filters[f], strings[n]) == 0;
+
+	/* filters on the same property are alternatives */
+	for (size_t f = 0; f < client->filters_count; f++) {
+		const size_t len = strchr(client->filters[f], '=') - client->filters[f] + 1;
+		bool any = false;
+		for (size_t g = 0; g < client->filters_count && !any; g++)
+			any = matched[g] && strncmp(client->filters[f], client->filters[g], len) == 0;
+		if (!any)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Format an event record.
+ * @return the length of the record, or 0 if it is too large.
+ */
+static size_t server_format(char *buffer, const char *event, const char *path, char *const *strings, size_t count) {
+	size_t len = snprintf(buffer, SERVER_RECORD_MAX, "%s%s%s\n", event, path ? " " : "", path ? path : "");
+
+	for (size_t n = 0; n < count && len < SERVER_RECORD_MAX; n++) {
+		const size_t start = len;
+		len += snprintf(buffer + len, SERVER_RECORD_MAX - len, "%s\n", strings[n]);
+		/* a value must not end the record early */
+		for (char *c = buffer + start; c < buffer + len - 1 && c < buffer + SERVER_RECORD_MAX; c++)
+			if (*c == '\n')
+				*c = ' ';
+	}
+	if (len + 1 >= SERVER_RECORD_MAX)
+		return 0;
+
+	buffer[len++] = '\n';
+	return len;
+}
+
+/**
+ * Send an event record to one client, for example as part of a snapshot.
+ */
+void bluealsa_agent_server_send(struct bluealsa_agent_server_client *client, const char *event, const char *path, char *const *strings, size_t count) {
+	char record[SERVER_RECORD_MAX];
+	size_t len;
+
+	/* records without a PCM are not filtered */
+	if (client->failed || (path != NULL && !client_match(client, strings, count)))
+		return;
+	if ((len = server_format(record, event, path, strings, count)) == 0)
+		return;
+	if (!client_queue(client, record, len))
+		client->failed = true;
+}
+
+static void client_snapshot(struct bluealsa_agent_server_client *client) {
+	server.snapshot_func(client);
+	bluealsa_agent_server_send(client, "ready", NULL, NULL, 0);
+}
+
+/**
+ * Discard the records queued for a client that has fallen behind, apart from
+ * any record that it has partly received, and queue a new snapshot.
+ */
+static void client_resync(struct bluealsa_agent_server_client *client) {
+	client_compact(client);
+	client->len = client->sent > 0 ? client_record_end(client, 0) : 0;
+
+	warn("Event client %d is too slow: resynchronizing", client->fd);
+	bluealsa_agent_server_send(client, "resync", NULL, NULL, 0);
+	client_snapshot(client);
+}
+
+static void client_close(size_t n) {
+	struct bluealsa_agent_server_client *client = &server.clients[n];
+	debug("Event client %d disconnected", client->fd);
+	close(client->fd);
+	free(client->queue);
+	if (--server.clients_count > n)
+		memcpy(client, &server.clients[server.clients_count], sizeof(*client));
+}
+
+static void server_close_failed(void) {
+	size_t n = server.clients_count;
+	while (n-- > 0)
+		if (server.clients[n].failed)
+			client_close(n);
+}
+
+/**
+ * Parse the subscription line of a client.
+ * @return false if the line is invalid.
+ */
+static bool client_subscribe(struct bluealsa_agent_server_client *client, char *line) {
+	char *token;
+
+	if ((token = strtok(line, " \t\r")) == NULL || strcmp(token, "subscribe") != 0)
+		return false;
+
+	while ((token = strtok(NULL, " \t\r")) != NULL) {
+		char *filter = client->filters[client->filters_count];
+		if (client->filters_count == SERVER_MAX_FILTERS || strchr(token, '=') == NULL ||
+				snprintf(filter, sizeof(client->filters[0]), "BLUEALSA_PCM_PROPERTY_%s", token) >= (int)sizeof(client->filters[0]))
+			return false;
+		for (char *c = filter; *c != '='; c++)
+			*c = toupper((unsigned char)*c);
+		client->filters_count++;
+	}
+
+	client->subscribed = true;
+	return true;
+}
+
+static void client_read(struct bluealsa_agent_server_client *client) {
+	char *newline;
+	ssize_t ret;
+
+	if ((ret = read(client->fd, client->input + client->input_len, sizeof(client->input) - client->input_len - 1)) <= 0) {
+		if (ret == 0 || (errno != EAGAIN && errno != EINTR))
+			client->failed = true;
+		return;
+	}
+
+	/* input after the subscription is ignored */
+	if (client->subscribed)
+		return;
+
+	client->input_len += ret;
+	client->input[client->input_len] = '\0';
+	if ((newline = strchr(client->input, '\n')) == NULL) {
+		if (client->input_len == sizeof(client->input) - 1)
+			client->failed = true;
+		return;
+	}
+	*newline = '\0';
+
+	if (!client_subscribe(client, client->input)) {
+		debug("Invalid event subscription: %s", client->input);
+		client->failed = true;
+		return;
+	}
+
+	client_snapshot(client);
+	client_flush(client);
+}
+
+static void server_accept(void) {
+	struct bluealsa_agent_server_client *client;
+	int fd;
+
+	while ((fd = accept4(server.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if (server.clients_count == BLUEALSA_AGENT_SERVER_MAX_CLIENTS) {
+			warn("Too many event clients");
+			close(fd);
+			continue;
+		}
+		client = &server.clients[server.clients_count];
+		memset(client, 0, sizeof(*client));
+		if ((client->queue = malloc(SERVER_QUEUE_SIZE)) == NULL) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+		server.clients_count++;
+		debug("Event client %d connected", fd);
+	}
+}
+
+/**
+ * Listen for event clients on a Unix socket.
+ * @param snapshot_func called to send the current PCMs to a new client.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_agent_server_open(const char *path, bluealsa_agent_server_snapshot_t snapshot_func) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	if ((server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+		return -errno;
+
+	/* a socket left by an agent that did not exit cleanly */
+	unlink(path);
+	if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+			listen(server.fd, 8) == -1 ||
+			(server.path = strdup(path)) == NULL) {
+		ret = -errno;
+		close(server.fd);
+		server.fd = -1;
+		return ret;
+	}
+
+	server.snapshot_func = snapshot_func;
+	return 0;
+}
+
+void bluealsa_agent_server_close(void) {
+	if (server.fd == -1)
+		return;
+	while (server.clients_count > 0)
+		client_close(server.clients_count - 1);
+	close(server.fd);
+	server.fd = -1;
+	unlink(server.path);
+	free(server.path);
+	server.path = NULL;
+}
+
+/**
+ * Get the file descriptors to be polled for the server.
+ * @param size the number of entries available in fds.
+ * @return the number of entries used.
+ */
+size_t bluealsa_agent_server_poll_fds(struct pollfd *fds, size_t size) {
+	size_t count = 0;
+
+	if (server.fd == -1 || size == 0)
+		return 0;
+
+	fds[count].fd = server.fd;
+	fds[count++].events = POLLIN;
+	for (size_t n = 0; n < server.clients_count && count < size; n++) {
+		const struct bluealsa_agent_server_client *client = &server.clients[n];
+		fds[count].fd = client->fd;
+		fds[count++].events = POLLIN | (client->sent < client->len ? POLLOUT : 0);
+	}
+
+	return count;
+}
+
+void bluealsa_agent_server_dispatch(const struct pollfd *fds, size_t count) {
+	bool listener = false;
+
+	for (size_t n = 0; n < count; n++) {
+		if (fds[n].revents == 0)
+			continue;
+		if (fds[n].fd == server.fd) {
+			listener = true;
+			continue;
+		}
+		for (size_t c = 0; c < server.clients_count; c++) {
+			struct bluealsa_agent_server_client *client = &server.clients[c];
+			if (client->fd != fds[n].fd)
+				continue;
+			if (fds[n].revents & POLLOUT)
+				client_flush(client);
+			if (fds[n].revents & (POLLIN | POLLHUP | POLLERR))
+				client_read(client);
+			break;
+		}
+	}
+
+	server_close_failed();
+
+	/* after the clients, so that the fd of a new client is not mistaken
+	 * for that of a closed one */
+	if (listener)
+		server_accept();
+}
+
+bool bluealsa_agent_server_has_clients(void) {
+	return server.clients_count > 0;
+}
+
+/**
+ * Send an event record to all subscribed clients. A client which has fallen
+ * too far behind is sent a snapshot instead, which must therefore already
+ * reflect the event of a record with a PCM path; any other record is queued
+ * after the snapshot.
+ * @param path the PCM path, or NULL for a record which is not about a PCM.
+ * @param strings the PCM properties, as given to the handlers.
+ */
+void bluealsa_agent_server_event(const char *event, const char *path, char *const *strings, size_t count) {
+	char record[SERVER_RECORD_MAX];
+	size_t len;
+
+	if (server.clients_count == 0)
+		return;
+	if ((len = server_format(record, event, path, strings, count)) == 0) {
+		error("Event record too large: %s %s", event, path);
+		return;
+	}
+
+	for (size_t n = 0; n < server.clients_count; n++) {
+		struct bluealsa_agent_server_client *client = &server.clients[n];
+		if (!client->subscribed || client->failed || !client_match(client, strings, count))
+			continue;
+		if (!client_queue(client, record, len)) {
+			client_resync(client);
+			if (path == NULL && !client->failed && !client_queue(client, record, len))
+				client->failed = true;
+		}
+		client_flush(client);
+	}
+
+	server_close_failed();
+}
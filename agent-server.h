@@ -0,0 +1,31 @@
+/*
+ * bluealsa-autoconfig - agent-server.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_SERVER_H
+#define BLUEALSA_AGENT_SERVER_H
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Most clients connected to the event socket at one time */
+#define BLUEALSA_AGENT_SERVER_MAX_CLIENTS 16
+
+struct bluealsa_agent_server_client;
+
+/* Called to send an "add" event for each current PCM to a client */
+typedef void (*bluealsa_agent_server_snapshot_t)(struct bluealsa_agent_server_client *client);
+
+int bluealsa_agent_server_open(const char *path, bluealsa_agent_server_snapshot_t snapshot_func);
+void bluealsa_agent_server_close(void);
+size_t bluealsa_agent_server_poll_fds(struct pollfd *fds, size_t size);
+void bluealsa_agent_server_dispatch(const struct pollfd *fds, size_t count);
+bool bluealsa_agent_server_has_clients(void);
+void bluealsa_agent_server_send(struct bluealsa_agent_server_client *client, const char *event, const char *path, char *const *strings, size_t count);
+void bluealsa_agent_server_event(const char *event, const char *path, char *const *strings, size_t count);
+
+#endif
@@ -0,0 +1,199 @@
+/*
+ * bluealsa-autoconfig - agent-state.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "agent-state.h"
+#include "bluealsa-agent-state.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Writer of the state file described in bluealsa-agent-state.h. All updates
+ * are made from the agent main thread, so the sequence lock has only one
+ * writer.
+ */
+
+static struct {
+	char *path;
+	struct bluealsa_agent_state *map;
+} state = { 0 };
+
+static void state_begin(void) {
+	atomic_fetch_add_explicit(&state.map->sequence, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void state_end(void) {
+	atomic_fetch_add_explicit(&state.map->sequence, 1, memory_order_release);
+}
+
+static struct bluealsa_agent_state_pcm *state_find(const char *path) {
+	for (size_t n = 0; n < state.map->count; n++)
+		if (strcmp(state.map->pcms[n].path, path) == 0)
+			return &state.map->pcms[n];
+	return NULL;
+}
+
+static void state_copy(struct bluealsa_agent_state_pcm *record, const struct bluealsa_pcm_data *pcm_data) {
+	snprintf(record->path, sizeof(record->path), "%s", pcm_data->path);
+	snprintf(record->address, sizeof(record->address), "%s", pcm_data->address);
+	snprintf(record->alias, sizeof(record->alias), "%s", pcm_data->alias);
+	snprintf(record->profile, sizeof(record->profile), "%s", pcm_data->profile);
+	snprintf(record->mode, sizeof(record->mode), "%s", pcm_data->mode);
+	snprintf(record->codec, sizeof(record->codec), "%s", pcm_data->codec);
+	snprintf(record->format, sizeof(record->format), "%s", pcm_data->format);
+	record->channels = strtoul(pcm_data->channels, NULL, 10);
+	record->rate = strtoul(pcm_data->rate, NULL, 10);
+	record->running = pcm_data->running;
+	record->softvol = pcm_data->softvol;
+	record->server_delay = pcm_data->server_delay;
+	record->client_delay = pcm_data->client_delay;
+}
+
+/**
+ * Create the state file, replacing any left by a previous agent. The file is
+ * first written under a temporary name, so readers never map an incomplete
+ * file.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_agent_state_open(const char *path) {
+	char tmp[PATH_MAX];
+	void *map;
+	int fd, ret;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1)
+		return -errno;
+
+	if (fchmod(fd, 0644) == -1 || ftruncate(fd, sizeof(*state.map)) == -1 ||
+			(map = mmap(NULL, sizeof(*state.map), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		ret = -errno;
+		goto fail;
+	}
+
+	state.map = map;
+	state.map->magic = BLUEALSA_AGENT_STATE_MAGIC;
+	state.map->version = BLUEALSA_AGENT_STATE_VERSION;
+	state.map->pcm_size = sizeof(struct bluealsa_agent_state_pcm);
+	atomic_init(&state.map->flags, 0);
+	atomic_init(&state.map->sequence, 0);
+	state.map->count = 0;
+
+	if ((state.path = strdup(path)) == NULL || rename(tmp, path) == -1) {
+		ret = -errno;
+		munmap(state.map, sizeof(*state.map));
+		state.map = NULL;
+		free(state.path);
+		state.path = NULL;
+		goto fail;
+	}
+
+	close(fd);
+	return 0;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	return ret;
+}
+
+/**
+ * Mark the state as closed for readers which have it mapped, and remove the
+ * file.
+ */
+void bluealsa_agent_state_close(void) {
+	if (state.map == NULL)
+		return;
+
+	unlink(state.path);
+	state_begin();
+	state.map->count = 0;
+	atomic_fetch_or_explicit(&state.map->flags, BLUEALSA_AGENT_STATE_CLOSED, memory_order_relaxed);
+	state_end();
+
+	munmap(state.map, sizeof(*state.map));
+	state.map = NULL;
+	free(state.path);
+	state.path = NULL;
+}
+
+/**
+ * Add a record for a PCM.
+ * @param volume the BlueALSA Volume property of the PCM.
+ */
+void bluealsa_agent_state_add(const struct bluealsa_pcm_data *pcm_data, const uint8_t *volume) {
+	struct bluealsa_agent_state_pcm *record;
+
+	if (state.map == NULL)
+		return;
+
+	if ((record = state_find(pcm_data->path)) == NULL) {
+		if (state.map->count == BLUEALSA_AGENT_STATE_MAX_PCMS) {
+			warn("State file full: %s not recorded", pcm_data->path);
+			return;
+		}
+		record = &state.map->pcms[state.map->count];
+	}
+
+	state_begin();
+	memset(record, 0, sizeof(*record));
+	state_copy(record, pcm_data);
+	memcpy(record->volume, volume, sizeof(record->volume));
+	if (record == &state.map->pcms[state.map->count])
+		state.map->count++;
+	state_end();
+}
+
+/**
+ * Update the record of a PCM from the stored PCM data.
+ */
+void bluealsa_agent_state_update(const struct bluealsa_pcm_data *pcm_data) {
+	struct bluealsa_agent_state_pcm *record;
+
+	if (state.map == NULL || (record = state_find(pcm_data->path)) == NULL)
+		return;
+
+	state_begin();
+	state_copy(record, pcm_data);
+	state_end();
+}
+
+void bluealsa_agent_state_volume(const char *path, const uint8_t *volume) {
+	struct bluealsa_agent_state_pcm *record;
+
+	if (state.map == NULL || (record = state_find(path)) == NULL)
+		return;
+
+	state_begin();
+	memcpy(record->volume, volume, sizeof(record->volume));
+	state_end();
+}
+
+void bluealsa_agent_state_remove(const char *path) {
+	struct bluealsa_agent_state_pcm *record;
+
+	if (state.map == NULL || (record = state_find(path)) == NULL)
+		return;
+
+	state_begin();
+	if (--state.map->count > (size_t)(record - state.map->pcms))
+		memcpy(record, &state.map->pcms[state.map->count], sizeof(*record));
+	state_end();
+}
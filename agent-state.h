@@ -0,0 +1,22 @@
+/*
+ * bluealsa-autoconfig - agent-state.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_STATE_WRITER_H
+#define BLUEALSA_AGENT_STATE_WRITER_H
+
+#include <stdint.h>
+
+#include "bluealsa-agent-plugin.h"
+
+int bluealsa_agent_state_open(const char *path);
+void bluealsa_agent_state_close(void);
+void bluealsa_agent_state_add(const struct bluealsa_pcm_data *pcm_data, const uint8_t *volume);
+void bluealsa_agent_state_update(const struct bluealsa_pcm_data *pcm_data);
+void bluealsa_agent_state_volume(const char *path, const uint8_t *volume);
+void bluealsa_agent_state_remove(const char *path);
+
+#endif
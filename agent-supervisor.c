@@ -0,0 +1,396 @@
+/*
+ * bluealsa-autoconfig - agent-supervisor.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agent-supervisor.h"
+#include "bluez-alsa/shared/log.h"
+#include "metrics.h"
+
+/* Time allowed for a service to terminate after SIGTERM, in milliseconds */
+#define SUPERVISOR_KILL_TIMEOUT 5000
+/* Delay before restarting a failed service, doubled after each early failure */
+#define SUPERVISOR_RESTART_DELAY 1000
+#define SUPERVISOR_RESTART_DELAY_MAX 32000
+/* A service which runs for this long has its restart delay reset */
+#define SUPERVISOR_STABLE_TIME 10000
+
+enum service_state {
+	SERVICE_RUNNING,
+	/* terminated by the supervisor, waiting for it to exit */
+	SERVICE_STOPPING,
+	/* exited, waiting to be restarted */
+	SERVICE_WAITING,
+};
+
+struct service {
+	unsigned int owner;
+	char path[128];
+	char *command;
+	char **envp;
+	size_t envc;
+	enum bluealsa_agent_restart restart;
+	enum service_state state;
+	/* start again as soon as a stopping service has exited */
+	bool start_pending;
+	pid_t pid;
+	uint64_t started;
+	/* time of the next SIGKILL or restart, in milliseconds */
+	uint64_t deadline;
+	unsigned int delay;
+};
+
+static struct {
+	struct service *data;
+	size_t capacity;
+	size_t count;
+} services = { 0 };
+
+static uint64_t supervisor_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void service_free_env(struct service *service) {
+	for (size_t n = 0; n < service->envc; n++)
+		free(service->envp[n]);
+	free(service->envp);
+	service->envp = NULL;
+	service->envc = 0;
+}
+
+static int service_set_env(struct service *service, char *const *envp, size_t envc) {
+	service_free_env(service);
+	if ((service->envp = calloc(envc, sizeof(char *))) == NULL)
+		return -ENOMEM;
+	for (size_t n = 0; n < envc; n++) {
+		if ((service->envp[n] = strdup(envp[n])) == NULL)
+			return -ENOMEM;
+		service->envc++;
+	}
+	return 0;
+}
+
+static void service_remove(size_t n) {
+	struct service *service = &services.data[n];
+	free(service->command);
+	service_free_env(service);
+	if (--services.count > n)
+		memcpy(service, &services.data[services.count], sizeof(*service));
+}
+
+static struct service *service_find(unsigned int owner, const char *path) {
+	for (size_t n = 0; n < services.count; n++)
+		if (services.data[n].owner == owner && strcmp(services.data[n].path, path) == 0)
+			return &services.data[n];
+	return NULL;
+}
+
+static void service_schedule_restart(struct service *service, uint64_t now) {
+	if (now - service->started >= SUPERVISOR_STABLE_TIME)
+		service->delay = SUPERVISOR_RESTART_DELAY;
+	service->state = SERVICE_WAITING;
+	service->deadline = now + service->delay;
+	debug("Restarting %s for %s in %u ms", service->command, service->path, service->delay);
+	if ((service->delay *= 2) > SUPERVISOR_RESTART_DELAY_MAX)
+		service->delay = SUPERVISOR_RESTART_DELAY_MAX;
+}
+
+/**
+ * Apply the restart policy of a service that has stopped by itself, or that
+ * could not be started.
+ * @param n the index of the service.
+ * @param failed whether the service failed.
+ */
+static void service_stopped(size_t n, bool failed) {
+	struct service *service = &services.data[n];
+	if (service->restart == BLUEALSA_AGENT_RESTART_ALWAYS ||
+			(service->restart == BLUEALSA_AGENT_RESTART_ON_FAILURE && failed))
+		service_schedule_restart(service, supervisor_now());
+	else
+		service_remove(n);
+}
+
+/**
+ * Start the service process.
+ * @return 0 on success, or a negative error code if the process could not
+ * be created, in which case the restart policy must be applied.
+ */
+static int service_spawn(struct service *service) {
+	const uint64_t now = supervisor_now();
+	pid_t pid;
+	int ret;
+
+	service->start_pending = false;
+	service->started = now;
+
+	switch (pid = fork()) {
+	case 0:
+		{
+			char *argv[] = { service->command, service->path, NULL };
+			sigset_t mask;
+
+			/* a new process group, so that all the service processes can
+			 * be terminated together */
+			setpgid(0, 0);
+			for (size_t n = 0; n < service->envc; n++)
+				putenv(service->envp[n]);
+
+			sigfillset(&mask);
+			sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+			execv(service->command, argv);
+			error("Failed to execute %s (%s)", service->command, strerror(errno));
+			_exit(EXIT_FAILURE);
+		}
+	case -1:
+		ret = -errno;
+		error("Failed to fork process for %s (%s)", service->command, strerror(-ret));
+		return ret;
+	default:
+		/* also set here to avoid a race with an early stop */
+		setpgid(pid, pid);
+		debug("Started %s [%d] for %s", service->command, pid, service->path);
+		service->pid = pid;
+		service->state = SERVICE_RUNNING;
+		break;
+	}
+
+	return 0;
+}
+
+static void service_terminate(struct service *service) {
+	if (kill(-service->pid, SIGTERM) == -1 && errno != ESRCH)
+		warn("Couldn't terminate %s [%d] (%s)", service->command, service->pid, strerror(errno));
+	service->state = SERVICE_STOPPING;
+	service->deadline = supervisor_now() + SUPERVISOR_KILL_TIMEOUT;
+}
+
+/**
+ * Start a service, unless it is already running.
+ * @param owner identifies the rule that selected the PCM.
+ * @param path the D-Bus path of the PCM, passed as the only argument.
+ * @param command the absolute path of the service executable.
+ * @param envp environment variables to be set for the service.
+ * @param envc the number of environment variables.
+ * @param restart the policy applied when the service exits by itself.
+ * @return 0 on success, or a negative error code.
+ */
+int bluealsa_agent_supervisor_start(unsigned int owner, const char *path, const char *command, char *const *envp, size_t envc, enum bluealsa_agent_restart restart) {
+	struct service *service;
+	int ret;
+
+	if ((service = service_find(owner, path)) != NULL) {
+		switch (service->state) {
+		case SERVICE_RUNNING:
+			return 0;
+		case SERVICE_STOPPING:
+			/* the old process may still hold the PCM open, so wait for it */
+			if ((ret = service_set_env(service, envp, envc)) < 0)
+				return ret;
+			service->start_pending = true;
+			return 0;
+		case SERVICE_WAITING:
+			if ((ret = service_set_env(service, envp, envc)) < 0)
+				return ret;
+			service->delay = SUPERVISOR_RESTART_DELAY;
+			if (service_spawn(service) < 0)
+				service_stopped(service - services.data, true);
+			return 0;
+		}
+	}
+
+	if (strlen(path) >= sizeof(service->path))
+		return -EINVAL;
+
+	if (services.count == services.capacity) {
+		const size_t new_size = services.capacity + 8;
+		if ((service = realloc(services.data, new_size * sizeof(*services.data))) == NULL)
+			return -ENOMEM;
+		services.data = service;
+		services.capacity = new_size;
+	}
+
+	service = &services.data[services.count];
+	memset(service, 0, sizeof(*service));
+	service->owner = owner;
+	strcpy(service->path, path);
+	service->restart = restart;
+	service->delay = SUPERVISOR_RESTART_DELAY;
+	if ((service->command = strdup(command)) == NULL ||
+			(ret = service_set_env(service, envp, envc)) < 0) {
+		free(service->command);
+		service_free_env(service);
+		return -ENOMEM;
+	}
+	services.count++;
+
+	if (service_spawn(service) < 0)
+		service_stopped(services.count - 1, true);
+	return 0;
+}
+
+/**
+ * Stop a service. The whole process group of the service is sent SIGTERM, and
+ * then SIGKILL if it has not terminated within the timeout.
+ */
+void bluealsa_agent_supervisor_stop(unsigned int owner, const char *path) {
+	struct service *service;
+
+	if ((service = service_find(owner, path)) == NULL)
+		return;
+
+	switch (service->state) {
+	case SERVICE_RUNNING:
+		service_terminate(service);
+		break;
+	case SERVICE_STOPPING:
+		service->start_pending = false;
+		break;
+	case SERVICE_WAITING:
+		service_remove(service - services.data);
+		break;
+	}
+}
+
+/**
+ * Stop all services and wait for them to terminate.
+ */
+void bluealsa_agent_supervisor_stop_all(void) {
+	const struct timespec interval = { .tv_nsec = 50000000 };
+	uint64_t deadline = supervisor_now() + SUPERVISOR_KILL_TIMEOUT;
+	size_t n;
+
+	for (n = services.count; n > 0; n--) {
+		struct service *service = &services.data[n - 1];
+		service->start_pending = false;
+		if (service->state == SERVICE_RUNNING)
+			service_terminate(service);
+		else if (service->state == SERVICE_WAITING)
+			service_remove(n - 1);
+	}
+
+	while (services.count > 0) {
+		pid_t pid;
+		int status;
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+			bluealsa_agent_supervisor_reaped(pid, status);
+
+		if (services.count == 0 || supervisor_now() >= deadline)
+			break;
+		nanosleep(&interval, NULL);
+	}
+
+	for (n = services.count; n > 0; n--) {
+		struct service *service = &services.data[n - 1];
+		warn("Killing %s [%d]", service->command, service->pid);
+		bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_TIMED_OUT, 1);
+		kill(-service->pid, SIGKILL);
+		waitpid(service->pid, NULL, 0);
+		service_remove(n - 1);
+	}
+
+	free(services.data);
+	services.data = NULL;
+	services.capacity = 0;
+}
+
+/**
+ * Update the state of the service, if any, with the given process ID after
+ * it has been reaped.
+ * @param pid the process ID returned by waitpid().
+ * @param status the status returned by waitpid().
+ */
+void bluealsa_agent_supervisor_reaped(pid_t pid, int status) {
+	struct service *service = NULL;
+	size_t n;
+
+	for (n = 0; n < services.count; n++)
+		if (services.data[n].state != SERVICE_WAITING && services.data[n].pid == pid) {
+			service = &services.data[n];
+			break;
+		}
+	if (service == NULL)
+		return;
+
+	if (service->state == SERVICE_STOPPING) {
+		debug("Stopped %s [%d] for %s", service->command, pid, service->path);
+		if (!service->start_pending)
+			service_remove(n);
+		else if (service_spawn(service) < 0)
+			service_stopped(n, true);
+		return;
+	}
+
+	/* the service exited by itself, do not leave any of its children behind */
+	kill(-pid, SIGTERM);
+
+	const bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	if (WIFSIGNALED(status))
+		warn("Service %s [%d] for %s terminated by signal %d", service->command, pid, service->path, WTERMSIG(status));
+	else if (failed)
+		warn("Service %s [%d] for %s exited with status %d", service->command, pid, service->path, WEXITSTATUS(status));
+
+	service_stopped(n, failed);
+}
+
+/**
+ * @return the number of milliseconds until the next call to
+ * bluealsa_agent_supervisor_run_timers() is required, or -1 if none is.
+ */
+int bluealsa_agent_supervisor_timeout(void) {
+	const uint64_t now = supervisor_now();
+	int timeout = -1;
+
+	for (size_t n = 0; n < services.count; n++) {
+		const struct service *service = &services.data[n];
+		if (service->state == SERVICE_RUNNING || service->deadline == UINT64_MAX)
+			continue;
+		const int remaining = service->deadline > now ? service->deadline - now : 0;
+		if (timeout == -1 || remaining < timeout)
+			timeout = remaining;
+	}
+
+	return timeout;
+}
+
+/**
+ * Kill services that have not terminated in time, and restart services
+ * whose restart delay has expired.
+ */
+void bluealsa_agent_supervisor_run_timers(void) {
+	const uint64_t now = supervisor_now();
+
+	/* iterate from the end so that removing a service does not move the
+	 * services yet to be checked */
+	for (size_t n = services.count; n > 0; n--) {
+		struct service *service = &services.data[n - 1];
+		if (service->state == SERVICE_RUNNING || service->deadline > now)
+			continue;
+		if (service->state == SERVICE_STOPPING) {
+			warn("Killing %s [%d]", service->command, service->pid);
+			bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_TIMED_OUT, 1);
+			kill(-service->pid, SIGKILL);
+			service->deadline = UINT64_MAX;
+		}
+		else if (service_spawn(service) < 0)
+			service_stopped(n - 1, true);
+	}
+}
@@ -0,0 +1,27 @@
+/*
+ * bluealsa-autoconfig - agent-supervisor.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_SUPERVISOR_H
+#define BLUEALSA_AGENT_SUPERVISOR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum bluealsa_agent_restart {
+	BLUEALSA_AGENT_RESTART_NO = 0,
+	BLUEALSA_AGENT_RESTART_ON_FAILURE,
+	BLUEALSA_AGENT_RESTART_ALWAYS,
+};
+
+int bluealsa_agent_supervisor_start(unsigned int owner, const char *path, const char *command, char *const *envp, size_t envc, enum bluealsa_agent_restart restart);
+void bluealsa_agent_supervisor_stop(unsigned int owner, const char *path);
+void bluealsa_agent_supervisor_stop_all(void);
+void bluealsa_agent_supervisor_reaped(pid_t pid, int status);
+int bluealsa_agent_supervisor_timeout(void);
+void bluealsa_agent_supervisor_run_timers(void);
+
+#endif
@@ -11,10 +11,12 @@
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,10 +25,25 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <bluetooth/bluetooth.h>
+
+#include "agent-bridge.h"
+#include "agent-calibration.h"
+#include "agent-plugin.h"
+#include "agent-prewarm.h"
+#include "agent-sched.h"
+#include "agent-server.h"
+#include "agent-state.h"
+#include "agent-supervisor.h"
 #include "bluealsa-client.h"
+#include "bluez-alsa/shared/dbus-client.h"
 #include "bluez-alsa/shared/log.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "trace.h"
 #include "version.h"
 
 enum bluealsa_profile {
@@ -43,71 +60,319 @@ enum bluealsa_mode {
 };
 
 enum {
-	PROPERTY_DELAY   = 1 << 0,
-	PROPERTY_RUNNING = 1 << 1,
-	PROPERTY_SOFTVOL = 1 << 2,
+	PROPERTY_INDEX_DELAY,
+	PROPERTY_INDEX_RUNNING,
+	PROPERTY_INDEX_SOFTVOL,
+};
+
+enum {
+	PROPERTY_DELAY   = 1 << PROPERTY_INDEX_DELAY,
+	PROPERTY_RUNNING = 1 << PROPERTY_INDEX_RUNNING,
+	PROPERTY_SOFTVOL = 1 << PROPERTY_INDEX_SOFTVOL,
+};
+
+/* Note - the order of this array must match the PROPERTY_INDEX_ values above */
+static const struct {
+	const char *name;
+	bool numeric;
+} bluealsa_properties[] = {
+	{ "Delay", true },
+	{ "Running", false },
+	{ "SoftVolume", false },
+};
+
+/* Note - the order of this array must match the BLUEALSA_AGENT_CHANGE_ bits */
+static const char *bluealsa_changes[] = {
+	"CODEC",
+	"FORMAT",
+	"CHANNELS",
+	"RATE",
+	"CODEC_CONFIG",
+	"DELAY",
+	"CLIENT_DELAY",
+	"RUNNING",
+	"SOFTVOL",
+	"MODE",
+};
+
+enum {
+	DIRECTION_SINK,
+	DIRECTION_SOURCE,
+	DIRECTION_COUNT,
+};
+
+static const char *bluealsa_direction_prefix[] = {
+	"SINK_",
+	"SOURCE_",
+};
+
+/* maximum number of rule sets, limited by the size of the PCM rules mask */
+#define BLUEALSA_AGENT_MAX_RULES 32
+
+struct bluealsa_agent_pcm {
+	struct bluealsa_pcm_data data;
+	/* mask of the rules which select this PCM */
+	uint32_t rules;
+	/* values most recently passed to the handlers of each rule */
+	struct {
+		uint16_t server_delay;
+		int16_t client_delay;
+	} reported[BLUEALSA_AGENT_MAX_RULES];
+	/* calibrated client delay set by the agent, not yet confirmed */
+	bool calibration_pending;
+	int16_t calibration_delay;
+	/* SoftVolume value set by the agent, not yet confirmed */
+	bool softvol_pending;
+	bool softvol_expected;
 };
 
-static const char *bluealsa_properties[] = {
-	"Delay",
-	"Running",
-	"SoftVolume",
+enum bluealsa_device_event {
+	DEVICE_EVENT_NONE,
+	DEVICE_EVENT_ADD,
+	DEVICE_EVENT_UPDATE,
+	DEVICE_EVENT_REMOVE,
 };
 
-struct bluealsa_pcm_data {
+struct bluealsa_device_data {
 	char path[128];
-	char address[18];
-	char alias[64];
-	char profile[5];
-	char mode[9];
-	char codec[16];
-	char codec_config[64];
-	char format[16];
-	char channels[3];
-	char rate[8];
-	char transport[12];
+	char service[32];
 	char transport_type[5];
+	/* snapshot of the device PCMs, indexed by DIRECTION_ */
+	struct bluealsa_pcm_data pcms[DIRECTION_COUNT];
+	bool present[DIRECTION_COUNT];
+	/* the handlers have been run with an "add" event for this device */
+	bool announced;
+	enum bluealsa_device_event pending;
+	unsigned int changes[DIRECTION_COUNT];
+	unsigned int device_changes;
+};
+
+/* maximum number of handlers with an open directives channel */
+#define BLUEALSA_AGENT_MAX_CHANNELS 16
+
+/* The PCMs to which directives from a handler are applied */
+struct bluealsa_agent_directives {
 	char service[32];
-	char alsa_id[96];
-	uint16_t server_delay;
-	int16_t client_delay;
+	/* for device events indexed by DIRECTION_, otherwise only the first */
+	char paths[DIRECTION_COUNT][128];
+	bool device;
 };
 
-struct bluealsa_agent {
-	bluealsa_client_t client;
-	const char *program;
+/* A pipe from which directives are read from a running handler */
+struct bluealsa_agent_channel {
+	int fd;
+	/* the handler process, or 0 if not known */
+	pid_t pid;
+	/* the handler has been reaped, but the write end may have been inherited
+	 * by a process that it left running */
+	bool exited;
+	struct bluealsa_agent_directives target;
+	char buffer[1024];
+	size_t len;
+	bool overflow;
+};
+
+/* When a supervised service is started */
+enum bluealsa_agent_start_on {
+	BLUEALSA_AGENT_START_ON_RUNNING = 0,
+	BLUEALSA_AGENT_START_ON_ADD,
+};
+
+/* How the volume of a PCM is to be controlled */
+enum bluealsa_agent_softvol {
+	BLUEALSA_AGENT_SOFTVOL_UNCHANGED = 0,
+	/* hardware if the device supports it, otherwise software */
+	BLUEALSA_AGENT_SOFTVOL_AUTO,
+	BLUEALSA_AGENT_SOFTVOL_SOFTWARE,
+	BLUEALSA_AGENT_SOFTVOL_HARDWARE,
+};
+
+/* Volume control policy for one codec, or for all codecs if codec is "" */
+struct bluealsa_agent_softvol_policy {
+	char codec[16];
+	enum bluealsa_agent_softvol softvol;
+};
+
+/* Long options that have no short equivalent */
+enum {
+	BLUEALSA_AGENT_OPT_START_ON = 0x100,
+	BLUEALSA_AGENT_OPT_RESTART,
+	BLUEALSA_AGENT_OPT_BRIDGE_PLAYBACK,
+	BLUEALSA_AGENT_OPT_BRIDGE_CAPTURE,
+	BLUEALSA_AGENT_OPT_BRIDGE_LATENCY,
+	BLUEALSA_AGENT_OPT_ADDRESS,
+	BLUEALSA_AGENT_OPT_PREFER_CODECS,
+	BLUEALSA_AGENT_OPT_CALIBRATION,
+	BLUEALSA_AGENT_OPT_LEARN_DELAY,
+	BLUEALSA_AGENT_OPT_SOFT_VOLUME,
+	BLUEALSA_AGENT_OPT_HANDLER_CPUS,
+	BLUEALSA_AGENT_OPT_HANDLER_NICE,
+	BLUEALSA_AGENT_OPT_HANDLER_SCHED,
+	BLUEALSA_AGENT_OPT_HANDLER_IOPRIO,
+	BLUEALSA_AGENT_OPT_HANDLER_CGROUP,
+	BLUEALSA_AGENT_OPT_HANDLER_CPU_WEIGHT,
+	BLUEALSA_AGENT_OPT_HANDLER_MEMORY_MAX,
+	BLUEALSA_AGENT_OPT_PREWARM,
+	BLUEALSA_AGENT_OPT_PCM_FD,
+	BLUEALSA_AGENT_OPT_STATE_FILE,
+	BLUEALSA_AGENT_OPT_EVENT_SOCKET,
+	BLUEALSA_AGENT_OPT_METRICS_FILE,
+	BLUEALSA_AGENT_OPT_RECORDER_FILE,
+	BLUEALSA_AGENT_OPT_TRACE_FILE,
+	BLUEALSA_AGENT_OPT_BUS_ADDRESS,
+	BLUEALSA_AGENT_OPT_RECORD,
+	BLUEALSA_AGENT_OPT_REPLAY,
+};
+
+struct bluealsa_agent_rule {
+	/* config file section name, or NULL if given on the command line */
+	char *name;
+	char *program;
 	bool program_is_dir;
 	char **progs;
 	size_t prog_count;
+	/* plugins given as NAME[:ARGS], and their instances once loaded */
+	char **plugin_specs;
+	struct bluealsa_agent_plugin_instance **plugins;
+	size_t plugins_count;
+	char **services;
+	size_t services_count;
+	/* Bluetooth addresses of the selected devices, or none for all */
+	char **addresses;
+	size_t addresses_count;
 	uint16_t profiles;
 	enum bluealsa_mode mode;
 	uint8_t properties;
+	/* minimum change required to report a numeric property */
+	unsigned int thresholds[ARRAYSIZE(bluealsa_properties)];
+	bool wait;
+	/* aggregate the PCMs of each device into a single event */
+	bool device_events;
+	/* give handlers a channel on which to return directives */
+	bool directives;
+	/* long-running service started for each selected PCM */
+	char *supervise;
+	enum bluealsa_agent_start_on start_on;
+	enum bluealsa_agent_restart restart;
+	/* audio bridge between the selected PCMs and local ALSA devices */
+	struct bluealsa_agent_bridge_config bridge;
+	/* codecs to be selected when a PCM is added, most preferred first */
+	char **codecs;
+	size_t codecs_count;
+	/* client delay calibration file, and the table loaded from it */
+	char *calibration_path;
+	struct bluealsa_agent_calibration *calibration;
+	/* record client delays set by other BlueALSA clients */
+	bool learn_delay;
+	/* volume control policies, later entries take precedence */
+	struct bluealsa_agent_softvol_policy *softvol;
+	size_t softvol_count;
+	/* scheduling of the handler processes, or NULL to inherit the agent's */
+	struct bluealsa_agent_sched *sched;
+	/* milliseconds for which handlers are pre-spawned on device connection */
+	unsigned int prewarm;
+	/* open each added PCM and give its file descriptors to the handlers */
+	bool pcm_fd;
 	struct {
-		struct bluealsa_pcm_data *data;
+		struct bluealsa_device_data *data;
+		size_t capacity;
+		size_t count;
+	} devices;
+};
+
+struct bluealsa_agent {
+	bluealsa_client_t client;
+	struct bluealsa_agent_rule *rules;
+	size_t rules_count;
+	struct {
+		struct bluealsa_agent_pcm *data;
 		size_t capacity;
 		size_t count;
 	} pcms;
-	bool wait;
+	/* milliseconds until pending device events are run, or -1 */
+	int timeout;
+	/* monotonic time in milliseconds at which pending device events are run */
+	uint64_t deadline;
+	struct bluealsa_agent_channel channels[BLUEALSA_AGENT_MAX_CHANNELS];
+	size_t channels_count;
+	/* properties of connected devices, fetched in advance for --prewarm */
+	struct {
+		struct bluealsa_agent_device *data;
+		size_t capacity;
+		size_t count;
+	} devices;
+};
+
+/* PCM file descriptors given to the handlers of an event, each with the name
+ * of the environment variable that gives its number */
+struct bluealsa_agent_fds {
+	char names[2 * DIRECTION_COUNT][32];
+	int fds[2 * DIRECTION_COUNT];
+	size_t count;
+};
+
+struct bluealsa_agent_device {
+	char path[128];
+	char address[18];
+	char alias[64];
 };
 
 typedef struct {
-	char string[19][256];
+	char string[32][256];
 	size_t count;
 } envvars_t;
 
 static struct bluealsa_agent agent = { 0 };
 
-static bool bluealsa_agent_filter(const struct ba_pcm *pcm) {
-	const bool profile_match = (agent.profiles == PROFILE_ALL) ||
-									(agent.profiles & pcm->transport);
-	const bool mode_match = (agent.mode == MODE_ALL) || (pcm->mode == agent.mode);
- 	return profile_match && mode_match;
+static bool bluealsa_agent_address_match(const struct bluealsa_agent_rule *rule, const char *address) {
+	if (rule->addresses_count == 0)
+		return true;
+	for (size_t n = 0; n < rule->addresses_count; n++)
+		if (strcasecmp(address, rule->addresses[n]) == 0)
+			return true;
+	return false;
+}
+
+static bool bluealsa_agent_filter(const struct bluealsa_agent_rule *rule, const struct ba_pcm *pcm, const char *service) {
+	const bool profile_match = (rule->profiles == PROFILE_ALL) ||
+									(rule->profiles & pcm->transport);
+	const bool mode_match = (rule->mode == MODE_ALL) || (pcm->mode == rule->mode);
+	bool service_match = false;
+	for (size_t n = 0; n < rule->services_count; n++)
+		if (strcmp(service, rule->services[n]) == 0)
+			service_match = true;
+	char address[18];
+	ba2str(&pcm->addr, address);
+ 	return profile_match && mode_match && service_match && bluealsa_agent_address_match(rule, address);
+}
+
+static struct bluealsa_agent_device *bluealsa_agent_find_device(const char *path) {
+	for (size_t n = 0; n < agent.devices.count; n++)
+		if (strcmp(agent.devices.data[n].path, path) == 0)
+			return &agent.devices.data[n];
+	return NULL;
+}
+
+/**
+ * Get the address and alias of a device, from those fetched when it
+ * connected if available, otherwise from BlueZ.
+ */
+static void bluealsa_agent_get_device(struct bluealsa_client_device *device) {
+	const struct bluealsa_agent_device *cached;
+	if ((cached = bluealsa_agent_find_device(device->path)) != NULL) {
+		memcpy(device->hex_addr, cached->address, sizeof(device->hex_addr));
+		memcpy(device->alias, cached->alias, sizeof(device->alias));
+		return;
+	}
+	bluealsa_client_get_device(agent.client, device);
 }
 
-static struct bluealsa_pcm_data *bluealsa_agent_add_pcm_path(
+static struct bluealsa_agent_pcm *bluealsa_agent_add_pcm_path(
 				const struct ba_pcm *pcm,
-				const char *service) {
+				const char *service,
+				uint32_t rules) {
 
+	struct bluealsa_agent_pcm *entry;
 	struct bluealsa_pcm_data *pcm_data;
 	struct bluealsa_client_device device = { .path = pcm->device_path };
 	const char *profile, *mode, *transport, *transport_type, *format;
@@ -126,18 +391,21 @@ static struct bluealsa_pcm_data *bluealsa_agent_add_pcm_path(
 
 	if (agent.pcms.count == agent.pcms.capacity) {
 		const size_t new_size = 2 * agent.pcms.capacity;
-		pcm_data = realloc(agent.pcms.data, new_size * sizeof(*agent.pcms.data));
-		if (pcm_data == NULL)
+		entry = realloc(agent.pcms.data, new_size * sizeof(*agent.pcms.data));
+		if (entry == NULL)
 			return NULL;
 
-		agent.pcms.data = pcm_data;
+		agent.pcms.data = entry;
 		agent.pcms.capacity = new_size;
 	}
-	pcm_data = &agent.pcms.data[agent.pcms.count];
+	entry = &agent.pcms.data[agent.pcms.count];
+	pcm_data = &entry->data;
 
-	bluealsa_client_get_device(agent.client, &device);
+	bluealsa_agent_get_device(&device);
 
+	memset(entry, 0, sizeof(*entry));
 	memcpy(pcm_data->path, pcm->pcm_path, sizeof(pcm_data->path));
+	memcpy(pcm_data->device_path, pcm->device_path, sizeof(pcm_data->device_path));
 	memcpy(pcm_data->address, device.hex_addr, sizeof(pcm_data->address));
 	memcpy(pcm_data->alias, device.alias, sizeof(pcm_data->alias));
 	memcpy(pcm_data->profile, profile, sizeof(pcm_data->profile));
@@ -154,12 +422,19 @@ static struct bluealsa_pcm_data *bluealsa_agent_add_pcm_path(
 	memcpy(pcm_data->service, service, sizeof(pcm_data->service));
 	pcm_data->server_delay = pcm->delay;
 	pcm_data->client_delay = pcm->client_delay;
+	pcm_data->running = pcm->running;
+	pcm_data->softvol = pcm->soft_volume;
+	entry->rules = rules;
+	for (size_t n = 0; n < BLUEALSA_AGENT_MAX_RULES; n++) {
+		entry->reported[n].server_delay = pcm->delay;
+		entry->reported[n].client_delay = pcm->client_delay;
+	}
 
 	const bool show_service = (strcmp(service, "org.bluealsa.") > 0);
 	snprintf(pcm_data->alsa_id, sizeof(pcm_data->alsa_id), "bluealsa:DEV=%s,PROFILE=%s%s%s", pcm_data->address, transport_type, show_service ? ",SRV=" : "", show_service ? service + strlen("org.bluealsa.") : "");
 
 	agent.pcms.count++;
-	return pcm_data;
+	return entry;
 }
 
 static void bluealsa_agent_remove_pcm_data(size_t n) {
@@ -170,7 +445,7 @@ static void bluealsa_agent_remove_pcm_data(size_t n) {
 
 static bool bluealsa_agent_remove_pcm_path(const char *path) {
 	for (size_t n = 0; n < agent.pcms.count; n++) {
-		if (strcmp(path, agent.pcms.data[n].path) == 0) {
+		if (strcmp(path, agent.pcms.data[n].data.path) == 0) {
 			bluealsa_agent_remove_pcm_data(n);
 			return true;
 		}
@@ -178,78 +453,290 @@ static bool bluealsa_agent_remove_pcm_path(const char *path) {
 	return false;
 }
 
-static struct bluealsa_pcm_data *bluealsa_agent_find_pcm_data(const char *path) {
+static struct bluealsa_agent_pcm *bluealsa_agent_find_pcm(const char *path) {
 	for (size_t n = 0; n < agent.pcms.count; n++) {
-		if (strcmp(path, agent.pcms.data[n].path) == 0)
+		if (strcmp(path, agent.pcms.data[n].data.path) == 0)
 			return &agent.pcms.data[n];
 	}
 	return NULL;
 }
 
-static void bluealsa_agent_run_prog(size_t prog_num, const char *event, const char *obj_path, envvars_t *envp, bool wait) {
-	const char *prog = agent.progs[prog_num];
+/**
+ * Determine if a numeric property has changed sufficiently to be reported.
+ * @param rule the rule whose threshold is applied.
+ * @param property index of the property in bluealsa_properties.
+ * @param reported the value most recently passed to the handlers.
+ * @param value the new value.
+ * @return true if the difference is at least the configured threshold.
+ */
+static bool bluealsa_agent_threshold_reached(const struct bluealsa_agent_rule *rule, size_t property, int reported, int value) {
+	return (unsigned int)abs(value - reported) >= rule->thresholds[property];
+}
+
+/**
+ * Open a pipe on which a handler can return directives.
+ * @param prog the handler, for diagnostics.
+ * @param fd returns the write end of the pipe, to be passed to the handler.
+ * @return the channel, or NULL if none is available.
+ */
+static struct bluealsa_agent_channel *bluealsa_agent_open_channel(const char *prog, const struct bluealsa_agent_directives *target, int *fd) {
+	struct bluealsa_agent_channel *channel;
+	int pipefd[2];
+
+	if (agent.channels_count == ARRAYSIZE(agent.channels)) {
+		warn("Too many handlers with open directive channels: Ignoring directives from %s", prog);
+		return NULL;
+	}
+	if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) == -1) {
+		error("Couldn't create directive channel (%s)", strerror(errno));
+		return NULL;
+	}
+	/* only the read end is non-blocking */
+	fcntl(pipefd[1], F_SETFL, 0);
+
+	channel = &agent.channels[agent.channels_count++];
+	memset(channel, 0, sizeof(*channel));
+	channel->fd = pipefd[0];
+	channel->target = *target;
+	*fd = pipefd[1];
+	return channel;
+}
+
+static void bluealsa_agent_close_channel(size_t n) {
+	assert(n < agent.channels_count);
+	close(agent.channels[n].fd);
+	if (--agent.channels_count > n)
+		memcpy(&agent.channels[n], &agent.channels[agent.channels_count], sizeof(*agent.channels));
+}
+
+/**
+ * Mark the channel of a reaped handler, so that the main loop closes it
+ * without waiting for EOF.
+ */
+static void bluealsa_agent_channel_reaped(pid_t pid) {
+	for (size_t n = 0; n < agent.channels_count; n++)
+		if (agent.channels[n].pid == pid)
+			agent.channels[n].exited = true;
+}
+
+/**
+ * Open a PCM for the handlers of an event.
+ * @param prefix inserted before each variable name, "" for PCM events.
+ */
+static void bluealsa_agent_open_pcm_fds(struct bluealsa_agent_fds *fds, const struct bluealsa_pcm_data *pcm_data, const char *prefix) {
+	int fd_pcm, fd_ctrl;
+
+	if (fds->count + 2 > ARRAYSIZE(fds->fds))
+		return;
+	if (bluealsa_client_open_pcm(agent.client, pcm_data->service, pcm_data->path, &fd_pcm, &fd_ctrl) < 0) {
+		warn("Couldn't open %s for handlers", pcm_data->path);
+		return;
+	}
+
+	snprintf(fds->names[fds->count], sizeof(fds->names[0]), "BLUEALSA_PCM_%sFD", prefix);
+	fds->fds[fds->count++] = fd_pcm;
+	snprintf(fds->names[fds->count], sizeof(fds->names[0]), "BLUEALSA_PCM_%sCONTROL_FD", prefix);
+	fds->fds[fds->count++] = fd_ctrl;
+}
+
+/**
+ * Close the agent's copies of the PCM file descriptors of an event, once all
+ * the handlers have been started. The PCM is closed when the handlers have
+ * also closed them.
+ */
+static void bluealsa_agent_close_pcm_fds(struct bluealsa_agent_fds *fds) {
+	for (size_t n = 0; n < fds->count; n++)
+		close(fds->fds[n]);
+	fds->count = 0;
+}
+
+static void bluealsa_agent_run_prog(const char *prog, const char *event, const char *obj_path, envvars_t *envp, bool wait, const struct bluealsa_agent_sched *sched, const struct bluealsa_agent_fds *fds, const struct bluealsa_agent_directives *directives) {
+	struct bluealsa_agent_channel *channel = NULL;
+	int directive_fd = -1;
+	char action[32];
+
+	if (directives != NULL)
+		channel = bluealsa_agent_open_channel(prog, directives, &directive_fd);
+
 	pid_t pid = fork();
 	switch (pid) {
 	case 0:
 		{
 			char *argv[] = {(char*)prog, (char*)event, (char*)obj_path, NULL};
+			char directive_env[48];
 			bluealsa_client_close(agent.client);
 			for (size_t n = 0; n < envp->count; n++)
 				putenv(envp->string[n]);
 
+			if (directive_fd != -1) {
+				fcntl(directive_fd, F_SETFD, 0);
+				snprintf(directive_env, sizeof(directive_env), "BLUEALSA_AGENT_DIRECTIVE_FD=%d", directive_fd);
+				putenv(directive_env);
+			}
+
+			char fd_env[ARRAYSIZE(fds->fds)][48];
+			for (size_t n = 0; fds != NULL && n < fds->count; n++) {
+				fcntl(fds->fds[n], F_SETFD, 0);
+				snprintf(fd_env[n], sizeof(fd_env[n]), "%s=%d", fds->names[n], fds->fds[n]);
+				putenv(fd_env[n]);
+			}
+
 			sigset_t mask;
 			sigfillset(&mask);
 			sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
+			bluealsa_agent_sched_apply(sched);
+
 			execv(prog, argv);
 			error("Failed to execute %s (%s)", prog, strerror(errno));
 			exit(1);
 		}
 	case -1:
 		error("Failed to fork process for %s (%s)", prog, strerror(errno));
+		bluealsa_metrics_handler_spawned(-1);
+		bluealsa_recorder_add(event, NULL, obj_path, 0, "fork failed");
+		if (directive_fd != -1) {
+			close(directive_fd);
+			/* the channel read end will see EOF and be closed */
+		}
 		return;
 	default:
-		if (wait)
-			waitpid(pid, NULL, 0);
-		else
-			signal(SIGCHLD,SIG_IGN);
+		snprintf(action, sizeof(action), "handler spawned [%d]", pid);
+		bluealsa_metrics_handler_spawned(pid);
+		bluealsa_recorder_add(event, NULL, obj_path, 0, action);
+		bluealsa_trace(BLUEALSA_TRACE_SPAWN, pid);
+		if (directive_fd != -1) {
+			close(directive_fd);
+			channel->pid = pid;
+		}
+		/* other children are reaped by the main loop on SIGCHLD */
+		if (wait) {
+			int status;
+			if (waitpid(pid, &status, 0) == pid) {
+				bluealsa_trace(BLUEALSA_TRACE_REAPED, pid);
+				bluealsa_metrics_handler_reaped(pid, status);
+				bluealsa_agent_channel_reaped(pid);
+			}
+		}
 		break;
 	}
 }
 
-static void bluealsa_agent_run_progs(const char *event, const char *obj_path, envvars_t *envp) {
-	for (size_t n = 0; n < agent.prog_count; n++) {
-		bluealsa_agent_run_prog(n, event, obj_path, envp, agent.wait);
+/**
+ * Give an event to a handler process that was pre-spawned when the device
+ * connected.
+ * @return false if there is no such process, and so the handler must be run
+ * by bluealsa_agent_run_prog().
+ */
+static bool bluealsa_agent_run_warm(unsigned int owner, const char *prog, const char *address, const char *event, const char *obj_path, envvars_t *envp, bool wait, const struct bluealsa_agent_fds *fds, const struct bluealsa_agent_directives *directives) {
+	char *env[ARRAYSIZE(envp->string)];
+	const char *fd_names[1 + ARRAYSIZE(fds->fds)];
+	int fd_list[1 + ARRAYSIZE(fds->fds)];
+	size_t fd_count = 0;
+	struct bluealsa_agent_channel *channel = NULL;
+	int directive_fd = -1;
+	char action[32];
+	pid_t pid;
+
+	if (!bluealsa_agent_prewarm_ready(owner, address, prog))
+		return false;
+
+	for (size_t n = 0; n < envp->count; n++)
+		env[n] = envp->string[n];
+	if (directives != NULL &&
+			(channel = bluealsa_agent_open_channel(prog, directives, &directive_fd)) != NULL) {
+		fd_names[fd_count] = "BLUEALSA_AGENT_DIRECTIVE_FD";
+		fd_list[fd_count++] = directive_fd;
+	}
+	for (size_t n = 0; fds != NULL && n < fds->count; n++) {
+		fd_names[fd_count] = fds->names[n];
+		fd_list[fd_count++] = fds->fds[n];
+	}
+
+	pid = bluealsa_agent_prewarm_run(owner, address, prog, event, obj_path, env, envp->count, fd_names, fd_list, fd_count);
+	/* if the process did not receive it, the channel read end sees EOF */
+	if (directive_fd != -1)
+		close(directive_fd);
+	if (pid == -1)
+		return false;
+
+	if (channel != NULL)
+		channel->pid = pid;
+	snprintf(action, sizeof(action), "handler prewarmed [%d]", pid);
+	bluealsa_metrics_handler_spawned(pid);
+	bluealsa_recorder_add(event, NULL, obj_path, 0, action);
+	bluealsa_trace(BLUEALSA_TRACE_SPAWN, pid);
+	if (wait) {
+		int status;
+		if (waitpid(pid, &status, 0) == pid) {
+			bluealsa_trace(BLUEALSA_TRACE_REAPED, pid);
+			bluealsa_metrics_handler_reaped(pid, status);
+			bluealsa_agent_channel_reaped(pid);
+		}
+	}
+	return true;
+}
+
+/**
+ * Run all the programs of a rule for one event.
+ * @param address the address of the device, for which handler processes may
+ *                have been pre-spawned.
+ * @param fds PCM file descriptors to be inherited by the handlers, or NULL.
+ * @param directives the PCMs to which handler directives apply, or NULL if
+ *                   directives are not accepted for this event.
+ */
+static void bluealsa_agent_run_progs(const struct bluealsa_agent_rule *rule, const char *event, const char *obj_path, envvars_t *envp, const char *address, const struct bluealsa_agent_fds *fds, const struct bluealsa_agent_directives *directives) {
+	const unsigned int owner = rule - agent.rules;
+	/* only the first event of a newly connected device can use a warm
+	 * process */
+	const bool warm = rule->prewarm > 0 && strcmp(event, "add") == 0;
+
+	if (!rule->directives)
+		directives = NULL;
+	for (size_t n = 0; n < rule->prog_count; n++) {
+		if (warm && bluealsa_agent_run_warm(owner, rule->progs[n], address, event, obj_path, envp, rule->wait, fds, directives))
+			continue;
+		bluealsa_agent_run_prog(rule->progs[n], event, obj_path, envp, rule->wait, rule->sched, fds, directives);
 	}
 }
 
+static void bluealsa_agent_pcm_directives(struct bluealsa_agent_directives *directives, const struct bluealsa_pcm_data *pcm_data) {
+	memset(directives, 0, sizeof(*directives));
+	memcpy(directives->service, pcm_data->service, sizeof(directives->service));
+	memcpy(directives->paths[0], pcm_data->path, sizeof(directives->paths[0]));
+}
+
 static int cmpstringp(const void *p1, const void *p2) {
 	return strcmp(*(const char **) p1, *(const char **) p2);
 }
 
-static void bluealsa_agent_get_progs(const char *program) {
+static void bluealsa_agent_get_progs(struct bluealsa_agent_rule *rule) {
+	const char *program = rule->program;
 	struct stat statbuf;
 	DIR *dir;
 	struct dirent *entry;
 	char path[PATH_MAX];
-	const size_t offset = strlen(program) + 1;
 	size_t capacity = 10;
 
+	/* a rule may have only plugins */
+	if (program == NULL)
+		return;
+
+	const size_t offset = strlen(program) + 1;
+
 	if (stat(program, &statbuf) != 0) {
 		error("Cannot stat program path '%s' (%s)", program, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	agent.program = program;
-
 	if (S_ISDIR(statbuf.st_mode)) {
 		if ((dir = opendir(program)) == NULL) {
 			error("Cannot read directory '%s' (%s)", program, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
 
-		agent.program_is_dir = true;
-		agent.progs = malloc(capacity * sizeof(char*));
+		rule->program_is_dir = true;
+		rule->progs = malloc(capacity * sizeof(char*));
 		strcpy(path, program);
 		strcat(path, "/");
 
@@ -259,31 +746,31 @@ static void bluealsa_agent_get_progs(const char *program) {
 			if (strlen(entry->d_name) + offset > PATH_MAX)
 				continue;
 			strcpy(path + offset, entry->d_name);
-			if (agent.prog_count >= capacity) {
+			if (rule->prog_count >= capacity) {
 				capacity *= 2;
-				agent.progs = realloc(agent.progs, capacity * sizeof(char*));
-				if (agent.progs == NULL) {
+				rule->progs = realloc(rule->progs, capacity * sizeof(char*));
+				if (rule->progs == NULL) {
 					error("Out of memory");
 					exit(EXIT_FAILURE);
 				}
 			}
-			agent.progs[agent.prog_count] = strdup(path);
-			if (agent.progs[agent.prog_count] == NULL) {
+			rule->progs[rule->prog_count] = strdup(path);
+			if (rule->progs[rule->prog_count] == NULL) {
 				error("Out of memory");
 				exit(EXIT_FAILURE);
 			}
-			++agent.prog_count;
+			++rule->prog_count;
 		}
 		closedir(dir);
 
-		qsort(agent.progs, agent.prog_count, sizeof(char *), cmpstringp);
-		agent.wait = true;
+		qsort(rule->progs, rule->prog_count, sizeof(char *), cmpstringp);
+		rule->wait = true;
 	}
 	else if (S_ISREG(statbuf.st_mode)) {
-		agent.progs = malloc(sizeof(char*));
-		agent.progs[0] = strdup(program);
-		agent.prog_count = 1;
-		agent.wait = false;
+		rule->progs = malloc(sizeof(char*));
+		rule->progs[0] = strdup(program);
+		rule->prog_count = 1;
+		rule->wait = false;
 	}
 	else {
 		error("Invalid file type for program '%s'", program);
@@ -291,284 +778,1730 @@ static void bluealsa_agent_get_progs(const char *program) {
 	}
 }
 
-static size_t bluealsa_agent_init_envvars(envvars_t *envvars, const struct bluealsa_pcm_data *pcm_data) {
-	size_t n = 0;
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_ADDRESS=%s", pcm_data->address);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_NAME=%s", pcm_data->alias);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_PROFILE=%s", pcm_data->profile);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_MODE=%s", pcm_data->mode);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_CODEC=%s", pcm_data->codec);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_CODEC_CONFIG=%s", pcm_data->codec_config);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_FORMAT=%s", pcm_data->format);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_CHANNELS=%s", pcm_data->channels);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_SAMPLING=%s", pcm_data->rate);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_RATE=%s", pcm_data->rate);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_TRANSPORT=%s", pcm_data->transport);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_TRANSPORT_TYPE=%s", pcm_data->transport_type);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_SERVICE=%s", pcm_data->service);
-	snprintf(envvars->string[n++], 256, "BLUEALSA_PCM_PROPERTY_ALSA_ID=%s", pcm_data->alsa_id);
-	envvars->count = n;
-	return n;
-}
-
-static void bluealsa_agent_terminated(void) {
-	for (size_t n = 0; n < agent.pcms.count; n++) {
-		envvars_t envvars;
-		struct bluealsa_pcm_data *pcm_data = &agent.pcms.data[n];
-		bluealsa_agent_init_envvars(&envvars, pcm_data);
-		bluealsa_agent_run_progs("remove", pcm_data->path, &envvars);
+static void bluealsa_agent_add_envvar(envvars_t *envvars, const char *format, ...) {
+	va_list ap;
+	if (envvars->count >= ARRAYSIZE(envvars->string)) {
+		error("Too many environment variables");
+		return;
 	}
+	va_start(ap, format);
+	vsnprintf(envvars->string[envvars->count++], sizeof(envvars->string[0]), format, ap);
+	va_end(ap);
 }
 
-static void bluealsa_agent_pcm_added(const struct ba_pcm *pcm, const char *service, void *data) {
-	(void) data;
-	struct bluealsa_pcm_data *pcm_data;
-	envvars_t envvars;
-	size_t n;
+/**
+ * Add the properties which are common to all the PCMs of a device.
+ * @param envvars the environment to which the variables are added.
+ * @param pcm_data the PCM from which the property values are taken.
+ */
+static void bluealsa_agent_device_envvars(envvars_t *envvars, const struct bluealsa_pcm_data *pcm_data) {
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_ADDRESS=%s", pcm_data->address);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_NAME=%s", pcm_data->alias);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_PROFILE=%s", pcm_data->profile);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_TRANSPORT_TYPE=%s", pcm_data->transport_type);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_SERVICE=%s", pcm_data->service);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_ALSA_ID=%s", pcm_data->alsa_id);
+}
 
-	if (!bluealsa_agent_filter(pcm))
-		return;
+/**
+ * Add the properties which are specific to a single PCM.
+ * @param envvars the environment to which the variables are added.
+ * @param pcm_data the PCM from which the property values are taken.
+ * @param prefix inserted before each property name, "" for PCM events.
+ */
+static void bluealsa_agent_pcm_envvars(envvars_t *envvars, const struct bluealsa_pcm_data *pcm_data, const char *prefix) {
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sCODEC=%s", prefix, pcm_data->codec);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sCODEC_CONFIG=%s", prefix, pcm_data->codec_config);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sFORMAT=%s", prefix, pcm_data->format);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sCHANNELS=%s", prefix, pcm_data->channels);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sRATE=%s", prefix, pcm_data->rate);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sTRANSPORT=%s", prefix, pcm_data->transport);
+}
 
-	if ((pcm_data = bluealsa_agent_add_pcm_path(pcm, service)) == NULL) {
-		error("Out of memory");
-		return;
+/**
+ * Add the status properties selected with --status.
+ * @param rule the rule for which the properties are selected.
+ * @param envvars the environment to which the variables are added.
+ * @param pcm_data the PCM from which the property values are taken.
+ * @param prefix inserted before each property name, "" for PCM events.
+ * @param changes if not zero, then add only those properties included in
+ *                this mask of BLUEALSA_AGENT_CHANGE_ bits.
+ */
+static void bluealsa_agent_status_envvars(const struct bluealsa_agent_rule *rule, envvars_t *envvars, const struct bluealsa_pcm_data *pcm_data, const char *prefix, unsigned int changes) {
+	if (changes == 0)
+		changes = ~0U;
+	if (rule->properties & PROPERTY_DELAY && changes & (BLUEALSA_AGENT_CHANGE_DELAY | BLUEALSA_AGENT_CHANGE_CLIENT_DELAY)) {
+		bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sDELAY=%u", prefix, pcm_data->server_delay);
+		bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sCLIENT_DELAY=%d", prefix, pcm_data->client_delay);
 	}
+	if (rule->properties & PROPERTY_RUNNING && changes & BLUEALSA_AGENT_CHANGE_RUNNING)
+		bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sRUNNING=%s", prefix, pcm_data->running ? "true" : "false");
+	if (rule->properties & PROPERTY_SOFTVOL && changes & BLUEALSA_AGENT_CHANGE_SOFTVOL)
+		bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_%sSOFTVOL=%s", prefix, pcm_data->softvol ? "true" : "false");
+}
 
-	n = bluealsa_agent_init_envvars(&envvars, pcm_data);
+static void bluealsa_agent_init_envvars(envvars_t *envvars, const struct bluealsa_pcm_data *pcm_data) {
+	envvars->count = 0;
+	bluealsa_agent_device_envvars(envvars, pcm_data);
+	bluealsa_agent_pcm_envvars(envvars, pcm_data, "");
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_MODE=%s", pcm_data->mode);
+	bluealsa_agent_add_envvar(envvars, "BLUEALSA_PCM_PROPERTY_SAMPLING=%s", pcm_data->rate);
+}
 
-	if (agent.properties & PROPERTY_DELAY) {
-		snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_DELAY=%u", pcm_data->server_delay);
-		snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_CLIENT_DELAY=%d", pcm_data->client_delay);
+/**
+ * Append the names of changed properties to a space-separated list.
+ * @param buffer the list, which must be nul-terminated.
+ * @param size the size of buffer in bytes.
+ * @param changes mask of BLUEALSA_AGENT_CHANGE_ bits.
+ * @param prefix inserted before each name, or NULL for PCM events.
+ */
+static void bluealsa_agent_format_changes(char *buffer, size_t size, unsigned int changes, const char *prefix) {
+	for (size_t i = 0; i < ARRAYSIZE(bluealsa_changes); i++) {
+		if (!(changes & (1 << i)))
+			continue;
+		size_t len = strlen(buffer);
+		snprintf(buffer + len, size - len, "%s%s%s", len > 0 ? " " : "", prefix ? prefix : "", bluealsa_changes[i]);
+		/* For compatibility, PCM events also report "SAMPLING" */
+		if (prefix == NULL && (1 << i) == BLUEALSA_AGENT_CHANGE_RATE)
+			strncat(buffer, " SAMPLING", size - strlen(buffer) - 1);
 	}
-	if (agent.properties & PROPERTY_RUNNING)
-		snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_RUNNING=%s", pcm->running ? "true" : "false");
-	if (agent.properties & PROPERTY_SOFTVOL)
-		snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_SOFTVOL=%s", pcm->soft_volume ? "true" : "false");
-
-	envvars.count = n;
-
-	bluealsa_agent_run_progs("add", pcm->pcm_path, &envvars);
-
 }
 
-static void bluealsa_agent_pcm_removed(const char *path, void *data) {
-	(void) data;
-	const struct bluealsa_pcm_data *pcm_data;
+/**
+ * Send an event to the clients of the event socket, with all the properties
+ * of the PCM. The list of PCMs must already reflect the event.
+ * @param client the client to which a snapshot is being sent, or NULL to send
+ *               the event to all clients.
+ * @param changes mask of BLUEALSA_AGENT_CHANGE_ bits for an "update" event.
+ */
+static void bluealsa_agent_publish(struct bluealsa_agent_server_client *client, const char *event, const struct bluealsa_pcm_data *pcm_data, unsigned int changes) {
+	static const struct bluealsa_agent_rule all = { .properties = PROPERTY_DELAY | PROPERTY_RUNNING | PROPERTY_SOFTVOL };
+	char *strings[ARRAYSIZE(((envvars_t *)NULL)->string)];
 	envvars_t envvars;
 
-	if ((pcm_data = bluealsa_agent_find_pcm_data(path)) == NULL)
+	if (client == NULL && !bluealsa_agent_server_has_clients())
 		return;
 
 	bluealsa_agent_init_envvars(&envvars, pcm_data);
+	bluealsa_agent_status_envvars(&all, &envvars, pcm_data, "", 0);
+	if (changes != 0) {
+		char list[128] = {0};
+		bluealsa_agent_format_changes(list, sizeof(list), changes, NULL);
+		bluealsa_agent_add_envvar(&envvars, "BLUEALSA_PCM_PROPERTY_CHANGES=%s", list);
+	}
 
-	if (bluealsa_agent_remove_pcm_path(path))
-		bluealsa_agent_run_progs("remove", path, &envvars);
+	for (size_t n = 0; n < envvars.count; n++)
+		strings[n] = envvars.string[n];
+	if (client != NULL)
+		bluealsa_agent_server_send(client, event, pcm_data->path, strings, envvars.count);
+	else
+		bluealsa_agent_server_event(event, pcm_data->path, strings, envvars.count);
 }
 
-static void bluealsa_agent_pcm_updated(const char *path, const char *service, struct bluealsa_pcm_properties *props, void *data) {
-	(void) service;
-	(void) data;
-	envvars_t envvars;
-	size_t n;
-	char changes[64] = {0};
-	struct bluealsa_pcm_data *pcm_data;
-
-	if ((props->mask & ~(BLUEALSA_PCM_PROPERTY_CHANGED_VOLUME)) == 0)
-		return;
+static void bluealsa_agent_server_snapshot(struct bluealsa_agent_server_client *client) {
+	for (size_t n = 0; n < agent.pcms.count; n++)
+		bluealsa_agent_publish(client, "add", &agent.pcms.data[n].data, 0);
+}
 
-	if ((pcm_data = bluealsa_agent_find_pcm_data(path)) == NULL)
-		return;
+/**
+ * Update the stored PCM data with changed property values.
+ * @param pcm_data the PCM to be updated.
+ * @param props the changed properties.
+ * @return mask of BLUEALSA_AGENT_CHANGE_ bits for all the changed properties.
+ */
+static unsigned int bluealsa_agent_update_pcm_data(struct bluealsa_pcm_data *pcm_data, const struct bluealsa_pcm_properties *props) {
+	unsigned int changes = 0;
 
 	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CODEC) {
 		memcpy(pcm_data->codec, props->codec.name, sizeof(pcm_data->codec));
-		strcpy(changes, "CODEC ");
+		changes |= BLUEALSA_AGENT_CHANGE_CODEC;
 	}
 	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_FORMAT) {
 		memcpy(pcm_data->format, bluealsa_client_format_to_string(props->format), sizeof(pcm_data->format));
-		strcat(changes, "FORMAT ");
+		changes |= BLUEALSA_AGENT_CHANGE_FORMAT;
 	}
 	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CHANNELS) {
 		snprintf(pcm_data->channels, sizeof(pcm_data->channels), "%hhu", props->channels);
-		strcat(changes, "CHANNELS ");
+		changes |= BLUEALSA_AGENT_CHANGE_CHANNELS;
 	}
 	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_RATE) {
 		snprintf(pcm_data->rate, sizeof(pcm_data->rate), "%u", props->rate);
-		strcat(changes, "RATE SAMPLING ");
+		changes |= BLUEALSA_AGENT_CHANGE_RATE;
 	}
-
 	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CODEC_CONFIG) {
 		bluealsa_client_codec_blob_to_string(&props->codec, pcm_data->codec_config, sizeof(pcm_data->codec_config));
-		strcat(changes, "CODEC_CONFIG ");
+		changes |= BLUEALSA_AGENT_CHANGE_CODEC_CONFIG;
 	}
-
-	n = bluealsa_agent_init_envvars(&envvars, pcm_data);
-
-	if (agent.properties & PROPERTY_DELAY) {
-		bool changed = false;
-		if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_DELAY) {
-			pcm_data->server_delay = props->delay;
-			strcat(changes, "DELAY ");
-			changed = true;
-		}
-		if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CLIENT_DELAY) {
-			pcm_data->client_delay = props->client_delay;
-			strcat(changes, "CLIENT_DELAY ");
-			changed = true;
-		}
-		if (changed) {
-			snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_DELAY=%u", pcm_data->server_delay);
-			snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_CLIENT_DELAY=%d", pcm_data->client_delay);
-		}
+	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_DELAY) {
+		pcm_data->server_delay = props->delay;
+		changes |= BLUEALSA_AGENT_CHANGE_DELAY;
 	}
-	if (agent.properties & PROPERTY_RUNNING)
-		if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_RUNNING) {
-			snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_RUNNING=%s", props->running ? "true" : "false");
-			strcat(changes, "RUNNING ");
-		}
-	if (agent.properties & PROPERTY_SOFTVOL)
-		if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_SOFTVOL) {
-			snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_SOFTVOL=%s", props->softvolume ? "true" : "false");
-			strcat(changes, "SOFTVOL ");
-		}
-
-	if (strlen(changes) > 0) {
-		changes[strlen(changes) - 1] = '\0';
-		snprintf(envvars.string[n++], 256, "BLUEALSA_PCM_PROPERTY_CHANGES=%s", changes);
-		envvars.count = n;
-		bluealsa_agent_run_progs("update", path, &envvars);
+	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CLIENT_DELAY) {
+		pcm_data->client_delay = props->client_delay;
+		changes |= BLUEALSA_AGENT_CHANGE_CLIENT_DELAY;
+	}
+	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_RUNNING) {
+		pcm_data->running = props->running;
+		changes |= BLUEALSA_AGENT_CHANGE_RUNNING;
+	}
+	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_SOFTVOL) {
+		pcm_data->softvol = props->softvolume;
+		changes |= BLUEALSA_AGENT_CHANGE_SOFTVOL;
 	}
 
+	return changes;
 }
 
-static int bluealsa_agent_init_client() {
-	int ret;
-	struct bluealsa_client_callbacks callbacks = {
-		bluealsa_agent_pcm_added,
-		bluealsa_agent_pcm_removed,
-		bluealsa_agent_pcm_updated,
-		NULL,
-		NULL,
-	};
-	if ((ret = bluealsa_client_open(&agent.client, &callbacks)) < 0) {
-		error("Unable to open bluealsa interface (%s)", strerror(-ret));
-		return ret;
+/**
+ * Select the changes which are to be reported to the handlers of a rule.
+ * @param rule the rule.
+ * @param index the index of the rule in the agent rules array.
+ * @param entry the updated PCM.
+ * @param changes mask of BLUEALSA_AGENT_CHANGE_ bits for all the changed properties.
+ * @return mask of BLUEALSA_AGENT_CHANGE_ bits for the properties to be reported.
+ */
+static unsigned int bluealsa_agent_rule_changes(const struct bluealsa_agent_rule *rule, size_t index, struct bluealsa_agent_pcm *entry, unsigned int changes) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	const unsigned int status = BLUEALSA_AGENT_CHANGE_DELAY | BLUEALSA_AGENT_CHANGE_CLIENT_DELAY | BLUEALSA_AGENT_CHANGE_RUNNING | BLUEALSA_AGENT_CHANGE_SOFTVOL;
+	unsigned int reported = changes & ~status;
+
+	if (rule->properties & PROPERTY_DELAY) {
+		if (changes & BLUEALSA_AGENT_CHANGE_DELAY &&
+				bluealsa_agent_threshold_reached(rule, PROPERTY_INDEX_DELAY, entry->reported[index].server_delay, pcm_data->server_delay))
+			reported |= BLUEALSA_AGENT_CHANGE_DELAY;
+		if (changes & BLUEALSA_AGENT_CHANGE_CLIENT_DELAY &&
+				bluealsa_agent_threshold_reached(rule, PROPERTY_INDEX_DELAY, entry->reported[index].client_delay, pcm_data->client_delay))
+			reported |= BLUEALSA_AGENT_CHANGE_CLIENT_DELAY;
+		if (reported & (BLUEALSA_AGENT_CHANGE_DELAY | BLUEALSA_AGENT_CHANGE_CLIENT_DELAY)) {
+			entry->reported[index].server_delay = pcm_data->server_delay;
+			entry->reported[index].client_delay = pcm_data->client_delay;
+		}
 	}
+	if (rule->properties & PROPERTY_RUNNING)
+		reported |= changes & BLUEALSA_AGENT_CHANGE_RUNNING;
+	if (rule->properties & PROPERTY_SOFTVOL)
+		reported |= changes & BLUEALSA_AGENT_CHANGE_SOFTVOL;
 
-	return 0;
+	return reported;
 }
 
-static void bluealsa_agent_reload(void) {
-	if (!agent.program_is_dir)
+static uint64_t bluealsa_agent_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Arm the device event timer. The deadline is fixed by the first pending
+ * event, so that a steady stream of later events cannot postpone the run.
+ */
+static void bluealsa_agent_set_timeout(void) {
+	if (agent.timeout != -1)
 		return;
+	agent.timeout = 20;
+	agent.deadline = bluealsa_agent_now() + agent.timeout;
+}
 
-	info("Reloading commands");
-	free(agent.progs);
-	agent.progs = NULL;
-	agent.prog_count = 0;
-	bluealsa_agent_get_progs(agent.program);
+static size_t bluealsa_agent_pcm_direction(const struct bluealsa_pcm_data *pcm_data) {
+	return strcmp(pcm_data->mode, "sink") == 0 ? DIRECTION_SINK : DIRECTION_SOURCE;
 }
 
-int main(int argc, char *argv[]) {
+static struct bluealsa_device_data *bluealsa_agent_find_device_data(struct bluealsa_agent_rule *rule, const struct bluealsa_pcm_data *pcm_data) {
+	for (size_t n = 0; n < rule->devices.count; n++) {
+		struct bluealsa_device_data *device = &rule->devices.data[n];
+		if (strcmp(device->path, pcm_data->device_path) == 0 &&
+				strcmp(device->service, pcm_data->service) == 0 &&
+				strcmp(device->transport_type, pcm_data->transport_type) == 0)
+			return device;
+	}
+	return NULL;
+}
 
-	char **services = malloc(sizeof(char*));
-	services[0] = strdup(BLUEALSA_SERVICE);
-	unsigned int services_count = 1;
-	const char *programs = NULL;
+static struct bluealsa_device_data *bluealsa_agent_add_device_data(struct bluealsa_agent_rule *rule, const struct bluealsa_pcm_data *pcm_data) {
+	struct bluealsa_device_data *device;
 
-	int opt;
-	const char *opts = "hVp:m:B:s::";
-	const struct option longopts[] = {
-		{ "help", no_argument, NULL, 'h' },
-		{ "version", no_argument, NULL, 'V' },
-		{ "profile", required_argument, NULL, 'p' },
-		{ "mode", required_argument, NULL, 'm' },
-		{ "dbus", required_argument, NULL, 'B'},
-		{ "status", optional_argument, NULL, 's' },
-		{ 0, 0, 0, 0 },
-	};
+	if (rule->devices.count == rule->devices.capacity) {
+		const size_t new_size = rule->devices.capacity > 0 ? 2 * rule->devices.capacity : 4;
+		device = realloc(rule->devices.data, new_size * sizeof(*rule->devices.data));
+		if (device == NULL)
+			return NULL;
 
-	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
-		switch (opt) {
-		case 'h' /* --help */ :
-			printf("%1$s - Utility to run BlueALSA event handler\n"
-					"\nUsage:\n"
-					"  %1$s [OPTION]... PROGRAM\n"
-					"\nOptions:\n"
-					"  -h, --help\t\t\tprint this help and exit\n"
-					"  -V, --version\t\t\tprint version and exit\n"
-					"  -p, --profile=[a2dp|asha|sco]\tselect only given profile\n"
-					"  -m, --mode=[sink|source]\tselect only given mode\n"
-					"  -B, --dbus=NAME\t\tBlueALSA service name suffix\n"
-					"  -s, --status[=PROPLIST]\thandle status change events\n"
-					"\n  The options --profile and --dbus may be given more "
-					"than once to select multiple profiles and/or services\n"
-					"\nPROGRAM:\n"
-					"  absolute path to program, or directory of programs, to "
-					"be run when a BlueALSA event occurs\n",
-					argv[0]);
-			return EXIT_SUCCESS;
+		rule->devices.data = device;
+		rule->devices.capacity = new_size;
+	}
+	device = &rule->devices.data[rule->devices.count++];
 
-		case 'V' /* --version */ :
-			printf("%s\n", PACKAGE_VERSION);
-			return EXIT_SUCCESS;
+	memset(device, 0, sizeof(*device));
+	memcpy(device->path, pcm_data->device_path, sizeof(device->path));
+	memcpy(device->service, pcm_data->service, sizeof(device->service));
+	memcpy(device->transport_type, pcm_data->transport_type, sizeof(device->transport_type));
+	return device;
+}
 
-		case 'p' /* --profile=[a2dp|asha|sco] */ : {
-			if (strcmp(optarg, "a2dp") == 0)
-				agent.profiles |= PROFILE_A2DP;
-			else if (strcmp(optarg, "asha") == 0)
-				agent.profiles |= PROFILE_ASHA;
-			else if (strcmp(optarg, "sco") == 0)
-				agent.profiles |= PROFILE_SCO;
-			else {
-				fprintf(stderr, "Invalid profile (%s)\n", optarg);
-				return EXIT_FAILURE;
-			}
-			break;
-		}
+static void bluealsa_agent_remove_device_data(struct bluealsa_agent_rule *rule, size_t n) {
+	assert(n < rule->devices.count);
+	if (--rule->devices.count > n)
+		memcpy(&rule->devices.data[n], &rule->devices.data[rule->devices.count], sizeof(*rule->devices.data));
+}
 
-		case 'm' /* --mode=[sink|source] */ : {
-			if (strcmp(optarg, "sink") == 0)
-				agent.mode = MODE_SINK;
-			else if (strcmp(optarg, "source") == 0)
-				agent.mode = MODE_SOURCE;
-			else {
-				fprintf(stderr, "Invalid mode (%s)\n", optarg);
-				return EXIT_FAILURE;
-			}
-			break;
-		}
+/**
+ * Run the handlers for a device event.
+ * The PCMs included in the event are those currently present, or for a
+ * "remove" event those that were present when the device was last reported.
+ */
+static void bluealsa_agent_run_device_event(const struct bluealsa_agent_rule *rule, struct bluealsa_device_data *device, const char *event) {
+	const bool removed = strcmp(event, "remove") == 0;
+	const struct bluealsa_pcm_data *first = NULL;
+	char changes[256] = { 0 };
+	bool included[DIRECTION_COUNT];
+	envvars_t envvars = { .count = 0 };
+
+	for (size_t dir = 0; dir < DIRECTION_COUNT; dir++) {
+		included[dir] = removed ? device->pcms[dir].path[0] != '\0' : device->present[dir];
+		if (included[dir] && first == NULL)
+			first = &device->pcms[dir];
+	}
+	if (first == NULL)
+		return;
 
-		case 'B' /* --dbus=NAME */ : {
-			char service[32];
-			snprintf(service, sizeof(service), BLUEALSA_SERVICE ".%s", optarg);
-			services = realloc(services, (services_count + 1) * sizeof(char*));
-			services[services_count++] = strdup(service);
-			break;
-		}
+	bluealsa_agent_device_envvars(&envvars, first);
+	bluealsa_agent_add_envvar(&envvars, "BLUEALSA_PCM_PROPERTY_MODE=%s",
+			included[DIRECTION_SINK] && included[DIRECTION_SOURCE] ? "duplex" :
+			included[DIRECTION_SINK] ? "sink" : "source");
 
-		case 's' /* --status[=PROPLIST] */ : {
-			if (optarg == NULL)
-				optarg = "Running";
+	for (size_t dir = 0; dir < DIRECTION_COUNT; dir++) {
+		if (!included[dir])
+			continue;
+		bluealsa_agent_pcm_envvars(&envvars, &device->pcms[dir], bluealsa_direction_prefix[dir]);
+		if (!removed)
+			bluealsa_agent_status_envvars(rule, &envvars, &device->pcms[dir], bluealsa_direction_prefix[dir], 0);
+		bluealsa_agent_format_changes(changes, sizeof(changes), device->changes[dir], bluealsa_direction_prefix[dir]);
+	}
 
-			for (char *prop = strtok(optarg, ","); prop; prop = strtok(NULL, ",")) {
+	if (strcmp(event, "update") == 0) {
+		bluealsa_agent_format_changes(changes, sizeof(changes), device->device_changes, "");
+		bluealsa_agent_add_envvar(&envvars, "BLUEALSA_PCM_PROPERTY_CHANGES=%s", changes);
+	}
 
-				bool found = false;
-				for (size_t i = 0; i < ARRAYSIZE(bluealsa_properties); i++) {
-					if (strcasecmp(prop, bluealsa_properties[i]) == 0) {
-						agent.properties |= (1 << i);
-						found = true;
-						break;
-					}
-				}
+	struct bluealsa_agent_directives directives = { .device = true };
+	memcpy(directives.service, device->service, sizeof(directives.service));
+	for (size_t dir = 0; dir < DIRECTION_COUNT; dir++)
+		if (included[dir])
+			memcpy(directives.paths[dir], device->pcms[dir].path, sizeof(directives.paths[dir]));
 
-				if (!found) {
-					fprintf(stderr, "Unknown property '%s'\n", prop);
-					return false;
-				}
+	struct bluealsa_agent_fds fds = { .count = 0 };
+	if (rule->pcm_fd && strcmp(event, "add") == 0)
+		for (size_t dir = 0; dir < DIRECTION_COUNT; dir++)
+			if (included[dir])
+				bluealsa_agent_open_pcm_fds(&fds, &device->pcms[dir], bluealsa_direction_prefix[dir]);
 
-			}
-			break;
-		}
+	bluealsa_agent_run_progs(rule, event, device->path, &envvars, first->address, &fds, removed ? NULL : &directives);
+	bluealsa_agent_close_pcm_fds(&fds);
+}
+
+/**
+ * Run the handlers of a rule for all devices with pending events.
+ */
+static void bluealsa_agent_flush_devices(struct bluealsa_agent_rule *rule) {
+	size_t n = rule->devices.count;
+	while (n-- > 0) {
+		struct bluealsa_device_data *device = &rule->devices.data[n];
+
+		switch (device->pending) {
+		case DEVICE_EVENT_NONE:
+			continue;
+		case DEVICE_EVENT_ADD:
+			bluealsa_agent_run_device_event(rule, device, "add");
+			device->announced = true;
+			break;
+		case DEVICE_EVENT_UPDATE:
+			bluealsa_agent_run_device_event(rule, device, "update");
+			break;
+		case DEVICE_EVENT_REMOVE:
+			bluealsa_agent_run_device_event(rule, device, "remove");
+			bluealsa_agent_remove_device_data(rule, n);
+			continue;
+		}
+
+		/* forget PCMs whose removal has now been reported */
+		for (size_t dir = 0; dir < DIRECTION_COUNT; dir++)
+			if (!device->present[dir])
+				memset(&device->pcms[dir], 0, sizeof(device->pcms[dir]));
+		memset(device->changes, 0, sizeof(device->changes));
+		device->device_changes = 0;
+		device->pending = DEVICE_EVENT_NONE;
+	}
+}
+
+static void bluealsa_agent_device_pcm_added(struct bluealsa_agent_rule *rule, const struct bluealsa_pcm_data *pcm_data) {
+	struct bluealsa_device_data *device;
+	const size_t dir = bluealsa_agent_pcm_direction(pcm_data);
+
+	if ((device = bluealsa_agent_find_device_data(rule, pcm_data)) == NULL &&
+			(device = bluealsa_agent_add_device_data(rule, pcm_data)) == NULL) {
+		error("Out of memory");
+		return;
+	}
+
+	device->pcms[dir] = *pcm_data;
+	device->present[dir] = true;
+	if (!device->announced)
+		device->pending = DEVICE_EVENT_ADD;
+	else {
+		device->pending = DEVICE_EVENT_UPDATE;
+		device->device_changes |= BLUEALSA_AGENT_CHANGE_MODE;
+	}
+	bluealsa_agent_set_timeout();
+}
+
+static void bluealsa_agent_device_pcm_removed(struct bluealsa_agent_rule *rule, const struct bluealsa_pcm_data *pcm_data) {
+	struct bluealsa_device_data *device;
+	const size_t dir = bluealsa_agent_pcm_direction(pcm_data);
+
+	if ((device = bluealsa_agent_find_device_data(rule, pcm_data)) == NULL)
+		return;
+
+	device->pcms[dir] = *pcm_data;
+	device->present[dir] = false;
+	device->changes[dir] = 0;
+
+	if (!device->present[DIRECTION_SINK] && !device->present[DIRECTION_SOURCE]) {
+		if (!device->announced) {
+			bluealsa_agent_remove_device_data(rule, device - rule->devices.data);
+			return;
+		}
+		device->pending = DEVICE_EVENT_REMOVE;
+	}
+	else if (device->announced) {
+		device->pending = DEVICE_EVENT_UPDATE;
+		device->device_changes |= BLUEALSA_AGENT_CHANGE_MODE;
+	}
+	else
+		memset(&device->pcms[dir], 0, sizeof(device->pcms[dir]));
+
+	bluealsa_agent_set_timeout();
+}
+
+static void bluealsa_agent_device_pcm_updated(struct bluealsa_agent_rule *rule, const struct bluealsa_pcm_data *pcm_data, unsigned int changes) {
+	struct bluealsa_device_data *device;
+	const size_t dir = bluealsa_agent_pcm_direction(pcm_data);
+
+	if ((device = bluealsa_agent_find_device_data(rule, pcm_data)) == NULL)
+		return;
+
+	device->pcms[dir] = *pcm_data;
+	if (device->pending == DEVICE_EVENT_NONE || device->pending == DEVICE_EVENT_UPDATE) {
+		device->pending = DEVICE_EVENT_UPDATE;
+		device->changes[dir] |= changes;
+	}
+	bluealsa_agent_set_timeout();
+}
+
+static void bluealsa_agent_flush_all_devices(void) {
+	for (size_t n = 0; n < agent.rules_count; n++)
+		bluealsa_agent_flush_devices(&agent.rules[n]);
+}
+
+static void bluealsa_agent_terminated(void) {
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+
+		for (size_t n = 0; n < agent.pcms.count; n++)
+			if (agent.pcms.data[n].rules & (1U << i))
+				for (size_t p = 0; p < rule->plugins_count; p++)
+					bluealsa_agent_plugin_remove(rule->plugins[p], &agent.pcms.data[n].data);
+
+		if (rule->device_events) {
+			for (size_t n = 0; n < rule->devices.count; n++) {
+				struct bluealsa_device_data *device = &rule->devices.data[n];
+				if (device->announced)
+					bluealsa_agent_run_device_event(rule, device, "remove");
+			}
+			continue;
+		}
+
+		for (size_t n = 0; n < agent.pcms.count; n++) {
+			envvars_t envvars;
+			struct bluealsa_agent_pcm *entry = &agent.pcms.data[n];
+			struct bluealsa_pcm_data *pcm_data = &entry->data;
+			if (!(entry->rules & (1U << i)))
+				continue;
+			bluealsa_agent_init_envvars(&envvars, pcm_data);
+			bluealsa_agent_run_progs(rule, "remove", pcm_data->path, &envvars, pcm_data->address, NULL, NULL);
+		}
+	}
+}
+
+/**
+ * Start the supervised service of a rule for a PCM.
+ * @param index the index of the rule, which identifies the service owner.
+ */
+static void bluealsa_agent_supervise(const struct bluealsa_agent_rule *rule, size_t index, const struct bluealsa_pcm_data *pcm_data) {
+	envvars_t envvars;
+	char *envp[ARRAYSIZE(envvars.string)];
+
+	bluealsa_agent_init_envvars(&envvars, pcm_data);
+	bluealsa_agent_status_envvars(rule, &envvars, pcm_data, "", 0);
+	for (size_t n = 0; n < envvars.count; n++)
+		envp[n] = envvars.string[n];
+
+	if (bluealsa_agent_supervisor_start(index, pcm_data->path, rule->supervise, envp, envvars.count, rule->restart) < 0)
+		error("Couldn't start %s for %s", rule->supervise, pcm_data->path);
+}
+
+/**
+ * Select the most preferred of the codecs available to a newly added PCM,
+ * according to the first rule which selects the PCM and has codec
+ * preferences. The codec is not changed if it is already the preferred one.
+ * @return true if the codec has been changed.
+ */
+static bool bluealsa_agent_select_codec(const struct bluealsa_agent_pcm *entry) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	const struct bluealsa_agent_rule *rule = NULL;
+	struct ba_pcm_codecs codecs = { 0 };
+	const char *codec = NULL;
+	bool changed = false;
+
+	for (size_t i = 0; i < agent.rules_count && rule == NULL; i++)
+		if (entry->rules & (1U << i) && agent.rules[i].codecs_count > 0)
+			rule = &agent.rules[i];
+	if (rule == NULL)
+		return false;
+
+	/* the sink and source PCMs of a transport share the same codec, so the
+	 * selection is made only for the first of them to be added */
+	for (size_t n = 0; n < agent.pcms.count; n++) {
+		const struct bluealsa_pcm_data *other = &agent.pcms.data[n].data;
+		if (other != pcm_data &&
+				strcmp(other->device_path, pcm_data->device_path) == 0 &&
+				strcmp(other->transport_type, pcm_data->transport_type) == 0 &&
+				strcmp(other->service, pcm_data->service) == 0)
+			return false;
+	}
+
+	if (bluealsa_client_get_codecs(agent.client, pcm_data->service, pcm_data->path, &codecs) < 0)
+		return false;
+
+	for (size_t n = 0; n < rule->codecs_count && codec == NULL; n++)
+		for (size_t c = 0; c < codecs.codecs_len; c++)
+			if (strcasecmp(rule->codecs[n], codecs.codecs[c].name) == 0) {
+				codec = codecs.codecs[c].name;
+				break;
+			}
+
+	if (codec == NULL)
+		debug("No preferred codec available for %s", pcm_data->path);
+	else if (strcasecmp(codec, pcm_data->codec) == 0)
+		debug("Preferred codec %s already selected for %s", codec, pcm_data->path);
+	else {
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (bluealsa_client_select_codec(agent.client, pcm_data->service, pcm_data->path, codec) == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			info("Selected codec %s for %s in %ld ms", codec, pcm_data->path,
+					(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+			changed = true;
+		}
+	}
+
+	ba_dbus_pcm_codecs_free(&codecs);
+	return changed;
+}
+
+/**
+ * @return the first rule which selects the PCM and has a calibration file,
+ * or NULL if there is none.
+ */
+static const struct bluealsa_agent_rule *bluealsa_agent_calibration_rule(const struct bluealsa_agent_pcm *entry) {
+	for (size_t i = 0; i < agent.rules_count; i++)
+		if (entry->rules & (1U << i) && agent.rules[i].calibration != NULL)
+			return &agent.rules[i];
+	return NULL;
+}
+
+/**
+ * Set the client delay of a PCM to the calibrated value for its device and
+ * current codec, if there is one.
+ */
+static void bluealsa_agent_apply_calibration(struct bluealsa_agent_pcm *entry) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	const struct bluealsa_agent_rule *rule;
+	int16_t delay;
+
+	if ((rule = bluealsa_agent_calibration_rule(entry)) == NULL ||
+			!bluealsa_agent_calibration_lookup(rule->calibration, pcm_data->address, pcm_data->codec, &delay) ||
+			delay == pcm_data->client_delay)
+		return;
+
+	if (bluealsa_client_set_client_delay(agent.client, pcm_data->service, pcm_data->path, delay) == 0) {
+		debug("Set client delay %d for %s (%s)", delay, pcm_data->path, pcm_data->codec);
+		entry->calibration_pending = true;
+		entry->calibration_delay = delay;
+	}
+}
+
+/**
+ * Record a changed client delay in the calibration file, unless the change
+ * is the confirmation of a value set by the agent.
+ */
+static void bluealsa_agent_learn_calibration(struct bluealsa_agent_pcm *entry) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	const struct bluealsa_agent_rule *rule;
+
+	if (entry->calibration_pending) {
+		entry->calibration_pending = false;
+		if (pcm_data->client_delay == entry->calibration_delay)
+			return;
+	}
+
+	if ((rule = bluealsa_agent_calibration_rule(entry)) == NULL || !rule->learn_delay)
+		return;
+
+	if (bluealsa_agent_calibration_store(rule->calibration, pcm_data->address, pcm_data->codec, pcm_data->client_delay) == 0)
+		debug("Learned client delay %d for %s (%s)", pcm_data->client_delay, pcm_data->address, pcm_data->codec);
+}
+
+/**
+ * @return the volume control policy of the first rule which selects the PCM
+ * and has one, for the current codec of the PCM.
+ */
+static enum bluealsa_agent_softvol bluealsa_agent_softvol_policy(const struct bluealsa_agent_pcm *entry) {
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		const struct bluealsa_agent_rule *rule = &agent.rules[i];
+		enum bluealsa_agent_softvol softvol = BLUEALSA_AGENT_SOFTVOL_UNCHANGED;
+		bool codec_match = false;
+
+		if (!(entry->rules & (1U << i)) || rule->softvol_count == 0)
+			continue;
+
+		/* a policy for the codec overrides a policy for all codecs */
+		for (size_t n = 0; n < rule->softvol_count; n++) {
+			const struct bluealsa_agent_softvol_policy *policy = &rule->softvol[n];
+			if (policy->codec[0] == '\0' && !codec_match)
+				softvol = policy->softvol;
+			else if (strcasecmp(policy->codec, entry->data.codec) == 0) {
+				softvol = policy->softvol;
+				codec_match = true;
+			}
+		}
+		return softvol;
+	}
+	return BLUEALSA_AGENT_SOFTVOL_UNCHANGED;
+}
+
+/**
+ * Set the SoftVolume property of a PCM according to the volume control
+ * policy for its current codec. The result is confirmed when the property
+ * change is signalled by the service.
+ */
+static void bluealsa_agent_apply_softvol(struct bluealsa_agent_pcm *entry) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	enum bluealsa_agent_softvol softvol;
+	int ret;
+
+	if ((softvol = bluealsa_agent_softvol_policy(entry)) == BLUEALSA_AGENT_SOFTVOL_UNCHANGED)
+		return;
+
+	if (softvol == BLUEALSA_AGENT_SOFTVOL_AUTO) {
+		/* BlueZ reports volume control support only for A2DP */
+		if (strcmp(pcm_data->transport_type, "A2DP") != 0)
+			return;
+		if ((ret = bluealsa_client_device_has_volume(agent.client, pcm_data->device_path)) < 0)
+			return;
+		softvol = ret ? BLUEALSA_AGENT_SOFTVOL_HARDWARE : BLUEALSA_AGENT_SOFTVOL_SOFTWARE;
+	}
+
+	const bool enabled = softvol == BLUEALSA_AGENT_SOFTVOL_SOFTWARE;
+	if (pcm_data->softvol == enabled)
+		return;
+
+	if (bluealsa_client_set_soft_volume(agent.client, pcm_data->service, pcm_data->path, enabled) == 0) {
+		debug("Set SoftVolume %s for %s (%s)", enabled ? "true" : "false", pcm_data->path, pcm_data->codec);
+		entry->softvol_pending = true;
+		entry->softvol_expected = enabled;
+	}
+}
+
+/**
+ * Check that a SoftVolume change made by the agent has taken effect.
+ */
+static void bluealsa_agent_verify_softvol(struct bluealsa_agent_pcm *entry) {
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+
+	if (!entry->softvol_pending)
+		return;
+	entry->softvol_pending = false;
+
+	if (pcm_data->softvol != entry->softvol_expected)
+		warn("SoftVolume of %s is %s, expected %s", pcm_data->path,
+				pcm_data->softvol ? "true" : "false", entry->softvol_expected ? "true" : "false");
+}
+
+static void bluealsa_agent_pcm_added(const struct ba_pcm *pcm, const char *service, void *data) {
+	(void) data;
+	struct bluealsa_agent_pcm *entry;
+	uint32_t rules = 0;
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		if (bluealsa_agent_filter(&agent.rules[i], pcm, service))
+			rules |= 1U << i;
+
+	if (rules == 0) {
+		bluealsa_recorder_add("add", service, pcm->pcm_path, 0, "filtered");
+		bluealsa_metrics_add(BLUEALSA_METRICS_EVENTS_FILTERED, 1);
+		return;
+	}
+	bluealsa_recorder_add("add", service, pcm->pcm_path, rules, "selected");
+
+	if ((entry = bluealsa_agent_add_pcm_path(pcm, service, rules)) == NULL) {
+		error("Out of memory");
+		return;
+	}
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+
+	uint8_t volume[ARRAYSIZE(pcm->volume)];
+	for (size_t n = 0; n < ARRAYSIZE(volume); n++)
+		volume[n] = pcm->volume[n].raw;
+	bluealsa_agent_state_add(pcm_data, volume);
+	bluealsa_agent_publish(NULL, "add", pcm_data, 0);
+
+	/* the handlers receive the new codec in a following update event, which
+	 * also applies the calibration for that codec */
+	if (!bluealsa_agent_select_codec(entry)) {
+		bluealsa_agent_apply_calibration(entry);
+		bluealsa_agent_apply_softvol(entry);
+	}
+
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		struct bluealsa_agent_directives directives;
+		envvars_t envvars;
+
+		if (!(rules & (1U << i)))
+			continue;
+
+		for (size_t p = 0; p < rule->plugins_count; p++)
+			bluealsa_agent_plugin_add(rule->plugins[p], pcm_data);
+
+		if (rule->supervise != NULL &&
+				(rule->start_on == BLUEALSA_AGENT_START_ON_ADD || pcm_data->running))
+			bluealsa_agent_supervise(rule, i, pcm_data);
+
+		if (rule->bridge.playback != NULL || rule->bridge.capture != NULL)
+			bluealsa_agent_bridge_add(i, &rule->bridge, pcm_data);
+
+		if (rule->device_events) {
+			bluealsa_agent_device_pcm_added(rule, pcm_data);
+			continue;
+		}
+
+		bluealsa_agent_init_envvars(&envvars, pcm_data);
+		bluealsa_agent_status_envvars(rule, &envvars, pcm_data, "", 0);
+
+		struct bluealsa_agent_fds fds = { .count = 0 };
+		if (rule->pcm_fd)
+			bluealsa_agent_open_pcm_fds(&fds, pcm_data, "");
+
+		bluealsa_agent_pcm_directives(&directives, pcm_data);
+		bluealsa_agent_run_progs(rule, "add", pcm->pcm_path, &envvars, pcm_data->address, &fds, &directives);
+		bluealsa_agent_close_pcm_fds(&fds);
+	}
+
+}
+
+static void bluealsa_agent_pcm_removed(const char *path, void *data) {
+	(void) data;
+	const struct bluealsa_agent_pcm *entry;
+
+	if ((entry = bluealsa_agent_find_pcm(path)) == NULL) {
+		bluealsa_recorder_add("remove", NULL, path, 0, "filtered");
+		return;
+	}
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	bluealsa_recorder_add("remove", pcm_data->service, path, entry->rules, "removed");
+
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		envvars_t envvars;
+
+		if (!(entry->rules & (1U << i)))
+			continue;
+
+		for (size_t p = 0; p < rule->plugins_count; p++)
+			bluealsa_agent_plugin_remove(rule->plugins[p], pcm_data);
+
+		if (rule->supervise != NULL)
+			bluealsa_agent_supervisor_stop(i, path);
+
+		if (rule->bridge.playback != NULL || rule->bridge.capture != NULL)
+			bluealsa_agent_bridge_remove(i, pcm_data);
+
+		if (rule->device_events) {
+			bluealsa_agent_device_pcm_removed(rule, pcm_data);
+			continue;
+		}
+
+		bluealsa_agent_init_envvars(&envvars, pcm_data);
+		bluealsa_agent_run_progs(rule, "remove", path, &envvars, pcm_data->address, NULL, NULL);
+	}
+
+	bluealsa_agent_state_remove(path);
+
+	/* published once the PCM has gone, so that a snapshot sent to a client
+	 * that has fallen behind does not include it */
+	const struct bluealsa_pcm_data removed = *pcm_data;
+	bluealsa_agent_remove_pcm_path(path);
+	bluealsa_agent_publish(NULL, "remove", &removed, 0);
+}
+
+static void bluealsa_agent_pcm_updated(const char *path, const char *service, struct bluealsa_pcm_properties *props, void *data) {
+	(void) data;
+	struct bluealsa_agent_pcm *entry;
+	unsigned int changed;
+
+	if (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_VOLUME)
+		bluealsa_agent_state_volume(path, props->volume);
+
+	if ((props->mask & ~(BLUEALSA_PCM_PROPERTY_CHANGED_VOLUME)) == 0)
+		return;
+
+	if ((entry = bluealsa_agent_find_pcm(path)) == NULL ||
+			(changed = bluealsa_agent_update_pcm_data(&entry->data, props)) == 0) {
+		bluealsa_recorder_add("update", service, path, props->mask, "filtered");
+		bluealsa_metrics_add(BLUEALSA_METRICS_EVENTS_FILTERED, 1);
+		return;
+	}
+	const struct bluealsa_pcm_data *pcm_data = &entry->data;
+	bluealsa_recorder_add("update", service, path, changed, "updated");
+	bluealsa_agent_state_update(pcm_data);
+	bluealsa_agent_publish(NULL, "update", pcm_data, changed);
+
+	/* a client delay that changes together with the codec is not a user
+	 * setting, and is replaced by the calibration for the new codec */
+	if (changed & BLUEALSA_AGENT_CHANGE_CODEC) {
+		entry->calibration_pending = false;
+		bluealsa_agent_apply_calibration(entry);
+	}
+	else if (changed & BLUEALSA_AGENT_CHANGE_CLIENT_DELAY)
+		bluealsa_agent_learn_calibration(entry);
+
+	if (changed & BLUEALSA_AGENT_CHANGE_SOFTVOL)
+		bluealsa_agent_verify_softvol(entry);
+	if (changed & BLUEALSA_AGENT_CHANGE_CODEC)
+		bluealsa_agent_apply_softvol(entry);
+
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		struct bluealsa_agent_directives directives;
+		envvars_t envvars;
+		char changes[128] = {0};
+		unsigned int mask;
+
+		if (!(entry->rules & (1U << i)))
+			continue;
+
+		if (rule->supervise != NULL && rule->start_on == BLUEALSA_AGENT_START_ON_RUNNING &&
+				(changed & BLUEALSA_AGENT_CHANGE_RUNNING)) {
+			if (pcm_data->running)
+				bluealsa_agent_supervise(rule, i, pcm_data);
+			else
+				bluealsa_agent_supervisor_stop(i, path);
+		}
+
+		if (rule->bridge.playback != NULL || rule->bridge.capture != NULL)
+			bluealsa_agent_bridge_update(i, pcm_data, changed);
+
+		if ((mask = bluealsa_agent_rule_changes(rule, i, entry, changed)) == 0)
+			continue;
+
+		for (size_t p = 0; p < rule->plugins_count; p++)
+			bluealsa_agent_plugin_update(rule->plugins[p], pcm_data, mask);
+
+		if (rule->device_events) {
+			bluealsa_agent_device_pcm_updated(rule, pcm_data, mask);
+			continue;
+		}
+
+		bluealsa_agent_init_envvars(&envvars, pcm_data);
+		bluealsa_agent_status_envvars(rule, &envvars, pcm_data, "", mask);
+
+		bluealsa_agent_format_changes(changes, sizeof(changes), mask, NULL);
+		bluealsa_agent_add_envvar(&envvars, "BLUEALSA_PCM_PROPERTY_CHANGES=%s", changes);
+
+		bluealsa_agent_pcm_directives(&directives, pcm_data);
+		bluealsa_agent_run_progs(rule, "update", path, &envvars, pcm_data->address, NULL, &directives);
+	}
+
+}
+
+static char *bluealsa_agent_trim(char *str) {
+	char *end;
+	while (*str == ' ' || *str == '\t')
+		str++;
+	end = str + strlen(str);
+	while (end > str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		*--end = '\0';
+	return str;
+}
+
+/* The directives received from one handler, the last value of each wins */
+struct bluealsa_agent_directive_batch {
+	int16_t client_delay;
+	bool softvol;
+	char codec[16];
+	bool has_client_delay;
+	bool has_softvol;
+};
+
+static bool bluealsa_agent_parse_directive(struct bluealsa_agent_directive_batch *batch, const char *name, const char *value) {
+	if (strcmp(name, "ClientDelay") == 0) {
+		char *end;
+		errno = 0;
+		long delay = strtol(value, &end, 10);
+		if (errno != 0 || end == value || *end != '\0' || delay < INT16_MIN || delay > INT16_MAX)
+			return false;
+		batch->client_delay = delay;
+		batch->has_client_delay = true;
+		return true;
+	}
+	if (strcmp(name, "SoftVolume") == 0) {
+		if (strcmp(value, "true") == 0)
+			batch->softvol = true;
+		else if (strcmp(value, "false") == 0)
+			batch->softvol = false;
+		else
+			return false;
+		batch->has_softvol = true;
+		return true;
+	}
+	if (strcmp(name, "Codec") == 0) {
+		if (value[0] == '\0' || strlen(value) >= sizeof(batch->codec))
+			return false;
+		strcpy(batch->codec, value);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Parse the directives received on a channel and apply them to the target
+ * PCMs. The codec is selected first because doing so may reset the other
+ * properties.
+ */
+static void bluealsa_agent_apply_directives(struct bluealsa_agent_channel *channel) {
+	const struct bluealsa_agent_directives *target = &channel->target;
+	struct bluealsa_agent_directive_batch batches[DIRECTION_COUNT] = { 0 };
+	char *line, *saveptr;
+
+	if (channel->overflow)
+		warn("Directives too long, some have been ignored");
+
+	channel->buffer[channel->len] = '\0';
+	for (line = strtok_r(channel->buffer, "\n", &saveptr); line != NULL;
+			line = strtok_r(NULL, "\n", &saveptr)) {
+		size_t dir = 0;
+		char *name = bluealsa_agent_trim(line);
+		char *value;
+
+		if (name[0] == '\0' || name[0] == '#')
+			continue;
+
+		if ((value = strchr(name, '=')) == NULL)
+			goto invalid;
+		*value++ = '\0';
+
+		if (target->device) {
+			for (dir = 0; dir < DIRECTION_COUNT; dir++) {
+				const size_t len = strlen(bluealsa_direction_prefix[dir]);
+				if (strncmp(name, bluealsa_direction_prefix[dir], len) == 0) {
+					name += len;
+					break;
+				}
+			}
+			if (dir == DIRECTION_COUNT)
+				goto invalid;
+		}
+
+		if (target->paths[dir][0] == '\0') {
+			warn("Directive for absent PCM ignored: %s", name);
+			continue;
+		}
+
+		if (bluealsa_agent_parse_directive(&batches[dir], name, bluealsa_agent_trim(value)))
+			continue;
+
+invalid:
+		warn("Invalid directive: %s", name);
+	}
+
+	for (size_t dir = 0; dir < DIRECTION_COUNT; dir++) {
+		const struct bluealsa_agent_directive_batch *batch = &batches[dir];
+		const char *path = target->paths[dir];
+
+		if (batch->codec[0] != '\0')
+			bluealsa_client_select_codec(agent.client, target->service, path, batch->codec);
+		if (batch->has_softvol)
+			bluealsa_client_set_soft_volume(agent.client, target->service, path, batch->softvol);
+		if (batch->has_client_delay)
+			bluealsa_client_set_client_delay(agent.client, target->service, path, batch->client_delay);
+	}
+}
+
+/**
+ * Read pending input from a directives channel.
+ * @return true if the handler has closed the channel.
+ */
+static bool bluealsa_agent_read_channel(struct bluealsa_agent_channel *channel) {
+	char discard[256];
+
+	for (;;) {
+		ssize_t len;
+		if (channel->len < sizeof(channel->buffer) - 1)
+			len = read(channel->fd, channel->buffer + channel->len, sizeof(channel->buffer) - 1 - channel->len);
+		else if ((len = read(channel->fd, discard, sizeof(discard))) > 0)
+			channel->overflow = true;
+
+		if (len == 0)
+			return true;
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno != EAGAIN;
+		}
+		if (!channel->overflow)
+			channel->len += len;
+	}
+}
+
+/**
+ * Fetch the properties of a newly connected device, and pre-spawn the
+ * handlers of the rules with --prewarm that select it, so that they are
+ * ready for the PCMs that are expected to follow.
+ */
+static void bluealsa_agent_device_connected(const char *path) {
+	struct bluealsa_client_device device = { .path = path };
+	struct bluealsa_agent_device *cached;
+
+	if (strlen(path) >= sizeof(cached->path) ||
+			bluealsa_client_get_device(agent.client, &device) < 0)
+		return;
+
+	if ((cached = bluealsa_agent_find_device(path)) == NULL) {
+		if (agent.devices.count == agent.devices.capacity) {
+			const size_t new_size = agent.devices.capacity + 4;
+			if ((cached = realloc(agent.devices.data, new_size * sizeof(*cached))) == NULL)
+				return;
+			agent.devices.data = cached;
+			agent.devices.capacity = new_size;
+		}
+		cached = &agent.devices.data[agent.devices.count++];
+		strcpy(cached->path, path);
+	}
+	memcpy(cached->address, device.hex_addr, sizeof(cached->address));
+	memcpy(cached->alias, device.alias, sizeof(cached->alias));
+
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		const struct bluealsa_agent_rule *rule = &agent.rules[i];
+		if (rule->prewarm == 0 || !bluealsa_agent_address_match(rule, cached->address))
+			continue;
+		for (size_t n = 0; n < rule->prog_count; n++)
+			if (bluealsa_agent_prewarm_spawn(i, cached->address, rule->progs[n], rule->sched, rule->prewarm) < 0)
+				warn("Couldn't pre-spawn %s for %s", rule->progs[n], cached->address);
+	}
+}
+
+static void bluealsa_agent_device_disconnected(const char *path) {
+	struct bluealsa_agent_device *cached;
+	if ((cached = bluealsa_agent_find_device(path)) == NULL)
+		return;
+	bluealsa_agent_prewarm_discard(cached->address);
+	if (--agent.devices.count > (size_t)(cached - agent.devices.data))
+		memcpy(cached, &agent.devices.data[agent.devices.count], sizeof(*cached));
+}
+
+static void bluealsa_agent_device_updated(const char *path, struct bluealsa_device_properties *props, void *data) {
+	(void) data;
+	struct bluealsa_agent_device *cached;
+
+	if (props->mask & BLUEALSA_DEVICE_PROPERTY_CHANGED_CONNECTED) {
+		if (props->connected)
+			bluealsa_agent_device_connected(path);
+		else
+			bluealsa_agent_device_disconnected(path);
+	}
+	else if (props->mask & BLUEALSA_DEVICE_PROPERTY_CHANGED_ALIAS &&
+			(cached = bluealsa_agent_find_device(path)) != NULL)
+		memcpy(cached->alias, props->alias, sizeof(cached->alias));
+}
+
+static int bluealsa_agent_init_client(const char *replay) {
+	int ret;
+	struct bluealsa_client_callbacks callbacks = {
+		bluealsa_agent_pcm_added,
+		bluealsa_agent_pcm_removed,
+		bluealsa_agent_pcm_updated,
+		NULL,
+		bluealsa_agent_device_updated,
+		NULL,
+	};
+	if (replay != NULL) {
+		if ((ret = bluealsa_client_open_replay(&agent.client, &callbacks, replay)) < 0) {
+			error("Unable to replay %s (%s)", replay, strerror(-ret));
+			return ret;
+		}
+	}
+	else if ((ret = bluealsa_client_open(&agent.client, &callbacks)) < 0) {
+		error("Unable to open bluealsa interface (%s)", strerror(-ret));
+		return ret;
+	}
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		if (agent.rules[i].prewarm > 0) {
+			if ((ret = bluealsa_client_watch_devices(agent.client)) < 0)
+				return ret;
+			break;
+		}
+
+	return 0;
+}
+
+static void bluealsa_agent_reap_children(void) {
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		bluealsa_trace(BLUEALSA_TRACE_REAPED, pid);
+		bluealsa_agent_supervisor_reaped(pid, status);
+		bluealsa_agent_prewarm_reaped(pid);
+		bluealsa_metrics_handler_reaped(pid, status);
+		bluealsa_agent_channel_reaped(pid);
+	}
+}
+
+static void bluealsa_agent_replay_flush(void) {
+	agent.timeout = -1;
+	bluealsa_client_replay_commit_begin(agent.client);
+	bluealsa_agent_flush_all_devices();
+	bluealsa_client_replay_commit_end(agent.client);
+}
+
+/**
+ * Dispatch all the events of the trace being replayed, and flush the device
+ * events whenever the recorded events pause for longer than the device
+ * timeout, as the main loop would have done.
+ * @return 0 on success, negative error code otherwise.
+ */
+static int bluealsa_agent_replay(void) {
+	uint64_t time, last = 0;
+	int ret;
+
+	while ((ret = bluealsa_client_replay_next(agent.client, &time)) > 0) {
+		if (agent.timeout != -1 && time - last >= (uint64_t)agent.timeout * 1000)
+			bluealsa_agent_replay_flush();
+		last = time;
+		if ((ret = bluealsa_client_replay_dispatch(agent.client)) < 0)
+			break;
+		bluealsa_agent_reap_children();
+	}
+	if (ret < 0) {
+		error("Invalid replay trace (%s)", strerror(-ret));
+		return ret;
+	}
+
+	if (agent.timeout != -1)
+		bluealsa_agent_replay_flush();
+
+	bluealsa_client_replay_report(agent.client, stdout);
+	return 0;
+}
+
+static void bluealsa_agent_reload(void) {
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		if (!rule->program_is_dir)
+			continue;
+
+		info("Reloading commands from '%s'", rule->program);
+		for (size_t n = 0; n < rule->prog_count; n++)
+			free(rule->progs[n]);
+		free(rule->progs);
+		rule->progs = NULL;
+		rule->prog_count = 0;
+		bluealsa_agent_get_progs(rule);
+	}
+}
+
+static void bluealsa_agent_rule_init(struct bluealsa_agent_rule *rule, const char *name) {
+	memset(rule, 0, sizeof(*rule));
+	if (name != NULL)
+		rule->name = strdup(name);
+	rule->services = malloc(sizeof(char*));
+	rule->services[0] = strdup(BLUEALSA_SERVICE);
+	rule->services_count = 1;
+	bluealsa_agent_bridge_config_init(&rule->bridge);
+}
+
+/**
+ * @return true if the rule runs a supervised service or an audio bridge, or
+ * has codec preferences, a calibration file or a volume control policy.
+ */
+static bool bluealsa_agent_rule_has_builtin_action(const struct bluealsa_agent_rule *rule) {
+	return rule->supervise != NULL || rule->bridge.playback != NULL || rule->bridge.capture != NULL ||
+		rule->codecs_count > 0 || rule->calibration_path != NULL || rule->softvol_count > 0;
+}
+
+/**
+ * Append a new rule to the agent rules array.
+ * @param name the rule name, or NULL.
+ * @return pointer to the new rule, or NULL on error.
+ */
+static struct bluealsa_agent_rule *bluealsa_agent_add_rule(const char *name) {
+	struct bluealsa_agent_rule *rules;
+
+	if (agent.rules_count == BLUEALSA_AGENT_MAX_RULES) {
+		error("Too many rules (maximum %d)", BLUEALSA_AGENT_MAX_RULES);
+		return NULL;
+	}
+	if ((rules = realloc(agent.rules, (agent.rules_count + 1) * sizeof(*rules))) == NULL) {
+		error("Out of memory");
+		return NULL;
+	}
+	agent.rules = rules;
+
+	bluealsa_agent_rule_init(&agent.rules[agent.rules_count], name);
+	return &agent.rules[agent.rules_count++];
+}
+
+/**
+ * Apply a rule option, given either on the command line or in a config file.
+ * @param rule the rule to be modified.
+ * @param opt the short option character.
+ * @param arg the option argument, may be NULL.
+ * @return true if successful, false if the argument is invalid.
+ */
+static bool bluealsa_agent_rule_option(struct bluealsa_agent_rule *rule, int opt, char *arg) {
+	switch (opt) {
+	case 'p' /* --profile=[a2dp|asha|sco] */ : {
+		if (strcmp(arg, "a2dp") == 0)
+			rule->profiles |= PROFILE_A2DP;
+		else if (strcmp(arg, "asha") == 0)
+			rule->profiles |= PROFILE_ASHA;
+		else if (strcmp(arg, "sco") == 0)
+			rule->profiles |= PROFILE_SCO;
+		else {
+			fprintf(stderr, "Invalid profile (%s)\n", arg);
+			return false;
+		}
+		break;
+	}
+
+	case 'm' /* --mode=[sink|source] */ : {
+		if (strcmp(arg, "sink") == 0)
+			rule->mode = MODE_SINK;
+		else if (strcmp(arg, "source") == 0)
+			rule->mode = MODE_SOURCE;
+		else {
+			fprintf(stderr, "Invalid mode (%s)\n", arg);
+			return false;
+		}
+		break;
+	}
+
+	case 'B' /* --dbus=NAME */ : {
+		char service[32];
+		snprintf(service, sizeof(service), BLUEALSA_SERVICE ".%s", arg);
+		rule->services = realloc(rule->services, (rule->services_count + 1) * sizeof(char*));
+		rule->services[rule->services_count++] = strdup(service);
+		break;
+	}
+
+	case 's' /* --status[=PROPLIST] */ : {
+		char running[] = "Running";
+		if (arg == NULL)
+			arg = running;
+
+		for (char *prop = strtok(arg, ","); prop; prop = strtok(NULL, ",")) {
+
+			char *threshold = strchr(prop, ':');
+			if (threshold != NULL)
+				*threshold++ = '\0';
+
+			bool found = false;
+			for (size_t i = 0; i < ARRAYSIZE(bluealsa_properties); i++) {
+				if (strcasecmp(prop, bluealsa_properties[i].name) == 0) {
+					rule->properties |= (1 << i);
+					found = true;
+					if (threshold != NULL) {
+						char *endptr;
+						unsigned long value = strtoul(threshold, &endptr, 10);
+						if (!bluealsa_properties[i].numeric || *threshold == '\0' ||
+								*endptr != '\0' || value > UINT16_MAX) {
+							fprintf(stderr, "Invalid threshold for property '%s'\n", prop);
+							return false;
+						}
+						rule->thresholds[i] = value;
+					}
+					break;
+				}
+			}
+
+			if (!found) {
+				fprintf(stderr, "Unknown property '%s'\n", prop);
+				return false;
+			}
+
+		}
+		break;
+	}
+
+	case 'd' /* --device-events */ :
+		rule->device_events = true;
+		break;
+
+	case 'D' /* --directives */ :
+		rule->directives = true;
+		break;
+
+	case 'S' /* --supervise=COMMAND */ :
+		if (arg[0] != '/') {
+			fprintf(stderr, "Service command must be an absolute path: %s\n", arg);
+			return false;
+		}
+		free(rule->supervise);
+		rule->supervise = strdup(arg);
+		break;
+
+	case BLUEALSA_AGENT_OPT_START_ON /* --start-on=[add|running] */ :
+		if (strcasecmp(arg, "add") == 0)
+			rule->start_on = BLUEALSA_AGENT_START_ON_ADD;
+		else if (strcasecmp(arg, "running") == 0)
+			rule->start_on = BLUEALSA_AGENT_START_ON_RUNNING;
+		else {
+			fprintf(stderr, "Invalid start event: %s\n", arg);
+			return false;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_BRIDGE_PLAYBACK /* --bridge-playback=DEVICE */ :
+		free(rule->bridge.playback);
+		rule->bridge.playback = strdup(arg);
+		break;
+
+	case BLUEALSA_AGENT_OPT_BRIDGE_CAPTURE /* --bridge-capture=DEVICE */ :
+		free(rule->bridge.capture);
+		rule->bridge.capture = strdup(arg);
+		break;
+
+	case BLUEALSA_AGENT_OPT_BRIDGE_LATENCY /* --bridge-latency=CODEC:MS[,...] */ :
+		if (!bluealsa_agent_bridge_parse_latency(&rule->bridge, arg)) {
+			fprintf(stderr, "Invalid bridge latency: %s\n", arg);
+			return false;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_ADDRESS /* --address=BDADDR */ : {
+		bdaddr_t addr;
+		if (strlen(arg) != 17 || str2ba(arg, &addr) != 0) {
+			fprintf(stderr, "Invalid Bluetooth address: %s\n", arg);
+			return false;
+		}
+		rule->addresses = realloc(rule->addresses, (rule->addresses_count + 1) * sizeof(char*));
+		rule->addresses[rule->addresses_count++] = strdup(arg);
+		break;
+	}
+
+	case BLUEALSA_AGENT_OPT_PREFER_CODECS /* --prefer-codecs=CODEC[,CODEC]... */ :
+		for (char *codec = strtok(arg, ","); codec; codec = strtok(NULL, ",")) {
+			rule->codecs = realloc(rule->codecs, (rule->codecs_count + 1) * sizeof(char*));
+			rule->codecs[rule->codecs_count++] = strdup(codec);
+		}
+		if (rule->codecs_count == 0) {
+			fprintf(stderr, "Invalid codec list: %s\n", arg);
+			return false;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_CALIBRATION /* --calibration=FILE */ :
+		free(rule->calibration_path);
+		rule->calibration_path = strdup(arg);
+		break;
+
+	case BLUEALSA_AGENT_OPT_LEARN_DELAY /* --learn-delay */ :
+		rule->learn_delay = true;
+		break;
+
+	case BLUEALSA_AGENT_OPT_SOFT_VOLUME /* --soft-volume=[CODEC:]POLICY[,...] */ :
+		for (char *item = strtok(arg, ","); item; item = strtok(NULL, ",")) {
+			struct bluealsa_agent_softvol_policy policy = { 0 };
+			char *value;
+
+			if ((value = strchr(item, ':')) != NULL) {
+				*value++ = '\0';
+				if (item[0] == '\0' || strlen(item) >= sizeof(policy.codec)) {
+					fprintf(stderr, "Invalid codec: %s\n", item);
+					return false;
+				}
+				strcpy(policy.codec, item);
+			}
+			else
+				value = item;
+
+			if (strcasecmp(value, "auto") == 0)
+				policy.softvol = BLUEALSA_AGENT_SOFTVOL_AUTO;
+			else if (strcasecmp(value, "software") == 0)
+				policy.softvol = BLUEALSA_AGENT_SOFTVOL_SOFTWARE;
+			else if (strcasecmp(value, "hardware") == 0)
+				policy.softvol = BLUEALSA_AGENT_SOFTVOL_HARDWARE;
+			else {
+				fprintf(stderr, "Invalid volume control policy: %s\n", value);
+				return false;
+			}
+
+			rule->softvol = realloc(rule->softvol, (rule->softvol_count + 1) * sizeof(*rule->softvol));
+			rule->softvol[rule->softvol_count++] = policy;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_RESTART /* --restart=[no|on-failure|always] */ :
+		if (strcasecmp(arg, "no") == 0)
+			rule->restart = BLUEALSA_AGENT_RESTART_NO;
+		else if (strcasecmp(arg, "on-failure") == 0)
+			rule->restart = BLUEALSA_AGENT_RESTART_ON_FAILURE;
+		else if (strcasecmp(arg, "always") == 0)
+			rule->restart = BLUEALSA_AGENT_RESTART_ALWAYS;
+		else {
+			fprintf(stderr, "Invalid restart policy: %s\n", arg);
+			return false;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_HANDLER_CPUS /* --handler-cpus=CPULIST */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_NICE /* --handler-nice=N */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_SCHED /* --handler-sched=[other|batch|idle] */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_IOPRIO /* --handler-ioprio=CLASS[:LEVEL] */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_CGROUP /* --handler-cgroup=PATH */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_CPU_WEIGHT /* --handler-cpu-weight=N */ :
+	case BLUEALSA_AGENT_OPT_HANDLER_MEMORY_MAX /* --handler-memory-max=BYTES */ :
+		if (!bluealsa_agent_sched_parse(&rule->sched, opt - BLUEALSA_AGENT_OPT_HANDLER_CPUS + BLUEALSA_AGENT_SCHED_CPUS, arg)) {
+			fprintf(stderr, "Invalid handler scheduling setting: %s\n", arg);
+			return false;
+		}
+		break;
+
+	case BLUEALSA_AGENT_OPT_PREWARM /* --prewarm=SECONDS */ : {
+		char *end;
+		const unsigned long seconds = strtoul(arg, &end, 10);
+		if (end == arg || *end != '\0' || seconds < 1 || seconds > 3600) {
+			fprintf(stderr, "Invalid pre-spawn timeout: %s\n", arg);
+			return false;
+		}
+		rule->prewarm = seconds * 1000;
+		break;
+	}
+
+	case BLUEALSA_AGENT_OPT_PCM_FD /* --pcm-fd */ :
+		rule->pcm_fd = true;
+		break;
+
+	case 'P' /* --plugin=NAME[:ARGS] */ :
+		rule->plugin_specs = realloc(rule->plugin_specs, (rule->plugins_count + 1) * sizeof(char*));
+		rule->plugin_specs[rule->plugins_count++] = strdup(arg);
+		break;
+	}
+
+	return true;
+}
+
+static const struct option bluealsa_agent_longopts[] = {
+	{ "help", no_argument, NULL, 'h' },
+	{ "version", no_argument, NULL, 'V' },
+	{ "config", required_argument, NULL, 'c' },
+	{ "profile", required_argument, NULL, 'p' },
+	{ "mode", required_argument, NULL, 'm' },
+	{ "dbus", required_argument, NULL, 'B'},
+	{ "status", optional_argument, NULL, 's' },
+	{ "device-events", no_argument, NULL, 'd' },
+	{ "directives", no_argument, NULL, 'D' },
+	{ "supervise", required_argument, NULL, 'S' },
+	{ "start-on", required_argument, NULL, BLUEALSA_AGENT_OPT_START_ON },
+	{ "restart", required_argument, NULL, BLUEALSA_AGENT_OPT_RESTART },
+	{ "bridge-playback", required_argument, NULL, BLUEALSA_AGENT_OPT_BRIDGE_PLAYBACK },
+	{ "bridge-capture", required_argument, NULL, BLUEALSA_AGENT_OPT_BRIDGE_CAPTURE },
+	{ "bridge-latency", required_argument, NULL, BLUEALSA_AGENT_OPT_BRIDGE_LATENCY },
+	{ "address", required_argument, NULL, BLUEALSA_AGENT_OPT_ADDRESS },
+	{ "prefer-codecs", required_argument, NULL, BLUEALSA_AGENT_OPT_PREFER_CODECS },
+	{ "calibration", required_argument, NULL, BLUEALSA_AGENT_OPT_CALIBRATION },
+	{ "learn-delay", no_argument, NULL, BLUEALSA_AGENT_OPT_LEARN_DELAY },
+	{ "soft-volume", required_argument, NULL, BLUEALSA_AGENT_OPT_SOFT_VOLUME },
+	{ "handler-cpus", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_CPUS },
+	{ "handler-nice", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_NICE },
+	{ "handler-sched", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_SCHED },
+	{ "handler-ioprio", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_IOPRIO },
+	{ "handler-cgroup", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_CGROUP },
+	{ "handler-cpu-weight", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_CPU_WEIGHT },
+	{ "handler-memory-max", required_argument, NULL, BLUEALSA_AGENT_OPT_HANDLER_MEMORY_MAX },
+	{ "prewarm", required_argument, NULL, BLUEALSA_AGENT_OPT_PREWARM },
+	{ "pcm-fd", no_argument, NULL, BLUEALSA_AGENT_OPT_PCM_FD },
+	{ "state-file", required_argument, NULL, BLUEALSA_AGENT_OPT_STATE_FILE },
+	{ "event-socket", required_argument, NULL, BLUEALSA_AGENT_OPT_EVENT_SOCKET },
+	{ "metrics-file", required_argument, NULL, BLUEALSA_AGENT_OPT_METRICS_FILE },
+	{ "recorder-file", required_argument, NULL, BLUEALSA_AGENT_OPT_RECORDER_FILE },
+	{ "trace-file", required_argument, NULL, BLUEALSA_AGENT_OPT_TRACE_FILE },
+	{ "bus-address", required_argument, NULL, BLUEALSA_AGENT_OPT_BUS_ADDRESS },
+	{ "record", required_argument, NULL, BLUEALSA_AGENT_OPT_RECORD },
+	{ "replay", required_argument, NULL, BLUEALSA_AGENT_OPT_REPLAY },
+	{ "plugin", required_argument, NULL, 'P' },
+	{ 0, 0, 0, 0 },
+};
+
+/**
+ * Read rules from a config file.
+ * Each rule is a section headed "[name]", containing lines of the form
+ * "option=value" or "option", where option is the long name of a rule
+ * command line option, or "program". Each rule must have a program or at
+ * least one plugin.
+ * @param path the config file path.
+ * @return true if successful, false on error.
+ */
+static bool bluealsa_agent_read_config(const char *path) {
+	struct bluealsa_agent_rule *rule = NULL;
+	unsigned int lineno = 0;
+	char buffer[512];
+	bool ret = false;
+	FILE *file;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		error("Cannot open config file '%s' (%s)", path, strerror(errno));
+		return false;
+	}
+
+	while (fgets(buffer, sizeof(buffer), file) != NULL) {
+		const struct option *option;
+		char *line, *value;
+
+		lineno++;
+		line = bluealsa_agent_trim(buffer);
+		if (line[0] == '\0' || line[0] == '#' || line[0] == ';')
+			continue;
+
+		if (line[0] == '[') {
+			char *end = strchr(line, ']');
+			if (end == NULL || end[1] != '\0') {
+				error("%s:%u: Invalid section header", path, lineno);
+				goto fail;
+			}
+			*end = '\0';
+			if ((rule = bluealsa_agent_add_rule(bluealsa_agent_trim(line + 1))) == NULL)
+				goto fail;
+			continue;
+		}
+
+		if (rule == NULL) {
+			error("%s:%u: Option outside of a rule section", path, lineno);
+			goto fail;
+		}
+
+		if ((value = strchr(line, '=')) != NULL) {
+			*value = '\0';
+			value = bluealsa_agent_trim(value + 1);
+		}
+		line = bluealsa_agent_trim(line);
+
+		if (strcmp(line, "program") == 0) {
+			if (value == NULL || value[0] == '\0') {
+				error("%s:%u: Missing program path", path, lineno);
+				goto fail;
+			}
+			free(rule->program);
+			rule->program = strdup(value);
+			continue;
+		}
+
+		for (option = bluealsa_agent_longopts; option->name != NULL; option++)
+			if (strcmp(line, option->name) == 0)
+				break;
+		if (option->name == NULL || option->val == 'h' || option->val == 'V' || option->val == 'c') {
+			error("%s:%u: Unknown option '%s'", path, lineno, line);
+			goto fail;
+		}
+		if ((option->has_arg == required_argument && value == NULL) ||
+				(option->has_arg == no_argument && value != NULL)) {
+			error("%s:%u: Invalid use of option '%s'", path, lineno, line);
+			goto fail;
+		}
+
+		if (!bluealsa_agent_rule_option(rule, option->val, value)) {
+			error("%s:%u: Invalid value for option '%s'", path, lineno, line);
+			goto fail;
+		}
+	}
+
+	for (size_t n = 0; n < agent.rules_count; n++) {
+		if (agent.rules[n].program == NULL && agent.rules[n].plugins_count == 0 &&
+				!bluealsa_agent_rule_has_builtin_action(&agent.rules[n])) {
+			error("%s: No program, plugin, service, bridge or PCM policy specified for rule [%s]", path, agent.rules[n].name ? agent.rules[n].name : "");
+			goto fail;
+		}
+	}
+
+	ret = true;
+
+fail:
+	fclose(file);
+	return ret;
+}
+
+int main(int argc, char *argv[]) {
+
+	struct bluealsa_agent_rule cmdline;
+	bool cmdline_options = false;
+	const char *config = NULL;
+	const char *state_file = NULL;
+	const char *event_socket = NULL;
+	const char *metrics_file = NULL;
+	const char *recorder_file = NULL;
+	const char *trace_file = NULL;
+	const char *record = NULL;
+	const char *replay = NULL;
+
+	bluealsa_agent_rule_init(&cmdline, NULL);
+
+	int opt;
+	const char *opts = "hVc:p:m:B:s::dDP:S:";
+
+	while ((opt = getopt_long(argc, argv, opts, bluealsa_agent_longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h' /* --help */ :
+			printf("%1$s - Utility to run BlueALSA event handler\n"
+					"\nUsage:\n"
+					"  %1$s [OPTION]... PROGRAM\n"
+					"  %1$s [OPTION]... --plugin=NAME[:ARGS] [PROGRAM]\n"
+					"  %1$s [OPTION]... --supervise=COMMAND [PROGRAM]\n"
+					"  %1$s --config=FILE [[OPTION]... PROGRAM]\n"
+					"\nOptions:\n"
+					"  -h, --help\t\t\tprint this help and exit\n"
+					"  -V, --version\t\t\tprint version and exit\n"
+					"  -c, --config=FILE\t\tread rule sets from FILE\n"
+					"      --state-file=FILE\tmirror PCM state in FILE\n"
+					"      --event-socket=PATH\tsend PCM events to clients of PATH\n"
+					"      --metrics-file=FILE\twrite metrics to FILE\n"
+					"      --recorder-file=FILE\twrite recorded events to FILE on SIGUSR1\n"
+					"      --trace-file=FILE\ttoggle tracing to FILE on SIGUSR2\n"
+					"      --bus-address=ADDRESS\tuse D-Bus server ADDRESS, not the system bus\n"
+					"      --record=FILE\t\trecord the BlueALSA events to FILE\n"
+					"      --replay=FILE\t\treplay the events of FILE and exit\n"
+					"  -p, --profile=[a2dp|asha|sco]\tselect only given profile\n"
+					"  -m, --mode=[sink|source]\tselect only given mode\n"
+					"      --address=BDADDR\t\tselect only given device\n"
+					"  -B, --dbus=NAME\t\tBlueALSA service name suffix\n"
+					"  -s, --status[=PROPLIST]\thandle status change events\n"
+					"  -d, --device-events\t\tone event per device, not per PCM\n"
+					"  -D, --directives\t\taccept directives from PROGRAM\n"
+					"  -P, --plugin=NAME[:ARGS]\trun plugin in the agent process\n"
+					"  -S, --supervise=COMMAND\trun COMMAND as a service for each PCM\n"
+					"      --start-on=[add|running]\tstart service on PCM add or running\n"
+					"      --restart=[no|on-failure|always]\n"
+					"\t\t\t\trestart service when it exits\n"
+					"      --bridge-playback=DEVICE\tplay audio from source PCMs on DEVICE\n"
+					"      --bridge-capture=DEVICE\tsend audio from DEVICE to sink PCMs\n"
+					"      --bridge-latency=CODEC:MS[,CODEC:MS]...\n"
+					"\t\t\t\tset bridge target latency\n"
+					"      --prefer-codecs=CODEC[,CODEC]...\n"
+					"\t\t\t\tselect first available codec on PCM add\n"
+					"      --calibration=FILE\tset client delay of PCMs from FILE\n"
+					"      --learn-delay\t\tsave client delay changes to FILE\n"
+					"      --soft-volume=[CODEC:]POLICY[,[CODEC:]POLICY]...\n"
+					"\t\t\t\tset volume control to auto|software|hardware\n"
+					"      --handler-cpus=CPULIST\trun PROGRAM on given CPUs only\n"
+					"      --handler-nice=N\t\trun PROGRAM with nice value N\n"
+					"      --handler-sched=[other|batch|idle]\n"
+					"\t\t\t\trun PROGRAM with given scheduling policy\n"
+					"      --handler-ioprio=[idle|best-effort[:N]|realtime[:N]]\n"
+					"\t\t\t\trun PROGRAM with given I/O priority\n"
+					"      --handler-cgroup=PATH\trun PROGRAM in given cgroup\n"
+					"      --handler-cpu-weight=N\tset cpu.weight of handler cgroup\n"
+					"      --handler-memory-max=BYTES\n"
+					"\t\t\t\tset memory.max of handler cgroup\n"
+					"      --prewarm=SECONDS\tstart PROGRAM when device connects\n"
+					"      --pcm-fd\t\t\topen added PCMs for PROGRAM\n"
+					"\n  The options --profile, --address, --dbus and --plugin may be given "
+					"more than once to select multiple profiles, devices, services and/or plugins\n"
+					"\nPROGRAM:\n"
+					"  absolute path to program, or directory of programs, to "
+					"be run when a BlueALSA event occurs\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+
+		case 'V' /* --version */ :
+			printf("%s\n", PACKAGE_VERSION);
+			return EXIT_SUCCESS;
+
+		case 'c' /* --config=FILE */ :
+			config = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_STATE_FILE /* --state-file=FILE */ :
+			state_file = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_EVENT_SOCKET /* --event-socket=PATH */ :
+			event_socket = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_METRICS_FILE /* --metrics-file=FILE */ :
+			metrics_file = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_RECORDER_FILE /* --recorder-file=FILE */ :
+			recorder_file = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_TRACE_FILE /* --trace-file=FILE */ :
+			trace_file = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_BUS_ADDRESS /* --bus-address=ADDRESS */ :
+			ba_dbus_set_bus_address(optarg);
+			break;
+
+		case BLUEALSA_AGENT_OPT_RECORD /* --record=FILE */ :
+			record = optarg;
+			break;
+
+		case BLUEALSA_AGENT_OPT_REPLAY /* --replay=FILE */ :
+			replay = optarg;
+			break;
+
+		case 'p' /* --profile=[a2dp|asha|sco] */ :
+		case 'm' /* --mode=[sink|source] */ :
+		case 'B' /* --dbus=NAME */ :
+		case 's' /* --status[=PROPLIST] */ :
+		case 'd' /* --device-events */ :
+		case 'D' /* --directives */ :
+		case 'P' /* --plugin=NAME[:ARGS] */ :
+		case 'S' /* --supervise=COMMAND */ :
+		case BLUEALSA_AGENT_OPT_START_ON /* --start-on=[add|running] */ :
+		case BLUEALSA_AGENT_OPT_RESTART /* --restart=[no|on-failure|always] */ :
+		case BLUEALSA_AGENT_OPT_BRIDGE_PLAYBACK /* --bridge-playback=DEVICE */ :
+		case BLUEALSA_AGENT_OPT_BRIDGE_CAPTURE /* --bridge-capture=DEVICE */ :
+		case BLUEALSA_AGENT_OPT_BRIDGE_LATENCY /* --bridge-latency=CODEC:MS[,...] */ :
+		case BLUEALSA_AGENT_OPT_ADDRESS /* --address=BDADDR */ :
+		case BLUEALSA_AGENT_OPT_PREFER_CODECS /* --prefer-codecs=CODEC[,CODEC]... */ :
+		case BLUEALSA_AGENT_OPT_CALIBRATION /* --calibration=FILE */ :
+		case BLUEALSA_AGENT_OPT_LEARN_DELAY /* --learn-delay */ :
+		case BLUEALSA_AGENT_OPT_SOFT_VOLUME /* --soft-volume=[CODEC:]POLICY[,...] */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_CPUS /* --handler-cpus=CPULIST */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_NICE /* --handler-nice=N */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_SCHED /* --handler-sched=[other|batch|idle] */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_IOPRIO /* --handler-ioprio=CLASS[:LEVEL] */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_CGROUP /* --handler-cgroup=PATH */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_CPU_WEIGHT /* --handler-cpu-weight=N */ :
+		case BLUEALSA_AGENT_OPT_HANDLER_MEMORY_MAX /* --handler-memory-max=BYTES */ :
+		case BLUEALSA_AGENT_OPT_PREWARM /* --prewarm=SECONDS */ :
+		case BLUEALSA_AGENT_OPT_PCM_FD /* --pcm-fd */ :
+			if (!bluealsa_agent_rule_option(&cmdline, opt, optarg))
+				return EXIT_FAILURE;
+			cmdline_options = true;
+			break;
 
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
@@ -577,11 +2510,37 @@ int main(int argc, char *argv[]) {
 
 	log_open(argv[0], false);
 
-	if (optind == argc) {
+	int ret;
+	/* a slow journal must not stall the event loop */
+	if ((ret = log_async()) < 0)
+		warn("Couldn't start logging thread: %s", strerror(-ret));
+
+	if (replay != NULL && record != NULL) {
+		error("The --replay and --record options cannot be used together");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the state file or event socket alone selects all PCMs, unless rule
+	 * sets are given */
+	if (optind < argc || cmdline.plugins_count > 0 ||
+			bluealsa_agent_rule_has_builtin_action(&cmdline) ||
+			((state_file != NULL || event_socket != NULL) && config == NULL)) {
+		struct bluealsa_agent_rule *rule;
+		if ((rule = bluealsa_agent_add_rule(NULL)) == NULL)
+			exit(EXIT_FAILURE);
+		free(rule->services[0]);
+		free(rule->services);
+		*rule = cmdline;
+		if (optind < argc)
+			rule->program = strdup(argv[optind]);
+	}
+	else if (config == NULL || cmdline_options) {
 		error("No program(s) specified");
 		exit(EXIT_FAILURE);
 	}
-	programs = argv[optind];
+
+	if (config != NULL && !bluealsa_agent_read_config(config))
+		exit(EXIT_FAILURE);
 
 	agent.pcms.data = calloc(8, sizeof(*agent.pcms.data));
 	if (agent.pcms.data == NULL) {
@@ -589,27 +2548,26 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	agent.pcms.capacity = 8;
-
-	bluealsa_agent_get_progs(programs);
-	if (agent.prog_count == 0)
-		exit(EXIT_SUCCESS);
-
-	if (bluealsa_agent_init_client() < 0)
-		return EXIT_FAILURE;
-
-	unsigned int index;
-	for (index = 0; index < services_count; index++) {
-		bluealsa_client_watch_service(agent.client, services[index]);
-		bluealsa_client_get_pcms(agent.client, services[index]);
-		free(services[index]);
+	agent.timeout = -1;
+
+	size_t prog_count = 0;
+	for (size_t n = 0; n < agent.rules_count; n++) {
+		bluealsa_agent_get_progs(&agent.rules[n]);
+		prog_count += agent.rules[n].prog_count + agent.rules[n].plugins_count;
+		if (bluealsa_agent_rule_has_builtin_action(&agent.rules[n]))
+			prog_count++;
 	}
-	free(services);
+	if (prog_count == 0 && state_file == NULL && event_socket == NULL)
+		exit(EXIT_SUCCESS);
 
 	sigset_t mask;
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGTERM);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
 	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
 		error("sigprocmask");
 		exit(EXIT_FAILURE);
@@ -620,24 +2578,138 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
-	struct pollfd pfds[11];
+	/* SIGPIPE is blocked too, but not read from the signalfd, so that a bridge
+	 * thread writing to a PCM that BlueALSA has closed gets EPIPE instead of
+	 * terminating the agent. Child processes unblock all signals. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		error("sigprocmask");
+		exit(EXIT_FAILURE);
+	}
+
+	/* plugin threads must inherit the blocked signal mask */
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		rule->plugins = calloc(rule->plugins_count, sizeof(*rule->plugins));
+		for (size_t n = 0; n < rule->plugins_count; n++)
+			if ((rule->plugins[n] = bluealsa_agent_plugin_load(rule->plugin_specs[n])) == NULL)
+				exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		struct bluealsa_agent_rule *rule = &agent.rules[i];
+		if (rule->calibration_path != NULL &&
+				(rule->calibration = bluealsa_agent_calibration_open(rule->calibration_path)) == NULL)
+			exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		if (bluealsa_agent_sched_setup(agent.rules[i].sched) < 0)
+			exit(EXIT_FAILURE);
+
+	if (state_file != NULL && (ret = bluealsa_agent_state_open(state_file)) < 0) {
+		error("Couldn't create state file %s (%s)", state_file, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	if (event_socket != NULL &&
+			(ret = bluealsa_agent_server_open(event_socket, bluealsa_agent_server_snapshot)) < 0) {
+		error("Couldn't create event socket %s (%s)", event_socket, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	if (metrics_file != NULL &&
+			(ret = bluealsa_metrics_open(metrics_file, BLUEALSA_METRICS_AGENT)) < 0) {
+		error("Couldn't create metrics file %s (%s)", metrics_file, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+
+	if (bluealsa_agent_init_client(replay) < 0)
+		return EXIT_FAILURE;
+	if (record != NULL && (ret = bluealsa_client_record(agent.client, record)) < 0) {
+		error("Couldn't create record file %s (%s)", record, strerror(-ret));
+		exit(EXIT_FAILURE);
+	}
+	bluealsa_agent_bridge_init(agent.client);
+
+	/* watch each service only once, however many rules use it */
+	for (size_t i = 0; i < agent.rules_count; i++) {
+		const struct bluealsa_agent_rule *rule = &agent.rules[i];
+		for (size_t n = 0; n < rule->services_count; n++) {
+			bool watched = false;
+			for (size_t j = 0; j < i && !watched; j++)
+				for (size_t k = 0; k < agent.rules[j].services_count; k++)
+					if (strcmp(rule->services[n], agent.rules[j].services[k]) == 0)
+						watched = true;
+			for (size_t k = 0; k < n && !watched; k++)
+				if (strcmp(rule->services[n], rule->services[k]) == 0)
+					watched = true;
+			if (watched)
+				continue;
+			bluealsa_client_watch_service(agent.client, rule->services[n]);
+			bluealsa_client_get_pcms(agent.client, rule->services[n]);
+		}
+	}
+
+	struct pollfd pfds[12 + BLUEALSA_AGENT_MAX_CHANNELS + BLUEALSA_AGENT_SERVER_MAX_CLIENTS];
 	nfds_t pfds_len = ARRAYSIZE(pfds);
 	pfds[0].fd = sfd;
 	pfds[0].events = POLLIN;
 
 	int exit_status = EXIT_SUCCESS;
-	bool terminated = false;
+	if (replay != NULL && bluealsa_agent_replay() < 0)
+		exit_status = EXIT_FAILURE;
+
+	bool terminated = replay != NULL;
 	while (!terminated) {
 		int res;
-		nfds_t temp = pfds_len - 1;
-		if (bluealsa_client_poll_fds(agent.client, pfds + 1, &temp) < 0) {
+
+		/* a handler that has exited can send no more directives, but a process
+		 * that it left running may hold the channel open indefinitely */
+		for (size_t n = agent.channels_count; n > 0; n--) {
+			struct bluealsa_agent_channel *channel = &agent.channels[n - 1];
+			if (!channel->exited)
+				continue;
+			bluealsa_agent_read_channel(channel);
+			bluealsa_agent_apply_directives(channel);
+			bluealsa_agent_close_channel(n - 1);
+		}
+
+		/* directive channels follow the signalfd */
+		const nfds_t channels_count = agent.channels_count;
+		for (size_t n = 0; n < channels_count; n++) {
+			pfds[1 + n].fd = agent.channels[n].fd;
+			pfds[1 + n].events = POLLIN;
+		}
+
+		/* then the event socket and its clients */
+		struct pollfd *server_pfds = pfds + 1 + channels_count;
+		const nfds_t server_count = bluealsa_agent_server_poll_fds(server_pfds,
+				1 + BLUEALSA_AGENT_SERVER_MAX_CLIENTS);
+		struct pollfd *dbus_pfds = server_pfds + server_count;
+
+		nfds_t temp = ARRAYSIZE(pfds) - 1 - channels_count - server_count;
+		if (bluealsa_client_poll_fds(agent.client, dbus_pfds, &temp) < 0) {
 			error("Couldn't get D-Bus connection file descriptors");
 			exit_status = EXIT_FAILURE;
 			break;
 		}
-		pfds_len = temp + 1;
+		pfds_len = temp + 1 + channels_count + server_count;
+
+		int timeout = bluealsa_agent_supervisor_timeout();
+		const int prewarm_timeout = bluealsa_agent_prewarm_timeout();
+		if (prewarm_timeout != -1 && (timeout == -1 || prewarm_timeout < timeout))
+			timeout = prewarm_timeout;
+		const int metrics_timeout = bluealsa_metrics_timeout();
+		if (metrics_timeout != -1 && (timeout == -1 || metrics_timeout < timeout))
+			timeout = metrics_timeout;
+		if (agent.timeout != -1) {
+			const uint64_t now = bluealsa_agent_now();
+			const int device_timeout = agent.deadline > now ? agent.deadline - now : 0;
+			if (timeout == -1 || device_timeout < timeout)
+				timeout = device_timeout;
+		}
 
-		if ((res = poll(pfds, pfds_len, -1)) == -1 &&
+		if ((res = poll(pfds, pfds_len, timeout)) == -1 &&
 				errno == EINTR)
 			continue;
 
@@ -647,6 +2719,21 @@ int main(int argc, char *argv[]) {
 			break;
 		}
 
+		bluealsa_agent_supervisor_run_timers();
+		bluealsa_agent_prewarm_run_timers();
+		bluealsa_metrics_flush();
+
+		/* pending device events are run once their deadline has passed,
+		 * whatever woke up the poll */
+		if (agent.timeout != -1 && bluealsa_agent_now() >= agent.deadline) {
+			agent.timeout = -1;
+			bluealsa_agent_flush_all_devices();
+		}
+
+		/* timeout */
+		if (res == 0)
+			continue;
+
 		if (pfds[0].revents == POLLIN) {
 			struct signalfd_siginfo fdsi;
 			ssize_t s = read(pfds[0].fd, &fdsi, sizeof(fdsi));
@@ -668,14 +2755,61 @@ int main(int argc, char *argv[]) {
 					debug("Reloading commands on signal SIGHUP");
 					bluealsa_agent_reload();
 					break;
+				case SIGUSR1:
+					if ((ret = bluealsa_recorder_dump(recorder_file)) < 0)
+						error("Couldn't write recorder file %s (%s)", recorder_file, strerror(-ret));
+					break;
+				case SIGUSR2:
+					if (trace_file == NULL)
+						warn("Tracing requires --trace-file");
+					else if ((ret = bluealsa_trace_toggle(trace_file)) < 0)
+						error("Couldn't create trace file %s (%s)", trace_file, strerror(-ret));
+					break;
+				case SIGCHLD:
+					bluealsa_agent_reap_children();
+					break;
+			}
+		}
+
+		/* iterate from the end so that closing a channel does not move the
+		 * channels yet to be checked */
+		for (size_t n = channels_count; n > 0; n--) {
+			struct bluealsa_agent_channel *channel = &agent.channels[n - 1];
+			if (pfds[n].revents == 0)
+				continue;
+			if (bluealsa_agent_read_channel(channel)) {
+				bluealsa_agent_apply_directives(channel);
+				bluealsa_agent_close_channel(n - 1);
 			}
 		}
 
-		bluealsa_client_poll_dispatch(agent.client, pfds + 1, pfds_len - 1);
+		bluealsa_agent_server_dispatch(server_pfds, server_count);
+
+		bluealsa_client_poll_dispatch(agent.client, dbus_pfds, pfds_len - 1 - channels_count - server_count);
 	}
 
+	while (agent.channels_count > 0)
+		bluealsa_agent_close_channel(agent.channels_count - 1);
+
 	bluealsa_agent_terminated();
+	bluealsa_agent_prewarm_discard_all();
+	bluealsa_agent_supervisor_stop_all();
+	bluealsa_agent_bridge_stop_all();
 	bluealsa_client_close(agent.client);
+	bluealsa_agent_state_close();
+	bluealsa_agent_server_close();
+	bluealsa_trace_stop();
+	bluealsa_metrics_close();
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		for (size_t n = 0; n < agent.rules[i].plugins_count; n++)
+			bluealsa_agent_plugin_unload(agent.rules[i].plugins[n]);
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		bluealsa_agent_calibration_close(agent.rules[i].calibration);
+
+	for (size_t i = 0; i < agent.rules_count; i++)
+		bluealsa_agent_sched_free(agent.rules[i].sched);
 
 	return exit_status;
 }
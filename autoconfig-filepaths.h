@@ -15,5 +15,8 @@
 #define BLUEALSA_AUTOCONFIG_RUN_DIR  "/run/bluealsa-autoconfig"
 #define BLUEALSA_AUTOCONFIG_DEFAULTS_FILE  BLUEALSA_AUTOCONFIG_RUN_DIR "/defaults.conf"
 #define BLUEALSA_AUTOCONFIG_LOCK_FILE  BLUEALSA_AUTOCONFIG_RUN_DIR "/lock"
+#define BLUEALSA_AUTOCONFIG_METRICS_FILE  BLUEALSA_AUTOCONFIG_RUN_DIR "/metrics.prom"
+#define BLUEALSA_AUTOCONFIG_RECORDER_FILE  BLUEALSA_AUTOCONFIG_RUN_DIR "/events.tsv"
+#define BLUEALSA_AUTOCONFIG_TRACE_FILE  BLUEALSA_AUTOCONFIG_RUN_DIR "/trace.bin"
 
 #endif
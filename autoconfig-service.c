@@ -0,0 +1,258 @@
+/*
+ * bluealsa-autoconfig - autoconfig-service.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autoconfig-service.h"
+#include "bluez-alsa/shared/dbus-client.h"
+#include "bluez-alsa/shared/defs.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * D-Bus service publishing the namehints and defaults written by the most
+ * recent commit. The published lists are copied at commit time, so a query
+ * always describes the ALSA configuration currently on disk and never the
+ * pending changes of the next commit.
+ */
+
+static const char *introspection_xml =
+	DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+	"<node>\n"
+	" <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+	"  <method name=\"Introspect\">\n"
+	"   <arg name=\"xml\" type=\"s\" direction=\"out\"/>\n"
+	"  </method>\n"
+	" </interface>\n"
+	" <interface name=\"" BLUEALSA_AUTOCONFIG_INTERFACE "\">\n"
+	"  <method name=\"GetHints\">\n"
+	"   <arg name=\"generation\" type=\"t\" direction=\"out\"/>\n"
+	"   <arg name=\"hints\" type=\"a(ssssss)\" direction=\"out\"/>\n"
+	"  </method>\n"
+	"  <method name=\"GetDefaults\">\n"
+	"   <arg name=\"generation\" type=\"t\" direction=\"out\"/>\n"
+	"   <arg name=\"defaults\" type=\"a(ssssss)\" direction=\"out\"/>\n"
+	"  </method>\n"
+	"  <signal name=\"Changed\">\n"
+	"   <arg name=\"generation\" type=\"t\"/>\n"
+	"  </signal>\n"
+	" </interface>\n"
+	"</node>\n";
+
+struct bluealsa_autoconfig_service_entry {
+	char id[128];
+	char address[18];
+	char profile[8];
+	char stream[16];
+	char description[256];
+	char service[32];
+};
+
+struct bluealsa_autoconfig_service_list {
+	struct bluealsa_autoconfig_service_entry *entries;
+	size_t count;
+	size_t size;
+};
+
+struct bluealsa_autoconfig_service {
+	struct ba_dbus_ctx dbus_ctx;
+	uint64_t generation;
+	struct bluealsa_autoconfig_service_list hints;
+	struct bluealsa_autoconfig_service_list defaults;
+};
+
+static void bluealsa_autoconfig_service_list_add(const struct bluealsa_namehint_entry *entry, void *data) {
+	struct bluealsa_autoconfig_service_list *list = data;
+	struct bluealsa_autoconfig_service_entry *e;
+
+	if (list->count == list->size) {
+		size_t size = list->size == 0 ? 8 : list->size * 2;
+		if ((e = realloc(list->entries, size * sizeof(*e))) == NULL) {
+			error("Out of memory");
+			return;
+		}
+		list->entries = e;
+		list->size = size;
+	}
+
+	e = &list->entries[list->count++];
+	snprintf(e->id, sizeof(e->id), "%s", entry->id);
+	snprintf(e->address, sizeof(e->address), "%s", entry->address);
+	snprintf(e->profile, sizeof(e->profile), "%s", entry->profile);
+	snprintf(e->stream, sizeof(e->stream), "%s", entry->stream);
+	snprintf(e->description, sizeof(e->description), "%s", entry->description);
+	snprintf(e->service, sizeof(e->service), "%s", entry->service);
+}
+
+static bool bluealsa_autoconfig_service_append_list(DBusMessage *msg, uint64_t generation, const struct bluealsa_autoconfig_service_list *list) {
+	DBusMessageIter iter, array, item;
+	dbus_uint64_t gen = generation;
+
+	dbus_message_iter_init_append(msg, &iter);
+	if (!dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT64, &gen) ||
+			!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(ssssss)", &array))
+		return false;
+
+	for (size_t n = 0; n < list->count; n++) {
+		const struct bluealsa_autoconfig_service_entry *e = &list->entries[n];
+		const char *fields[] = { e->id, e->address, e->profile, e->stream, e->description, e->service };
+
+		if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &item))
+			goto fail;
+		for (size_t f = 0; f < ARRAYSIZE(fields); f++)
+			if (!dbus_message_iter_append_basic(&item, DBUS_TYPE_STRING, &fields[f])) {
+				dbus_message_iter_abandon_container(&array, &item);
+				goto fail;
+			}
+		if (!dbus_message_iter_close_container(&array, &item))
+			goto fail;
+	}
+
+	return dbus_message_iter_close_container(&iter, &array);
+
+fail:
+	dbus_message_iter_abandon_container(&iter, &array);
+	return false;
+}
+
+static DBusHandlerResult bluealsa_autoconfig_service_message(DBusConnection *conn, DBusMessage *message, void *data) {
+	struct bluealsa_autoconfig_service *service = data;
+	DBusMessage *reply = NULL;
+
+	if (dbus_message_is_method_call(message, DBUS_INTERFACE_INTROSPECTABLE, "Introspect")) {
+		if ((reply = dbus_message_new_method_return(message)) != NULL &&
+				!dbus_message_append_args(reply, DBUS_TYPE_STRING, &introspection_xml, DBUS_TYPE_INVALID)) {
+			dbus_message_unref(reply);
+			reply = NULL;
+		}
+	}
+	else if (dbus_message_is_method_call(message, BLUEALSA_AUTOCONFIG_INTERFACE, "GetHints") ||
+			dbus_message_is_method_call(message, BLUEALSA_AUTOCONFIG_INTERFACE, "GetDefaults")) {
+		const struct bluealsa_autoconfig_service_list *list =
+			strcmp(dbus_message_get_member(message), "GetHints") == 0 ? &service->hints : &service->defaults;
+		if ((reply = dbus_message_new_method_return(message)) != NULL &&
+				!bluealsa_autoconfig_service_append_list(reply, service->generation, list)) {
+			dbus_message_unref(reply);
+			reply = NULL;
+		}
+	}
+	else if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+		reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, NULL);
+	else
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (reply == NULL)
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable bluealsa_autoconfig_service_vtable = {
+	.message_function = bluealsa_autoconfig_service_message,
+};
+
+/**
+ * Connect to the system bus, register the autoconfig object and claim the
+ * service name.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_autoconfig_service_open(struct bluealsa_autoconfig_service **service) {
+	struct bluealsa_autoconfig_service *new_service;
+	DBusError err = DBUS_ERROR_INIT;
+	int ret;
+
+	if ((new_service = calloc(1, sizeof(*new_service))) == NULL)
+		return -ENOMEM;
+
+	if (!ba_dbus_connection_ctx_init(&new_service->dbus_ctx, "", &err)) {
+		error("Couldn't initialize D-Bus context: %s", err.message);
+		ret = -EIO;
+		goto fail;
+	}
+
+	if (!dbus_connection_try_register_object_path(new_service->dbus_ctx.conn,
+				BLUEALSA_AUTOCONFIG_PATH, &bluealsa_autoconfig_service_vtable, new_service, &err)) {
+		error("Couldn't register D-Bus object: %s", err.message);
+		ret = -EIO;
+		goto fail;
+	}
+
+	if ((ret = dbus_bus_request_name(new_service->dbus_ctx.conn, BLUEALSA_AUTOCONFIG_SERVICE,
+				DBUS_NAME_FLAG_DO_NOT_QUEUE, &err)) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		error("Couldn't acquire D-Bus name %s: %s", BLUEALSA_AUTOCONFIG_SERVICE,
+				dbus_error_is_set(&err) ? err.message : "Name already in use");
+		ret = -EBUSY;
+		goto fail;
+	}
+
+	*service = new_service;
+	return 0;
+
+fail:
+	dbus_error_free(&err);
+	ba_dbus_connection_ctx_free(&new_service->dbus_ctx);
+	free(new_service);
+	return ret;
+}
+
+void bluealsa_autoconfig_service_close(struct bluealsa_autoconfig_service *service) {
+	ba_dbus_connection_ctx_free(&service->dbus_ctx);
+	free(service->hints.entries);
+	free(service->defaults.entries);
+	free(service);
+}
+
+int bluealsa_autoconfig_service_poll_fds(struct bluealsa_autoconfig_service *service, struct pollfd *fds, nfds_t *nfds) {
+	if (!ba_dbus_connection_poll_fds(&service->dbus_ctx, fds, nfds))
+		return -1;
+	return 0;
+}
+
+void bluealsa_autoconfig_service_poll_dispatch(struct bluealsa_autoconfig_service *service, struct pollfd *fds, nfds_t nfds) {
+	if (ba_dbus_connection_poll_dispatch(&service->dbus_ctx, fds, nfds))
+		while (dbus_connection_dispatch(service->dbus_ctx.conn) == DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+}
+
+/**
+ * Publish the namehints and defaults of a commit, and signal the change to
+ * clients.
+ * @param hints the namehint container just written.
+ * @param pattern template used for hint descriptions.
+ * @param with_service true if the PCM ids include the service name.
+ * @param with_defaults true if the defaults file was written.
+ */
+void bluealsa_autoconfig_service_commit(struct bluealsa_autoconfig_service *service, const struct bluealsa_namehint *hints, const char *pattern, bool with_service, bool with_defaults) {
+	DBusMessage *msg;
+	dbus_uint64_t generation;
+
+	service->hints.count = 0;
+	service->defaults.count = 0;
+	bluealsa_namehint_foreach(hints, pattern, with_service, bluealsa_autoconfig_service_list_add, &service->hints);
+	if (with_defaults)
+		bluealsa_namehint_foreach_default(hints, bluealsa_autoconfig_service_list_add, &service->defaults);
+
+	generation = ++service->generation;
+
+	if ((msg = dbus_message_new_signal(BLUEALSA_AUTOCONFIG_PATH, BLUEALSA_AUTOCONFIG_INTERFACE, "Changed")) == NULL ||
+			!dbus_message_append_args(msg, DBUS_TYPE_UINT64, &generation, DBUS_TYPE_INVALID) ||
+			!dbus_connection_send(service->dbus_ctx.conn, msg, NULL))
+		error("Couldn't send D-Bus Changed signal");
+	/* whatever cannot be written at once is sent from the main loop */
+
+	if (msg != NULL)
+		dbus_message_unref(msg);
+}
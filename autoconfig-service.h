@@ -0,0 +1,28 @@
+/*
+ * bluealsa-autoconfig - autoconfig-service.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AUTOCONFIG_SERVICE_H
+#define BLUEALSA_AUTOCONFIG_SERVICE_H
+
+#include <poll.h>
+#include <stdbool.h>
+
+#include "namehint.h"
+
+#define BLUEALSA_AUTOCONFIG_SERVICE "io.github.borine.bluealsa_autoconfig"
+#define BLUEALSA_AUTOCONFIG_PATH "/org/bluealsa/autoconfig"
+#define BLUEALSA_AUTOCONFIG_INTERFACE "io.github.borine.bluealsa_autoconfig.Autoconfig1"
+
+struct bluealsa_autoconfig_service;
+
+int bluealsa_autoconfig_service_open(struct bluealsa_autoconfig_service **service);
+void bluealsa_autoconfig_service_close(struct bluealsa_autoconfig_service *service);
+int bluealsa_autoconfig_service_poll_fds(struct bluealsa_autoconfig_service *service, struct pollfd *fds, nfds_t *nfds);
+void bluealsa_autoconfig_service_poll_dispatch(struct bluealsa_autoconfig_service *service, struct pollfd *fds, nfds_t nfds);
+void bluealsa_autoconfig_service_commit(struct bluealsa_autoconfig_service *service, const struct bluealsa_namehint *hints, const char *pattern, bool with_service, bool with_defaults);
+
+#endif
@@ -12,6 +12,7 @@
 #include <alsa/conf.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -25,9 +26,14 @@
 
 #include "alsa.h"
 #include "autoconfig-filepaths.h"
+#include "autoconfig-service.h"
 #include "bluealsa-client.h"
+#include "bluez-alsa/shared/dbus-client.h"
 #include "bluez-alsa/shared/log.h"
+#include "metrics.h"
 #include "namehint.h"
+#include "recorder.h"
+#include "trace.h"
 #include "version.h"
 
 #define BLUEALSA_AUTOCONFIG_CONFIG_TEMPLATE "%n %p (%c)%lBluetooth Audio %s"
@@ -35,14 +41,61 @@
 struct bluealsa_autoconfig {
 	bluealsa_client_t client;
 	struct bluealsa_namehint *hints;
+	struct bluealsa_autoconfig_service *service;
 	int timeout;
+	/* time of the D-Bus signal of the first uncommitted change */
+	uint64_t changed;
 	char *pattern;
 	char udev_control[sizeof("/sys/class/sound/controlCXXX/uevent")];
 };
 
 static bool udev_events = false;
 static bool defaults = false;
+static bool publish = false;
+static bool metrics = false;
 static volatile bool running = true;
+static volatile sig_atomic_t dump_recorder = 0;
+static volatile sig_atomic_t toggle_trace = 0;
+
+/* the file paths, below the root directory given with --root */
+static struct {
+	char config_dir[PATH_MAX];
+	char config_file[PATH_MAX];
+	char temp_file[PATH_MAX];
+	char run_dir[PATH_MAX];
+	char defaults_file[PATH_MAX];
+	char lock_file[PATH_MAX];
+	char metrics_file[PATH_MAX];
+	char recorder_file[PATH_MAX];
+	char trace_file[PATH_MAX];
+} paths;
+
+/**
+ * Set the file paths.
+ * @param root the directory that replaces "/" in every path.
+ * @return 0 on success, -1 if a path is too long.
+ */
+static int bluealsa_autoconfig_set_paths(const char *root) {
+	const struct {
+		char *buffer;
+		const char *path;
+	} table[] = {
+		{ paths.config_dir, BLUEALSA_AUTOCONFIG_CONFIG_DIR },
+		{ paths.config_file, BLUEALSA_AUTOCONFIG_CONFIG_FILE },
+		{ paths.temp_file, BLUEALSA_AUTOCONFIG_TEMP_FILE },
+		{ paths.run_dir, BLUEALSA_AUTOCONFIG_RUN_DIR },
+		{ paths.defaults_file, BLUEALSA_AUTOCONFIG_DEFAULTS_FILE },
+		{ paths.lock_file, BLUEALSA_AUTOCONFIG_LOCK_FILE },
+		{ paths.metrics_file, BLUEALSA_AUTOCONFIG_METRICS_FILE },
+		{ paths.recorder_file, BLUEALSA_AUTOCONFIG_RECORDER_FILE },
+		{ paths.trace_file, BLUEALSA_AUTOCONFIG_TRACE_FILE },
+	};
+
+	for (size_t i = 0; i < ARRAYSIZE(table); i++)
+		if ((size_t)snprintf(table[i].buffer, PATH_MAX, "%s%s", root, table[i].path) >= PATH_MAX)
+			return -1;
+	return 0;
+}
 
 static void bluealsa_autoconfig_get_pattern(struct bluealsa_autoconfig *config) {
 	snd_config_t *node;
@@ -94,6 +147,8 @@ static void bluealsa_autoconfig_udev_trigger(struct bluealsa_autoconfig *config)
 		debug("Unable to simulate udev events: %s", strerror(errno));
 		udev_events = false;
 	}
+	else
+		bluealsa_metrics_add(BLUEALSA_METRICS_UDEV_TRIGGERS, 1);
 	close(fd);
 }
 
@@ -110,34 +165,26 @@ static int bluealsa_autoconfig_init_alsa(const char *progname) {
 
 	/* Ensure the required directories exist */
 	mode_t mask = umask(~(S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH));
-	int ret = mkdir(BLUEALSA_AUTOCONFIG_CONFIG_DIR, 0775);
+	int ret = mkdir(paths.config_dir, 0775);
 	if (ret < 0 && errno != EEXIST) {
-		error(BLUEALSA_AUTOCONFIG_CONFIG_DIR ": %s\n", strerror(errno));
+		error("%s: %s\n", paths.config_dir, strerror(errno));
 		return -1;
 	}
 
-	ret = mkdir(BLUEALSA_AUTOCONFIG_RUN_DIR, 0775);
+	ret = mkdir(paths.run_dir, 0775);
 	if (ret < 0 && errno != EEXIST) {
-		error(BLUEALSA_AUTOCONFIG_RUN_DIR ": %s\n", strerror(errno));
+		error("%s: %s\n", paths.run_dir, strerror(errno));
 		return -1;
 	}
-
-	/* Clear the defaults file */
-	fd = open(BLUEALSA_AUTOCONFIG_DEFAULTS_FILE, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
-	if (fd < 0 && defaults) {
-		warn("Unable to open defaults file %s: %s\n", BLUEALSA_AUTOCONFIG_DEFAULTS_FILE, strerror(errno));
-	}
-	else
-		close(fd);
 	umask(mask);
 
 	/* To prevent two instances of this program running,
 	 * we create an exclusive lock file. The file descriptor, and therefore the
 	 * lock on it, will be released automatically by the kernel when this
 	 * program instance terminates. */
-	fd = open(BLUEALSA_AUTOCONFIG_LOCK_FILE, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+	fd = open(paths.lock_file, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
 	if (fd < 0) {
-		error("Unable to create lock file %s: %s\n", BLUEALSA_AUTOCONFIG_LOCK_FILE, strerror(errno));
+		error("Unable to create lock file %s: %s\n", paths.lock_file, strerror(errno));
 		return -1;
 	}
 	if (flock(fd, LOCK_EX|LOCK_NB) < 0) {
@@ -146,12 +193,22 @@ static int bluealsa_autoconfig_init_alsa(const char *progname) {
 		return -1;
 	}
 
+	/* Clear the defaults file, which belongs to the running instance */
+	mask = umask(~(S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH));
+	fd = open(paths.defaults_file, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+	if (fd < 0 && defaults) {
+		warn("Unable to open defaults file %s: %s\n", paths.defaults_file, strerror(errno));
+	}
+	else
+		close(fd);
+	umask(mask);
+
 	/* Create or truncate the ALSA config file. */
 	mask = umask(~(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
-	fd = open(BLUEALSA_AUTOCONFIG_CONFIG_FILE, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	fd = open(paths.config_file, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 	umask(mask);
 	if (fd < 0) {
-		error("%s: %s\n", BLUEALSA_AUTOCONFIG_CONFIG_FILE, strerror(errno));
+		error("%s: %s\n", paths.config_file, strerror(errno));
 		return -1;
 	}
 	close(fd);
@@ -160,6 +217,10 @@ static int bluealsa_autoconfig_init_alsa(const char *progname) {
 }
 
 void bluealsa_autoconfig_set_timeout(struct bluealsa_autoconfig *config) {
+	if (config->timeout != -1)
+		bluealsa_metrics_add(BLUEALSA_METRICS_COMMITS_SKIPPED, 1);
+	else
+		config->changed = bluealsa_metrics_signal_time();
 	config->timeout = 100;
 }
 
@@ -169,42 +230,72 @@ static void bluealsa_autoconfig_clear_timeout(struct bluealsa_autoconfig *config
 
 static void bluealsa_autoconfig_pcm_added(const struct ba_pcm *pcm, const char *service, void *data) {
 	struct bluealsa_autoconfig *config = data;
-	if (bluealsa_namehint_pcm_add(config->hints, pcm, config->client, service))
+	const bool changed = bluealsa_namehint_pcm_add(config->hints, pcm, config->client, service);
+	bluealsa_trace(BLUEALSA_TRACE_NAMEHINT_ADD, changed);
+	if (changed) {
+		bluealsa_recorder_add("add", service, pcm->pcm_path, 0, "commit pending");
 		bluealsa_autoconfig_set_timeout(config);
+	}
+	else {
+		bluealsa_recorder_add("add", service, pcm->pcm_path, 0, "filtered");
+		bluealsa_metrics_add(BLUEALSA_METRICS_EVENTS_FILTERED, 1);
+	}
 }
 
 static void bluealsa_autoconfig_pcm_removed(const char *path, void *data) {
 	struct bluealsa_autoconfig *config = data;
-	if (bluealsa_namehint_pcm_remove(config->hints, path))
+	const bool changed = bluealsa_namehint_pcm_remove(config->hints, path);
+	bluealsa_trace(BLUEALSA_TRACE_NAMEHINT_REMOVE, changed);
+	if (changed) {
+		bluealsa_recorder_add("remove", NULL, path, 0, "commit pending");
 		bluealsa_autoconfig_set_timeout(config);
+	}
+	else {
+		bluealsa_recorder_add("remove", NULL, path, 0, "filtered");
+		bluealsa_metrics_add(BLUEALSA_METRICS_EVENTS_FILTERED, 1);
+	}
 }
 
 static void bluealsa_autoconfig_pcm_updated(const char *path, const char *service, struct bluealsa_pcm_properties *props, void *data) {
-	(void) service;
 	struct bluealsa_autoconfig *config = data;
-	if (! (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CODEC))
+	if (! (props->mask & BLUEALSA_PCM_PROPERTY_CHANGED_CODEC) ||
+			!bluealsa_namehint_pcm_update(config->hints, path, props->codec.name)) {
+		bluealsa_recorder_add("update", service, path, props->mask, "filtered");
+		bluealsa_metrics_add(BLUEALSA_METRICS_EVENTS_FILTERED, 1);
 		return;
+	}
 
-	if (bluealsa_namehint_pcm_update(config->hints, path, props->codec.name))
-		bluealsa_autoconfig_set_timeout(config);
+	bluealsa_recorder_add("update", service, path, props->mask, "commit pending");
+	bluealsa_autoconfig_set_timeout(config);
 }
 
 static void bluealsa_autoconfig_service_stopped(const char *service, void *data) {
 	struct bluealsa_autoconfig *config = data;
-	if (bluealsa_namehint_service_remove(config->hints, service))
+	const bool changed = bluealsa_namehint_service_remove(config->hints, service);
+	bluealsa_trace(BLUEALSA_TRACE_NAMEHINT_REMOVE, changed);
+	if (changed) {
+		bluealsa_recorder_add("stopped", service, NULL, 0, "commit pending");
 		bluealsa_autoconfig_set_timeout(config);
+	}
 }
 
-static int bluealsa_autoconfig_init_client(struct bluealsa_autoconfig *config) {
+static int bluealsa_autoconfig_init_client(struct bluealsa_autoconfig *config, const char *replay) {
 	int ret;
 	struct bluealsa_client_callbacks callbacks = {
 		bluealsa_autoconfig_pcm_added,
 		bluealsa_autoconfig_pcm_removed,
 		bluealsa_autoconfig_pcm_updated,
 		bluealsa_autoconfig_service_stopped,
+		NULL,
 		config,
 	};
-	if ((ret = bluealsa_client_open(&config->client, &callbacks)) < 0) {
+	if (replay != NULL) {
+		if ((ret = bluealsa_client_open_replay(&config->client, &callbacks, replay)) < 0) {
+			error("Unable to replay %s: %s", replay, strerror(-ret));
+			return ret;
+		}
+	}
+	else if ((ret = bluealsa_client_open(&config->client, &callbacks)) < 0) {
 		error("Unable to open bluealsa interface");
 		return ret;
 	}
@@ -213,35 +304,90 @@ static int bluealsa_autoconfig_init_client(struct bluealsa_autoconfig *config) {
 }
 
 static int bluealsa_autoconfig_commit_changes(struct bluealsa_autoconfig *config) {
+	bluealsa_trace(BLUEALSA_TRACE_COMMIT_BEGIN, 0);
 	mode_t mask = umask(~(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
-	FILE *file = fopen(BLUEALSA_AUTOCONFIG_TEMP_FILE, "w");
+	FILE *file = fopen(paths.temp_file, "w");
 	umask(mask);
 	if (file == NULL) {
-		error("Unable to write to %s: %s", BLUEALSA_AUTOCONFIG_TEMP_FILE, strerror(errno));
+		error("Unable to write to %s: %s", paths.temp_file, strerror(errno));
 		return -1;
 	}
 
-	bluealsa_namehint_print(config->hints, file, config->pattern, bluealsa_client_num_services(config->client) > 1);
+	bool with_service = bluealsa_client_num_services(config->client) > 1;
+	bluealsa_namehint_print(config->hints, file, config->pattern, with_service);
 
+	long written = ftell(file);
 	fclose(file);
 
 	if (defaults) {
 		mask = umask(~(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
-		file = fopen(BLUEALSA_AUTOCONFIG_DEFAULTS_FILE, "w+");
+		file = fopen(paths.defaults_file, "w+");
 		umask(mask);
 		if (file != NULL) {
 			bluealsa_namehint_print_default(config->hints, file);
+			written += ftell(file);
 			fclose(file);
 		}
 	}
 
-	rename(BLUEALSA_AUTOCONFIG_TEMP_FILE, BLUEALSA_AUTOCONFIG_CONFIG_FILE);
+	rename(paths.temp_file, paths.config_file);
 
 	if (udev_events)
 		bluealsa_autoconfig_udev_trigger(config);
 
+	if (config->service != NULL)
+		bluealsa_autoconfig_service_commit(config->service, config->hints, config->pattern, with_service, defaults);
+
 	bluealsa_namehint_reset(config->hints);
 
+	bluealsa_recorder_add("commit", NULL, paths.config_file, 0, "written");
+	bluealsa_metrics_add(BLUEALSA_METRICS_BYTES_WRITTEN, written);
+	bluealsa_metrics_add(BLUEALSA_METRICS_COMMITS, 1);
+	if (config->changed != 0) {
+		bluealsa_metrics_observe(BLUEALSA_METRICS_COMMIT_LATENCY, config->changed);
+		config->changed = 0;
+	}
+
+	bluealsa_trace(BLUEALSA_TRACE_COMMIT_END, written);
+	return 0;
+}
+
+static int bluealsa_autoconfig_replay_commit(struct bluealsa_autoconfig *config) {
+	int ret;
+	bluealsa_autoconfig_clear_timeout(config);
+	bluealsa_client_replay_commit_begin(config->client);
+	ret = bluealsa_autoconfig_commit_changes(config);
+	bluealsa_client_replay_commit_end(config->client);
+	return ret;
+}
+
+/**
+ * Dispatch all the events of the trace being replayed, and commit the
+ * changes whenever the recorded events pause for longer than the commit
+ * timeout, as the main loop would have done.
+ * @return 0 on success, -1 otherwise.
+ */
+static int bluealsa_autoconfig_replay(struct bluealsa_autoconfig *config) {
+	uint64_t time, last = 0;
+	int ret;
+
+	while ((ret = bluealsa_client_replay_next(config->client, &time)) > 0) {
+		if (config->timeout != -1 && time - last >= (uint64_t)config->timeout * 1000 &&
+				bluealsa_autoconfig_replay_commit(config) == -1)
+			return -1;
+		last = time;
+		if ((ret = bluealsa_client_replay_dispatch(config->client)) < 0)
+			break;
+	}
+	if (ret < 0) {
+		error("Invalid replay trace: %s", strerror(-ret));
+		return -1;
+	}
+
+	if (config->timeout != -1 && bluealsa_autoconfig_replay_commit(config) == -1)
+		return -1;
+
+	bluealsa_client_replay_report(config->client, stdout);
 	return 0;
 }
 
@@ -249,10 +395,14 @@ static void bluealsa_autoconfig_cleanup(struct bluealsa_autoconfig *config) {
 	bluealsa_namehint_remove_all(config->hints);
 	bluealsa_autoconfig_commit_changes(config);
 	bluealsa_namehint_free(config->hints);
+	if (config->service != NULL)
+		bluealsa_autoconfig_service_close(config->service);
 	if (config->client != NULL)
 		bluealsa_client_close(config->client);
 	free(config->pattern);
-	unlink(BLUEALSA_AUTOCONFIG_LOCK_FILE);
+	bluealsa_trace_stop();
+	bluealsa_metrics_close();
+	unlink(paths.lock_file);
 }
 
 static void bluealsa_autoconfig_terminate(int sig) {
@@ -260,23 +410,48 @@ static void bluealsa_autoconfig_terminate(int sig) {
 	running = false;
 }
 
+static void bluealsa_autoconfig_user_signal(int sig) {
+	if (sig == SIGUSR1)
+		dump_recorder = 1;
+	else
+		toggle_trace = 1;
+}
+
+/* Long options that have no short equivalent */
+enum {
+	BLUEALSA_AUTOCONFIG_OPT_BUS_ADDRESS = 0x100,
+	BLUEALSA_AUTOCONFIG_OPT_RECORD,
+	BLUEALSA_AUTOCONFIG_OPT_REPLAY,
+	BLUEALSA_AUTOCONFIG_OPT_ROOT,
+};
+
 int main(int argc, char *argv[]) {
 	struct bluealsa_autoconfig config = {
 		.timeout = -1,
 	};
 
+	const char *record = NULL;
+	const char *replay = NULL;
+	const char *root = "";
+
 	char **services = malloc(sizeof(char*));
 	services[0] = strdup(BLUEALSA_SERVICE);
 	unsigned int services_count = 1;
 
 	int opt;
-	const char *opts = "hVlB:du";
+	const char *opts = "hVlB:dmpu";
 	const struct option longopts[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "version", no_argument, NULL, 'V' },
 		{ "dbus", required_argument, NULL, 'B'},
 		{ "default", no_argument, NULL, 'd' },
+		{ "metrics", no_argument, NULL, 'm' },
+		{ "publish", no_argument, NULL, 'p' },
 		{ "udev", no_argument, NULL, 'u' },
+		{ "bus-address", required_argument, NULL, BLUEALSA_AUTOCONFIG_OPT_BUS_ADDRESS },
+		{ "record", required_argument, NULL, BLUEALSA_AUTOCONFIG_OPT_RECORD },
+		{ "replay", required_argument, NULL, BLUEALSA_AUTOCONFIG_OPT_REPLAY },
+		{ "root", required_argument, NULL, BLUEALSA_AUTOCONFIG_OPT_ROOT },
 		{ 0, 0, 0, 0 },
 	};
 
@@ -290,7 +465,14 @@ int main(int argc, char *argv[]) {
 					"  -V, --version\t\tprint version and exit\n"
 					"  -B, --dbus=NAME\tBlueALSA service name suffix\n"
 					"  -d, --default\t\tmanagement of default PCM and CTL\n"
-					"  -u, --udev\t\tsimulate soundcard udev events\n",
+					"  -m, --metrics\t\twrite metrics to " BLUEALSA_AUTOCONFIG_METRICS_FILE "\n"
+					"  -p, --publish\t\tpublish hints and defaults on D-Bus\n"
+					"  -u, --udev\t\tsimulate soundcard udev events\n"
+					"      --bus-address=ADDRESS\n"
+					"\t\t\tuse D-Bus server ADDRESS, not the system bus\n"
+					"      --record=FILE\trecord the BlueALSA events to FILE\n"
+					"      --replay=FILE\treplay the events of FILE and exit\n"
+					"      --root=DIR\twrite all files below DIR, not /\n",
 					argv[0]);
 			return EXIT_SUCCESS;
 
@@ -310,31 +492,86 @@ int main(int argc, char *argv[]) {
 			defaults = true;
 			break;
 
+		case 'm' /* --metrics */ :
+			metrics = true;
+			break;
+
+		case 'p' /* --publish */ :
+			publish = true;
+			break;
+
 		case 'u' /* --udev */ :
 			udev_events = true;
 			break;
 
+		case BLUEALSA_AUTOCONFIG_OPT_BUS_ADDRESS /* --bus-address=ADDRESS */ :
+			ba_dbus_set_bus_address(optarg);
+			break;
+
+		case BLUEALSA_AUTOCONFIG_OPT_RECORD /* --record=FILE */ :
+			record = optarg;
+			break;
+
+		case BLUEALSA_AUTOCONFIG_OPT_REPLAY /* --replay=FILE */ :
+			replay = optarg;
+			break;
+
+		case BLUEALSA_AUTOCONFIG_OPT_ROOT /* --root=DIR */ :
+			root = optarg;
+			break;
+
 		default:
 			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
 			return EXIT_FAILURE;
 		}
 
 
+	if (replay != NULL && (publish || record != NULL)) {
+		fprintf(stderr, "%s: --replay cannot be used with --publish or --record\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (bluealsa_autoconfig_set_paths(root) < 0) {
+		fprintf(stderr, "%s: --root: %s\n", argv[0], strerror(ENAMETOOLONG));
+		return EXIT_FAILURE;
+	}
+
 	log_open(argv[0], false);
 
+	int ret;
+	/* a slow journal must not stall the event loop */
+	if ((ret = log_async()) < 0)
+		warn("Couldn't start logging thread: %s", strerror(-ret));
+
 	if (bluealsa_autoconfig_init_alsa(argv[0]) < 0)
 		return EXIT_FAILURE;
 
 	debug("Runtime ALSA libasound version: %s", alsa_version_string());
 
+	if (metrics && (ret = bluealsa_metrics_open(paths.metrics_file, BLUEALSA_METRICS_AUTOCONFIG)) < 0) {
+		error("Unable to write metrics file %s: %s", paths.metrics_file, strerror(-ret));
+		return EXIT_FAILURE;
+	}
+
 	if (bluealsa_namehint_init(&config.hints) < 0) {
 		error("Out of memory");
 		return EXIT_FAILURE;
 	}
 
-	if (bluealsa_autoconfig_init_client(&config) < 0)
+	if (bluealsa_autoconfig_init_client(&config, replay) < 0)
 		return EXIT_FAILURE;
 
+	if (record != NULL && (ret = bluealsa_client_record(config.client, record)) < 0) {
+		error("Unable to write %s: %s", record, strerror(-ret));
+		bluealsa_autoconfig_cleanup(&config);
+		return EXIT_FAILURE;
+	}
+
+	if (publish && bluealsa_autoconfig_service_open(&config.service) < 0) {
+		bluealsa_autoconfig_cleanup(&config);
+		return EXIT_FAILURE;
+	}
+
 	bluealsa_autoconfig_get_pattern(&config);
 
 	if (udev_events)
@@ -348,13 +585,34 @@ int main(int argc, char *argv[]) {
 	}
 	free(services);
 
+	if (replay != NULL) {
+		ret = bluealsa_autoconfig_replay(&config);
+		bluealsa_autoconfig_cleanup(&config);
+		return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	struct sigaction sigact = { .sa_handler = bluealsa_autoconfig_terminate };
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGINT, &sigact, NULL);
+	struct sigaction sigact_user = { .sa_handler = bluealsa_autoconfig_user_signal };
+	sigaction(SIGUSR1, &sigact_user, NULL);
+	sigaction(SIGUSR2, &sigact_user, NULL);
 
 	while (running) {
-		struct pollfd pfds[10];
-		nfds_t pfds_len = ARRAYSIZE(pfds);
+		if (dump_recorder) {
+			dump_recorder = 0;
+			if ((ret = bluealsa_recorder_dump(paths.recorder_file)) < 0)
+				error("Unable to write %s: %s", paths.recorder_file, strerror(-ret));
+		}
+		if (toggle_trace) {
+			toggle_trace = 0;
+			if ((ret = bluealsa_trace_toggle(paths.trace_file)) < 0)
+				error("Unable to write %s: %s", paths.trace_file, strerror(-ret));
+		}
+
+		struct pollfd pfds[20];
+		nfds_t pfds_len = ARRAYSIZE(pfds) / 2;
+		nfds_t service_pfds_len = 0;
 		int res;
 
 		if (bluealsa_client_poll_fds(config.client, pfds, &pfds_len) < 0) {
@@ -362,22 +620,41 @@ int main(int argc, char *argv[]) {
 			return EXIT_FAILURE;
 		}
 
-		if ((res = poll(pfds, pfds_len, config.timeout)) == -1 &&
+		if (config.service != NULL) {
+			service_pfds_len = ARRAYSIZE(pfds) - pfds_len;
+			if (bluealsa_autoconfig_service_poll_fds(config.service, pfds + pfds_len, &service_pfds_len) < 0) {
+				error("Couldn't get D-Bus service file descriptors");
+				return EXIT_FAILURE;
+			}
+		}
+
+		int timeout = bluealsa_metrics_timeout();
+		const bool commit_timeout = config.timeout != -1 && (timeout == -1 || config.timeout <= timeout);
+		if (commit_timeout)
+			timeout = config.timeout;
+
+		if ((res = poll(pfds, pfds_len + service_pfds_len, timeout)) == -1 &&
 				errno == EINTR)
 			continue;
 
 		if (res == -1)
 			break;
 
+		bluealsa_metrics_flush();
+
 		/* timeout */
 		if (res == 0) {
-			bluealsa_autoconfig_clear_timeout(&config);
-			if (bluealsa_autoconfig_commit_changes(&config) == -1)
-				return EXIT_FAILURE;
+			if (commit_timeout) {
+				bluealsa_autoconfig_clear_timeout(&config);
+				if (bluealsa_autoconfig_commit_changes(&config) == -1)
+					return EXIT_FAILURE;
+			}
 			continue;
 		}
 
 		bluealsa_client_poll_dispatch(config.client, pfds, pfds_len);
+		if (config.service != NULL)
+			bluealsa_autoconfig_service_poll_dispatch(config.service, pfds + pfds_len, service_pfds_len);
 	}
 
 	bluealsa_autoconfig_cleanup(&config);
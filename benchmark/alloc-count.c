@@ -0,0 +1,57 @@
+/*
+ * bluealsa-autoconfig - benchmark/alloc-count.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Allocation counter, preloaded into a program that replays a trace. The
+ * replay looks up bluealsa_alloc_count() to report the allocations made per
+ * event and per commit.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long count = 0;
+
+unsigned long bluealsa_alloc_count(void) {
+	return __atomic_load_n(&count, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	void *mem;
+	if ((mem = memalign(alignment, size)) == NULL)
+		return ENOMEM;
+	*ptr = mem;
+	return 0;
+}
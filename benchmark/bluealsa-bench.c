@@ -0,0 +1,606 @@
+/*
+ * bluealsa-autoconfig - benchmark/bluealsa-bench.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * End-to-end latency benchmark. This program provides mock org.bluealsa and
+ * org.bluez services on a private bus, starts the daemon under test, and
+ * emits InterfacesAdded, PropertiesChanged and InterfacesRemoved signals for
+ * a population of PCMs at a set rate.
+ *
+ * For bluealsa-autoconfig the latency of each event is measured from the
+ * signal to the io.github.borine.bluealsa_autoconfig.Autoconfig1.Changed
+ * signal of the commit that includes it, so the daemon must be run with
+ * --publish. For bluealsa-agent it is measured from the signal to the exec
+ * of the handler; this program is itself the handler, and reports the exec
+ * time through a FIFO.
+ */
+
+#include <dbus/dbus.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef DBUS_INTERFACE_OBJECT_MANAGER
+# define DBUS_INTERFACE_OBJECT_MANAGER DBUS_INTERFACE_DBUS ".ObjectManager"
+#endif
+
+#define BENCH_FIFO_ENV "BLUEALSA_BENCH_FIFO"
+#define BENCH_PCM_INTERFACE "org.bluealsa.PCM1"
+#define BENCH_AUTOCONFIG_INTERFACE "io.github.borine.bluealsa_autoconfig.Autoconfig1"
+/* time allowed for the last event of a phase to be handled */
+#define BENCH_SETTLE_US (30 * 1000000ULL)
+
+enum bench_target {
+	BENCH_TARGET_AUTOCONFIG,
+	BENCH_TARGET_AGENT,
+};
+
+enum bench_phase {
+	BENCH_PHASE_ADD,
+	BENCH_PHASE_UPDATE,
+	BENCH_PHASE_REMOVE,
+};
+
+static const char *bench_phase_names[] = {
+	[BENCH_PHASE_ADD] = "add",
+	[BENCH_PHASE_UPDATE] = "update",
+	[BENCH_PHASE_REMOVE] = "remove",
+};
+
+struct bench_pcm {
+	char path[96];
+	char device[48];
+	char address[18];
+	const char *transport;
+	const char *mode;
+	const char *codec;
+	/* listed by GetManagedObjects */
+	bool present;
+	/* time the event being measured was sent, or 0 */
+	uint64_t sent;
+};
+
+static struct {
+	enum bench_target target;
+	DBusConnection *conn;
+	int fifo;
+	pid_t daemon;
+	struct bench_pcm *pcms;
+	size_t pcms_count;
+	/* number of sent events not yet handled */
+	size_t pending;
+	uint64_t *latencies;
+	size_t latencies_count;
+	/* the daemon has listed the PCMs */
+	bool ready;
+} bench = { .fifo = -1, .daemon = -1 };
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Handler mode: report the time of exec by the agent.
+ */
+static int bench_handler(const char *fifo, const char *event, const char *path) {
+	char line[256];
+	const uint64_t now = bench_now();
+	int fd, len;
+
+	if ((fd = open(fifo, O_WRONLY | O_CLOEXEC)) == -1)
+		return EXIT_FAILURE;
+	/* lines shorter than PIPE_BUF are written atomically */
+	len = snprintf(line, sizeof(line), "%s %s %ju\n", event, path, (uintmax_t)now);
+	if (write(fd, line, len) != len)
+		return EXIT_FAILURE;
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+static void bench_dict_append(DBusMessageIter *dict, const char *key, int type, const void *value) {
+	const char signature[] = { (char)type, '\0' };
+	DBusMessageIter entry, variant;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature, &variant);
+	dbus_message_iter_append_basic(&variant, type, value);
+	dbus_message_iter_close_container(&entry, &variant);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void bench_append_pcm_interface(DBusMessageIter *array, const struct bench_pcm *pcm) {
+	const char *interface = BENCH_PCM_INTERFACE;
+	const char *device = pcm->device;
+	const dbus_uint32_t sequence = 1;
+	const dbus_bool_t running = FALSE;
+	const dbus_bool_t softvol = TRUE;
+	const dbus_uint16_t format = 0x8210;
+	const unsigned char channels = 2;
+	const dbus_uint32_t rate = strcmp(pcm->transport, "A2DP-source") == 0 ? 48000 : 16000;
+	const dbus_uint16_t delay = 150;
+	const dbus_int16_t client_delay = 0;
+	DBusMessageIter entry, dict;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &interface);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	bench_dict_append(&dict, "Device", DBUS_TYPE_OBJECT_PATH, &device);
+	bench_dict_append(&dict, "Sequence", DBUS_TYPE_UINT32, &sequence);
+	bench_dict_append(&dict, "Transport", DBUS_TYPE_STRING, &pcm->transport);
+	bench_dict_append(&dict, "Mode", DBUS_TYPE_STRING, &pcm->mode);
+	bench_dict_append(&dict, "Running", DBUS_TYPE_BOOLEAN, &running);
+	bench_dict_append(&dict, "Format", DBUS_TYPE_UINT16, &format);
+	bench_dict_append(&dict, "Channels", DBUS_TYPE_BYTE, &channels);
+	bench_dict_append(&dict, "Rate", DBUS_TYPE_UINT32, &rate);
+	bench_dict_append(&dict, "Codec", DBUS_TYPE_STRING, &pcm->codec);
+	bench_dict_append(&dict, "Delay", DBUS_TYPE_UINT16, &delay);
+	bench_dict_append(&dict, "ClientDelay", DBUS_TYPE_INT16, &client_delay);
+	bench_dict_append(&dict, "SoftVolume", DBUS_TYPE_BOOLEAN, &softvol);
+	dbus_message_iter_close_container(&entry, &dict);
+	dbus_message_iter_close_container(array, &entry);
+}
+
+static void bench_send(DBusMessage *msg) {
+	dbus_connection_send(bench.conn, msg, NULL);
+	dbus_message_unref(msg);
+}
+
+static void bench_emit_added(const struct bench_pcm *pcm) {
+	DBusMessage *msg = dbus_message_new_signal("/org/bluealsa",
+			DBUS_INTERFACE_OBJECT_MANAGER, "InterfacesAdded");
+	const char *path = pcm->path;
+	DBusMessageIter iter, array;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sa{sv}}", &array);
+	bench_append_pcm_interface(&array, pcm);
+	dbus_message_iter_close_container(&iter, &array);
+	bench_send(msg);
+}
+
+static void bench_emit_removed(const struct bench_pcm *pcm) {
+	DBusMessage *msg = dbus_message_new_signal("/org/bluealsa",
+			DBUS_INTERFACE_OBJECT_MANAGER, "InterfacesRemoved");
+	const char *path = pcm->path;
+	const char *interface = BENCH_PCM_INTERFACE;
+	DBusMessageIter iter, array;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &interface);
+	dbus_message_iter_close_container(&iter, &array);
+	bench_send(msg);
+}
+
+static void bench_emit_codec_changed(const struct bench_pcm *pcm) {
+	DBusMessage *msg = dbus_message_new_signal(pcm->path,
+			DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+	const char *interface = BENCH_PCM_INTERFACE;
+	DBusMessageIter iter, dict, array;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	bench_dict_append(&dict, "Codec", DBUS_TYPE_STRING, &pcm->codec);
+	dbus_message_iter_close_container(&iter, &dict);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array);
+	dbus_message_iter_close_container(&iter, &array);
+	bench_send(msg);
+}
+
+static DBusMessage *bench_get_managed_objects(DBusMessage *call) {
+	DBusMessage *reply = dbus_message_new_method_return(call);
+	DBusMessageIter iter, objects, object, interfaces;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &objects);
+
+	/* BlueZ objects are queried at "/", and have no media transports */
+	if (strcmp(dbus_message_get_path(call), "/org/bluealsa") == 0)
+		for (size_t n = 0; n < bench.pcms_count; n++) {
+			const char *path = bench.pcms[n].path;
+			if (!bench.pcms[n].present)
+				continue;
+			dbus_message_iter_open_container(&objects, DBUS_TYPE_DICT_ENTRY, NULL, &object);
+			dbus_message_iter_append_basic(&object, DBUS_TYPE_OBJECT_PATH, &path);
+			dbus_message_iter_open_container(&object, DBUS_TYPE_ARRAY, "{sa{sv}}", &interfaces);
+			bench_append_pcm_interface(&interfaces, &bench.pcms[n]);
+			dbus_message_iter_close_container(&object, &interfaces);
+			dbus_message_iter_close_container(&objects, &object);
+		}
+
+	dbus_message_iter_close_container(&iter, &objects);
+	return reply;
+}
+
+static DBusMessage *bench_get_device(DBusMessage *call) {
+	DBusMessage *reply = dbus_message_new_method_return(call);
+	const char *path = dbus_message_get_path(call);
+	const dbus_bool_t connected = TRUE;
+	const char *adapter = "/org/bluez/hci0";
+	DBusMessageIter iter, dict;
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (size_t n = 0; n < bench.pcms_count; n++)
+		if (strcmp(bench.pcms[n].device, path) == 0) {
+			const char *address = bench.pcms[n].address;
+			bench_dict_append(&dict, "Adapter", DBUS_TYPE_OBJECT_PATH, &adapter);
+			bench_dict_append(&dict, "Address", DBUS_TYPE_STRING, &address);
+			bench_dict_append(&dict, "Alias", DBUS_TYPE_STRING, &address);
+			bench_dict_append(&dict, "Connected", DBUS_TYPE_BOOLEAN, &connected);
+			break;
+		}
+	dbus_message_iter_close_container(&iter, &dict);
+	return reply;
+}
+
+static void bench_commit(void) {
+	const uint64_t now = bench_now();
+	for (size_t n = 0; n < bench.pcms_count; n++)
+		if (bench.pcms[n].sent != 0) {
+			bench.latencies[bench.latencies_count++] = now - bench.pcms[n].sent;
+			bench.pcms[n].sent = 0;
+			bench.pending--;
+		}
+}
+
+static DBusHandlerResult bench_message(DBusConnection *conn, DBusMessage *msg, void *data) {
+	(void)data;
+	DBusMessage *reply;
+
+	if (dbus_message_is_signal(msg, BENCH_AUTOCONFIG_INTERFACE, "Changed")) {
+		bench_commit();
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (dbus_message_is_method_call(msg, DBUS_INTERFACE_OBJECT_MANAGER, "GetManagedObjects")) {
+		reply = bench_get_managed_objects(msg);
+		bench.ready = true;
+	}
+	else if (dbus_message_is_method_call(msg, DBUS_INTERFACE_PROPERTIES, "GetAll"))
+		reply = bench_get_device(msg);
+	else
+		reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, dbus_message_get_member(msg));
+
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void bench_read_fifo(void) {
+	static char buffer[4096];
+	static size_t len = 0;
+	char *line, *end;
+	ssize_t ret;
+
+	if ((ret = read(bench.fifo, buffer + len, sizeof(buffer) - len - 1)) <= 0)
+		return;
+	len += ret;
+	buffer[len] = '\0';
+
+	for (line = buffer; (end = strchr(line, '\n')) != NULL; line = end + 1) {
+		char event[16], path[96];
+		uintmax_t time;
+
+		*end = '\0';
+		if (sscanf(line, "%15s %95s %ju", event, path, &time) != 3)
+			continue;
+		for (size_t n = 0; n < bench.pcms_count; n++) {
+			struct bench_pcm *pcm = &bench.pcms[n];
+			if (pcm->sent != 0 && strcmp(pcm->path, path) == 0) {
+				bench.latencies[bench.latencies_count++] = time - pcm->sent;
+				pcm->sent = 0;
+				bench.pending--;
+				break;
+			}
+		}
+	}
+
+	len -= line - buffer;
+	memmove(buffer, line, len);
+}
+
+/**
+ * Serve the bus and the FIFO until the given time.
+ * @param until monotonic time in microseconds.
+ * @param settle if true, return as soon as no events are pending.
+ */
+static void bench_run(uint64_t until, bool settle) {
+	int dbus_fd;
+
+	dbus_connection_get_unix_fd(bench.conn, &dbus_fd);
+
+	for (;;) {
+		dbus_connection_flush(bench.conn);
+		while (dbus_connection_dispatch(bench.conn) == DBUS_DISPATCH_DATA_REMAINS)
+			continue;
+
+		const uint64_t now = bench_now();
+		if (now >= until || (settle && bench.pending == 0))
+			return;
+
+		struct pollfd pfds[] = {
+			{ dbus_fd, POLLIN, 0 },
+			{ bench.fifo, POLLIN, 0 },
+		};
+		int timeout = (until - now + 999) / 1000;
+		if (poll(pfds, bench.fifo == -1 ? 1 : 2, timeout) == -1 && errno != EINTR)
+			return;
+
+		if (pfds[0].revents)
+			dbus_connection_read_write(bench.conn, 0);
+		if (bench.fifo != -1 && pfds[1].revents)
+			bench_read_fifo();
+	}
+}
+
+static int bench_compare(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Send one event for each PCM at the given rate, and wait for them to be
+ * handled.
+ * @return the number of events not handled in time.
+ */
+static size_t bench_phase(enum bench_phase phase, unsigned int rate) {
+	const uint64_t start = bench_now();
+	uint64_t sum = 0;
+
+	bench.latencies_count = 0;
+	bench.pending = 0;
+
+	for (size_t n = 0; n < bench.pcms_count; n++) {
+		struct bench_pcm *pcm = &bench.pcms[n];
+
+		bench_run(start + n * 1000000ULL / rate, false);
+
+		pcm->sent = bench_now();
+		bench.pending++;
+		switch (phase) {
+		case BENCH_PHASE_ADD:
+			pcm->present = true;
+			bench_emit_added(pcm);
+			break;
+		case BENCH_PHASE_UPDATE:
+			pcm->codec = strcmp(pcm->codec, "SBC") == 0 ? "AAC" :
+				strcmp(pcm->codec, "AAC") == 0 ? "SBC" :
+				strcmp(pcm->codec, "CVSD") == 0 ? "mSBC" : "CVSD";
+			bench_emit_codec_changed(pcm);
+			break;
+		case BENCH_PHASE_REMOVE:
+			pcm->present = false;
+			bench_emit_removed(pcm);
+			break;
+		}
+	}
+
+	bench_run(bench_now() + BENCH_SETTLE_US, true);
+
+	const size_t missed = bench.pending;
+	for (size_t n = 0; n < bench.pcms_count; n++)
+		bench.pcms[n].sent = 0;
+
+	qsort(bench.latencies, bench.latencies_count, sizeof(*bench.latencies), bench_compare);
+	for (size_t n = 0; n < bench.latencies_count; n++)
+		sum += bench.latencies[n];
+
+	printf("%-6s pcms=%zu rate=%u/s handled=%zu missed=%zu", bench_phase_names[phase],
+			bench.pcms_count, rate, bench.latencies_count, missed);
+	if (bench.latencies_count > 0)
+		printf(" latency ms: mean=%.3f p50=%.3f p99=%.3f max=%.3f",
+				sum / 1000.0 / bench.latencies_count,
+				bench.latencies[bench.latencies_count / 2] / 1000.0,
+				bench.latencies[bench.latencies_count * 99 / 100] / 1000.0,
+				bench.latencies[bench.latencies_count - 1] / 1000.0);
+	printf("\n");
+	fflush(stdout);
+
+	return missed;
+}
+
+static void bench_init_pcms(size_t count) {
+	bench.pcms = calloc(count, sizeof(*bench.pcms));
+	bench.latencies = calloc(count, sizeof(*bench.latencies));
+	bench.pcms_count = count;
+
+	/* two PCMs per device: A2DP playback and HFP playback */
+	for (size_t n = 0; n < count; n++) {
+		struct bench_pcm *pcm = &bench.pcms[n];
+		const unsigned int dev = n / 2;
+		snprintf(pcm->address, sizeof(pcm->address), "00:11:22:33:%02X:%02X",
+				(dev >> 8) & 0xff, dev & 0xff);
+		snprintf(pcm->device, sizeof(pcm->device), "/org/bluez/hci0/dev_00_11_22_33_%02X_%02X",
+				(dev >> 8) & 0xff, dev & 0xff);
+		if (n % 2 == 0) {
+			pcm->transport = "A2DP-source";
+			pcm->mode = "sink";
+			pcm->codec = "SBC";
+			snprintf(pcm->path, sizeof(pcm->path), "/org/bluealsa/hci0/dev_00_11_22_33_%02X_%02X/a2dpsrc/sink",
+					(dev >> 8) & 0xff, dev & 0xff);
+		}
+		else {
+			pcm->transport = "HFP-AG";
+			pcm->mode = "sink";
+			pcm->codec = "CVSD";
+			snprintf(pcm->path, sizeof(pcm->path), "/org/bluealsa/hci0/dev_00_11_22_33_%02X_%02X/hfpag/sink",
+					(dev >> 8) & 0xff, dev & 0xff);
+		}
+	}
+}
+
+static pid_t bench_spawn(char *argv[], const char *fifo) {
+	pid_t pid;
+
+	if ((pid = fork()) == 0) {
+		if (fifo != NULL)
+			setenv(BENCH_FIFO_ENV, fifo, 1);
+		execv(argv[0], argv);
+		fprintf(stderr, "Couldn't execute %s: %s\n", argv[0], strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void bench_stop_daemon(void) {
+	if (bench.daemon <= 0)
+		return;
+	kill(bench.daemon, SIGTERM);
+	waitpid(bench.daemon, NULL, 0);
+	bench.daemon = -1;
+}
+
+int main(int argc, char *argv[]) {
+	const char *fifo = getenv(BENCH_FIFO_ENV);
+	const char *address = NULL;
+	char fifo_path[64] = "";
+	unsigned int pcms = 1;
+	unsigned int rate = 1000;
+	DBusError err = DBUS_ERROR_INIT;
+	size_t missed = 0;
+	int opt;
+
+	/* the agent runs us as PROGRAM EVENT PATH */
+	if (fifo != NULL && argc == 3 && argv[1][0] != '-')
+		return bench_handler(fifo, argv[1], argv[2]);
+
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "bus-address", required_argument, NULL, 'a' },
+		{ "pcms", required_argument, NULL, 'n' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "target", required_argument, NULL, 't' },
+		{ 0, 0, 0, 0 },
+	};
+
+	while ((opt = getopt_long(argc, argv, "+ha:n:r:t:", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h' /* --help */ :
+			printf("Usage:\n"
+					"  %s [OPTION]... -- DAEMON [ARG]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\t\tprint this help and exit\n"
+					"  -a, --bus-address=ADDRESS\tD-Bus server address\n"
+					"  -n, --pcms=N\t\t\tnumber of PCMs\n"
+					"  -r, --rate=N\t\t\tevents per second\n"
+					"  -t, --target=[autoconfig|agent]\n"
+					"\t\t\t\tdaemon under test\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'a' /* --bus-address=ADDRESS */ :
+			address = optarg;
+			break;
+		case 'n' /* --pcms=N */ :
+			pcms = atoi(optarg);
+			break;
+		case 'r' /* --rate=N */ :
+			rate = atoi(optarg);
+			break;
+		case 't' /* --target=[autoconfig|agent] */ :
+			if (strcmp(optarg, "autoconfig") == 0)
+				bench.target = BENCH_TARGET_AUTOCONFIG;
+			else if (strcmp(optarg, "agent") == 0)
+				bench.target = BENCH_TARGET_AGENT;
+			else {
+				fprintf(stderr, "Invalid target: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	if (address == NULL || optind == argc || pcms == 0 || rate == 0) {
+		fprintf(stderr, "Usage: %s --bus-address=ADDRESS [OPTION]... -- DAEMON [ARG]...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((bench.conn = dbus_connection_open_private(address, &err)) == NULL ||
+			!dbus_bus_register(bench.conn, &err)) {
+		fprintf(stderr, "Couldn't connect to %s: %s\n", address, err.message);
+		return EXIT_FAILURE;
+	}
+	if (dbus_bus_request_name(bench.conn, "org.bluealsa", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) !=
+				DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER ||
+			dbus_bus_request_name(bench.conn, "org.bluez", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err) !=
+				DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "Couldn't acquire mock service names\n");
+		return EXIT_FAILURE;
+	}
+	dbus_connection_add_filter(bench.conn, bench_message, NULL, NULL);
+	dbus_bus_add_match(bench.conn, "type='signal',interface='" BENCH_AUTOCONFIG_INTERFACE "',member='Changed'", NULL);
+
+	if (bench.target == BENCH_TARGET_AGENT) {
+		snprintf(fifo_path, sizeof(fifo_path), "/tmp/bluealsa-bench-%d.fifo", getpid());
+		/* opened for writing too, so that it never reports EOF */
+		if (mkfifo(fifo_path, 0600) == -1 ||
+				(bench.fifo = open(fifo_path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1) {
+			fprintf(stderr, "Couldn't create FIFO %s: %s\n", fifo_path, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	bench_init_pcms(pcms);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((bench.daemon = bench_spawn(&argv[optind], fifo_path[0] != '\0' ? fifo_path : NULL)) == -1) {
+		fprintf(stderr, "Couldn't start %s: %s\n", argv[optind], strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* the daemon is ready once it has listed the PCMs; allow it to finish
+	 * its start-up before sending events */
+	const uint64_t deadline = bench_now() + 10000000;
+	while (!bench.ready && bench_now() < deadline &&
+			waitpid(bench.daemon, NULL, WNOHANG) == 0)
+		bench_run(bench_now() + 100000, false);
+	if (!bench.ready) {
+		fprintf(stderr, "Daemon %s did not start\n", argv[optind]);
+		bench_stop_daemon();
+		missed = pcms;
+		goto final;
+	}
+	bench_run(bench_now() + 500000, false);
+
+	missed += bench_phase(BENCH_PHASE_ADD, rate);
+	missed += bench_phase(BENCH_PHASE_UPDATE, rate);
+	missed += bench_phase(BENCH_PHASE_REMOVE, rate);
+
+	bench_stop_daemon();
+
+final:
+	if (fifo_path[0] != '\0')
+		unlink(fifo_path);
+	dbus_connection_close(bench.conn);
+	dbus_connection_unref(bench.conn);
+	free(bench.pcms);
+	free(bench.latencies);
+	return missed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+# bluealsa-autoconfig - benchmark/bluealsa-bench.sh
+# SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine/>
+# SPDX-License-Identifier: MIT
+#
+# Run one end-to-end latency benchmark on a private message bus.
+# Usage: bluealsa-bench.sh DBUS-DAEMON BENCH TARGET PCMS DAEMON [RECORD-FILE]
+
+dbus_daemon=$1 bench=$2 target=$3 pcms=$4 daemon=$5
+record=${6:+--record=$6}
+
+dir=$(mktemp -d) || exit 1
+trap 'kill $bus 2>/dev/null; rm -rf "$dir"' EXIT
+
+# bluealsa-autoconfig writes its files below this root, not the system ones
+mkdir -p "$dir/root/var/lib/alsa" "$dir/root/run" || exit 1
+
+cat > "$dir/bus.conf" <<EOC
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$dir/bus</listen>
+  <policy context="default">
+    <allow send_destination="*"/>
+    <allow receive_sender="*"/>
+    <allow own="*"/>
+  </policy>
+</busconfig>
+EOC
+
+"$dbus_daemon" --config-file="$dir/bus.conf" --nofork --print-address=3 3>"$dir/address" &
+bus=$!
+while [ ! -s "$dir/address" ]; do
+	kill -0 $bus 2>/dev/null || exit 1
+	sleep 0.1
+done
+address=$(head -n 1 "$dir/address")
+
+case "$target" in
+autoconfig)
+	"$bench" --bus-address="$address" --target=autoconfig --pcms="$pcms" -- \
+		"$daemon" --publish --bus-address="$address" --root="$dir/root" $record
+	;;
+agent)
+	# the benchmark program is also the handler, which reports its exec time
+	"$bench" --bus-address="$address" --target=agent --pcms="$pcms" -- \
+		"$daemon" --bus-address="$address" $record "$bench"
+	;;
+esac
@@ -0,0 +1,28 @@
+#!/bin/sh
+# bluealsa-autoconfig - benchmark/bluealsa-replay.sh
+# SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine/>
+# SPDX-License-Identifier: MIT
+#
+# Record the events of one end-to-end benchmark, then replay them with no
+# message bus and report the cost of handling them.
+# Usage: bluealsa-replay.sh BENCH-SCRIPT DBUS-DAEMON BENCH TARGET PCMS DAEMON ALLOC-COUNT HANDLER
+
+bench_script=$1 dbus_daemon=$2 bench=$3 target=$4 pcms=$5 daemon=$6
+alloc_count=$7 handler=$8
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+"$bench_script" "$dbus_daemon" "$bench" "$target" "$pcms" "$daemon" "$dir/trace" >/dev/null
+ret=$?
+[ $ret -eq 0 ] || exit $ret
+
+case "$target" in
+autoconfig)
+	mkdir -p "$dir/root/var/lib/alsa" "$dir/root/run" || exit 1
+	LD_PRELOAD="$alloc_count" "$daemon" --replay="$dir/trace" --root="$dir/root"
+	;;
+agent)
+	LD_PRELOAD="$alloc_count" "$daemon" --replay="$dir/trace" "$handler"
+	;;
+esac
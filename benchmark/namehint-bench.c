@@ -0,0 +1,331 @@
+/*
+ * bluealsa-autoconfig - benchmark/namehint-bench.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+/*
+ * Microbenchmark of the namehint container. A synthetic population of PCMs is
+ * added, updated, printed and removed, and the time, the allocations and the
+ * output size of each operation are reported. Device lookups are answered by
+ * a stub, so no D-Bus connection is made. The allocation counter is linked
+ * into this program.
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alsa.h"
+#include "bluealsa-client.h"
+#include "namehint.h"
+
+unsigned long bluealsa_alloc_count(void);
+
+/* the default description template of bluealsa-autoconfig */
+#define BENCH_PATTERN "%n %p (%c)%lBluetooth Audio %s"
+
+/* enough for the output of the largest population */
+#define BENCH_OUTPUT_SIZE (64 * 1024 * 1024)
+
+struct bench_result {
+	uint64_t time;
+	unsigned long allocs;
+	size_t bytes;
+	unsigned long ops;
+};
+
+static struct {
+	struct ba_pcm *pcms;
+	/* index into services of the service of each PCM */
+	unsigned int *pcm_services;
+	unsigned int count;
+	char (*services)[32];
+	unsigned int services_count;
+	/* index into pcms of each PCM, in the order of update and removal */
+	unsigned int *order;
+	char *output;
+	FILE *file;
+} bench = { 0 };
+
+/**
+ * Answer a device lookup from the device path, instead of from BlueZ.
+ * The address is taken from the "dev_XX_XX_XX_XX_XX_XX" path suffix. */
+int bluealsa_client_get_device(bluealsa_client_t client, struct bluealsa_client_device *device) {
+	(void)client;
+
+	const char *dev = strstr(device->path, "/dev_");
+	if (dev == NULL)
+		return -1;
+	strncpy(device->hex_addr, dev + 5, sizeof(device->hex_addr) - 1);
+	device->hex_addr[sizeof(device->hex_addr) - 1] = '\0';
+	for (char *c = device->hex_addr; *c != '\0'; c++)
+		if (*c == '_')
+			*c = ':';
+	snprintf(device->alias, sizeof(device->alias), "Bench Device %s", dev + 5);
+
+	return 0;
+}
+
+static uint64_t bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_pcm_init(struct ba_pcm *pcm, unsigned int device, unsigned int transport, unsigned int mode, const char *codec) {
+	const char *profile = transport == BA_PCM_TRANSPORT_A2DP_SOURCE ? "a2dpsrc" : "hfpag";
+
+	memset(pcm, 0, sizeof(*pcm));
+	snprintf(pcm->device_path, sizeof(pcm->device_path),
+			"/org/bluez/hci0/dev_00_00_00_%02X_%02X_%02X",
+			(device >> 16) & 0xFF, (device >> 8) & 0xFF, device & 0xFF);
+	snprintf(pcm->pcm_path, sizeof(pcm->pcm_path),
+			"/org/bluealsa/hci0/dev_00_00_00_%02X_%02X_%02X/%s/%s",
+			(device >> 16) & 0xFF, (device >> 8) & 0xFF, device & 0xFF,
+			profile, mode == BA_PCM_MODE_SINK ? "sink" : "source");
+	pcm->transport = transport;
+	pcm->mode = mode;
+	strcpy(pcm->codec.name, codec);
+}
+
+/**
+ * Create the population. Each device has an A2DP playback PCM, and the given
+ * percentage of devices also has a duplex HFP pair. Devices are assigned to
+ * the services in turn.
+ * @return 0 on success, -1 on allocation failure. */
+static int bench_populate(unsigned int count, unsigned int services, unsigned int duplex) {
+	if ((bench.pcms = calloc(count, sizeof(*bench.pcms))) == NULL ||
+			(bench.pcm_services = calloc(count, sizeof(*bench.pcm_services))) == NULL ||
+			(bench.order = calloc(count, sizeof(*bench.order))) == NULL ||
+			(bench.services = calloc(services, sizeof(*bench.services))) == NULL)
+		return -1;
+
+	bench.count = count;
+	bench.services_count = services;
+	for (unsigned int i = 0; i < services; i++)
+		snprintf(bench.services[i], sizeof(bench.services[i]),
+				i == 0 ? "org.bluealsa" : "org.bluealsa.bench%u", i);
+
+	for (unsigned int i = 0, device = 0; i < count; device++) {
+		const unsigned int first = i;
+		bench_pcm_init(&bench.pcms[i++], device, BA_PCM_TRANSPORT_A2DP_SOURCE, BA_PCM_MODE_SINK, "SBC");
+		/* spread the duplex devices evenly over the population */
+		if ((device * 37) % 100 < duplex) {
+			if (i < count)
+				bench_pcm_init(&bench.pcms[i++], device, BA_PCM_TRANSPORT_HFP_AG, BA_PCM_MODE_SINK, "CVSD");
+			if (i < count)
+				bench_pcm_init(&bench.pcms[i++], device, BA_PCM_TRANSPORT_HFP_AG, BA_PCM_MODE_SOURCE, "CVSD");
+		}
+		for (unsigned int j = first; j < i; j++)
+			bench.pcm_services[j] = device % services;
+	}
+
+	/* fixed shuffle, so that runs are comparable */
+	uint32_t seed = 1;
+	for (unsigned int i = 0; i < count; i++)
+		bench.order[i] = i;
+	for (unsigned int i = count; i > 1; i--) {
+		seed = seed * 1103515245 + 12345;
+		unsigned int j = (seed >> 8) % i;
+		unsigned int tmp = bench.order[i - 1];
+		bench.order[i - 1] = bench.order[j];
+		bench.order[j] = tmp;
+	}
+
+	return 0;
+}
+
+static void bench_add_all(struct bluealsa_namehint *hint) {
+	for (unsigned int i = 0; i < bench.count; i++)
+		bluealsa_namehint_pcm_add(hint, &bench.pcms[i], NULL, bench.services[bench.pcm_services[i]]);
+}
+
+static void bench_start(struct bench_result *result) {
+	result->allocs -= bluealsa_alloc_count();
+	result->time -= bench_now();
+}
+
+static void bench_stop(struct bench_result *result, unsigned long ops) {
+	result->time += bench_now();
+	result->allocs += bluealsa_alloc_count();
+	result->ops += ops;
+}
+
+enum {
+	BENCH_ADD,
+	BENCH_UPDATE,
+	BENCH_PRINT,
+	BENCH_PRINT_SERVICE,
+	BENCH_PRINT_DEFAULT,
+	BENCH_REMOVE,
+	BENCH_SERVICE_REMOVE,
+	BENCH_OPS,
+};
+
+static const char *bench_op_names[BENCH_OPS] = {
+	[BENCH_ADD] = "pcm_add",
+	[BENCH_UPDATE] = "pcm_update",
+	[BENCH_PRINT] = "print",
+	[BENCH_PRINT_SERVICE] = "print_service",
+	[BENCH_PRINT_DEFAULT] = "print_default",
+	[BENCH_REMOVE] = "pcm_remove",
+	[BENCH_SERVICE_REMOVE] = "service_remove",
+};
+
+/**
+ * Run one round of every operation on the whole population.
+ * @return 0 on success, -1 otherwise. */
+static int bench_round(struct bench_result *results) {
+	struct bluealsa_namehint *hint;
+	struct bench_result *r;
+
+	if (bluealsa_namehint_init(&hint) == -1)
+		return -1;
+
+	r = &results[BENCH_ADD];
+	bench_start(r);
+	bench_add_all(hint);
+	bench_stop(r, bench.count);
+
+	r = &results[BENCH_UPDATE];
+	bench_start(r);
+	for (unsigned int i = 0; i < bench.count; i++) {
+		const struct ba_pcm *pcm = &bench.pcms[bench.order[i]];
+		const char *codec = pcm->transport == BA_PCM_TRANSPORT_HFP_AG ? "mSBC" : "AAC";
+		bluealsa_namehint_pcm_update(hint, pcm->pcm_path, codec);
+	}
+	bench_stop(r, bench.count);
+
+	r = &results[BENCH_PRINT];
+	rewind(bench.file);
+	bench_start(r);
+	bluealsa_namehint_print(hint, bench.file, BENCH_PATTERN, false);
+	bench_stop(r, 1);
+	r->bytes = ftell(bench.file);
+
+	r = &results[BENCH_PRINT_SERVICE];
+	rewind(bench.file);
+	bench_start(r);
+	bluealsa_namehint_print(hint, bench.file, BENCH_PATTERN, true);
+	bench_stop(r, 1);
+	r->bytes = ftell(bench.file);
+
+	r = &results[BENCH_PRINT_DEFAULT];
+	rewind(bench.file);
+	bench_start(r);
+	bluealsa_namehint_print_default(hint, bench.file);
+	bench_stop(r, 1);
+	r->bytes = ftell(bench.file);
+
+	r = &results[BENCH_REMOVE];
+	bench_start(r);
+	for (unsigned int i = 0; i < bench.count; i++)
+		bluealsa_namehint_pcm_remove(hint, bench.pcms[bench.order[i]].pcm_path);
+	bench_stop(r, bench.count);
+
+	bench_add_all(hint);
+	r = &results[BENCH_SERVICE_REMOVE];
+	bench_start(r);
+	for (unsigned int i = 0; i < bench.services_count; i++)
+		bluealsa_namehint_service_remove(hint, bench.services[i]);
+	bench_stop(r, bench.services_count);
+
+	bluealsa_namehint_free(hint);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int opt;
+	const char *opts = "hn:s:d:r:";
+	const struct option longopts[] = {
+		{ "help", no_argument, NULL, 'h' },
+		{ "pcms", required_argument, NULL, 'n' },
+		{ "services", required_argument, NULL, 's' },
+		{ "duplex", required_argument, NULL, 'd' },
+		{ "rounds", required_argument, NULL, 'r' },
+		{ 0, 0, 0, 0 },
+	};
+
+	unsigned int pcms = 100;
+	unsigned int services = 1;
+	unsigned int duplex = 0;
+	unsigned int rounds = 0;
+
+	while ((opt = getopt_long(argc, argv, opts, longopts, NULL)) != -1)
+		switch (opt) {
+		case 'h':
+			printf("Usage:\n"
+					"  %s [OPTION]...\n"
+					"\nOptions:\n"
+					"  -h, --help\t\tprint this help and exit\n"
+					"  -n, --pcms=NUM\tnumber of PCMs (default 100)\n"
+					"  -s, --services=NUM\tnumber of BlueALSA services (default 1)\n"
+					"  -d, --duplex=PERCENT\tdevices with a duplex HFP pair (default 0)\n"
+					"  -r, --rounds=NUM\tnumber of rounds (default by population)\n",
+					argv[0]);
+			return EXIT_SUCCESS;
+		case 'n':
+			pcms = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			services = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			duplex = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+
+	if (pcms == 0 || services == 0 || duplex > 100) {
+		fprintf(stderr, "%s: Invalid population\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	/* about 10000 operations on PCMs of each kind, and at least 3 rounds */
+	if (rounds == 0)
+		rounds = pcms >= 10000 / 3 ? 3 : 10000 / pcms;
+
+	alsa_version_init();
+
+	if (bench_populate(pcms, services, duplex) == -1 ||
+			(bench.output = malloc(BENCH_OUTPUT_SIZE)) == NULL ||
+			(bench.file = fmemopen(bench.output, BENCH_OUTPUT_SIZE, "w")) == NULL) {
+		perror("Couldn't set up benchmark");
+		return EXIT_FAILURE;
+	}
+
+	struct bench_result results[BENCH_OPS] = { 0 };
+	for (unsigned int i = 0; i < rounds; i++)
+		if (bench_round(results) == -1) {
+			perror("Couldn't create namehint container");
+			return EXIT_FAILURE;
+		}
+
+	printf("PCMs: %u, services: %u, duplex: %u%%, rounds: %u\n",
+			pcms, services, duplex, rounds);
+	printf("%-16s %12s %12s %12s\n", "operation", "ns/op", "allocs/op", "bytes");
+	for (unsigned int i = 0; i < BENCH_OPS; i++)
+		printf("%-16s %12.1f %12.2f %12zu\n", bench_op_names[i],
+				(double)results[i].time / results[i].ops,
+				(double)results[i].allocs / results[i].ops,
+				results[i].bytes);
+
+	fclose(bench.file);
+	free(bench.output);
+	free(bench.services);
+	free(bench.order);
+	free(bench.pcm_services);
+	free(bench.pcms);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+/*
+ * bluealsa-autoconfig - bluealsa-agent-plugin.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_PLUGIN_H
+#define BLUEALSA_AGENT_PLUGIN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Interface for bluealsa-agent action plugins.
+ *
+ * A plugin is a shared object which exports a constant
+ * struct bluealsa_agent_plugin with the name given by
+ * BLUEALSA_AGENT_PLUGIN_SYMBOL. The agent calls init_func once at startup and
+ * free_func once at exit, both from its main thread. The event callbacks,
+ * add_func, remove_func and update_func, are called from a worker thread
+ * dedicated to the plugin, one call at a time. free_func is called only after
+ * the worker thread has ended, so a plugin needs no locking of its own data.
+ * A callback which does not return within the plugin time budget causes the
+ * plugin to be disabled. If that callback is still running at exit, the
+ * worker thread is abandoned and free_func is not called.
+ */
+
+/* Increment whenever this interface is changed incompatibly */
+#define BLUEALSA_AGENT_PLUGIN_ABI_VERSION 1
+
+#define BLUEALSA_AGENT_PLUGIN_SYMBOL "bluealsa_agent_plugin"
+
+/* Default time budget for a single callback, in milliseconds */
+#define BLUEALSA_AGENT_PLUGIN_DEFAULT_BUDGET 1000
+
+/* Bits of the changes mask passed to update_func */
+enum {
+	BLUEALSA_AGENT_CHANGE_CODEC        = 1 << 0,
+	BLUEALSA_AGENT_CHANGE_FORMAT       = 1 << 1,
+	BLUEALSA_AGENT_CHANGE_CHANNELS     = 1 << 2,
+	BLUEALSA_AGENT_CHANGE_RATE         = 1 << 3,
+	BLUEALSA_AGENT_CHANGE_CODEC_CONFIG = 1 << 4,
+	BLUEALSA_AGENT_CHANGE_DELAY        = 1 << 5,
+	BLUEALSA_AGENT_CHANGE_CLIENT_DELAY = 1 << 6,
+	BLUEALSA_AGENT_CHANGE_RUNNING      = 1 << 7,
+	BLUEALSA_AGENT_CHANGE_SOFTVOL      = 1 << 8,
+	BLUEALSA_AGENT_CHANGE_MODE         = 1 << 9,
+};
+
+/* The PCM properties, as passed to the handler environment variables */
+struct bluealsa_pcm_data {
+	char path[128];
+	char device_path[128];
+	char address[18];
+	char alias[64];
+	char profile[5];
+	char mode[9];
+	char codec[16];
+	char codec_config[64];
+	char format[16];
+	char channels[3];
+	char rate[8];
+	char transport[12];
+	char transport_type[5];
+	char service[32];
+	char alsa_id[96];
+	uint16_t server_delay;
+	int16_t client_delay;
+	bool running;
+	bool softvol;
+};
+
+struct bluealsa_agent_plugin {
+	/* must be BLUEALSA_AGENT_PLUGIN_ABI_VERSION */
+	unsigned int abi_version;
+	const char *name;
+	/* time budget for a single callback in milliseconds, 0 for default */
+	unsigned int budget;
+	/* args is the text following the plugin name in the agent option, or
+	 * NULL; data receives a pointer to be passed to the other functions.
+	 * Returns 0 on success, or a negative error code. Called from the agent
+	 * main thread. May be NULL. */
+	int (*init_func)(const char *args, void **data);
+	/* Called from the plugin worker thread */
+	void (*add_func)(const struct bluealsa_pcm_data *pcm, void *data);
+	void (*remove_func)(const struct bluealsa_pcm_data *pcm, void *data);
+	void (*update_func)(const struct bluealsa_pcm_data *pcm, unsigned int changes, void *data);
+	/* Called from the agent main thread, after the worker thread has ended,
+	 * or if the worker thread cannot be started. May be NULL. */
+	void (*free_func)(void *data);
+};
+
+#endif
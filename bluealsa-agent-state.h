@@ -0,0 +1,166 @@
+/*
+ * bluealsa-autoconfig - bluealsa-agent-state.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_AGENT_STATE_H
+#define BLUEALSA_AGENT_STATE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Live PCM state file of bluealsa-agent.
+ *
+ * With the --state-file option the agent keeps one fixed-size record for
+ * each PCM selected by its rule sets in a file of fixed size, which readers
+ * map into memory. The agent updates the records under a sequence lock: the
+ * sequence number is odd while an update is in progress and is incremented
+ * again when it is complete. A reader copies the records, then repeats the
+ * copy if the sequence number was odd or has changed. So, once the file is
+ * mapped, a consistent snapshot of all the PCMs costs no system calls.
+ *
+ * The agent replaces the file when it starts, and sets
+ * BLUEALSA_AGENT_STATE_CLOSED and removes the file when it exits. A reader
+ * that finds that flag set should map the file again later.
+ *
+ * The functions below are the complete reader API; there is no library to
+ * link.
+ */
+
+#define BLUEALSA_AGENT_STATE_MAGIC 0x53414c42 /* "BLAS" */
+
+/* Increment whenever the file layout is changed incompatibly */
+#define BLUEALSA_AGENT_STATE_VERSION 1
+
+/* Most PCMs recorded in the file */
+#define BLUEALSA_AGENT_STATE_MAX_PCMS 64
+
+/* Bits of the state flags */
+#define BLUEALSA_AGENT_STATE_CLOSED (1 << 0)
+
+/* Bits of each channel volume, as in the BlueALSA Volume property */
+#define BLUEALSA_AGENT_STATE_VOLUME_MUTED 0x80
+#define BLUEALSA_AGENT_STATE_VOLUME_LEVEL 0x7f
+
+struct bluealsa_agent_state_pcm {
+	/* BlueALSA D-Bus PCM path */
+	char path[128];
+	char address[18];
+	char alias[64];
+	char profile[5];
+	char mode[9];
+	char codec[16];
+	char format[16];
+	uint8_t channels;
+	uint8_t running;
+	uint8_t softvol;
+	uint8_t volume[8];
+	uint32_t rate;
+	/* delays in 1/10 milliseconds */
+	uint16_t server_delay;
+	int16_t client_delay;
+};
+
+struct bluealsa_agent_state {
+	uint32_t magic;
+	uint32_t version;
+	/* size of struct bluealsa_agent_state_pcm, for a sanity check */
+	uint32_t pcm_size;
+	atomic_uint flags;
+	/* odd while the records are being updated */
+	atomic_uint sequence;
+	uint32_t count;
+	struct bluealsa_agent_state_pcm pcms[BLUEALSA_AGENT_STATE_MAX_PCMS];
+};
+
+/**
+ * Map the state file into memory.
+ * @return the state, or NULL with errno set if the file cannot be mapped or
+ * was written by an incompatible agent.
+ */
+static inline const struct bluealsa_agent_state *bluealsa_agent_state_map(const char *path) {
+	const struct bluealsa_agent_state *state;
+	struct stat statbuf;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &statbuf) == -1 || statbuf.st_size < (off_t)sizeof(*state)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	state = mmap(NULL, sizeof(*state), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (state == MAP_FAILED)
+		return NULL;
+
+	if (state->magic != BLUEALSA_AGENT_STATE_MAGIC ||
+			state->version != BLUEALSA_AGENT_STATE_VERSION ||
+			state->pcm_size != sizeof(struct bluealsa_agent_state_pcm)) {
+		munmap((void *)state, sizeof(*state));
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return state;
+}
+
+static inline void bluealsa_agent_state_unmap(const struct bluealsa_agent_state *state) {
+	munmap((void *)state, sizeof(*state));
+}
+
+/**
+ * @return true if the agent that wrote the state has exited.
+ */
+static inline bool bluealsa_agent_state_closed(const struct bluealsa_agent_state *state) {
+	return atomic_load_explicit(&((struct bluealsa_agent_state *)state)->flags, memory_order_acquire) & BLUEALSA_AGENT_STATE_CLOSED;
+}
+
+/**
+ * @return the current sequence number. A reader may compare this with the
+ * number returned by its last snapshot to detect changes cheaply.
+ */
+static inline unsigned int bluealsa_agent_state_sequence(const struct bluealsa_agent_state *state) {
+	return atomic_load_explicit(&((struct bluealsa_agent_state *)state)->sequence, memory_order_acquire);
+}
+
+/**
+ * Copy a consistent snapshot of the PCM records.
+ * @param pcms receives the records; must have room for
+ *             BLUEALSA_AGENT_STATE_MAX_PCMS entries.
+ * @param count receives the number of records.
+ * @return the sequence number of the snapshot.
+ */
+static inline unsigned int bluealsa_agent_state_snapshot(const struct bluealsa_agent_state *state, struct bluealsa_agent_state_pcm *pcms, size_t *count) {
+	struct bluealsa_agent_state *shared = (struct bluealsa_agent_state *)state;
+	unsigned int begin, end;
+	uint32_t n;
+
+	do {
+		while ((begin = atomic_load_explicit(&shared->sequence, memory_order_acquire)) & 1)
+			continue;
+		n = shared->count;
+		if (n > BLUEALSA_AGENT_STATE_MAX_PCMS)
+			n = BLUEALSA_AGENT_STATE_MAX_PCMS;
+		memcpy(pcms, shared->pcms, n * sizeof(*pcms));
+		atomic_thread_fence(memory_order_acquire);
+		end = atomic_load_explicit(&shared->sequence, memory_order_relaxed);
+	} while (begin != end);
+
+	*count = n;
+	return begin;
+}
+
+#endif
@@ -5,32 +5,147 @@
  */
 
 #include "bluealsa-client.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "trace.h"
 #include "bluez-alsa/dbus.h"
 #include "bluez-alsa/shared/dbus-client-pcm.h"
 #include "bluez-alsa/shared/log.h"
 
 #include <bluetooth/bluetooth.h>
 #include <dbus/dbus.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 struct bluealsa_client_service {
 	char well_known_name[32];
 	char unique_name[16];
 };
 
+/*
+ * Record and replay of the decoded events. A trace is a header followed by
+ * records, each of which is a fixed header and a payload of the callback
+ * arguments: a structure, if any, then NUL terminated strings. Structures
+ * are written as they are in memory, so a trace can be replayed only by a
+ * build with the same structure layouts, which the trace header records.
+ */
+
+#define BLUEALSA_CLIENT_TRACE_MAGIC "BAREPLAY"
+#define BLUEALSA_CLIENT_TRACE_VERSION 1
+
+enum bluealsa_client_trace_type {
+	BLUEALSA_CLIENT_TRACE_ADD = 1,
+	BLUEALSA_CLIENT_TRACE_REMOVE,
+	BLUEALSA_CLIENT_TRACE_UPDATE,
+	BLUEALSA_CLIENT_TRACE_STOPPED,
+	BLUEALSA_CLIENT_TRACE_DEVICE,
+	/* result of a device lookup made by a callback, not itself an event */
+	BLUEALSA_CLIENT_TRACE_LOOKUP,
+};
+
+struct bluealsa_client_trace_header {
+	char magic[8];
+	uint16_t version;
+	uint16_t pcm_size;
+	uint16_t pcm_properties_size;
+	uint16_t device_properties_size;
+};
+
+struct bluealsa_client_trace_record {
+	/* microseconds since the start of the recording */
+	uint64_t time;
+	uint16_t type;
+	uint16_t length;
+	uint32_t reserved;
+};
+
+struct bluealsa_client_replay {
+	uint8_t *data;
+	size_t size;
+	/* offset of the next record */
+	size_t offset;
+	/* the lookup records, answered in place of BlueZ */
+	const uint8_t **lookups;
+	size_t lookups_count;
+	/* returns the allocations made by the process, if it is counted */
+	unsigned long (*alloc_count)(void);
+	uint64_t events;
+	uint64_t events_time;
+	uint64_t events_allocs;
+	uint64_t commits;
+	uint64_t commits_time;
+	uint64_t commits_allocs;
+	uint64_t commit_max;
+	uint64_t commit_start;
+	unsigned long commit_start_allocs;
+};
+
 struct bluealsa_client {
 	struct ba_dbus_ctx dbus_ctx;
 	pcm_added_t add_func;
 	pcm_removed_t remove_func;
 	pcm_updated_t update_func;
 	service_stopped_t stopped_func;
+	device_updated_t device_func;
 	void *user_data;
 	struct bluealsa_client_service *services;
 	size_t services_count;
+	/* the trace being recorded, or -1 */
+	int record;
+	uint64_t record_start;
+	/* the trace being replayed, in place of the D-Bus connection */
+	struct bluealsa_client_replay *replay;
 };
 
+static uint64_t bluealsa_client_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Write an event to the trace being recorded. Each record is written with a
+ * single unbuffered write, so that the trace is complete up to the last
+ * event even if the program does not exit cleanly.
+ * @param data the structure argument of the event, or NULL.
+ * @param size the size of the structure.
+ * @param ... up to three string arguments of the event, terminated by NULL.
+ */
+static void bluealsa_client_record_event(bluealsa_client_t client, enum bluealsa_client_trace_type type, const void *data, size_t size, ...) {
+	struct bluealsa_client_trace_record record = { .type = type, .length = size };
+	struct iovec iov[5] = {
+		{ &record, sizeof(record) },
+		{ (void *)data, size },
+	};
+	size_t iovcnt = 2;
+	const char *str;
+	va_list ap;
+
+	if (client->record == -1)
+		return;
+
+	record.time = (bluealsa_client_now() - client->record_start) / 1000;
+
+	va_start(ap, size);
+	while ((str = va_arg(ap, const char *)) != NULL && iovcnt < ARRAYSIZE(iov)) {
+		iov[iovcnt].iov_base = (void *)str;
+		iov[iovcnt++].iov_len = strlen(str) + 1;
+		record.length += strlen(str) + 1;
+	}
+	va_end(ap);
+
+	if (writev(client->record, iov, iovcnt) == -1)
+		warn("Couldn't write event to trace: %s", strerror(errno));
+}
+
 static const char *bluealsa_client_get_unique_name(DBusConnection *conn, const char *well_known_name) {
 
 	DBusError error = DBUS_ERROR_INIT;
@@ -85,6 +200,7 @@ static void	bluealsa_client_service_started(bluealsa_client_t client, const char
 		struct bluealsa_client_service *service = &client->services[index];
 		if (strcmp(service->well_known_name, well_known_name) == 0) {
 			strncpy(service->unique_name, unique_name, sizeof(service->unique_name) - 1);
+			bluealsa_recorder_add("NameOwnerChanged", well_known_name, NULL, 0, "started");
 			return;
 		}
 	}
@@ -97,6 +213,9 @@ static void	bluealsa_client_service_stopped(bluealsa_client_t client, const char
 		struct bluealsa_client_service *service = &client->services[index];
 		if (strcmp(service->well_known_name, well_known_name) == 0) {
 			service->unique_name[0] = '\0';
+			bluealsa_recorder_add("NameOwnerChanged", well_known_name, NULL, 0, "stopped");
+			bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_STOPPED, NULL, 0,
+					service->well_known_name, NULL);
 			client->stopped_func(service->well_known_name, client->user_data);
 			return;
 		}
@@ -109,10 +228,14 @@ static void	bluealsa_client_pcm_added(bluealsa_client_t client, struct ba_pcm *p
 	for (unsigned int index = 0; index < client->services_count; index++) {
 		struct bluealsa_client_service *service = &client->services[index];
 		if (strcmp(service->unique_name, unique_name) == 0) {
+			bluealsa_recorder_add("InterfacesAdded", service->well_known_name, pcm->pcm_path, 0, "dispatched");
+			bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_ADD, pcm, sizeof(*pcm),
+					service->well_known_name, NULL);
 			client->add_func(pcm, service->well_known_name, client->user_data);
 			return;
 		}
 	}
+	bluealsa_recorder_add("InterfacesAdded", unique_name, pcm->pcm_path, 0, "unknown service");
 }
 
 static void	bluealsa_client_pcm_removed(bluealsa_client_t client, const char *path, const char *unique_name) {
@@ -121,10 +244,13 @@ static void	bluealsa_client_pcm_removed(bluealsa_client_t client, const char *pa
 	for (unsigned int index = 0; index < client->services_count; index++) {
 		struct bluealsa_client_service *service = &client->services[index];
 		if (strcmp(service->unique_name, unique_name) == 0) {
+			bluealsa_recorder_add("InterfacesRemoved", service->well_known_name, path, 0, "dispatched");
+			bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_REMOVE, NULL, 0, path, NULL);
 			client->remove_func(path, client->user_data);
 			return;
 		}
 	}
+	bluealsa_recorder_add("InterfacesRemoved", unique_name, path, 0, "unknown service");
 }
 
 static void	bluealsa_client_pcm_updated(bluealsa_client_t client, const char *path, const char *unique_name, struct bluealsa_pcm_properties *props) {
@@ -133,10 +259,14 @@ static void	bluealsa_client_pcm_updated(bluealsa_client_t client, const char *pa
 	for (unsigned int index = 0; index < client->services_count; index++) {
 		struct bluealsa_client_service *service = &client->services[index];
 		if (strcmp(service->unique_name, unique_name) == 0) {
+			bluealsa_recorder_add("PropertiesChanged", service->well_known_name, path, props->mask, "dispatched");
+			bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_UPDATE, props, sizeof(*props),
+					path, service->well_known_name, NULL);
 			client->update_func(path, service->well_known_name, props, client->user_data);
 			return;
 		}
 	}
+	bluealsa_recorder_add("PropertiesChanged", unique_name, path, props->mask, "unknown service");
 }
 
 static DBusHandlerResult bluealsa_client_objmgr_signal_handler(bluealsa_client_t client, const char *signal, const char *service, DBusMessageIter *iter) {
@@ -368,6 +498,42 @@ static DBusHandlerResult bluealsa_client_parse_properties(DBusMessageIter *iter,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+static DBusHandlerResult bluealsa_client_parse_device_property(const char *name, DBusMessageIter *iter, void *data) {
+	struct bluealsa_device_properties *props = data;
+
+	if (strcmp(name, "Connected") == 0) {
+		if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_BOOLEAN)
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		dbus_bool_t connected;
+		dbus_message_iter_get_basic(iter, &connected);
+		props->connected = connected;
+		props->mask |= BLUEALSA_DEVICE_PROPERTY_CHANGED_CONNECTED;
+	}
+	else if (strcmp(name, "Alias") == 0) {
+		if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING)
+			return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		const char *alias;
+		dbus_message_iter_get_basic(iter, &alias);
+		strncpy(props->alias, alias, sizeof(props->alias) - 1);
+		props->mask |= BLUEALSA_DEVICE_PROPERTY_CHANGED_ALIAS;
+	}
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult bluealsa_client_device_properties_changed(bluealsa_client_t client, const char *path, DBusMessageIter *iter) {
+	struct bluealsa_device_properties props = { 0 };
+	if (client->device_func == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	bluealsa_client_parse_properties(iter, bluealsa_client_parse_device_property, &props);
+	if (props.mask != 0) {
+		bluealsa_recorder_add("PropertiesChanged", "org.bluez", path, props.mask, "dispatched");
+		bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_DEVICE, &props, sizeof(props), path, NULL);
+		client->device_func(path, &props, client->user_data);
+	}
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
 static DBusHandlerResult bluealsa_client_pcm_properties_changed(bluealsa_client_t client, const char *path, const char *service, DBusMessageIter *iter) {
 	struct bluealsa_pcm_properties props = { 0 };
 	bluealsa_client_parse_properties(iter, bluealsa_client_parse_pcm_property, &props);
@@ -391,6 +557,8 @@ static DBusHandlerResult bluealsa_client_properties_signal_handler(bluealsa_clie
 
 	if (strcmp(interface, "org.bluealsa.PCM1") == 0)
 		return bluealsa_client_pcm_properties_changed(client, path, service, iter);
+	if (strcmp(interface, "org.bluez.Device1") == 0)
+		return bluealsa_client_device_properties_changed(client, path, iter);
 
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -406,6 +574,9 @@ static DBusHandlerResult bluealsa_client_dbus_signal_handler(DBusConnection *con
 	const char *signal = dbus_message_get_member(message);
 	const char *service = dbus_message_get_sender(message);
 
+	bluealsa_trace(BLUEALSA_TRACE_SIGNAL, bluealsa_trace_signal_value(signal));
+	bluealsa_metrics_signal(signal);
+
 	DBusMessageIter iter;
 	if (!dbus_message_iter_init(message, &iter))
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -429,6 +600,7 @@ int bluealsa_client_open(bluealsa_client_t *client, struct bluealsa_client_callb
 	bluealsa_client_t new_client = calloc(1, sizeof(struct bluealsa_client));
 	if (new_client == NULL)
 		return -ENOMEM;
+	new_client->record = -1;
 
 	DBusError err = DBUS_ERROR_INIT;
 	dbus_threads_init_default();
@@ -444,6 +616,7 @@ int bluealsa_client_open(bluealsa_client_t *client, struct bluealsa_client_callb
 		new_client->remove_func = callbacks->remove_func;
 		new_client->update_func = callbacks->update_func;
 		new_client->stopped_func = callbacks->stopped_func;
+		new_client->device_func = callbacks->device_func;
 		new_client->user_data = callbacks->data;
 
 		if (!dbus_connection_add_filter(new_client->dbus_ctx.conn, bluealsa_client_dbus_signal_handler, new_client, NULL)) {
@@ -462,14 +635,339 @@ fail:
 	return -ret;
 }
 
+static size_t bluealsa_client_trace_strings(const uint8_t *payload, size_t length) {
+	size_t count = 0;
+	for (size_t n = 0; n < length; n++)
+		if (payload[n] == '\0')
+			count++;
+	return count;
+}
+
+/**
+ * Check that the records of a trace are complete, and index its lookups.
+ * @return 0 on success, negative error code otherwise.
+ */
+static int bluealsa_client_replay_load(struct bluealsa_client_replay *replay) {
+	const struct bluealsa_client_trace_header header = {
+		.magic = BLUEALSA_CLIENT_TRACE_MAGIC,
+		.version = BLUEALSA_CLIENT_TRACE_VERSION,
+		.pcm_size = sizeof(struct ba_pcm),
+		.pcm_properties_size = sizeof(struct bluealsa_pcm_properties),
+		.device_properties_size = sizeof(struct bluealsa_device_properties),
+	};
+	struct bluealsa_client_trace_record record;
+	size_t offset;
+
+	if (replay->size < sizeof(header) || memcmp(replay->data, &header, sizeof(header)) != 0)
+		return -EINVAL;
+
+	for (offset = sizeof(header); offset < replay->size; offset += sizeof(record) + record.length) {
+		if (replay->size - offset < sizeof(record))
+			return -EINVAL;
+		memcpy(&record, replay->data + offset, sizeof(record));
+		if (replay->size - offset - sizeof(record) < record.length ||
+				(record.length > 0 && replay->data[offset + sizeof(record) + record.length - 1] != '\0'))
+			return -EINVAL;
+		if (record.type != BLUEALSA_CLIENT_TRACE_LOOKUP)
+			continue;
+		/* path, address and alias */
+		if (bluealsa_client_trace_strings(replay->data + offset + sizeof(record), record.length) < 3)
+			return -EINVAL;
+		const uint8_t **lookups = realloc(replay->lookups, (replay->lookups_count + 1) * sizeof(*lookups));
+		if (lookups == NULL)
+			return -ENOMEM;
+		replay->lookups = lookups;
+		replay->lookups[replay->lookups_count++] = replay->data + offset + sizeof(record);
+	}
+
+	replay->offset = sizeof(header);
+	return 0;
+}
+
+/**
+ * Open a client that dispatches the events of a recorded trace, with no
+ * D-Bus connection at all. Device lookups are answered from the trace, and
+ * requests to the BlueALSA service fail with -ENOTCONN.
+ * @param path the trace written by bluealsa_client_record().
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_open_replay(bluealsa_client_t *client, struct bluealsa_client_callbacks *callbacks, const char *path) {
+	bluealsa_client_t new_client = NULL;
+	struct bluealsa_client_replay *replay;
+	struct stat st;
+	FILE *file;
+	int ret;
+
+	if ((replay = calloc(1, sizeof(*replay))) == NULL)
+		return -ENOMEM;
+	if ((file = fopen(path, "re")) == NULL) {
+		ret = -errno;
+		goto fail;
+	}
+	/* the whole trace is read in advance, so that replay does no I/O */
+	if (fstat(fileno(file), &st) == -1) {
+		ret = -errno;
+		fclose(file);
+		goto fail;
+	}
+	replay->size = st.st_size;
+	if ((replay->data = malloc(replay->size)) == NULL) {
+		ret = -ENOMEM;
+		fclose(file);
+		goto fail;
+	}
+	if (fread(replay->data, 1, replay->size, file) != replay->size) {
+		ret = -EIO;
+		fclose(file);
+		goto fail;
+	}
+	fclose(file);
+
+	if ((ret = bluealsa_client_replay_load(replay)) < 0)
+		goto fail;
+
+	/* a counting allocator may be preloaded by the benchmarks */
+	*(void **)&replay->alloc_count = dlsym(RTLD_DEFAULT, "bluealsa_alloc_count");
+
+	if ((new_client = calloc(1, sizeof(*new_client))) == NULL) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	if (callbacks != NULL) {
+		new_client->add_func = callbacks->add_func;
+		new_client->remove_func = callbacks->remove_func;
+		new_client->update_func = callbacks->update_func;
+		new_client->stopped_func = callbacks->stopped_func;
+		new_client->device_func = callbacks->device_func;
+		new_client->user_data = callbacks->data;
+	}
+	new_client->replay = replay;
+	new_client->record = -1;
+
+	*client = new_client;
+	return 0;
+
+fail:
+	free(replay->lookups);
+	free(replay->data);
+	free(replay);
+	return ret;
+}
+
 int bluealsa_client_close(bluealsa_client_t client) {
+	if (client->record != -1)
+		close(client->record);
+	if (client->replay != NULL) {
+		free(client->replay->lookups);
+		free(client->replay->data);
+		free(client->replay);
+	}
 	ba_dbus_connection_ctx_free(&client->dbus_ctx);
 	free(client->services);
 	free(client);
 	return 0;
 }
 
+/**
+ * Record all the events that are dispatched to the callbacks from now on,
+ * and the device lookups that the callbacks make.
+ * @param path the trace file to be replaced.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_record(bluealsa_client_t client, const char *path) {
+	const struct bluealsa_client_trace_header header = {
+		.magic = BLUEALSA_CLIENT_TRACE_MAGIC,
+		.version = BLUEALSA_CLIENT_TRACE_VERSION,
+		.pcm_size = sizeof(struct ba_pcm),
+		.pcm_properties_size = sizeof(struct bluealsa_pcm_properties),
+		.device_properties_size = sizeof(struct bluealsa_device_properties),
+	};
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -errno;
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return -EIO;
+	}
+
+	if (client->record != -1)
+		close(client->record);
+	client->record = fd;
+	client->record_start = bluealsa_client_now();
+	return 0;
+}
+
+/**
+ * Get the time of the next event of the trace being replayed.
+ * @param time returns the time of the event in microseconds since the
+ *             start of the recording.
+ * @return 1 if there is an event, 0 at the end of the trace.
+ */
+int bluealsa_client_replay_next(bluealsa_client_t client, uint64_t *time) {
+	struct bluealsa_client_replay *replay = client->replay;
+	struct bluealsa_client_trace_record record;
+
+	if (replay == NULL)
+		return -EINVAL;
+
+	for (; replay->offset < replay->size; replay->offset += sizeof(record) + record.length) {
+		memcpy(&record, replay->data + replay->offset, sizeof(record));
+		if (record.type != BLUEALSA_CLIENT_TRACE_LOOKUP) {
+			*time = record.time;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static unsigned long bluealsa_client_replay_allocs(const struct bluealsa_client_replay *replay) {
+	return replay->alloc_count != NULL ? replay->alloc_count() : 0;
+}
+
+/**
+ * Dispatch the next event of the trace being replayed to the callbacks.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_replay_dispatch(bluealsa_client_t client) {
+	struct bluealsa_client_replay *replay = client->replay;
+	struct bluealsa_client_trace_record record;
+	uint64_t time;
+	int ret;
+
+	if ((ret = bluealsa_client_replay_next(client, &time)) <= 0)
+		return ret == 0 ? -ENOENT : ret;
+
+	memcpy(&record, replay->data + replay->offset, sizeof(record));
+	const uint8_t *payload = replay->data + replay->offset + sizeof(record);
+	const uint8_t *end = payload + record.length;
+	replay->offset += sizeof(record) + record.length;
+
+	union {
+		struct ba_pcm pcm;
+		struct bluealsa_pcm_properties pcm_props;
+		struct bluealsa_device_properties device_props;
+	} arg;
+	size_t size = 0;
+	switch (record.type) {
+	case BLUEALSA_CLIENT_TRACE_ADD:
+		size = sizeof(arg.pcm);
+		break;
+	case BLUEALSA_CLIENT_TRACE_UPDATE:
+		size = sizeof(arg.pcm_props);
+		break;
+	case BLUEALSA_CLIENT_TRACE_DEVICE:
+		size = sizeof(arg.device_props);
+		break;
+	}
+	if (record.length < size + 1)
+		return -EINVAL;
+	memcpy(&arg, payload, size);
+
+	/* the strings follow the structure, the last is checked on load; they
+	 * are copied because a callback may close the client, as a forked
+	 * handler does, and still use its arguments */
+	char str1[256], str2[256];
+	const char *next = (const char *)payload + size;
+	if (strlen(next) >= sizeof(str1))
+		return -EINVAL;
+	strcpy(str1, next);
+	next += strlen(next) + 1;
+	if ((const uint8_t *)next >= end)
+		str2[0] = '\0';
+	else if (strlen(next) >= sizeof(str2))
+		return -EINVAL;
+	else
+		strcpy(str2, next);
+
+	const unsigned long allocs = bluealsa_client_replay_allocs(replay);
+	const uint64_t start = bluealsa_client_now();
+
+	switch (record.type) {
+	case BLUEALSA_CLIENT_TRACE_ADD:
+		if (client->add_func != NULL)
+			client->add_func(&arg.pcm, str1, client->user_data);
+		break;
+	case BLUEALSA_CLIENT_TRACE_REMOVE:
+		if (client->remove_func != NULL)
+			client->remove_func(str1, client->user_data);
+		break;
+	case BLUEALSA_CLIENT_TRACE_UPDATE:
+		if (str2[0] == '\0')
+			return -EINVAL;
+		if (client->update_func != NULL)
+			client->update_func(str1, str2, &arg.pcm_props, client->user_data);
+		break;
+	case BLUEALSA_CLIENT_TRACE_STOPPED:
+		if (client->stopped_func != NULL)
+			client->stopped_func(str1, client->user_data);
+		break;
+	case BLUEALSA_CLIENT_TRACE_DEVICE:
+		if (client->device_func != NULL)
+			client->device_func(str1, &arg.device_props, client->user_data);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	replay->events_time += bluealsa_client_now() - start;
+	replay->events_allocs += bluealsa_client_replay_allocs(replay) - allocs;
+	replay->events++;
+	return 0;
+}
+
+/**
+ * Account the time and allocations from now until
+ * bluealsa_client_replay_commit_end() to a commit of the replayed events.
+ */
+void bluealsa_client_replay_commit_begin(bluealsa_client_t client) {
+	struct bluealsa_client_replay *replay = client->replay;
+	if (replay == NULL)
+		return;
+	replay->commit_start_allocs = bluealsa_client_replay_allocs(replay);
+	replay->commit_start = bluealsa_client_now();
+}
+
+void bluealsa_client_replay_commit_end(bluealsa_client_t client) {
+	struct bluealsa_client_replay *replay = client->replay;
+	if (replay == NULL)
+		return;
+	const uint64_t time = bluealsa_client_now() - replay->commit_start;
+	replay->commits_time += time;
+	replay->commits_allocs += bluealsa_client_replay_allocs(replay) - replay->commit_start_allocs;
+	replay->commit_max = MAX(replay->commit_max, time);
+	replay->commits++;
+}
+
+/**
+ * Write the statistics of the replayed events and commits.
+ */
+void bluealsa_client_replay_report(const bluealsa_client_t client, FILE *file) {
+	const struct bluealsa_client_replay *replay = client->replay;
+	if (replay == NULL)
+		return;
+
+	fprintf(file, "Events: %ju in %.6f s, %.0f events/s, %.0f ns/event\n",
+			(uintmax_t)replay->events, replay->events_time / 1e9,
+			replay->events_time > 0 ? replay->events * 1e9 / replay->events_time : 0,
+			replay->events > 0 ? (double)replay->events_time / replay->events : 0);
+	fprintf(file, "Commits: %ju, mean %.1f us, max %.1f us\n",
+			(uintmax_t)replay->commits,
+			replay->commits > 0 ? replay->commits_time / 1e3 / replay->commits : 0,
+			replay->commit_max / 1e3);
+	if (replay->alloc_count != NULL)
+		fprintf(file, "Allocations: %.2f per event, %.2f per commit\n",
+				replay->events > 0 ? (double)replay->events_allocs / replay->events : 0,
+				replay->commits > 0 ? (double)replay->commits_allocs / replay->commits : 0);
+	else
+		fprintf(file, "Allocations: not counted\n");
+}
+
 int bluealsa_client_get_pcms(bluealsa_client_t client, const char *service) {
+	/* the PCMs that were present are the first events of the trace */
+	if (client->replay != NULL)
+		return 0;
 	if (strlen(service) >= sizeof(client->dbus_ctx.ba_service))
 		return -EINVAL;
 
@@ -477,12 +975,17 @@ int bluealsa_client_get_pcms(bluealsa_client_t client, const char *service) {
 	struct ba_pcm *pcms = NULL;
 	size_t count = 0;
 	strcpy(client->dbus_ctx.ba_service, service);
+	const uint64_t start = bluealsa_metrics_now();
 	if (!ba_dbus_pcm_get_all(&client->dbus_ctx, &pcms, &count, &error))
 		return -ENOENT;
+	bluealsa_metrics_observe(BLUEALSA_METRICS_GET_MANAGED_OBJECTS, start);
 
 	size_t i;
-	for (i = 0; i < count; i++)
+	for (i = 0; i < count; i++) {
+		bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_ADD, &pcms[i], sizeof(pcms[i]),
+				service, NULL);
 		client->add_func(&pcms[i], service, client->user_data);
+	}
 
 	free(pcms);
 	return 0;
@@ -493,12 +996,18 @@ int bluealsa_client_num_services(const bluealsa_client_t client) {
 }
 
 int bluealsa_client_poll_fds(bluealsa_client_t client, struct pollfd *fds, nfds_t *nfds) {
+	if (client->replay != NULL) {
+		*nfds = 0;
+		return 0;
+	}
 	if (!ba_dbus_connection_poll_fds(&client->dbus_ctx, fds, nfds))
 		return -1;
 	return 0;
 }
 
 int bluealsa_client_poll_dispatch(bluealsa_client_t client, struct pollfd *pfds, nfds_t nfds) {
+	if (client->replay != NULL)
+		return 0;
 	if (ba_dbus_connection_poll_dispatch(&client->dbus_ctx, pfds, nfds))
 		while (dbus_connection_dispatch(client->dbus_ctx.conn) == DBUS_DISPATCH_DATA_REMAINS)
 			continue;
@@ -515,6 +1024,8 @@ int bluealsa_client_watch_service(bluealsa_client_t client, const char *service)
 	struct bluealsa_client_service *new_service = &client->services[client->services_count++];
 
 	strncpy(new_service->well_known_name, service, sizeof(new_service->well_known_name) - 1);
+	if (client->replay != NULL)
+		return 0;
 	const char *unique_name = bluealsa_client_get_unique_name(client->dbus_ctx.conn, service);
 	if (unique_name != NULL)
 		strncpy(new_service->unique_name, unique_name, sizeof(new_service->unique_name) - 1);
@@ -547,15 +1058,237 @@ int bluealsa_client_watch_service(bluealsa_client_t client, const char *service)
 	return 0;
 }
 
+/**
+ * Receive changes to the connection state and alias of BlueZ devices.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_watch_devices(bluealsa_client_t client) {
+	if (client->device_func == NULL)
+		return -EINVAL;
+	if (client->replay != NULL)
+		return 0;
+	if (!ba_dbus_connection_signal_match_add(&client->dbus_ctx,
+				"org.bluez", NULL, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged",
+				"path_namespace='/org/bluez',arg0='org.bluez.Device1'"))
+		return -ENOMEM;
+	return 0;
+}
+
+static int bluealsa_client_set_service(bluealsa_client_t client, const char *service) {
+	if (client->replay != NULL)
+		return -ENOTCONN;
+	if (strlen(service) >= sizeof(client->dbus_ctx.ba_service))
+		return -EINVAL;
+	strcpy(client->dbus_ctx.ba_service, service);
+	return 0;
+}
+
+/**
+ * Set the ClientDelay property of a PCM. The request is sent without
+ * waiting for a reply; the change is confirmed by a PropertiesChanged signal.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_set_client_delay(bluealsa_client_t client, const char *service, const char *path, int16_t delay) {
+	DBusError error = DBUS_ERROR_INIT;
+	struct ba_pcm pcm = { .client_delay = delay };
+	int ret;
+
+	if ((ret = bluealsa_client_set_service(client, service)) < 0)
+		return ret;
+	strncpy(pcm.pcm_path, path, sizeof(pcm.pcm_path) - 1);
+	if (!ba_dbus_pcm_update(&client->dbus_ctx, &pcm, BLUEALSA_PCM_CLIENT_DELAY, &error)) {
+		dbus_error_free(&error);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Set the SoftVolume property of a PCM. The request is sent without
+ * waiting for a reply; the change is confirmed by a PropertiesChanged signal.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_set_soft_volume(bluealsa_client_t client, const char *service, const char *path, bool enabled) {
+	DBusError error = DBUS_ERROR_INIT;
+	struct ba_pcm pcm = { .soft_volume = enabled };
+	int ret;
+
+	if ((ret = bluealsa_client_set_service(client, service)) < 0)
+		return ret;
+	strncpy(pcm.pcm_path, path, sizeof(pcm.pcm_path) - 1);
+	if (!ba_dbus_pcm_update(&client->dbus_ctx, &pcm, BLUEALSA_PCM_SOFT_VOLUME, &error)) {
+		dbus_error_free(&error);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * Get the codecs that are available for a PCM.
+ * @param codecs returns the codecs, which must be released with
+ *               ba_dbus_pcm_codecs_free().
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_get_codecs(bluealsa_client_t client, const char *service, const char *path, struct ba_pcm_codecs *codecs) {
+	DBusError error = DBUS_ERROR_INIT;
+	int ret;
+
+	if ((ret = bluealsa_client_set_service(client, service)) < 0)
+		return ret;
+	if (!ba_dbus_pcm_codecs_get(&client->dbus_ctx, path, codecs, &error)) {
+		error("Couldn't get codecs for %s (%s)", path, error.message);
+		dbus_error_free(&error);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Select the codec of a PCM. This call blocks until the service has
+ * completed, or failed, the codec change.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_select_codec(bluealsa_client_t client, const char *service, const char *path, const char *codec) {
+	DBusError error = DBUS_ERROR_INIT;
+	int ret;
+
+	if ((ret = bluealsa_client_set_service(client, service)) < 0)
+		return ret;
+	if (!ba_dbus_pcm_select_codec(&client->dbus_ctx, path, codec, NULL, 0, 0, 0, BA_PCM_SELECT_CODEC_FLAG_NONE, &error)) {
+		error("Couldn't select codec %s for %s (%s)", codec, path, error.message);
+		dbus_error_free(&error);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Open a PCM for audio transfer, as a BlueALSA client.
+ * @param fd_pcm returns the PCM audio file descriptor.
+ * @param fd_ctrl returns the PCM control file descriptor.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_client_open_pcm(bluealsa_client_t client, const char *service, const char *path, int *fd_pcm, int *fd_ctrl) {
+	DBusError error = DBUS_ERROR_INIT;
+	int ret;
+
+	if ((ret = bluealsa_client_set_service(client, service)) < 0)
+		return ret;
+	if (!ba_dbus_pcm_open(&client->dbus_ctx, path, fd_pcm, fd_ctrl, &error)) {
+		error("Couldn't open PCM %s (%s)", path, error.message);
+		dbus_error_free(&error);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * Determine whether a device supports volume control by BlueZ, that is
+ * whether any of its media transports has the "Volume" property.
+ * @param path the BlueZ D-Bus path of the device.
+ * @return 1 if volume control is supported, 0 if not, or a negative error
+ * code if BlueZ could not be queried.
+ */
+int bluealsa_client_device_has_volume(bluealsa_client_t client, const char *path) {
+	DBusError error = DBUS_ERROR_INIT;
+	DBusMessageIter iter, objects;
+	DBusMessage *msg, *rep;
+	const size_t path_len = strlen(path);
+	int ret = 0;
+
+	if (client->replay != NULL)
+		return -ENOTCONN;
+
+	if ((msg = dbus_message_new_method_call("org.bluez", "/",
+					DBUS_INTERFACE_OBJECT_MANAGER, "GetManagedObjects")) == NULL)
+		return -ENOMEM;
+	rep = dbus_connection_send_with_reply_and_block(client->dbus_ctx.conn, msg,
+			DBUS_TIMEOUT_USE_DEFAULT, &error);
+	dbus_message_unref(msg);
+	if (rep == NULL) {
+		error("Couldn't get BlueZ objects (%s)", error.message);
+		dbus_error_free(&error);
+		return -EIO;
+	}
+
+	if (!dbus_message_iter_init(rep, &iter) ||
+			strcmp(dbus_message_get_signature(rep), "a{oa{sa{sv}}}") != 0) {
+		dbus_message_unref(rep);
+		return -EINVAL;
+	}
+
+	for (dbus_message_iter_recurse(&iter, &objects);
+			dbus_message_iter_get_arg_type(&objects) != DBUS_TYPE_INVALID && ret == 0;
+			dbus_message_iter_next(&objects)) {
+		DBusMessageIter object, interfaces;
+		const char *object_path;
+
+		dbus_message_iter_recurse(&objects, &object);
+		dbus_message_iter_get_basic(&object, &object_path);
+		/* the transports of a device are its children */
+		if (strncmp(object_path, path, path_len) != 0 || object_path[path_len] != '/')
+			continue;
+
+		dbus_message_iter_next(&object);
+		for (dbus_message_iter_recurse(&object, &interfaces);
+				dbus_message_iter_get_arg_type(&interfaces) != DBUS_TYPE_INVALID && ret == 0;
+				dbus_message_iter_next(&interfaces)) {
+			DBusMessageIter interface, props;
+			const char *name;
+
+			dbus_message_iter_recurse(&interfaces, &interface);
+			dbus_message_iter_get_basic(&interface, &name);
+			if (strcmp(name, "org.bluez.MediaTransport1") != 0)
+				continue;
+
+			dbus_message_iter_next(&interface);
+			for (dbus_message_iter_recurse(&interface, &props);
+					dbus_message_iter_get_arg_type(&props) != DBUS_TYPE_INVALID;
+					dbus_message_iter_next(&props)) {
+				DBusMessageIter prop;
+				dbus_message_iter_recurse(&props, &prop);
+				dbus_message_iter_get_basic(&prop, &name);
+				if (strcmp(name, "Volume") == 0) {
+					ret = 1;
+					break;
+				}
+			}
+		}
+	}
+
+	dbus_message_unref(rep);
+	return ret;
+}
+
+static int bluealsa_client_replay_get_device(const struct bluealsa_client_replay *replay, struct bluealsa_client_device *device) {
+	for (size_t n = 0; n < replay->lookups_count; n++) {
+		const char *path = (const char *)replay->lookups[n];
+		if (strcmp(path, device->path) != 0)
+			continue;
+		const char *hex_addr = path + strlen(path) + 1;
+		const char *alias = hex_addr + strlen(hex_addr) + 1;
+		strncpy(device->hex_addr, hex_addr, sizeof(device->hex_addr) - 1);
+		strncpy(device->alias, alias, sizeof(device->alias) - 1);
+		return 0;
+	}
+	return -1;
+}
+
 int bluealsa_client_get_device(bluealsa_client_t client, struct bluealsa_client_device *device) {
 	struct bluez_device dev = { 0 };
+	if (client->replay != NULL)
+		return bluealsa_client_replay_get_device(client->replay, device);
+	const uint64_t start = bluealsa_metrics_now();
 	if (dbus_bluez_get_device(client->dbus_ctx.conn, device->path, &dev, NULL) < 0)
 		return -1;
+	bluealsa_metrics_observe(BLUEALSA_METRICS_GET_DEVICE, start);
 
 	strncpy(device->alias, dev.name, sizeof(device->alias));
 	device->alias[sizeof(device->alias) - 1] = '\0';
 	ba2str(&dev.bt_addr, device->hex_addr);
 
+	bluealsa_client_record_event(client, BLUEALSA_CLIENT_TRACE_LOOKUP, NULL, 0,
+			device->path, device->hex_addr, device->alias, NULL);
 	return 0;
 }
 
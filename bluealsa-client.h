@@ -10,6 +10,8 @@
 
 #include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include "bluez-alsa/dbus.h"
 #include "bluez-alsa/shared/dbus-client-pcm.h"
 
@@ -47,27 +49,52 @@ struct bluealsa_pcm_properties {
 #define BLUEALSA_PCM_PROPERTY_CHANGED_VOLUME       (1 << 9)
 #define BLUEALSA_PCM_PROPERTY_CHANGED_CHANNEL_MAP  (1 << 10)
 
+struct bluealsa_device_properties {
+	uint8_t mask;
+	bool connected;
+	char alias[64];
+};
+
+#define BLUEALSA_DEVICE_PROPERTY_CHANGED_CONNECTED (1 << 0)
+#define BLUEALSA_DEVICE_PROPERTY_CHANGED_ALIAS     (1 << 1)
+
 typedef void (*pcm_added_t)(const struct ba_pcm *pcm, const char *service, void *data);
 typedef void (*pcm_removed_t)(const char *path, void *data);
 typedef void (*pcm_updated_t)(const char *path, const char *service, struct bluealsa_pcm_properties *props, void *data);
 typedef void (*service_stopped_t)(const char *service, void *data);
+typedef void (*device_updated_t)(const char *path, struct bluealsa_device_properties *props, void *data);
 
 struct bluealsa_client_callbacks {
 	pcm_added_t add_func;
 	pcm_removed_t remove_func;
 	pcm_updated_t update_func;
 	service_stopped_t stopped_func;
+	device_updated_t device_func;
 	void *data;
 };
 
 int bluealsa_client_open(bluealsa_client_t *client, struct bluealsa_client_callbacks *callbacks);
+int bluealsa_client_open_replay(bluealsa_client_t *client, struct bluealsa_client_callbacks *callbacks, const char *path);
 int bluealsa_client_close(bluealsa_client_t client);
+int bluealsa_client_record(bluealsa_client_t client, const char *path);
+int bluealsa_client_replay_next(bluealsa_client_t client, uint64_t *time);
+int bluealsa_client_replay_dispatch(bluealsa_client_t client);
+void bluealsa_client_replay_commit_begin(bluealsa_client_t client);
+void bluealsa_client_replay_commit_end(bluealsa_client_t client);
+void bluealsa_client_replay_report(const bluealsa_client_t client, FILE *file);
 int bluealsa_client_get_pcms(bluealsa_client_t client, const char *service);
 int bluealsa_client_num_services(const bluealsa_client_t client);
 int bluealsa_client_get_device(bluealsa_client_t client, struct bluealsa_client_device *device);
+int bluealsa_client_device_has_volume(bluealsa_client_t client, const char *path);
 int bluealsa_client_watch_service(bluealsa_client_t client, const char *service);
+int bluealsa_client_watch_devices(bluealsa_client_t client);
 int bluealsa_client_poll_fds(bluealsa_client_t client, struct pollfd *fds, nfds_t *nfds);
 int bluealsa_client_poll_dispatch(bluealsa_client_t client, struct pollfd *fds, nfds_t nfds);
+int bluealsa_client_set_client_delay(bluealsa_client_t client, const char *service, const char *path, int16_t delay);
+int bluealsa_client_set_soft_volume(bluealsa_client_t client, const char *service, const char *path, bool enabled);
+int bluealsa_client_get_codecs(bluealsa_client_t client, const char *service, const char *path, struct ba_pcm_codecs *codecs);
+int bluealsa_client_select_codec(bluealsa_client_t client, const char *service, const char *path, const char *codec);
+int bluealsa_client_open_pcm(bluealsa_client_t client, const char *service, const char *path, int *fd_pcm, int *fd_ctrl);
 
 const char *bluealsa_client_transport_to_role(int transport_code);
 const char *bluealsa_client_transport_to_type(int transport_code);
@@ -14,6 +14,20 @@
 
 #include "defs.h"
 
+/* address of the bus to connect to, or NULL for the system bus */
+static const char *ba_dbus_bus_address = NULL;
+
+/**
+ * Set the address of the message bus used by new connections.
+ *
+ * @param address The D-Bus server address, or NULL for the system bus. The
+ *   string is not copied, so it must stay valid while connections are being
+ *   created. */
+void ba_dbus_set_bus_address(
+		const char *address) {
+	ba_dbus_bus_address = address;
+}
+
 static dbus_bool_t ba_dbus_watch_add(DBusWatch *watch, void *data) {
 	struct ba_dbus_ctx *ctx = (struct ba_dbus_ctx *)data;
 	DBusWatch **tmp = ctx->watches;
@@ -45,8 +59,16 @@ dbus_bool_t ba_dbus_connection_ctx_init(
 	 * safe to call *_ctx_free() upon error. */
 	memset(ctx, 0, sizeof(*ctx));
 
-	if ((ctx->conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, error)) == NULL)
-		return FALSE;
+	if (ba_dbus_bus_address == NULL) {
+		if ((ctx->conn = dbus_bus_get_private(DBUS_BUS_SYSTEM, error)) == NULL)
+			return FALSE;
+	}
+	else {
+		if ((ctx->conn = dbus_connection_open_private(ba_dbus_bus_address, error)) == NULL)
+			return FALSE;
+		if (!dbus_bus_register(ctx->conn, error))
+			return FALSE;
+	}
 
 	/* do not terminate in case of D-Bus connection being lost */
 	dbus_connection_set_exit_on_disconnect(ctx->conn, FALSE);
@@ -176,6 +198,8 @@ dbus_bool_t ba_dbus_connection_poll_fds(
 			fds[i].fd = dbus_watch_get_unix_fd(watch);
 		if (dbus_watch_get_flags(watch) & DBUS_WATCH_READABLE)
 			fds[i].events = POLLIN;
+		if (dbus_watch_get_flags(watch) & DBUS_WATCH_WRITABLE)
+			fds[i].events |= POLLOUT;
 
 	}
 
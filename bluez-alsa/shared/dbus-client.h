@@ -43,6 +43,9 @@ struct ba_dbus_ctx {
 	char ba_service[32];
 };
 
+void ba_dbus_set_bus_address(
+		const char *address);
+
 dbus_bool_t ba_dbus_connection_ctx_init(
 		struct ba_dbus_ctx *ctx,
 		const char *ba_service_name,
@@ -10,13 +10,19 @@
 # include <config.h>
 #endif
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
@@ -38,6 +44,39 @@ static char *_ident = NULL;
 /* if true, system logging is enabled */
 static bool _syslog = false;
 
+/* number of messages held for the logging thread, enough for a complete
+ * dump of the event recorder (BLUEALSA_RECORDER_SIZE records and a header)
+ * with room to spare for other threads */
+#define LOG_ASYNC_SLOTS 512
+/* longer messages are truncated */
+#define LOG_ASYNC_MESSAGE_SIZE 512
+
+struct log_async_slot {
+	/* equal to the producer position when free, to the position + 1 when
+	 * holding a message */
+	atomic_size_t seq;
+	int priority;
+	/* offset of the message text, after the prefix */
+	size_t body;
+	size_t len;
+	char message[LOG_ASYNC_MESSAGE_SIZE];
+};
+
+/* if true, messages are written by the logging thread */
+static atomic_bool _async = false;
+
+static struct {
+	struct log_async_slot slots[LOG_ASYNC_SLOTS];
+	/* next position to be claimed by a producer */
+	atomic_size_t head;
+	/* next position to be read by the logging thread */
+	size_t tail;
+	/* messages lost because all slots were full */
+	atomic_uint dropped;
+	sem_t sem;
+	pthread_t thread;
+} _async_ring;
+
 #if DEBUG_TIME
 
 /* point "zero" for relative time */
@@ -71,6 +110,274 @@ static const char *priority2str[] = {
 	[LOG_DEBUG] = "D",
 };
 
+/**
+ * Format a message with the same prefix as written to stderr.
+ *
+ * @param slot The slot to receive the message.
+ * @param priority The message priority.
+ * @param format The message format.
+ * @param ap The message arguments. */
+static void log_async_format(struct log_async_slot *slot, int priority,
+		const char *format, va_list ap) {
+
+	const size_t size = sizeof(slot->message);
+	size_t len = 0;
+	int n;
+
+	if (!_syslog) {
+
+#if DEBUG_TIME
+		struct timespec ts;
+		gettimestamp(&ts);
+		timespecsub(&ts, &_ts0, &ts);
+#endif
+
+		if (_ident != NULL && (n = snprintf(slot->message, size, "%s: ", _ident)) > 0)
+			len += n;
+
+#if DEBUG_TIME
+		if (len < size && (n = snprintf(slot->message + len, size - len, "%lu.%.6lu: ",
+						(long int)ts.tv_sec, ts.tv_nsec / 1000)) > 0)
+			len += n;
+#endif
+
+#if DEBUG && HAVE_GETTID
+		if (len < size && (n = snprintf(slot->message + len, size - len, "[%d] ", gettid())) > 0)
+			len += n;
+#endif
+
+		if (len < size && (n = snprintf(slot->message + len, size - len, "%s: ",
+						priority2str[priority])) > 0)
+			len += n;
+
+	}
+
+	if (len >= size)
+		len = size - 1;
+	slot->body = len;
+
+	if ((n = vsnprintf(slot->message + len, size - len, format, ap)) > 0)
+		len += n;
+	if (len >= size)
+		len = size - 1;
+
+	slot->priority = priority;
+	slot->len = len;
+
+}
+
+/**
+ * Write a formatted message to stderr or to the system log. */
+static void log_async_write(const struct log_async_slot *slot) {
+
+	if (_syslog) {
+		syslog(slot->priority, "%s", slot->message + slot->body);
+		return;
+	}
+
+	struct iovec iov[] = {
+		{ .iov_base = (void *)slot->message, .iov_len = slot->len },
+		{ .iov_base = "\n", .iov_len = 1 },
+	};
+
+	/* the whole message is written with one system call, so that messages
+	 * from forked processes are not interleaved with it */
+	while (writev(STDERR_FILENO, iov, ARRAYSIZE(iov)) == -1 && errno == EINTR)
+		continue;
+
+}
+
+/**
+ * Format and write a message from the logging thread itself. */
+static void log_async_notice(int priority, const char *format, ...) {
+
+	struct log_async_slot slot;
+	va_list ap;
+
+	va_start(ap, format);
+	log_async_format(&slot, priority, format, ap);
+	va_end(ap);
+
+	log_async_write(&slot);
+
+}
+
+/**
+ * Give a message to the logging thread.
+ *
+ * This function never blocks. If all slots are in use, the message is
+ * dropped and counted, and the count is reported by the logging thread. */
+static void vlog_async(int priority, const char *format, va_list ap) {
+
+	size_t pos = atomic_load_explicit(&_async_ring.head, memory_order_relaxed);
+	struct log_async_slot *slot;
+
+	for (;;) {
+		slot = &_async_ring.slots[pos % LOG_ASYNC_SLOTS];
+		const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		const ptrdiff_t diff = (ptrdiff_t)(seq - pos);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&_async_ring.head, &pos, pos + 1,
+						memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0) {
+			atomic_fetch_add_explicit(&_async_ring.dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&_async_ring.head, memory_order_relaxed);
+	}
+
+	log_async_format(slot, priority, format, ap);
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	sem_post(&_async_ring.sem);
+
+}
+
+static void *log_async_thread(void *arg) {
+	(void)arg;
+
+	/* the text of the last message written, for repeat detection */
+	char last[LOG_ASYNC_MESSAGE_SIZE] = "";
+	int last_priority = LOG_DEBUG;
+	unsigned int repeated = 0;
+
+	for (;;) {
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+
+		if (sem_timedwait(&_async_ring.sem, &ts) == -1) {
+			if (errno == ETIMEDOUT && repeated > 0) {
+				log_async_notice(last_priority, "Last message repeated %u times", repeated);
+				/* the notice ends the run, so the message is written again */
+				last[0] = '\0';
+				repeated = 0;
+			}
+			continue;
+		}
+
+		struct log_async_slot *slot = &_async_ring.slots[_async_ring.tail % LOG_ASYNC_SLOTS];
+
+		/* the semaphore is posted once for every message, but an earlier slot
+		 * may still be being filled by a slower producer */
+		while (atomic_load_explicit(&slot->seq, memory_order_acquire) != _async_ring.tail + 1)
+			sched_yield();
+
+		/* the end of the messages is marked by an invalid priority */
+		if (slot->priority == -1) {
+			if (repeated > 0)
+				log_async_notice(last_priority, "Last message repeated %u times", repeated);
+			break;
+		}
+
+		if (slot->priority == last_priority &&
+				strcmp(slot->message + slot->body, last) == 0)
+			repeated++;
+		else {
+			if (repeated > 0)
+				log_async_notice(last_priority, "Last message repeated %u times", repeated);
+			repeated = 0;
+			log_async_write(slot);
+			strcpy(last, slot->message + slot->body);
+			last_priority = slot->priority;
+		}
+
+		atomic_store_explicit(&slot->seq, _async_ring.tail + LOG_ASYNC_SLOTS, memory_order_release);
+		_async_ring.tail++;
+
+		unsigned int dropped;
+		if ((dropped = atomic_exchange_explicit(&_async_ring.dropped, 0, memory_order_relaxed)) > 0)
+			log_async_notice(LOG_WARNING, "Log overflow: %u messages dropped", dropped);
+
+	}
+
+	return NULL;
+}
+
+/**
+ * Write out all pending messages and stop the logging thread. */
+static void log_async_stop(void) {
+
+	if (!atomic_exchange(&_async, false))
+		return;
+
+	/* Queue the end marker. Retry while the ring is full,
+	 * which is only until the logging thread has caught up. */
+	size_t pos;
+	struct log_async_slot *slot;
+	for (;;) {
+		pos = atomic_load(&_async_ring.head);
+		slot = &_async_ring.slots[pos % LOG_ASYNC_SLOTS];
+		if (atomic_load(&slot->seq) == pos &&
+				atomic_compare_exchange_strong(&_async_ring.head, &pos, pos + 1))
+			break;
+		sched_yield();
+	}
+	slot->priority = -1;
+	slot->body = slot->len = 0;
+	slot->message[0] = '\0';
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	sem_post(&_async_ring.sem);
+
+	pthread_join(_async_ring.thread, NULL);
+
+}
+
+/**
+ * A forked child has no logging thread, so it writes its own messages. */
+static void log_async_atfork_child(void) {
+	atomic_store(&_async, false);
+}
+
+/**
+ * Hand over writing of log messages to a background thread.
+ *
+ * After this call, log functions format the message into a fixed-size ring
+ * and return without waiting for stderr or syslog, so a slow reader cannot
+ * block the caller. Messages are dropped, and the loss reported, if the ring
+ * becomes full; consecutive identical messages are written once, followed by
+ * a count of the repeats. Pending messages are written out at exit.
+ *
+ * @return On success this function returns 0. Otherwise, a negative error
+ *   code is returned. */
+int log_async(void) {
+
+	sigset_t mask, oldmask;
+	int ret;
+
+	if (atomic_load(&_async))
+		return 0;
+
+	for (size_t i = 0; i < LOG_ASYNC_SLOTS; i++)
+		atomic_init(&_async_ring.slots[i].seq, i);
+	atomic_init(&_async_ring.head, 0);
+	_async_ring.tail = 0;
+
+	if (sem_init(&_async_ring.sem, 0, 0) == -1)
+		return -errno;
+
+	/* signals must be handled by the application threads only */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &oldmask);
+	ret = pthread_create(&_async_ring.thread, NULL, log_async_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (ret != 0) {
+		sem_destroy(&_async_ring.sem);
+		return -ret;
+	}
+
+	pthread_setname_np(_async_ring.thread, "log");
+	pthread_atfork(NULL, NULL, log_async_atfork_child);
+	atexit(log_async_stop);
+
+	atomic_store(&_async, true);
+	return 0;
+}
+
 static void vlog(int priority, const char *format, va_list ap) {
 
 	int oldstate;
@@ -81,7 +388,9 @@ static void vlog(int priority, const char *format, va_list ap) {
 	 * has to be temporally disabled. */
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 
-	if (_syslog) {
+	if (atomic_load_explicit(&_async, memory_order_relaxed))
+		vlog_async(priority, format, ap);
+	else if (_syslog) {
 
 		va_list ap_syslog;
 		va_copy(ap_syslog, ap);
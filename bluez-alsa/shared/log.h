@@ -23,6 +23,7 @@
 extern int log_level;
 
 void log_open(const char *ident, bool syslog);
+int log_async(void);
 void log_message(int priority, const char *format, ...) __attribute__ ((format(printf, 2, 3)));
 
 #if DEBUG
@@ -12,8 +12,9 @@ MIC_PCM="plughw:0,0"
 
 LATENCY_US=100000
 
-codec="${1:?No codec given}"
-addr="${2:-00:00:00:00:00:00}"
+# when run by bluealsa-agent --supervise the PCM properties are in the environment
+codec="${BLUEALSA_PCM_PROPERTY_CODEC:-${1:?No codec given}}"
+addr="${BLUEALSA_PCM_PROPERTY_ADDRESS:-${2:-00:00:00:00:00:00}}"
 
 case "${codec,,}" in
 	cvsd) rate=8000 ;;
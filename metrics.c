@@ -0,0 +1,363 @@
+/*
+ * bluealsa-autoconfig - metrics.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "bluez-alsa/shared/defs.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Counters and histograms written in the Prometheus text exposition format,
+ * for example for the node_exporter textfile collector. The file is replaced
+ * atomically, at most once per BLUEALSA_METRICS_INTERVAL, and only when a
+ * value has changed. Until bluealsa_metrics_open() is called every update is
+ * a no-op.
+ */
+
+/* Least interval between writes of the file, in milliseconds */
+#define BLUEALSA_METRICS_INTERVAL 1000
+
+/* Most handler processes whose run time is measured at one time */
+#define BLUEALSA_METRICS_MAX_HANDLERS 32
+
+#define BOTH (BLUEALSA_METRICS_AUTOCONFIG | BLUEALSA_METRICS_AGENT)
+
+/* Note - entries with the same name must be adjacent */
+static const struct {
+	const char *name;
+	const char *labels;
+	const char *help;
+	unsigned int programs;
+} counter_info[BLUEALSA_METRICS_COUNTERS] = {
+	[BLUEALSA_METRICS_SIGNAL_INTERFACES_ADDED] = { "dbus_signals_total", "type=\"InterfacesAdded\"",
+		"D-Bus signals received.", BOTH },
+	[BLUEALSA_METRICS_SIGNAL_INTERFACES_REMOVED] = { "dbus_signals_total", "type=\"InterfacesRemoved\"",
+		"D-Bus signals received.", BOTH },
+	[BLUEALSA_METRICS_SIGNAL_PROPERTIES_CHANGED] = { "dbus_signals_total", "type=\"PropertiesChanged\"",
+		"D-Bus signals received.", BOTH },
+	[BLUEALSA_METRICS_SIGNAL_NAME_OWNER_CHANGED] = { "dbus_signals_total", "type=\"NameOwnerChanged\"",
+		"D-Bus signals received.", BOTH },
+	[BLUEALSA_METRICS_EVENTS_FILTERED] = { "events_filtered_total", NULL,
+		"PCM events that required no action.", BOTH },
+	[BLUEALSA_METRICS_COMMITS] = { "commits_total", NULL,
+		"ALSA configuration commits.", BLUEALSA_METRICS_AUTOCONFIG },
+	[BLUEALSA_METRICS_COMMITS_SKIPPED] = { "commits_skipped_total", NULL,
+		"Changes merged into an already pending commit.", BLUEALSA_METRICS_AUTOCONFIG },
+	[BLUEALSA_METRICS_BYTES_WRITTEN] = { "written_bytes_total", NULL,
+		"Bytes written to ALSA configuration files.", BLUEALSA_METRICS_AUTOCONFIG },
+	[BLUEALSA_METRICS_UDEV_TRIGGERS] = { "udev_triggers_total", NULL,
+		"Synthesized udev change events.", BLUEALSA_METRICS_AUTOCONFIG },
+	[BLUEALSA_METRICS_HANDLERS_SPAWNED] = { "handlers_spawned_total", NULL,
+		"Handler processes started.", BLUEALSA_METRICS_AGENT },
+	[BLUEALSA_METRICS_HANDLERS_TIMED_OUT] = { "handlers_timed_out_total", NULL,
+		"Pre-spawned handlers discarded unused, and services killed after the stop timeout.", BLUEALSA_METRICS_AGENT },
+	[BLUEALSA_METRICS_HANDLERS_FAILED] = { "handlers_failed_total", NULL,
+		"Handlers that could not be started or that exited unsuccessfully.", BLUEALSA_METRICS_AGENT },
+};
+
+static const struct {
+	const char *name;
+	const char *help;
+	unsigned int programs;
+} histogram_info[BLUEALSA_METRICS_HISTOGRAMS] = {
+	[BLUEALSA_METRICS_GET_MANAGED_OBJECTS] = { "dbus_get_managed_objects_seconds",
+		"Round-trip time of BlueALSA GetManagedObjects calls.", BOTH },
+	[BLUEALSA_METRICS_GET_DEVICE] = { "dbus_get_device_seconds",
+		"Round-trip time of BlueZ device lookups.", BOTH },
+	[BLUEALSA_METRICS_COMMIT_LATENCY] = { "commit_latency_seconds",
+		"Time from the D-Bus signal of the first change to its commit.", BLUEALSA_METRICS_AUTOCONFIG },
+	[BLUEALSA_METRICS_HANDLER_LATENCY] = { "handler_latency_seconds",
+		"Time from the last D-Bus signal to the start of a handler.", BLUEALSA_METRICS_AGENT },
+	[BLUEALSA_METRICS_HANDLER_RUNTIME] = { "handler_runtime_seconds",
+		"Run time of handler processes.", BLUEALSA_METRICS_AGENT },
+};
+
+/* Histogram bucket upper bounds, in microseconds */
+static const uint64_t bucket_bounds[] = {
+	100, 250, 500,
+	1000, 2500, 5000,
+	10000, 25000, 50000,
+	100000, 250000, 500000,
+	1000000, 2500000, 5000000,
+	10000000,
+};
+
+struct bluealsa_metrics_histogram_data {
+	uint64_t buckets[ARRAYSIZE(bucket_bounds)];
+	uint64_t count;
+	uint64_t sum;
+};
+
+static struct {
+	char *path;
+	const char *prefix;
+	unsigned int program;
+	uint64_t counters[BLUEALSA_METRICS_COUNTERS];
+	struct bluealsa_metrics_histogram_data histograms[BLUEALSA_METRICS_HISTOGRAMS];
+	uint64_t signal_time;
+	struct {
+		pid_t pid;
+		uint64_t start;
+	} handlers[BLUEALSA_METRICS_MAX_HANDLERS];
+	size_t handlers_count;
+	bool dirty;
+	uint64_t written;
+} metrics = { 0 };
+
+static void metrics_print(FILE *file) {
+	const char *previous = NULL;
+
+	for (size_t n = 0; n < ARRAYSIZE(counter_info); n++) {
+		if (!(counter_info[n].programs & metrics.program))
+			continue;
+		if (previous == NULL || strcmp(previous, counter_info[n].name) != 0) {
+			fprintf(file, "# HELP %s_%s %s\n", metrics.prefix, counter_info[n].name, counter_info[n].help);
+			fprintf(file, "# TYPE %s_%s counter\n", metrics.prefix, counter_info[n].name);
+			previous = counter_info[n].name;
+		}
+		if (counter_info[n].labels != NULL)
+			fprintf(file, "%s_%s{%s} %ju\n", metrics.prefix, counter_info[n].name,
+					counter_info[n].labels, (uintmax_t)metrics.counters[n]);
+		else
+			fprintf(file, "%s_%s %ju\n", metrics.prefix, counter_info[n].name,
+					(uintmax_t)metrics.counters[n]);
+	}
+
+	for (size_t n = 0; n < ARRAYSIZE(histogram_info); n++) {
+		const struct bluealsa_metrics_histogram_data *h = &metrics.histograms[n];
+		const char *name = histogram_info[n].name;
+		uint64_t cumulative = 0;
+
+		if (!(histogram_info[n].programs & metrics.program))
+			continue;
+		fprintf(file, "# HELP %s_%s %s\n", metrics.prefix, name, histogram_info[n].help);
+		fprintf(file, "# TYPE %s_%s histogram\n", metrics.prefix, name);
+		for (size_t b = 0; b < ARRAYSIZE(bucket_bounds); b++) {
+			cumulative += h->buckets[b];
+			fprintf(file, "%s_%s_bucket{le=\"%g\"} %ju\n", metrics.prefix, name,
+					bucket_bounds[b] / 1e6, (uintmax_t)cumulative);
+		}
+		fprintf(file, "%s_%s_bucket{le=\"+Inf\"} %ju\n", metrics.prefix, name, (uintmax_t)h->count);
+		fprintf(file, "%s_%s_sum %.6f\n", metrics.prefix, name, h->sum / 1e6);
+		fprintf(file, "%s_%s_count %ju\n", metrics.prefix, name, (uintmax_t)h->count);
+	}
+}
+
+/**
+ * Replace the metrics file. The file is first written under a temporary
+ * name, so readers never see an incomplete file.
+ * @return 0 on success, negative error code otherwise.
+ */
+static int metrics_write(void) {
+	char tmp[PATH_MAX];
+	FILE *file;
+	int fd, ret = 0;
+
+	metrics.dirty = false;
+	metrics.written = bluealsa_metrics_now();
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", metrics.path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	if ((fd = mkostemp(tmp, O_CLOEXEC)) == -1)
+		return -errno;
+	if (fchmod(fd, 0644) == -1 || (file = fdopen(fd, "w")) == NULL) {
+		ret = -errno;
+		close(fd);
+		unlink(tmp);
+		return ret;
+	}
+
+	metrics_print(file);
+
+	if (fclose(file) == EOF || rename(tmp, metrics.path) == -1) {
+		ret = -errno;
+		unlink(tmp);
+	}
+
+	return ret;
+}
+
+/**
+ * Start writing metrics to a file.
+ * @param path the file, which is replaced.
+ * @param program selects the metrics written, and their name prefix.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_metrics_open(const char *path, enum bluealsa_metrics_program program) {
+	int ret;
+
+	if ((metrics.path = strdup(path)) == NULL)
+		return -ENOMEM;
+	metrics.program = program;
+	metrics.prefix = program == BLUEALSA_METRICS_AGENT ? "bluealsa_agent" : "bluealsa_autoconfig";
+
+	if ((ret = metrics_write()) < 0) {
+		free(metrics.path);
+		metrics.path = NULL;
+	}
+	return ret;
+}
+
+/**
+ * Stop writing metrics, and remove the file.
+ */
+void bluealsa_metrics_close(void) {
+	if (metrics.path == NULL)
+		return;
+	unlink(metrics.path);
+	free(metrics.path);
+	metrics.path = NULL;
+}
+
+/**
+ * @return the monotonic time in microseconds.
+ */
+uint64_t bluealsa_metrics_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void bluealsa_metrics_add(enum bluealsa_metrics_counter counter, uint64_t value) {
+	if (metrics.path == NULL)
+		return;
+	metrics.counters[counter] += value;
+	metrics.dirty = true;
+}
+
+/**
+ * Add the time elapsed since start to a histogram.
+ * @param start time returned by bluealsa_metrics_now().
+ */
+void bluealsa_metrics_observe(enum bluealsa_metrics_histogram histogram, uint64_t start) {
+	struct bluealsa_metrics_histogram_data *h = &metrics.histograms[histogram];
+	uint64_t elapsed;
+	size_t b;
+
+	if (metrics.path == NULL)
+		return;
+
+	elapsed = bluealsa_metrics_now() - start;
+	for (b = 0; b < ARRAYSIZE(bucket_bounds) && elapsed > bucket_bounds[b]; b++)
+		continue;
+	if (b < ARRAYSIZE(bucket_bounds))
+		h->buckets[b]++;
+	h->count++;
+	h->sum += elapsed;
+	metrics.dirty = true;
+}
+
+/**
+ * Count a D-Bus signal, and note the time at which it was received.
+ * @param member the signal name.
+ */
+void bluealsa_metrics_signal(const char *member) {
+	static const char *names[] = {
+		[BLUEALSA_METRICS_SIGNAL_INTERFACES_ADDED] = "InterfacesAdded",
+		[BLUEALSA_METRICS_SIGNAL_INTERFACES_REMOVED] = "InterfacesRemoved",
+		[BLUEALSA_METRICS_SIGNAL_PROPERTIES_CHANGED] = "PropertiesChanged",
+		[BLUEALSA_METRICS_SIGNAL_NAME_OWNER_CHANGED] = "NameOwnerChanged",
+	};
+
+	if (metrics.path == NULL)
+		return;
+
+	metrics.signal_time = bluealsa_metrics_now();
+	for (size_t n = 0; n < ARRAYSIZE(names); n++)
+		if (strcmp(member, names[n]) == 0) {
+			bluealsa_metrics_add(n, 1);
+			break;
+		}
+}
+
+/**
+ * @return the time at which the most recent D-Bus signal was received, or
+ * the current time if there has been none.
+ */
+uint64_t bluealsa_metrics_signal_time(void) {
+	return metrics.signal_time != 0 ? metrics.signal_time : bluealsa_metrics_now();
+}
+
+/**
+ * Count a handler process, and measure the time since the last D-Bus signal.
+ * @param pid the process ID, or -1 if the process could not be started.
+ */
+void bluealsa_metrics_handler_spawned(pid_t pid) {
+	if (metrics.path == NULL)
+		return;
+
+	if (pid == -1) {
+		bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_FAILED, 1);
+		return;
+	}
+
+	bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_SPAWNED, 1);
+	bluealsa_metrics_observe(BLUEALSA_METRICS_HANDLER_LATENCY, bluealsa_metrics_signal_time());
+	if (metrics.handlers_count < ARRAYSIZE(metrics.handlers)) {
+		metrics.handlers[metrics.handlers_count].pid = pid;
+		metrics.handlers[metrics.handlers_count++].start = bluealsa_metrics_now();
+	}
+}
+
+/**
+ * Measure the run time of a handler process after it has been reaped. Other
+ * processes are ignored.
+ * @param status the status returned by waitpid().
+ */
+void bluealsa_metrics_handler_reaped(pid_t pid, int status) {
+	for (size_t n = 0; n < metrics.handlers_count; n++)
+		if (metrics.handlers[n].pid == pid) {
+			bluealsa_metrics_observe(BLUEALSA_METRICS_HANDLER_RUNTIME, metrics.handlers[n].start);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				bluealsa_metrics_add(BLUEALSA_METRICS_HANDLERS_FAILED, 1);
+			if (--metrics.handlers_count > n)
+				memcpy(&metrics.handlers[n], &metrics.handlers[metrics.handlers_count], sizeof(metrics.handlers[n]));
+			return;
+		}
+}
+
+/**
+ * @return milliseconds until the metrics file is to be written, or -1 if it
+ * is up to date.
+ */
+int bluealsa_metrics_timeout(void) {
+	uint64_t elapsed;
+
+	if (metrics.path == NULL || !metrics.dirty)
+		return -1;
+	elapsed = (bluealsa_metrics_now() - metrics.written) / 1000;
+	return elapsed < BLUEALSA_METRICS_INTERVAL ? BLUEALSA_METRICS_INTERVAL - elapsed : 0;
+}
+
+/**
+ * Write the metrics file if it is due.
+ */
+void bluealsa_metrics_flush(void) {
+	int ret;
+
+	if (bluealsa_metrics_timeout() != 0)
+		return;
+	/* a failed write is retried after the next interval */
+	if ((ret = metrics_write()) < 0) {
+		metrics.dirty = true;
+		debug("Couldn't write metrics file %s: %s", metrics.path, strerror(-ret));
+	}
+}
@@ -0,0 +1,58 @@
+/*
+ * bluealsa-autoconfig - metrics.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_METRICS_H
+#define BLUEALSA_METRICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The program whose metrics are written */
+enum bluealsa_metrics_program {
+	BLUEALSA_METRICS_AUTOCONFIG = (1 << 0),
+	BLUEALSA_METRICS_AGENT = (1 << 1),
+};
+
+enum bluealsa_metrics_counter {
+	/* D-Bus signals received, by type */
+	BLUEALSA_METRICS_SIGNAL_INTERFACES_ADDED,
+	BLUEALSA_METRICS_SIGNAL_INTERFACES_REMOVED,
+	BLUEALSA_METRICS_SIGNAL_PROPERTIES_CHANGED,
+	BLUEALSA_METRICS_SIGNAL_NAME_OWNER_CHANGED,
+	BLUEALSA_METRICS_EVENTS_FILTERED,
+	BLUEALSA_METRICS_COMMITS,
+	BLUEALSA_METRICS_COMMITS_SKIPPED,
+	BLUEALSA_METRICS_BYTES_WRITTEN,
+	BLUEALSA_METRICS_UDEV_TRIGGERS,
+	BLUEALSA_METRICS_HANDLERS_SPAWNED,
+	BLUEALSA_METRICS_HANDLERS_TIMED_OUT,
+	BLUEALSA_METRICS_HANDLERS_FAILED,
+	BLUEALSA_METRICS_COUNTERS,
+};
+
+enum bluealsa_metrics_histogram {
+	BLUEALSA_METRICS_GET_MANAGED_OBJECTS,
+	BLUEALSA_METRICS_GET_DEVICE,
+	BLUEALSA_METRICS_COMMIT_LATENCY,
+	BLUEALSA_METRICS_HANDLER_LATENCY,
+	BLUEALSA_METRICS_HANDLER_RUNTIME,
+	BLUEALSA_METRICS_HISTOGRAMS,
+};
+
+int bluealsa_metrics_open(const char *path, enum bluealsa_metrics_program program);
+void bluealsa_metrics_close(void);
+uint64_t bluealsa_metrics_now(void);
+void bluealsa_metrics_add(enum bluealsa_metrics_counter counter, uint64_t value);
+void bluealsa_metrics_observe(enum bluealsa_metrics_histogram histogram, uint64_t start);
+void bluealsa_metrics_signal(const char *member);
+uint64_t bluealsa_metrics_signal_time(void);
+void bluealsa_metrics_handler_spawned(pid_t pid);
+void bluealsa_metrics_handler_reaped(pid_t pid, int status);
+int bluealsa_metrics_timeout(void);
+void bluealsa_metrics_flush(void);
+
+#endif
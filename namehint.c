@@ -593,56 +593,43 @@ int bluealsa_namehint_print(const struct bluealsa_namehint *hint, FILE *file, co
 	return 0;
 }
 
+enum {
+	CAPTURE,
+	PLAYBACK,
+	NUM_DEFAULT_STREAMS,
+};
+
+static const char *default_stream_name[] = {
+	"capture",
+	"playback",
+};
+
 /**
- * Write out most recently connected pcms for each profile and stream direction.
- * @param hint the namehint container.
- * @param file the file.
+ * Select the most recently connected pcm for each profile type and stream
+ * direction.
  */
-void bluealsa_namehint_print_default(struct bluealsa_namehint *hint, FILE *file) {
-	enum {
-		CAPTURE,
-		PLAYBACK
-	};
-
+static void bluealsa_namehint_get_defaults(const struct bluealsa_namehint *hint, struct bluealsa_namehint_pcm *defaults[NUM_DEFAULT_STREAMS][NUM_PROFILE_TYPES]) {
 	struct bluealsa_namehint_pcm *pcm = hint->pcms;
-	struct bluealsa_namehint_pcm *defaults[2][NUM_PROFILE_TYPES] = { 0 };
 
 	while (pcm != NULL) {
-		switch (pcm->stream) {
-		case STREAM_CAPTURE:
-			if (pcm->hint->profile == PROFILE_A2DP)
-				defaults[CAPTURE][PROFILE_TYPE_A2DP] = pcm;
-			else if (pcm->hint->profile == PROFILE_ASHA)
-				defaults[CAPTURE][PROFILE_TYPE_ASHA] = pcm;
-			else
-				defaults[CAPTURE][PROFILE_TYPE_SCO] = pcm;
-			break;
-		case STREAM_PLAYBACK:
-			if (pcm->hint->profile == PROFILE_A2DP)
-				defaults[PLAYBACK][PROFILE_TYPE_A2DP] = pcm;
-			else if (pcm->hint->profile == PROFILE_ASHA)
-				defaults[PLAYBACK][PROFILE_TYPE_ASHA] = pcm;
-			else
-				defaults[PLAYBACK][PROFILE_TYPE_SCO] = pcm;
-			break;
-		default: /* duplex stream */
-			if (pcm->hint->profile == PROFILE_A2DP) {
-				defaults[CAPTURE][PROFILE_TYPE_A2DP] = pcm;
-				defaults[PLAYBACK][PROFILE_TYPE_A2DP] = pcm;
-			}
-			else if (pcm->hint->profile == PROFILE_ASHA) {
-				defaults[CAPTURE][PROFILE_TYPE_ASHA] = pcm;
-				defaults[PLAYBACK][PROFILE_TYPE_ASHA] = pcm;
-			}
-			else {
-				defaults[CAPTURE][PROFILE_TYPE_SCO] = pcm;
-				defaults[PLAYBACK][PROFILE_TYPE_SCO] = pcm;
-			}
-			break;
-		}
-
+		profile_type_t type = profiles[pcm->hint->profile].type;
+		if (pcm->stream & STREAM_CAPTURE)
+			defaults[CAPTURE][type] = pcm;
+		if (pcm->stream & STREAM_PLAYBACK)
+			defaults[PLAYBACK][type] = pcm;
 		pcm = pcm->next;
 	}
+}
+
+/**
+ * Write out most recently connected pcms for each profile and stream direction.
+ * @param hint the namehint container.
+ * @param file the file.
+ */
+void bluealsa_namehint_print_default(struct bluealsa_namehint *hint, FILE *file) {
+	struct bluealsa_namehint_pcm *defaults[NUM_DEFAULT_STREAMS][NUM_PROFILE_TYPES] = { 0 };
+
+	bluealsa_namehint_get_defaults(hint, defaults);
 
 	if (defaults[CAPTURE][PROFILE_TYPE_A2DP] != NULL)
 		bluealsa_namehint_print_default_pcm(file,
@@ -710,6 +697,83 @@ void bluealsa_namehint_print_default(struct bluealsa_namehint *hint, FILE *file)
 
 }
 
+/**
+ * Call a function for each namehint.
+ * @param hint the namehint container.
+ * @param pattern template to be used for hint descriptions.
+ * @param with_service include the service name in the PCM id.
+ * @param func called once for each hint.
+ * @param data passed to func.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_namehint_foreach(const struct bluealsa_namehint *hint, const char *pattern, bool with_service, bluealsa_namehint_func_t func, void *data) {
+	const struct bluealsa_namehint_hint *h;
+
+	for (h = hint->hints; h != NULL; h = h->next) {
+		const char *profile = profile_type_name[profiles[h->profile].type];
+		char description[256];
+		char id[128];
+		int ret;
+
+		if ((ret = bluealsa_namehint_hint_expand_description(h, pattern, description, sizeof(description))) < 0)
+			return ret;
+		snprintf(id, sizeof(id), "bluealsa:DEV=%s,PROFILE=%s%s%s",
+			h->device->hex_addr,
+			profile,
+			with_service ? ",SRV=" : "",
+			with_service ? h->device->service : "");
+
+		struct bluealsa_namehint_entry entry = {
+			.id = id,
+			.address = h->device->hex_addr,
+			.profile = profile,
+			.stream = h->stream == STREAM_PLAYBACK ? "playback" :
+				h->stream == STREAM_CAPTURE ? "capture" : "duplex",
+			.description = description,
+			.service = h->device->service,
+		};
+		func(&entry, data);
+	}
+
+	return 0;
+}
+
+/**
+ * Call a function for the most recently connected pcm of each profile and
+ * stream direction, as selected by bluealsa_namehint_print_default().
+ * @param hint the namehint container.
+ * @param func called once for each default; the description is empty.
+ * @param data passed to func.
+ */
+void bluealsa_namehint_foreach_default(const struct bluealsa_namehint *hint, bluealsa_namehint_func_t func, void *data) {
+	struct bluealsa_namehint_pcm *defaults[NUM_DEFAULT_STREAMS][NUM_PROFILE_TYPES] = { 0 };
+
+	bluealsa_namehint_get_defaults(hint, defaults);
+
+	for (size_t s = 0; s < NUM_DEFAULT_STREAMS; s++)
+		for (size_t p = 0; p < NUM_PROFILE_TYPES; p++) {
+			const struct bluealsa_namehint_pcm *pcm = defaults[s][p];
+			char id[128];
+
+			if (pcm == NULL)
+				continue;
+			snprintf(id, sizeof(id), "bluealsa:DEV=%s,PROFILE=%s,SRV=%s",
+				pcm->device->hex_addr,
+				profile_type_name[p],
+				pcm->device->service);
+
+			struct bluealsa_namehint_entry entry = {
+				.id = id,
+				.address = pcm->device->hex_addr,
+				.profile = profile_type_name[p],
+				.stream = default_stream_name[s],
+				.description = "",
+				.service = pcm->device->service,
+			};
+			func(&entry, data);
+		}
+}
+
 /**
  * Free a bluealsa_namehint structure.
  */
@@ -14,6 +14,21 @@
 
 struct bluealsa_namehint;
 
+/* One namehint, as passed to bluealsa_namehint_func_t */
+struct bluealsa_namehint_entry {
+	/* ALSA PCM name, e.g. "bluealsa:DEV=XX:XX:XX:XX:XX:XX,PROFILE=a2dp" */
+	const char *id;
+	const char *address;
+	/* "a2dp", "asha" or "sco" */
+	const char *profile;
+	/* "capture", "playback" or "duplex" */
+	const char *stream;
+	const char *description;
+	const char *service;
+};
+
+typedef void (*bluealsa_namehint_func_t)(const struct bluealsa_namehint_entry *entry, void *data);
+
 int bluealsa_namehint_init(struct bluealsa_namehint **hint);
 void bluealsa_namehint_free(struct bluealsa_namehint *hint);
 
@@ -33,4 +48,8 @@ int bluealsa_namehint_print(const struct bluealsa_namehint *hint, FILE *file, co
 
 void bluealsa_namehint_print_default(struct bluealsa_namehint *hint, FILE *file);
 
+int bluealsa_namehint_foreach(const struct bluealsa_namehint *hint, const char *pattern, bool with_service, bluealsa_namehint_func_t func, void *data);
+
+void bluealsa_namehint_foreach_default(const struct bluealsa_namehint *hint, bluealsa_namehint_func_t func, void *data);
+
 #endif
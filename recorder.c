@@ -0,0 +1,116 @@
+/*
+ * bluealsa-autoconfig - recorder.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "bluez-alsa/shared/log.h"
+
+/*
+ * Flight recorder of D-Bus events and the actions taken on them. Records are
+ * kept in a fixed ring, so recording costs no allocation and no system call
+ * other than reading the clock. The ring is written out only on request.
+ */
+
+struct bluealsa_recorder_record {
+	/* monotonic time in microseconds */
+	uint64_t time;
+	char event[24];
+	char action[32];
+	uint32_t mask;
+	char service[32];
+	char path[128];
+};
+
+static struct {
+	struct bluealsa_recorder_record records[BLUEALSA_RECORDER_SIZE];
+	/* total number of records ever added */
+	uint64_t count;
+} recorder = { 0 };
+
+static void recorder_copy(char *dest, const char *src, size_t size) {
+	if (src == NULL)
+		src = "-";
+	strncpy(dest, src, size - 1);
+	dest[size - 1] = '\0';
+}
+
+static uint64_t recorder_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Add a record, overwriting the oldest if the ring is full.
+ * @param event the D-Bus signal or internal event.
+ * @param service the BlueALSA service, or NULL.
+ * @param path the D-Bus object path, or NULL.
+ * @param mask event specific flags, such as the changed properties.
+ * @param action what was done in response to the event.
+ */
+void bluealsa_recorder_add(const char *event, const char *service, const char *path, uint32_t mask, const char *action) {
+	struct bluealsa_recorder_record *record = &recorder.records[recorder.count++ % BLUEALSA_RECORDER_SIZE];
+
+	record->time = recorder_now();
+	recorder_copy(record->event, event, sizeof(record->event));
+	recorder_copy(record->action, action, sizeof(record->action));
+	record->mask = mask;
+	recorder_copy(record->service, service, sizeof(record->service));
+	recorder_copy(record->path, path, sizeof(record->path));
+}
+
+/**
+ * Write out the records, oldest first, as tab separated columns: time in
+ * seconds, event, service, path, mask and action.
+ * @param path the file to be replaced, or NULL to write to the log.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_recorder_dump(const char *path) {
+	const uint64_t first = recorder.count > BLUEALSA_RECORDER_SIZE ?
+			recorder.count - BLUEALSA_RECORDER_SIZE : 0;
+	FILE *file = NULL;
+	int fd;
+
+	if (path != NULL) {
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+			return -errno;
+		if ((file = fdopen(fd, "w")) == NULL) {
+			close(fd);
+			return -errno;
+		}
+		fprintf(file, "# dumped at %.6f, %ju records lost\n",
+				recorder_now() / 1e6, (uintmax_t)first);
+		fprintf(file, "# time\tevent\tservice\tpath\tmask\taction\n");
+	}
+	else
+		info("Event recorder: dumped at %.6f, %ju records lost",
+				recorder_now() / 1e6, (uintmax_t)first);
+
+	for (uint64_t n = first; n < recorder.count; n++) {
+		const struct bluealsa_recorder_record *r = &recorder.records[n % BLUEALSA_RECORDER_SIZE];
+		if (file != NULL)
+			fprintf(file, "%.6f\t%s\t%s\t%s\t%#x\t%s\n", r->time / 1e6,
+					r->event, r->service, r->path, r->mask, r->action);
+		else
+			info("Event recorder: %.6f\t%s\t%s\t%s\t%#x\t%s", r->time / 1e6,
+					r->event, r->service, r->path, r->mask, r->action);
+	}
+
+	if (file != NULL && fclose(file) == EOF)
+		return -errno;
+	return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * bluealsa-autoconfig - recorder.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_RECORDER_H
+#define BLUEALSA_RECORDER_H
+
+#include <stdint.h>
+
+/* Number of records kept; older records are overwritten. A dump to the log
+ * must fit in the ring of the logging thread (LOG_ASYNC_SLOTS). */
+#define BLUEALSA_RECORDER_SIZE 256
+
+void bluealsa_recorder_add(const char *event, const char *service, const char *path, uint32_t mask, const char *action);
+int bluealsa_recorder_dump(const char *path);
+
+#endif
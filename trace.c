@@ -0,0 +1,147 @@
+/*
+ * bluealsa-autoconfig - trace.c
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "bluez-alsa/shared/defs.h"
+#include "bluez-alsa/shared/log.h"
+#include "bluez-alsa/shared/rt.h"
+
+/*
+ * Latency tracing. A trace point costs a single untaken branch while tracing
+ * is off. While on, each trace point appends a fixed size binary record to a
+ * buffer, which is written to the trace file when full and when tracing is
+ * switched off. Trace points must only be used by the main thread.
+ *
+ * The file begins with a header of the 8 byte magic "BATRACE1" followed by
+ * the record size as a 32 bit integer. Integers are in host byte order.
+ */
+
+#define BLUEALSA_TRACE_MAGIC "BATRACE1"
+
+struct bluealsa_trace_header {
+	char magic[8];
+	uint32_t record_size;
+};
+
+struct bluealsa_trace_entry {
+	/* gettimestamp() time in nanoseconds */
+	uint64_t time;
+	uint16_t point;
+	uint16_t reserved;
+	uint32_t value;
+};
+
+bool bluealsa_trace_enabled = false;
+
+static struct {
+	int fd;
+	size_t count;
+	struct bluealsa_trace_entry entries[512];
+} trace = { .fd = -1 };
+
+static void bluealsa_trace_flush(void) {
+	const char *data = (const char *)trace.entries;
+	size_t len = trace.count * sizeof(trace.entries[0]);
+
+	trace.count = 0;
+	while (len > 0) {
+		ssize_t ret = write(trace.fd, data, len);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Couldn't write trace file: %s", strerror(errno));
+			return;
+		}
+		data += ret;
+		len -= ret;
+	}
+}
+
+void bluealsa_trace_record(enum bluealsa_trace_point point, uint32_t value) {
+	struct bluealsa_trace_entry *entry = &trace.entries[trace.count];
+	struct timespec ts;
+
+	gettimestamp(&ts);
+	entry->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	entry->point = point;
+	entry->reserved = 0;
+	entry->value = value;
+
+	if (++trace.count == ARRAYSIZE(trace.entries))
+		bluealsa_trace_flush();
+}
+
+/**
+ * @return the value of a BLUEALSA_TRACE_SIGNAL record for a D-Bus signal.
+ */
+uint32_t bluealsa_trace_signal_value(const char *member) {
+	static const char *names[] = {
+		"InterfacesAdded",
+		"InterfacesRemoved",
+		"PropertiesChanged",
+		"NameOwnerChanged",
+	};
+
+	for (size_t n = 0; n < ARRAYSIZE(names); n++)
+		if (strcmp(member, names[n]) == 0)
+			return n + 1;
+	return 0;
+}
+
+/**
+ * Switch tracing on, replacing the trace file, or off.
+ * @param path the trace file.
+ * @return 0 on success, negative error code otherwise.
+ */
+int bluealsa_trace_toggle(const char *path) {
+	const struct bluealsa_trace_header header = {
+		.magic = BLUEALSA_TRACE_MAGIC,
+		.record_size = sizeof(struct bluealsa_trace_entry),
+	};
+	int ret;
+
+	if (bluealsa_trace_enabled) {
+		bluealsa_trace_stop();
+		info("Tracing stopped");
+		return 0;
+	}
+
+	if ((trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return -errno;
+	if (write(trace.fd, &header, sizeof(header)) != sizeof(header)) {
+		ret = errno != 0 ? -errno : -EIO;
+		close(trace.fd);
+		trace.fd = -1;
+		return ret;
+	}
+
+	trace.count = 0;
+	bluealsa_trace_enabled = true;
+	info("Tracing to %s", path);
+	return 0;
+}
+
+/**
+ * Switch tracing off, writing out any buffered records.
+ */
+void bluealsa_trace_stop(void) {
+	if (!bluealsa_trace_enabled)
+		return;
+	bluealsa_trace_enabled = false;
+	bluealsa_trace_flush();
+	close(trace.fd);
+	trace.fd = -1;
+}
@@ -0,0 +1,43 @@
+/*
+ * bluealsa-autoconfig - trace.h
+ * SPDX-FileCopyrightText: 2024-2026 @borine <https://github.com/borine>
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+#ifndef BLUEALSA_TRACE_H
+#define BLUEALSA_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Trace points; the values are part of the trace file format */
+enum bluealsa_trace_point {
+	/* value: 1 InterfacesAdded, 2 InterfacesRemoved, 3 PropertiesChanged,
+	 * 4 NameOwnerChanged, 0 other */
+	BLUEALSA_TRACE_SIGNAL = 1,
+	/* value: 1 if the namehints changed, otherwise 0 */
+	BLUEALSA_TRACE_NAMEHINT_ADD = 2,
+	BLUEALSA_TRACE_NAMEHINT_REMOVE = 3,
+	BLUEALSA_TRACE_COMMIT_BEGIN = 4,
+	/* value: bytes written */
+	BLUEALSA_TRACE_COMMIT_END = 5,
+	/* value: process ID */
+	BLUEALSA_TRACE_SPAWN = 6,
+	BLUEALSA_TRACE_REAPED = 7,
+};
+
+extern bool bluealsa_trace_enabled;
+
+/* The value is evaluated only when tracing is on. */
+#define bluealsa_trace(point, value) do { \
+		if (__builtin_expect(bluealsa_trace_enabled, 0)) \
+			bluealsa_trace_record(point, value); \
+	} while (0)
+
+void bluealsa_trace_record(enum bluealsa_trace_point point, uint32_t value);
+uint32_t bluealsa_trace_signal_value(const char *member);
+int bluealsa_trace_toggle(const char *path);
+void bluealsa_trace_stop(void);
+
+#endif